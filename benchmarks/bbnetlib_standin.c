@@ -0,0 +1,114 @@
+/*
+ * ===========================
+ * bbnetlib_standin.c
+ * ===========================
+ * A host's output goes into a buffer that grows as
+ * needed, under the host's own lock, since executor
+ * and game workers can both send to one host.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bbnetlib_standin.h"
+
+struct standin_host {
+    pthread_mutex_t lock;
+    void *custom_attr;
+    char *output;
+    size_t output_len;
+    size_t output_capacity;
+};
+
+static atomic_ulong sends;
+static atomic_ulong bytes_sent;
+
+struct host *create_host(const char *ip, const uint16_t port)
+{
+    struct standin_host *host = calloc(1, sizeof(*host));
+    if (!host) {
+        perror("calloc");
+        exit(1);
+    }
+    pthread_mutex_init(&host->lock, NULL);
+    return (struct host *)host;
+}
+
+void standin_destroy_host(struct host *remotehost)
+{
+    struct standin_host *host = (struct standin_host *)remotehost;
+    pthread_mutex_destroy(&host->lock);
+    free(host->output);
+    free(host);
+}
+
+void enable_tls(void)
+{
+}
+
+// Nobody's listening, packets come from whoever calls the handler
+int listen_for_tcp(struct host *localhost,
+                   void (*packet_handler)(char *, ssize_t, struct host *))
+{
+    return -1;
+}
+
+ssize_t send_data_tcp(const char *data,
+                      const ssize_t data_size,
+                      struct host *remotehost)
+{
+    struct standin_host *host = (struct standin_host *)remotehost;
+    pthread_mutex_lock(&host->lock);
+    if (host->output_len + data_size > host->output_capacity) {
+        size_t capacity = host->output_capacity ? host->output_capacity : 4096;
+        while (capacity < host->output_len + data_size) {
+            capacity *= 2;
+        }
+        host->output = realloc(host->output, capacity);
+        if (!host->output) {
+            perror("realloc");
+            exit(1);
+        }
+        host->output_capacity = capacity;
+    }
+    memcpy(&host->output[host->output_len], data, data_size);
+    host->output_len += data_size;
+    pthread_mutex_unlock(&host->lock);
+    atomic_fetch_add_explicit(&sends, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&bytes_sent, data_size, memory_order_relaxed);
+    return data_size;
+}
+
+void set_host_custom_attr(struct host *remotehost, void *ptr)
+{
+    ((struct standin_host *)remotehost)->custom_attr = ptr;
+}
+
+void *get_host_custom_attr(struct host *remotehost)
+{
+    return ((struct standin_host *)remotehost)->custom_attr;
+}
+
+void close_connections(struct host *remotehost)
+{
+}
+
+size_t standin_take_output(struct host *remotehost, char *buf, size_t buf_size)
+{
+    struct standin_host *host = (struct standin_host *)remotehost;
+    pthread_mutex_lock(&host->lock);
+    const size_t len = host->output_len < buf_size ? host->output_len : buf_size;
+    memcpy(buf, host->output, len);
+    host->output_len = 0;
+    pthread_mutex_unlock(&host->lock);
+    return len;
+}
+
+void standin_get_stats(struct standin_stats *out)
+{
+    out->sends      = atomic_load(&sends);
+    out->bytes_sent = atomic_load(&bytes_sent);
+}
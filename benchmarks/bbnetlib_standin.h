@@ -0,0 +1,36 @@
+/*
+ * ===========================
+ * bbnetlib_standin.h
+ * ===========================
+ * Links in place of bb-net-lib, for benchmarks.
+ * It implements what the server uses of bbnetlib.h
+ * without a single socket: hosts are plain structs, and
+ * whatever's sent to one is kept in memory so the
+ * benchmark can look at the responses.
+ *
+ * Select NET_BACKEND_BBNETLIB to send through it.
+ */
+
+#ifndef BB_BBNETLIB_STANDIN
+#define BB_BBNETLIB_STANDIN
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bbnetlib.h"
+
+struct standin_stats {
+    uint64_t sends;
+    uint64_t bytes_sent;
+};
+
+/*
+ * Copies out what was sent to "remotehost" since
+ * the last call, up to "buf_size" bytes, and forgets
+ * it. Returns how many bytes were copied.
+ */
+size_t standin_take_output(struct host *remotehost, char *buf, size_t buf_size);
+void   standin_destroy_host(struct host *remotehost);
+void   standin_get_stats   (struct standin_stats *out);
+
+#endif
@@ -0,0 +1,453 @@
+/*
+ * ===========================
+ * encounter_bench.c
+ * ===========================
+ * Draws encounters the way a game does, with its own
+ * RNG, and compares that with a plain weighted pick
+ * that walks the cumulative odds of every encounter.
+ *
+ * Every thread gets a game of its own and draws
+ * across all the regions, so the numbers are per
+ * core. Before that, one game's draws are checked
+ * against the odds the weights give, and afterwards
+ * weights are changed over and over to time the
+ * rebuilds.
+ *
+ * Then synthetic heatmaps go in, and the lookups
+ * and draws that go through them are timed too.
+ * Last, a game's odds are shifted at random, some
+ * of them until they saturate, the overlay is
+ * checked cell by cell against a plain grid that
+ * got the same shifts, and shifts and lookups
+ * through the overlay are timed.
+ * Then players walk back and forth across the map,
+ * rolling every kilometre until something happens.
+ *
+ * Usage: encounterBench [draws_per_thread] [threads]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "encounters.h"
+#include "epoch.h"
+#include "heatmap.h"
+#include "movement.h"
+
+#define DEFAULT_DRAWS   20000000
+#define DEFAULT_THREADS 1
+#define CHECK_DRAWS     4000000
+#define UPDATES         100000
+#define LOOKUPS         20000000
+// Synthetic layers, smaller than the map so they get resampled
+#define LAYER_WIDTH     200
+#define LAYER_HEIGHT    120
+#define SHIFTS          100000
+#define SHIFT_CHECKS    2000
+#define MOVES           200000
+#define OUTCOME_COUNT   (ENCOUNTER_TYPE_COUNT * ENCOUNTER_COUNT)
+
+struct bench_thread {
+    pthread_t thread;
+    struct game *game;
+    uint64_t draws;
+    uint64_t alias_ns;
+    uint64_t linear_ns;
+    uint64_t sink;
+};
+
+// So the compiler can't skip the draws
+static volatile uint64_t sink;
+// Cumulative odds of every (category, encounter), for the linear pick
+static double cumulative[ENCOUNTER_REGION_COUNT][OUTCOME_COUNT];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static struct game *make_game(int index)
+{
+    struct game_config config = {.max_player_count = 4,
+                                 .min_player_count = 2,
+                                 .rng_seed         = 0x5EED + index};
+    snprintf(config.name, sizeof(config.name), "encounters-%d", index);
+    struct game *game = create_game(&config);
+    if (!game) {
+        fprintf(stderr, "Couldn't create the game\n");
+        exit(1);
+    }
+    return game;
+}
+
+static void build_cumulative(void)
+{
+    for (int region = 0; region < ENCOUNTER_REGION_COUNT; region++) {
+        double sum = 0.0;
+        for (int i = 0; i < OUTCOME_COUNT; i++) {
+            sum += get_encounter_chance(region,
+                                        i / ENCOUNTER_COUNT,
+                                        i % ENCOUNTER_COUNT);
+            cumulative[region][i] = sum;
+        }
+    }
+}
+
+static int draw_linear(struct game *game, int region)
+{
+    const double roll = game_random_double(game, 0.0, 1.0);
+    for (int i = 0; i < OUTCOME_COUNT; i++) {
+        if (roll < cumulative[region][i]) {
+            return i % ENCOUNTER_COUNT;
+        }
+    }
+    return ENCOUNTER_NONE;
+}
+
+/*
+ * The games aren't being played, so drawing
+ * from here instead of their actors is fine.
+ */
+static void *run_thread(void *arg)
+{
+    struct bench_thread *bench = arg;
+    uint64_t start             = 0;
+
+    epoch_enter();
+    start = now_ns();
+    for (uint64_t i = 0; i < bench->draws; i++) {
+        bench->sink += draw_encounter(bench->game,
+                                      (int)(i % ENCOUNTER_REGION_COUNT),
+                                      NULL);
+    }
+    bench->alias_ns = now_ns() - start;
+
+    start = now_ns();
+    for (uint64_t i = 0; i < bench->draws; i++) {
+        bench->sink +=
+            draw_linear(bench->game, (int)(i % ENCOUNTER_REGION_COUNT));
+    }
+    bench->linear_ns = now_ns() - start;
+    epoch_exit();
+    return NULL;
+}
+
+// Largest gap between how often something came up and its odds
+static double check_odds(struct game *game)
+{
+    static uint64_t counts[ENCOUNTER_TYPE_COUNT][ENCOUNTER_COUNT];
+    enum encounter_type_id type = ENCOUNTER_TYPE_NONE;
+    double worst                = 0.0;
+
+    epoch_enter();
+    for (int i = 0; i < CHECK_DRAWS; i++) {
+        const enum encounter_id encounter = draw_encounter(game, 0, &type);
+        counts[type][encounter]++;
+    }
+    for (int i = 0; i < OUTCOME_COUNT; i++) {
+        const int t           = i / ENCOUNTER_COUNT;
+        const int e           = i % ENCOUNTER_COUNT;
+        const double expected = get_encounter_chance(0, t, e);
+        const double seen     = (double)counts[t][e] / CHECK_DRAWS;
+        const double gap      = seen > expected ? seen - expected
+                                                : expected - seen;
+        if (expected == 0.0 && counts[t][e]) {
+            fprintf(stderr, "Drew %d/%d, which weighs nothing\n", t, e);
+            exit(1);
+        }
+        worst = gap > worst ? gap : worst;
+    }
+    epoch_exit();
+    return worst;
+}
+
+// Outside any read section, so the old regions get freed
+static uint64_t time_updates(void)
+{
+    const uint64_t start = now_ns();
+    for (int i = 0; i < UPDATES; i++) {
+        set_encounter_weight(i % ENCOUNTER_REGION_COUNT,
+                             ENCOUNTER_TYPE_BEASTS,
+                             ENCOUNTER_WOLVES,
+                             1 + i % 4);
+    }
+    return now_ns() - start;
+}
+
+// Gradients at different angles, one per category
+static void load_synthetic_heatmaps(void)
+{
+    static uint8_t grey[LAYER_WIDTH * LAYER_HEIGHT];
+    for (int type = 0; type < ENCOUNTER_TYPE_COUNT; type++) {
+        for (int y = 0; y < LAYER_HEIGHT; y++) {
+            for (int x = 0; x < LAYER_WIDTH; x++) {
+                grey[y * LAYER_WIDTH + x] =
+                    (uint8_t)(x * (type + 1) + y * type);
+            }
+        }
+        set_heatmap_layer(type, grey, LAYER_WIDTH, LAYER_HEIGHT);
+    }
+}
+
+// A walk across the map, so lookups don't all hit the same tile
+static struct coordinates walk(uint64_t i)
+{
+    return (struct coordinates){
+        .x = (double)(i % 1024) / 1024 * 2 * MAP_BOUND_X - MAP_BOUND_X,
+        .y = (double)(i % 640) / 640 * 2 * MAP_BOUND_Y - MAP_BOUND_Y};
+}
+
+static void time_heatmaps(struct game *game)
+{
+    struct heatmap_weights weights;
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < LOOKUPS; i++) {
+        const struct coordinates coords = walk(i);
+        get_heatmap_weights(&coords, &weights);
+        sink = sink + weights.lanes[i % ENCOUNTER_TYPE_COUNT];
+    }
+    const uint64_t lookup_ns = now_ns() - start;
+
+    uint64_t nothing = 0;
+    epoch_enter();
+    start = now_ns();
+    for (uint64_t i = 0; i < LOOKUPS; i++) {
+        const struct coordinates coords = walk(i);
+        nothing += draw_encounter_at(game, &coords, NULL) == ENCOUNTER_NONE;
+    }
+    const uint64_t draw_ns = now_ns() - start;
+    epoch_exit();
+
+    printf("Heatmaps, %d:\n"
+           "  lookup  %6.1fns each %7.2fM/s\n"
+           "  draw    %6.1fns each %7.2fM/s, %.1f%% nothing\n",
+           LOOKUPS,
+           (double)lookup_ns / LOOKUPS,
+           LOOKUPS * 1e3 / lookup_ns,
+           (double)draw_ns / LOOKUPS,
+           LOOKUPS * 1e3 / draw_ns,
+           100.0 * nothing / LOOKUPS);
+}
+
+// Somewhere in the middle of the cell
+static struct coordinates cell_coords(int col, int row)
+{
+    const double x = col * HEATMAP_TILE + HEATMAP_TILE / 2;
+    const double y = row * HEATMAP_TILE + HEATMAP_TILE / 2;
+    return (struct coordinates){
+        .x = x / (HEATMAP_WIDTH - 1) * 2 * MAP_BOUND_X - MAP_BOUND_X,
+        .y = MAP_BOUND_Y - y / (HEATMAP_HEIGHT - 1) * 2 * MAP_BOUND_Y};
+}
+
+static void random_shift(struct game *game, struct heatmap_shift *out)
+{
+    const int col = game_random_u64(game) % HEATMAP_OVERLAY_COLS;
+    const int row = game_random_u64(game) % HEATMAP_OVERLAY_ROWS;
+    out->col_min  = col;
+    out->row_min  = row;
+    out->col_max  = col + game_random_u64(game) % 8;
+    out->row_max  = row + game_random_u64(game) % 8;
+    out->type     = 1 + game_random_u64(game) % (ENCOUNTER_TYPE_COUNT - 1);
+    out->delta    = (int)(game_random_u64(game) % 61) - 30;
+}
+
+/*
+ * Like random_shift(), in a corner and as big as
+ * they get, so cells pile up past HEATMAP_SHIFT_MAX.
+ */
+static void random_big_shift(struct game *game, struct heatmap_shift *out)
+{
+    random_shift(game, out);
+    out->col_min %= 8;
+    out->row_min %= 8;
+    out->col_max = out->col_min + 4;
+    out->row_max = out->row_min + 4;
+    out->delta   = game_random_u64(game) % 4 ? -HEATMAP_FULL : HEATMAP_FULL;
+}
+
+// Exits if a cell doesn't add up
+static void check_shifts(struct game *game)
+{
+    static int expected[HEATMAP_OVERLAY_ROWS][HEATMAP_OVERLAY_COLS]
+                       [ENCOUNTER_TYPE_COUNT];
+    struct heatmap_shift shift;
+    struct heatmap_weights base, shifted;
+
+    int saturated = 0;
+    for (int i = 0; i < SHIFT_CHECKS; i++) {
+        if (i % 2) {
+            random_big_shift(game, &shift);
+        }
+        else {
+            random_shift(game, &shift);
+        }
+        const int delta = shift.delta;
+        const bool left = saturate_heatmap_shift(game, &shift);
+        saturated += shift.delta != delta;
+        if (!left) {
+            continue;
+        }
+        shift_heatmap(game, &shift);
+        for (int row = shift.row_min;
+             row <= shift.row_max && row < HEATMAP_OVERLAY_ROWS;
+             row++) {
+            for (int col = shift.col_min;
+                 col <= shift.col_max && col < HEATMAP_OVERLAY_COLS;
+                 col++) {
+                expected[row][col][shift.type] += shift.delta;
+            }
+        }
+    }
+    for (int row = 0; row < HEATMAP_OVERLAY_ROWS; row++) {
+        for (int col = 0; col < HEATMAP_OVERLAY_COLS; col++) {
+            const struct coordinates coords = cell_coords(col, row);
+            get_heatmap_weights(&coords, &base);
+            get_game_heatmap_weights(game, &coords, &shifted);
+            for (int type = 1; type < ENCOUNTER_TYPE_COUNT; type++) {
+                if (abs(expected[row][col][type]) > HEATMAP_SHIFT_MAX) {
+                    fprintf(stderr,
+                            "Cell %d,%d type %d was shifted by %d\n",
+                            col,
+                            row,
+                            type,
+                            expected[row][col][type]);
+                    exit(1);
+                }
+                int weight = base.lanes[type] + expected[row][col][type];
+                weight     = weight < 0             ? 0
+                           : weight > HEATMAP_FULL ? HEATMAP_FULL
+                                                   : weight;
+                if (shifted.lanes[type] != weight) {
+                    fprintf(stderr,
+                            "Cell %d,%d type %d is %d, should be %d\n",
+                            col,
+                            row,
+                            type,
+                            shifted.lanes[type],
+                            weight);
+                    exit(1);
+                }
+            }
+        }
+    }
+    printf("Shift checks, %d of %d saturated\n", saturated, SHIFT_CHECKS);
+}
+
+static void time_shifts(struct game *game)
+{
+    struct heatmap_shift shift;
+    struct heatmap_weights weights;
+    uint64_t start = now_ns();
+    for (int i = 0; i < SHIFTS; i++) {
+        random_shift(game, &shift);
+        shift_heatmap(game, &shift);
+    }
+    const uint64_t shift_ns = now_ns() - start;
+
+    start = now_ns();
+    for (uint64_t i = 0; i < LOOKUPS; i++) {
+        const struct coordinates coords = walk(i);
+        get_game_heatmap_weights(game, &coords, &weights);
+        sink = sink + weights.lanes[i % ENCOUNTER_TYPE_COUNT];
+    }
+    const uint64_t lookup_ns = now_ns() - start;
+
+    printf("Shifts, %d cells checked\n"
+           "  shift   %6.1fns each\n"
+           "  lookup  %6.1fns each %7.2fM/s\n",
+           HEATMAP_OVERLAY_CELLS,
+           (double)shift_ns / SHIFTS,
+           (double)lookup_ns / LOOKUPS,
+           LOOKUPS * 1e3 / lookup_ns);
+}
+
+static void time_moves(struct game *game)
+{
+    const struct player_credentials credentials = {.name = "walker"};
+    struct player *player = create_player(game, &credentials);
+    struct move_result move;
+    uint64_t rolls      = 0;
+    uint64_t encounters = 0;
+
+    epoch_enter();
+    const uint64_t start = now_ns();
+    for (int i = 0; i < MOVES; i++) {
+        const struct coordinates path[] = {
+            {(i & 1) ? -MAP_BOUND_X : MAP_BOUND_X, walk(i).y, 0.0}};
+        player->action_points = GAME_ACTION_POINTS;
+        move_player_along(player, path, 1, &move);
+        rolls += move.rolls;
+        encounters += move.encounter != ENCOUNTER_NONE;
+    }
+    const uint64_t move_ns = now_ns() - start;
+    epoch_exit();
+
+    printf("Moves, %d: %.1fns each, %.1fkm and %.0f%% encounters on "
+           "average, %.1fns a km\n",
+           MOVES,
+           (double)move_ns / MOVES,
+           (double)rolls / MOVES,
+           100.0 * encounters / MOVES,
+           (double)move_ns / rolls);
+}
+
+int main(int argc, char **argv)
+{
+    const uint64_t draws = argc > 1 ? strtoull(argv[1], NULL, 10)
+                                    : DEFAULT_DRAWS;
+    const int thread_count = argc > 2 ? atoi(argv[2]) : DEFAULT_THREADS;
+    if (draws == 0 || thread_count <= 0) {
+        fprintf(stderr, "Usage: %s [draws_per_thread] [threads]\n", argv[0]);
+        return 1;
+    }
+    struct bench_thread *threads = calloc(thread_count, sizeof(*threads));
+    if (!threads) {
+        perror("calloc");
+        return 1;
+    }
+
+    printf("Odds check, %d draws: worst gap %.5f\n",
+           CHECK_DRAWS,
+           check_odds(make_game(-1)));
+
+    epoch_enter();
+    build_cumulative();
+    epoch_exit();
+    for (int i = 0; i < thread_count; i++) {
+        threads[i].game  = make_game(i);
+        threads[i].draws = draws;
+        pthread_create(&threads[i].thread, NULL, run_thread, &threads[i]);
+    }
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i].thread, NULL);
+        sink = sink + threads[i].sink;
+        printf("Thread %d, %llu draws\n"
+               "  alias   %6.1fns/draw %7.2fM draws/s\n"
+               "  linear  %6.1fns/draw %7.2fM draws/s\n",
+               i,
+               (unsigned long long)draws,
+               (double)threads[i].alias_ns / draws,
+               draws * 1e3 / threads[i].alias_ns,
+               (double)threads[i].linear_ns / draws,
+               draws * 1e3 / threads[i].linear_ns);
+    }
+
+    const uint64_t update_ns = time_updates();
+    printf("Weight changes, %d: %.0fns each\n",
+           UPDATES,
+           (double)update_ns / UPDATES);
+
+    load_synthetic_heatmaps();
+    time_heatmaps(make_game(-2));
+
+    struct game *shifted = make_game(-3);
+    check_shifts(shifted);
+    time_shifts(shifted);
+    time_moves(shifted);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * ===========================
+ * executor_bench.c
+ * ===========================
+ * Mixed HTTP and websocket load on one network
+ * thread, once with everything handled inline like
+ * the old receive path, and once with the HTTP work
+ * handed to the executor.
+ *
+ * Events arrive open loop at a fixed rate, latency is
+ * measured from when an event was due to arrive until
+ * its handler finished, so time spent queued behind
+ * other work counts.
+ *
+ * Usage: executorBench [events] [interval_us] [http_percent] [workers]
+ */
+
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "executor.h"
+#include "helpers.h"
+
+#define DEFAULT_EVENTS       200000
+#define DEFAULT_INTERVAL_US  10
+#define DEFAULT_HTTP_PERCENT 10
+#define HTTP_RESPONSE_SIZE   8192
+#define WEBSOCKET_FRAME_SIZE 64
+
+enum event_type {
+    EVENT_HTTP,
+    EVENT_WEBSOCKET
+};
+
+struct event {
+    enum event_type type;
+    uint64_t due_ns;
+    uint64_t done_ns;
+};
+
+static const char login_form[] =
+    "POST /login HTTP/1.1\r\nHost: bench\r\nContent-Length: 58\r\n\r\n"
+    "playerName=bench&playerPassword=hunter2&gamePassword=hello";
+static const char websocket_key[] =
+    "dGhlIHNhbXBsZSBub25jZQ==258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+static struct executor_group group;
+// So the compiler can't skip the websocket work
+static volatile unsigned char sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Roughly what the HTTP path does per request:
+ * form parsing, a handshake hash and building
+ * a response.
+ */
+static void handle_http(struct event *event)
+{
+    struct html_form form                   = {0};
+    unsigned char digest[SHA_DIGEST_LENGTH] = {0};
+    char response[HTTP_RESPONSE_SIZE]       = {0};
+    int offset                              = 0;
+    const int form_index =
+        string_search(login_form, "playerName=", sizeof(login_form));
+
+    for (int i = 0; i < 8; i++) {
+        parse_html_form(&login_form[form_index],
+                        &form,
+                        sizeof(login_form) - form_index);
+        SHA1((const unsigned char *)websocket_key,
+             strlen(websocket_key),
+             digest);
+    }
+    while (offset < HTTP_RESPONSE_SIZE - 64) {
+        offset += snprintf(&response[offset],
+                           HTTP_RESPONSE_SIZE - offset,
+                           "<p>%s %02x</p>\n",
+                           form.fields[0],
+                           digest[offset % SHA_DIGEST_LENGTH]);
+    }
+    event->done_ns = now_ns();
+}
+
+// Unmasking a small websocket frame
+static void handle_websocket(struct event *event)
+{
+    static const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+    unsigned char frame[WEBSOCKET_FRAME_SIZE];
+    unsigned char checksum = 0;
+    for (int i = 0; i < WEBSOCKET_FRAME_SIZE; i++) {
+        frame[i] = (unsigned char)i ^ mask[i % 4];
+        checksum ^= frame[i];
+    }
+    sink           = checksum;
+    event->done_ns = now_ns();
+}
+
+static void run_http_task(void *arg)
+{
+    handle_http(arg);
+}
+
+static void generate_events(struct event *events,
+                            int count,
+                            int http_percent,
+                            uint64_t interval_ns)
+{
+    unsigned int seed   = 7676;
+    const uint64_t base = now_ns() + 1000000;
+    for (int i = 0; i < count; i++) {
+        events[i].type    = (int)(rand_r(&seed) % 100) < http_percent
+                                ? EVENT_HTTP
+                                : EVENT_WEBSOCKET;
+        events[i].due_ns  = base + (uint64_t)i * interval_ns;
+        events[i].done_ns = 0;
+    }
+}
+
+// The network thread
+static void run_load(struct event *events, int count, bool offload)
+{
+    for (int i = 0; i < count; i++) {
+        while (now_ns() < events[i].due_ns) {
+        }
+        if (events[i].type == EVENT_WEBSOCKET) {
+            handle_websocket(&events[i]);
+        }
+        else if (offload) {
+            executor_submit(run_http_task, &events[i], &group);
+        }
+        else {
+            handle_http(&events[i]);
+        }
+    }
+    executor_group_wait(&group);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_latencies(const char *name,
+                            const struct event *events,
+                            int count,
+                            enum event_type type)
+{
+    uint64_t *latencies = malloc(count * sizeof(*latencies));
+    int len             = 0;
+    if (!latencies) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        if (events[i].type == type) {
+            latencies[len++] = events[i].done_ns - events[i].due_ns;
+        }
+    }
+    if (len == 0) {
+        free(latencies);
+        return;
+    }
+    qsort(latencies, len, sizeof(*latencies), compare_u64);
+    printf("  %-10s n=%-7d p50=%8.1fus p99=%8.1fus max=%8.1fus\n",
+           name,
+           len,
+           latencies[len / 2] / 1000.0,
+           latencies[(len * 99) / 100] / 1000.0,
+           latencies[len - 1] / 1000.0);
+    free(latencies);
+}
+
+int main(int argc, char **argv)
+{
+    const int event_count  = argc > 1 ? atoi(argv[1]) : DEFAULT_EVENTS;
+    const int interval_us  = argc > 2 ? atoi(argv[2]) : DEFAULT_INTERVAL_US;
+    const int http_percent = argc > 3 ? atoi(argv[3]) : DEFAULT_HTTP_PERCENT;
+    const int workers      = argc > 4 ? atoi(argv[4]) : 0;
+    struct event *events   = calloc(event_count, sizeof(*events));
+    if (!events || event_count <= 0) {
+        fprintf(stderr, "Bad event count\n");
+        return 1;
+    }
+    executor_group_init(&group);
+
+    printf("%d events, one every %dus, %d%% HTTP\n",
+           event_count,
+           interval_us,
+           http_percent);
+
+    generate_events(events, event_count, http_percent, interval_us * 1000ull);
+    run_load(events, event_count, false);
+    printf("inline:\n");
+    print_latencies("websocket", events, event_count, EVENT_WEBSOCKET);
+    print_latencies("http", events, event_count, EVENT_HTTP);
+
+    executor_start(workers);
+    generate_events(events, event_count, http_percent, interval_us * 1000ull);
+    run_load(events, event_count, true);
+    printf("executor (%d workers):\n", executor_worker_count());
+    print_latencies("websocket", events, event_count, EVENT_WEBSOCKET);
+    print_latencies("http", events, event_count, EVENT_HTTP);
+
+    printf("  injection queue length %llu\n",
+           (unsigned long long)executor_injection_queue_length());
+    for (int i = 0; i < executor_worker_count(); i++) {
+        struct executor_stats stats;
+        executor_get_stats(i, &stats);
+        printf("  worker %-3d executed=%-8llu steals=%-6llu injected=%-8llu "
+               "queued=%llu\n",
+               i,
+               (unsigned long long)stats.executed,
+               (unsigned long long)stats.steals,
+               (unsigned long long)stats.injected,
+               (unsigned long long)stats.queue_length);
+    }
+    executor_group_destroy(&group);
+    free(events);
+    return 0;
+}
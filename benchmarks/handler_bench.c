@@ -0,0 +1,424 @@
+/*
+ * ===========================
+ * handler_bench.c
+ * ===========================
+ * Drives master_handler() like the network would,
+ * on the in-memory bb-net-lib stand-in, so the
+ * dispatch path can be measured without sockets.
+ *
+ * Every path runs in a batch over all the fake
+ * hosts, and reports:
+ * - dispatch: time spent inside master_handler(),
+ *   what the network thread pays
+ * - total: the whole batch until every response
+ *   was sent, executor and game workers included
+ * - heap, pool and arena allocations per op, heap
+ *   counts our own malloc()s (see --wrap in CMake)
+ *
+ * Last, the game is deleted, and epoch_collect() is
+ * called until it's really been freed.
+ *
+ * Run it from the build directory, the HTTP paths
+ * send the website files from the working directory.
+ *
+ * Usage: handlerBench [hosts] [rounds] [game_workers] [http_workers]
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bbnetlib_standin.h"
+#include "epoch.h"
+#include "executor.h"
+#include "file_handling.h"
+#include "game_logic.h"
+#include "host_custom_attributes.h"
+#include "html_server.h"
+#include "mem_pool.h"
+#include "net_backend.h"
+#include "packet_handlers.h"
+
+#define DEFAULT_ROUNDS    200
+#define REQUEST_MAX_LEN   512
+#define OUTPUT_BUFFER_LEN (1 << 20)
+#define DELETE_TIMEOUT_NS 1000000000ull
+
+/*
+ * Heap allocations from our own code, the linker
+ * points malloc() and friends at these.
+ */
+static atomic_ulong heap_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&heap_allocs, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    atomic_fetch_add_explicit(&heap_allocs, 1, memory_order_relaxed);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    atomic_fetch_add_explicit(&heap_allocs, 1, memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+
+struct bench_host {
+    struct host *host;
+    session_token_t token;
+};
+
+struct batch {
+    const char *name;
+    uint64_t ops;
+    uint64_t dispatch_ns;
+    uint64_t start_ns;
+    uint64_t heap_allocs;
+    struct mem_stats mem;
+};
+
+static struct game *game;
+static struct bench_host *hosts;
+static int host_count;
+static char *output;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void begin_batch(struct batch *batch, const char *name)
+{
+    memset(batch, 0, sizeof(*batch));
+    batch->name        = name;
+    batch->heap_allocs = atomic_load(&heap_allocs);
+    mem_get_stats(&batch->mem);
+    batch->start_ns = now_ns();
+}
+
+static void dispatch(struct batch *batch,
+                     char *data,
+                     ssize_t size,
+                     struct host *remotehost)
+{
+    const uint64_t start = now_ns();
+    master_handler(data, size, remotehost);
+    batch->dispatch_ns += now_ns() - start;
+    batch->ops++;
+}
+
+static void run_nothing(struct game *game,
+                        char *data,
+                        ssize_t data_size,
+                        struct host *remotehost)
+{
+}
+
+// Waits for the HTTP requests and game commands still in flight
+static void drain(void)
+{
+    for (int i = 0; i < host_count; i++) {
+        struct host_custom_attr *attr =
+            net_get_host_custom_attr(hosts[i].host);
+        if (attr) {
+            executor_group_wait(&attr->tasks);
+        }
+    }
+    game_actor_call(game, run_nothing, NULL, 0, NULL);
+}
+
+static void end_batch(struct batch *batch, bool keep_output)
+{
+    struct mem_stats mem = {0};
+    drain();
+    const uint64_t total_ns = now_ns() - batch->start_ns;
+    mem_get_stats(&mem);
+    const double ops = batch->ops ? (double)batch->ops : 1.0;
+    printf("  %-12s n=%-7llu dispatch=%8.0fns/op total=%8.0fns/op "
+           "heap=%5.2f/op pool=%5.2f/op arena=%5.2f/op\n",
+           batch->name,
+           (unsigned long long)batch->ops,
+           batch->dispatch_ns / ops,
+           total_ns / ops,
+           (atomic_load(&heap_allocs) - batch->heap_allocs) / ops,
+           (mem.pool_allocs - batch->mem.pool_allocs) / ops,
+           (mem.arena_allocs - batch->mem.arena_allocs) / ops);
+    // Keeps the stand-in's buffers from growing forever
+    for (int i = 0; i < host_count && !keep_output; i++) {
+        standin_take_output(hosts[i].host, output, OUTPUT_BUFFER_LEN);
+    }
+}
+
+// The last token sent to the host, 0 if there's none
+static session_token_t take_session_token(struct host *remotehost)
+{
+    const char cookie[] = "sessionToken=";
+    const char *token   = NULL;
+    const size_t len    = standin_take_output(remotehost,
+                                           output,
+                                           OUTPUT_BUFFER_LEN - 1);
+    output[len] = '\0';
+    for (const char *found = strstr(output, cookie); found;
+         found             = strstr(found + 1, cookie)) {
+        token = found;
+    }
+    return token ? strtoll(token + strlen(cookie), NULL, 10) : 0;
+}
+
+static int take_session_tokens(void)
+{
+    for (int i = 0; i < host_count; i++) {
+        hosts[i].token = take_session_token(hosts[i].host);
+        if (!hosts[i].token) {
+            fprintf(stderr, "Host %d didn't get logged in\n", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int build_post(char *out, const char *path, const char *cookie,
+                      const char *body)
+{
+    return snprintf(out,
+                    REQUEST_MAX_LEN,
+                    "POST /%s HTTP/1.1\r\nHost: bench\r\n%s"
+                    "Content-Length: %zu\r\n\r\n%s",
+                    path,
+                    cookie,
+                    strlen(body),
+                    body);
+}
+
+static void run_logins(const char *name, int rounds)
+{
+    char request[REQUEST_MAX_LEN];
+    char body[REQUEST_MAX_LEN];
+    struct batch batch;
+    begin_batch(&batch, name);
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < host_count; i++) {
+            snprintf(body,
+                     sizeof(body),
+                     "playerName=bench%d&playerPassword=pw&gamePassword=hello",
+                     i);
+            const int len = build_post(request, "login", "", body);
+            dispatch(&batch, request, len, hosts[i].host);
+        }
+    }
+    end_batch(&batch, true);
+}
+
+static void run_charsheets(int rounds)
+{
+    static const char body[] = "playerBackground=Trader&playerGender=Male"
+                               "&vigour=5&violence=4&cunning=4";
+    char request[REQUEST_MAX_LEN];
+    char cookie[REQUEST_MAX_LEN];
+    struct batch batch;
+    begin_batch(&batch, "charsheet");
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < host_count; i++) {
+            snprintf(cookie,
+                     sizeof(cookie),
+                     "Cookie: sessionToken=%lld\r\n",
+                     hosts[i].token);
+            const int len = build_post(request, "charsheet", cookie, body);
+            dispatch(&batch, request, len, hosts[i].host);
+        }
+    }
+    end_batch(&batch, false);
+}
+
+static void run_static_gets(int rounds)
+{
+    static const char request[] = "GET /styles.css HTTP/1.1\r\nHost: bench\r\n\r\n";
+    char data[sizeof(request)];
+    struct batch batch;
+    begin_batch(&batch, "get_static");
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < host_count; i++) {
+            memcpy(data, request, sizeof(request));
+            dispatch(&batch, data, sizeof(request) - 1, hosts[i].host);
+        }
+    }
+    end_batch(&batch, false);
+}
+
+// Every host ends up on a websocket
+static void run_upgrades(void)
+{
+    char request[REQUEST_MAX_LEN];
+    struct batch batch;
+    begin_batch(&batch, "ws_upgrade");
+    for (int i = 0; i < host_count; i++) {
+        const int len = snprintf(request,
+                                 sizeof(request),
+                                 "GET / HTTP/1.1\r\nHost: bench\r\n"
+                                 "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+                                 "Cookie: sessionToken=%lld\r\n"
+                                 "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                 "Sec-WebSocket-Version: 13\r\n\r\n",
+                                 hosts[i].token);
+        dispatch(&batch, request, len, hosts[i].host);
+    }
+    end_batch(&batch, false);
+}
+
+// A masked client frame, like browsers send
+static int build_frame(char *out, const void *payload, int payload_len)
+{
+    static const unsigned char mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+    const unsigned char *bytes         = payload;
+    out[0]                             = (char)0x82; // FIN, binary
+    out[1]                             = (char)(0x80 | payload_len);
+    memcpy(&out[2], mask, sizeof(mask));
+    for (int i = 0; i < payload_len; i++) {
+        out[6 + i] = (char)(bytes[i] ^ mask[i % 4]);
+    }
+    return 6 + payload_len;
+}
+
+static void run_game_opcodes(const char *name,
+                             const void *payload,
+                             int payload_len,
+                             int rounds)
+{
+    char frame[64];
+    struct batch batch;
+    const int frame_len = build_frame(frame, payload, payload_len);
+    begin_batch(&batch, name);
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < host_count; i++) {
+            dispatch(&batch, frame, frame_len, hosts[i].host);
+        }
+    }
+    end_batch(&batch, false);
+}
+
+static void run_disconnects(void)
+{
+    struct batch batch;
+    begin_batch(&batch, "disconnect");
+    for (int i = 0; i < host_count; i++) {
+        dispatch(&batch, NULL, 0, hosts[i].host);
+    }
+    end_batch(&batch, false);
+    for (int i = 0; i < host_count; i++) {
+        standin_destroy_host(hosts[i].host);
+    }
+    host_count = 0;
+}
+
+/*
+ * Nothing's connected anymore, so once the actor's
+ * done with the disconnects it only takes the grace
+ * epochs, and the one reclaim_game() waits on top.
+ */
+static int run_delete_game(void)
+{
+    const struct timespec pause = {.tv_sec = 0, .tv_nsec = 100000};
+    const uint64_t pending      = epoch_pending_count();
+    const uint64_t start        = now_ns();
+    int collects                = 0;
+    delete_game(game);
+    game = NULL;
+    // The game workers might still be closing its hosts
+    while (epoch_pending_count() > pending
+           && now_ns() - start < DELETE_TIMEOUT_NS) {
+        epoch_collect();
+        collects++;
+        if (epoch_pending_count() > pending) {
+            nanosleep(&pause, NULL);
+        }
+    }
+    if (epoch_pending_count() > pending) {
+        fprintf(stderr, "The deleted game was never freed\n");
+        return -1;
+    }
+    printf("  %-12s freed after %d collects, %.0fns\n",
+           "delete_game",
+           collects,
+           (double)(now_ns() - start));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const int requested_hosts = argc > 1 ? atoi(argv[1]) : MAX_PLAYERS_IN_GAME;
+    const int rounds          = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+    const int game_workers    = argc > 3 ? atoi(argv[3]) : 0;
+    const int http_workers    = argc > 4 ? atoi(argv[4]) : 0;
+    // One game, so one player each
+    host_count = requested_hosts < MAX_PLAYERS_IN_GAME ? requested_hosts
+                                                       : MAX_PLAYERS_IN_GAME;
+    if (host_count <= 0 || rounds <= 0) {
+        fprintf(stderr, "Bad host or round count\n");
+        return 1;
+    }
+    struct game_config config = {.name             = "test game",
+                                 .password         = "hello",
+                                 .max_player_count = host_count,
+                                 .min_player_count = 1};
+    hosts  = calloc(host_count, sizeof(*hosts));
+    output = malloc(OUTPUT_BUFFER_LEN);
+    if (!hosts || !output) {
+        perror("malloc");
+        return 1;
+    }
+
+    net_backend_select(NET_BACKEND_BBNETLIB);
+    create_allowed_file_table();
+    game = create_game(&config);
+    game_actor_start_workers(game_workers);
+    executor_start(http_workers);
+    for (int i = 0; i < host_count; i++) {
+        hosts[i].host = create_host("127.0.0.1", 7676);
+    }
+
+    printf("%d hosts in one game, %d rounds\n", host_count, rounds);
+    run_static_gets(rounds);
+    run_logins("login_new", 1);
+    run_logins("login_again", rounds);
+    if (take_session_tokens() != 0) {
+        return 1;
+    }
+    run_charsheets(rounds);
+    run_upgrades();
+
+    const struct {
+        opcode_t opcode;
+    } __attribute__((packed)) ping = {0};
+    const struct {
+        opcode_t opcode;
+        double x;
+        double y;
+    } __attribute__((packed)) move = {1, 0.25, -0.5};
+    run_game_opcodes("ws_ping", &ping, sizeof(ping), rounds);
+    run_game_opcodes("ws_move", &move, sizeof(move), rounds);
+    run_disconnects();
+    if (run_delete_game() != 0) {
+        return 1;
+    }
+
+    struct standin_stats stats = {0};
+    standin_get_stats(&stats);
+    printf("  sent %llu packets, %llu bytes\n",
+           (unsigned long long)stats.sends,
+           (unsigned long long)stats.bytes_sent);
+    return 0;
+}
@@ -0,0 +1,831 @@
+/*
+ * ===========================
+ * loadgen.c
+ * ===========================
+ * Plays a crowd of players against a running server
+ * over TLS, the way the browser client does:
+ * POST /login, POST /charsheet, GET / upgraded to a
+ * websocket, then OPCODE_PLAYER_CONNECT.
+ *
+ * Once everyone's connected, every player sends moves
+ * and pings at the rates asked for, with at most one
+ * of each in flight (closed loop), and we time each
+ * one until the server's answer comes back: the ping
+ * echo, or the move broadcast with our own player id.
+ *
+ * Reports how long setting up a player took, round
+ * trip percentiles per opcode, and how many frames
+ * per second the server pushed back at us.
+ *
+ * Usage: relicLoadgen [--host=IP] [--port=N] [--players=N]
+ *                     [--threads=N] [--duration=SECONDS]
+ *                     [--move-rate=HZ] [--ping-rate=HZ]
+ */
+
+#define _GNU_SOURCE // memmem()
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT       7676
+#define DEFAULT_PLAYERS    4
+#define DEFAULT_DURATION   10
+#define DEFAULT_MOVE_RATE  20.0
+#define DEFAULT_PING_RATE  1.0
+#define GAME_PASSWORD      "hello"
+#define NAME_MAX_LEN       32 // MAX_CREDENTIAL_LEN on the server
+#define READ_BUFFER_SIZE   (1 << 16)
+#define HTTP_RESPONSE_MAX  (1 << 20)
+#define POLL_TIMEOUT_MS    1
+
+// Coupled with enum response_opcodes in websocket_handlers.c
+enum loadgen_opcode {
+    OPCODE_PING,
+    OPCODE_PLAYER_MOVE,
+    OPCODE_PLAYER_CONNECT,
+    OPCODE_COUNT
+};
+
+static const char opcode_names[OPCODE_COUNT][16] = {"ping", "move", "connect"};
+
+// Growable list of latencies in nanoseconds
+struct samples {
+    uint64_t *values;
+    size_t len;
+    size_t capacity;
+};
+
+struct player {
+    char name[NAME_MAX_LEN];
+    int16_t id;
+    int fd;
+    SSL *ssl;
+    char *buffer; // Bytes read but not parsed yet
+    size_t buffered;
+    uint64_t next_due[OPCODE_COUNT];
+    uint64_t sent_at[OPCODE_COUNT]; // 0 when nothing's in flight
+};
+
+struct worker {
+    pthread_t thread;
+    int index;
+    struct player *players;
+    int player_count;
+    struct samples setup;
+    struct samples rtt[OPCODE_COUNT];
+    uint64_t frames_received;
+    uint64_t bytes_received;
+    uint64_t frames_sent;
+    int failures;
+};
+
+static struct {
+    const char *host;
+    int port;
+    int players;
+    int threads;
+    int duration;
+    double rates[OPCODE_COUNT];
+} options = {.host    = "127.0.0.1",
+             .port     = DEFAULT_PORT,
+             .players  = DEFAULT_PLAYERS,
+             .threads  = 1,
+             .duration = DEFAULT_DURATION,
+             .rates    = {DEFAULT_PING_RATE, DEFAULT_MOVE_RATE, 0.0}};
+
+static SSL_CTX *ssl_ctx;
+static pthread_barrier_t connected_barrier;
+static uint64_t run_start_ns;
+static uint64_t run_end_ns;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void add_sample(struct samples *samples, uint64_t value)
+{
+    if (samples->len == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        samples->values   = realloc(samples->values,
+                                  samples->capacity * sizeof(*samples->values));
+        if (!samples->values) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    samples->values[samples->len++] = value;
+}
+
+static void merge_samples(struct samples *into, const struct samples *from)
+{
+    for (size_t i = 0; i < from->len; i++) {
+        add_sample(into, from->values[i]);
+    }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_samples(const char *name, struct samples *samples)
+{
+    if (samples->len == 0) {
+        printf("  %-10s no samples\n", name);
+        return;
+    }
+    qsort(samples->values, samples->len, sizeof(*samples->values), compare_u64);
+    const size_t len = samples->len;
+    printf("  %-10s n=%-8zu p50=%9.1fus p99=%9.1fus p999=%9.1fus "
+           "max=%9.1fus\n",
+           name,
+           len,
+           samples->values[len / 2] / 1000.0,
+           samples->values[(len * 99) / 100] / 1000.0,
+           samples->values[(len * 999) / 1000] / 1000.0,
+           samples->values[len - 1] / 1000.0);
+}
+
+/*
+ * Connections
+ * --------------------
+ */
+static int tls_connect(int *out_fd, SSL **out_ssl)
+{
+    struct sockaddr_in addr = {0};
+    const int one           = 1;
+    addr.sin_family         = AF_INET;
+    addr.sin_port           = htons(options.port);
+    if (inet_pton(AF_INET, options.host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Bad host address %s\n", options.host);
+        return -1;
+    }
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("connect");
+        goto exit_error;
+    }
+    SSL *ssl = SSL_new(ssl_ctx);
+    if (!ssl) {
+        goto exit_error;
+    }
+    SSL_set_fd(ssl, fd);
+    if (SSL_connect(ssl) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        goto exit_error;
+    }
+    *out_fd  = fd;
+    *out_ssl = ssl;
+    return 0;
+
+exit_error:
+    close(fd);
+    return -1;
+}
+
+static void tls_close(int fd, SSL *ssl)
+{
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+}
+
+// Waits out a full socket buffer, once we're non-blocking
+static int ssl_write_all(SSL *ssl, const char *data, int len)
+{
+    while (len > 0) {
+        const int written = SSL_write(ssl, data, len);
+        if (written <= 0) {
+            const int error = SSL_get_error(ssl, written);
+            struct pollfd pfd = {.fd = SSL_get_fd(ssl), .events = POLLOUT};
+            if (error != SSL_ERROR_WANT_WRITE && error != SSL_ERROR_WANT_READ) {
+                return -1;
+            }
+            pfd.events = error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/*
+ * One request on a fresh connection, reads the
+ * headers and Content-Length worth of body.
+ * Returns the response length, or -1.
+ */
+static int http_request(const char *request, char *response, int response_size)
+{
+    int fd   = -1;
+    SSL *ssl = NULL;
+    int len  = 0;
+    if (tls_connect(&fd, &ssl) != 0) {
+        return -1;
+    }
+    if (ssl_write_all(ssl, request, strlen(request)) != 0) {
+        tls_close(fd, ssl);
+        return -1;
+    }
+    while (len < response_size - 1) {
+        const int got = SSL_read(ssl, &response[len], response_size - 1 - len);
+        if (got <= 0) {
+            break;
+        }
+        len += got;
+        response[len] = '\0';
+        // Matches "\r\n\r\n", and the session cookie's
+        // header that only ends in "\n"
+        const char *end = strstr(response, "\n\r\n");
+        if (!end) {
+            continue;
+        }
+        const char *field = strstr(response, "Content-Length: ");
+        if (!field || field > end
+            || len - (end + 3 - response) >= atoi(field + 16)) {
+            break;
+        }
+    }
+    tls_close(fd, ssl);
+    return len;
+}
+
+static long long get_session_token(const char *response)
+{
+    const char *cookie = strstr(response, "sessionToken=");
+    return cookie ? strtoll(cookie + strlen("sessionToken="), NULL, 10) : 0;
+}
+
+/*
+ * Websocket frames
+ * --------------------
+ */
+static int send_frame(struct player *player, const void *payload, int len)
+{
+    static const unsigned char mask[4] = {0x5a, 0x13, 0xc7, 0x81};
+    const unsigned char *bytes         = payload;
+    char frame[2 + sizeof(mask) + 125];
+    frame[0] = (char)0x82; // FIN, binary
+    frame[1] = (char)(0x80 | len);
+    memcpy(&frame[2], mask, sizeof(mask));
+    for (int i = 0; i < len; i++) {
+        frame[6 + i] = (char)(bytes[i] ^ mask[i % 4]);
+    }
+    return ssl_write_all(player->ssl, frame, 6 + len);
+}
+
+/*
+ * Pulls one whole server frame out of the player's
+ * buffer, returns its payload length, or -1 if it's
+ * not all here yet.
+ */
+static ssize_t pop_frame(struct player *player,
+                         const char **out_payload,
+                         size_t *out_frame_len)
+{
+    const unsigned char *buf = (const unsigned char *)player->buffer;
+    size_t header_len        = 2;
+    uint64_t payload_len     = 0;
+    if (player->buffered < 2) {
+        return -1;
+    }
+    payload_len = buf[1] & 0x7F;
+    if (payload_len == 126) {
+        header_len = 4;
+        if (player->buffered < header_len) {
+            return -1;
+        }
+        payload_len = ((uint64_t)buf[2] << 8) | buf[3];
+    }
+    else if (payload_len == 127) {
+        header_len = 10;
+        if (player->buffered < header_len) {
+            return -1;
+        }
+        payload_len = 0;
+        for (int i = 0; i < 8; i++) {
+            payload_len = (payload_len << 8) | buf[2 + i];
+        }
+    }
+    if (player->buffered < header_len + payload_len) {
+        return -1;
+    }
+    *out_payload   = &player->buffer[header_len];
+    *out_frame_len = header_len + payload_len;
+    return (ssize_t)payload_len;
+}
+
+static void drop_frame(struct player *player, size_t frame_len)
+{
+    player->buffered -= frame_len;
+    memmove(player->buffer, &player->buffer[frame_len], player->buffered);
+}
+
+// Returns -1 once the connection's gone
+static int read_available(struct player *player)
+{
+    while (player->buffered < READ_BUFFER_SIZE) {
+        const int got = SSL_read(player->ssl,
+                                 &player->buffer[player->buffered],
+                                 READ_BUFFER_SIZE - player->buffered);
+        if (got > 0) {
+            player->buffered += got;
+            continue;
+        }
+        const int error = SSL_get_error(player->ssl, got);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+            return 0;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// A source/wire.h varint, or -1 if it runs past "len"
+static long long read_varint(const char *payload, ssize_t len, ssize_t *offset)
+{
+    long long value = 0;
+    for (int shift = 0; *offset < len && shift < 35; shift += 7) {
+        const uint8_t byte = payload[(*offset)++];
+        value |= (long long)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Handles one server frame, timing it if it answers
+ * something we have in flight. Returns 1 for our own
+ * connect response, 0 otherwise.
+ */
+static int handle_frame(struct worker *worker,
+                        struct player *player,
+                        const char *payload,
+                        ssize_t len,
+                        uint64_t now)
+{
+    uint16_t opcode = 0;
+    if (len < (ssize_t)sizeof(opcode)) {
+        return 0;
+    }
+    memcpy(&opcode, payload, sizeof(opcode));
+    worker->frames_received++;
+    worker->bytes_received += len;
+
+    if (opcode == OPCODE_PING && player->sent_at[OPCODE_PING]) {
+        add_sample(&worker->rtt[OPCODE_PING], now - player->sent_at[OPCODE_PING]);
+        player->sent_at[OPCODE_PING] = 0;
+    }
+    else if (opcode == OPCODE_PLAYER_MOVE) {
+        // source/wire.h: seq, then the mover's id
+        ssize_t offset = sizeof(opcode);
+        read_varint(payload, len, &offset);
+        const int mover = read_varint(payload, len, &offset);
+        if (mover == player->id && player->sent_at[OPCODE_PLAYER_MOVE]) {
+            add_sample(&worker->rtt[OPCODE_PLAYER_MOVE],
+                       now - player->sent_at[OPCODE_PLAYER_MOVE]);
+            player->sent_at[OPCODE_PLAYER_MOVE] = 0;
+        }
+    }
+    else if (opcode == OPCODE_PLAYER_CONNECT) {
+        // source/wire.h: version, flags, epoch, seq, turn,
+        // connecting id. Only the player connecting gets this.
+        ssize_t offset = sizeof(opcode) + 2 + sizeof(uint32_t);
+        read_varint(payload, len, &offset);
+        read_varint(payload, len, &offset);
+        const int connecting = read_varint(payload, len, &offset);
+        if (connecting < 0) {
+            return 0;
+        }
+        player->id = connecting;
+        if (player->sent_at[OPCODE_PLAYER_CONNECT]) {
+            add_sample(&worker->rtt[OPCODE_PLAYER_CONNECT],
+                       now - player->sent_at[OPCODE_PLAYER_CONNECT]);
+            player->sent_at[OPCODE_PLAYER_CONNECT] = 0;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static int handle_frames(struct worker *worker, struct player *player)
+{
+    const char *payload   = NULL;
+    size_t frame_len      = 0;
+    int connected         = 0;
+    const uint64_t now    = now_ns();
+    ssize_t len           = 0;
+    while ((len = pop_frame(player, &payload, &frame_len)) >= 0) {
+        connected |= handle_frame(worker, player, payload, len, now);
+        drop_frame(player, frame_len);
+    }
+    return connected;
+}
+
+/*
+ * Setting a player up
+ * --------------------
+ */
+static int upgrade_to_websocket(struct player *player, long long token)
+{
+    char request[512];
+    snprintf(request,
+             sizeof(request),
+             "GET / HTTP/1.1\r\nHost: %s\r\n"
+             "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+             "Cookie: sessionToken=%lld\r\n"
+             "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+             "Sec-WebSocket-Version: 13\r\n\r\n",
+             options.host,
+             token);
+    if (tls_connect(&player->fd, &player->ssl) != 0
+        || ssl_write_all(player->ssl, request, strlen(request)) != 0) {
+        return -1;
+    }
+    // Anything after the headers is already websocket frames
+    while (1) {
+        const int got = SSL_read(player->ssl,
+                                 &player->buffer[player->buffered],
+                                 READ_BUFFER_SIZE - player->buffered);
+        if (got <= 0) {
+            return -1;
+        }
+        player->buffered += got;
+        // The server ends these headers with a bare "\n\n"
+        size_t end_len = 4;
+        const char *end =
+            memmem(player->buffer, player->buffered, "\r\n\r\n", 4);
+        if (!end) {
+            end_len = 2;
+            end     = memmem(player->buffer, player->buffered, "\n\n", 2);
+        }
+        if (end) {
+            if (strncmp(player->buffer, "HTTP/1.1 101", 12) != 0) {
+                return -1;
+            }
+            drop_frame(player, end + end_len - player->buffer);
+            return 0;
+        }
+    }
+}
+
+static int set_up_player(struct worker *worker, struct player *player)
+{
+    char request[512];
+    char body[256];
+    char *response = malloc(HTTP_RESPONSE_MAX);
+    const uint64_t start = now_ns();
+    if (!response) {
+        perror("malloc");
+        exit(1);
+    }
+
+    snprintf(body,
+             sizeof(body),
+             "playerName=%s&playerPassword=loadgen&gamePassword=%s",
+             player->name,
+             GAME_PASSWORD);
+    snprintf(request,
+             sizeof(request),
+             "POST /login HTTP/1.1\r\nHost: %s\r\nContent-Length: %zu\r\n\r\n%s",
+             options.host,
+             strlen(body),
+             body);
+    if (http_request(request, response, HTTP_RESPONSE_MAX) <= 0) {
+        goto exit_error;
+    }
+    const long long token = get_session_token(response);
+    if (!token) {
+        fprintf(stderr, "%s couldn't log in, is the game full?\n", player->name);
+        goto exit_error;
+    }
+
+    snprintf(body,
+             sizeof(body),
+             "playerBackground=Trader&playerGender=Male"
+             "&vigour=5&violence=4&cunning=4");
+    snprintf(request,
+             sizeof(request),
+             "POST /charsheet HTTP/1.1\r\nHost: %s\r\n"
+             "Cookie: sessionToken=%lld\r\nContent-Length: %zu\r\n\r\n%s",
+             options.host,
+             token,
+             strlen(body),
+             body);
+    if (http_request(request, response, HTTP_RESPONSE_MAX) <= 0
+        || upgrade_to_websocket(player, token) != 0) {
+        goto exit_error;
+    }
+
+    // Blocking until our own connect response comes back
+    const uint16_t connect = OPCODE_PLAYER_CONNECT;
+    const char connect_payload[3] = {(char)(connect & 0xFF), (char)(connect >> 8), 0};
+    player->sent_at[OPCODE_PLAYER_CONNECT] = now_ns();
+    if (send_frame(player, connect_payload, sizeof(connect_payload)) != 0) {
+        goto exit_error;
+    }
+    while (!handle_frames(worker, player)) {
+        const int got = SSL_read(player->ssl,
+                                 &player->buffer[player->buffered],
+                                 READ_BUFFER_SIZE - player->buffered);
+        if (got <= 0) {
+            goto exit_error;
+        }
+        player->buffered += got;
+    }
+    add_sample(&worker->setup, now_ns() - start);
+    free(response);
+    return 0;
+
+exit_error:
+    free(response);
+    return -1;
+}
+
+/*
+ * The steady state
+ * --------------------
+ */
+static void send_due(struct worker *worker, struct player *player, uint64_t now)
+{
+    for (int opcode = OPCODE_PING; opcode <= OPCODE_PLAYER_MOVE; opcode++) {
+        if (options.rates[opcode] <= 0 || player->sent_at[opcode]
+            || now < player->next_due[opcode]) {
+            continue;
+        }
+        struct {
+            uint16_t opcode;
+            double x;
+            double y;
+        } __attribute__((packed)) message = {opcode, 0.0, 0.0};
+        int len = sizeof(message.opcode);
+        if (opcode == OPCODE_PLAYER_MOVE) {
+            message.x = (double)(rand() % 2000) / 1000.0 - 1.0;
+            message.y = (double)(rand() % 2000) / 1000.0 - 1.0;
+            len       = sizeof(message);
+        }
+        player->sent_at[opcode] = now;
+        player->next_due[opcode] =
+            now + (uint64_t)(1e9 / options.rates[opcode]);
+        if (send_frame(player, &message, len) != 0) {
+            worker->failures++;
+            continue;
+        }
+        worker->frames_sent++;
+    }
+}
+
+static void run_load(struct worker *worker)
+{
+    struct pollfd *fds = calloc(worker->player_count, sizeof(*fds));
+    if (!fds) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < worker->player_count; i++) {
+        fds[i].fd     = worker->players[i].fd;
+        fds[i].events = POLLIN;
+        // Spread the first sends out over one period
+        for (int opcode = OPCODE_PING; opcode <= OPCODE_PLAYER_MOVE; opcode++) {
+            if (options.rates[opcode] > 0) {
+                worker->players[i].next_due[opcode] =
+                    run_start_ns
+                    + (uint64_t)(1e9 / options.rates[opcode]) * i
+                          / worker->player_count;
+            }
+        }
+    }
+    while (now_ns() < run_end_ns) {
+        const uint64_t now = now_ns();
+        for (int i = 0; i < worker->player_count; i++) {
+            if (fds[i].fd >= 0) {
+                send_due(worker, &worker->players[i], now);
+            }
+        }
+        if (poll(fds, worker->player_count, POLL_TIMEOUT_MS) <= 0) {
+            continue;
+        }
+        for (int i = 0; i < worker->player_count; i++) {
+            struct player *player = &worker->players[i];
+            if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP))) {
+                continue;
+            }
+            if (read_available(player) != 0) {
+                fprintf(stderr, "%s got disconnected\n", player->name);
+                worker->failures++;
+                fds[i].fd = -1;
+            }
+            handle_frames(worker, player);
+        }
+    }
+    free(fds);
+}
+
+static void *run_worker(void *arg)
+{
+    struct worker *worker = arg;
+    for (int i = 0; i < worker->player_count; i++) {
+        struct player *player = &worker->players[i];
+        if (set_up_player(worker, player) != 0) {
+            fprintf(stderr, "Couldn't set up %s\n", player->name);
+            exit(1);
+        }
+        // Non-blocking from here on, poll() drives us
+        fcntl(player->fd, F_SETFL, fcntl(player->fd, F_GETFL) | O_NONBLOCK);
+    }
+    pthread_barrier_wait(&connected_barrier);
+    pthread_barrier_wait(&connected_barrier);
+    run_load(worker);
+    for (int i = 0; i < worker->player_count; i++) {
+        tls_close(worker->players[i].fd, worker->players[i].ssl);
+    }
+    return NULL;
+}
+
+static void print_usage(const char *program_name)
+{
+    fprintf(stderr,
+            "Usage: %s [--host=IP] [--port=N] [--players=N]\n"
+            "          [--threads=N] [--duration=SECONDS]\n"
+            "          [--move-rate=HZ] [--ping-rate=HZ]\n"
+            "\n"
+            "  --players=N      Players to log in, the server's test\n"
+            "                   game needs room for them (--max-players).\n"
+            "  --move-rate=HZ   Moves per player per second, default %.0f.\n"
+            "  --ping-rate=HZ   Pings per player per second, default %.0f.\n",
+            program_name,
+            DEFAULT_MOVE_RATE,
+            DEFAULT_PING_RATE);
+}
+
+static int parse_options(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"host",      required_argument, NULL, 'a'},
+        {"port",      required_argument, NULL, 'p'},
+        {"players",   required_argument, NULL, 'n'},
+        {"threads",   required_argument, NULL, 't'},
+        {"duration",  required_argument, NULL, 'd'},
+        {"move-rate", required_argument, NULL, 'm'},
+        {"ping-rate", required_argument, NULL, 'i'},
+        {"help",      no_argument,       NULL, 'h'},
+        {NULL,        0,                 NULL, 0  }
+    };
+    int option = 0;
+    while ((option = getopt_long(argc, argv, "a:p:n:t:d:m:i:h", long_options, NULL))
+           != -1) {
+        switch (option) {
+        case 'a':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = atoi(optarg);
+            break;
+        case 'n':
+            options.players = atoi(optarg);
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            break;
+        case 'd':
+            options.duration = atoi(optarg);
+            break;
+        case 'm':
+            options.rates[OPCODE_PLAYER_MOVE] = atof(optarg);
+            break;
+        case 'i':
+            options.rates[OPCODE_PING] = atof(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+    if (options.players < 1 || options.threads < 1 || options.duration < 1) {
+        print_usage(argv[0]);
+        return -1;
+    }
+    if (options.threads > options.players) {
+        options.threads = options.players;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (parse_options(argc, argv) != 0) {
+        return 1;
+    }
+    ssl_ctx = SSL_CTX_new(TLS_client_method());
+    if (!ssl_ctx) {
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+    // Our own server with a self-signed certificate
+    SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+
+    struct worker *workers   = calloc(options.threads, sizeof(*workers));
+    struct player *players   = calloc(options.players, sizeof(*players));
+    const unsigned int nonce = (unsigned int)time(NULL) % 100000;
+    if (!workers || !players) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < options.players; i++) {
+        // Fresh names every run, so we never log in as someone else
+        snprintf(players[i].name, NAME_MAX_LEN, "lg%u-%d", nonce, i);
+        players[i].buffer = malloc(READ_BUFFER_SIZE);
+        if (!players[i].buffer) {
+            perror("malloc");
+            return 1;
+        }
+    }
+    pthread_barrier_init(&connected_barrier, NULL, options.threads + 1);
+
+    printf("%d players on %d threads against %s:%d, "
+           "%.1f moves and %.1f pings per player per second\n",
+           options.players,
+           options.threads,
+           options.host,
+           options.port,
+           options.rates[OPCODE_PLAYER_MOVE],
+           options.rates[OPCODE_PING]);
+    const uint64_t setup_start = now_ns();
+    int first_player           = 0;
+    for (int i = 0; i < options.threads; i++) {
+        const int count = options.players / options.threads
+                          + (i < options.players % options.threads);
+        workers[i].index        = i;
+        workers[i].players      = &players[first_player];
+        workers[i].player_count = count;
+        first_player += count;
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+    pthread_barrier_wait(&connected_barrier);
+    const uint64_t setup_ns = now_ns() - setup_start;
+    run_start_ns            = now_ns();
+    run_end_ns = run_start_ns + (uint64_t)options.duration * 1000000000ull;
+    pthread_barrier_wait(&connected_barrier);
+
+    struct samples setup                = {0};
+    struct samples rtt[OPCODE_COUNT]    = {0};
+    uint64_t frames_received            = 0;
+    uint64_t bytes_received             = 0;
+    uint64_t frames_sent                = 0;
+    int failures                        = 0;
+    for (int i = 0; i < options.threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        merge_samples(&setup, &workers[i].setup);
+        for (int opcode = 0; opcode < OPCODE_COUNT; opcode++) {
+            merge_samples(&rtt[opcode], &workers[i].rtt[opcode]);
+        }
+        frames_received += workers[i].frames_received;
+        bytes_received += workers[i].bytes_received;
+        frames_sent += workers[i].frames_sent;
+        failures += workers[i].failures;
+    }
+    const double seconds = (now_ns() - run_start_ns) / 1e9;
+
+    printf("Everyone connected in %.1fms\n", setup_ns / 1e6);
+    print_samples("setup", &setup);
+    for (int opcode = 0; opcode < OPCODE_COUNT; opcode++) {
+        print_samples(opcode_names[opcode], &rtt[opcode]);
+    }
+    printf("  sent       %.0f frames/s\n", frames_sent / seconds);
+    printf("  received   %.0f frames/s, %.2f MB/s\n",
+           frames_received / seconds,
+           bytes_received / seconds / 1e6);
+    if (failures) {
+        printf("  failures   %d\n", failures);
+    }
+    return failures ? 2 : 0;
+}
@@ -0,0 +1,426 @@
+/*
+ * ===========================
+ * replay.c
+ * ===========================
+ * Feeds a recording made with --record back through
+ * the real handlers, on the null network backend,
+ * as fast as the game workers take it.
+ *
+ * Messages go in through handle_game_message() from
+ * one thread, like they would from a reactor, and
+ * everything else a game was fed is run on its actor
+ * with game_actor_call(), so it lands in between the
+ * same messages it did live.
+ *
+ * At the end it prints the throughput, and a digest
+ * of every byte the server sent and of the final
+ * game state. Two replays of one recording should
+ * print the same digests, if they don't, something
+ * isn't deterministic. Players joining are checked
+ * against the recording as they go, which catches the
+ * game RNG drifting right where it happens.
+ *
+ * Usage: relicReplay RECORDING [game_workers]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "game_logic.h"
+#include "host_custom_attributes.h"
+#include "net_backend.h"
+#include "recorder.h"
+#include "websocket_handlers.h"
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ull
+#define FNV_PRIME        0x100000001B3ull
+
+struct replay_game {
+    struct game *game;
+    uint64_t next_tick;
+    struct host *hosts[MAX_PLAYERS_IN_GAME]; // Made on first use
+};
+
+struct replay {
+    struct replay_game *games; // By record id
+    uint32_t game_capacity;
+    uint64_t records;
+    uint64_t messages;
+    uint64_t gaps;
+    atomic_ulong divergences;
+};
+
+static struct replay replay = {0};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static struct replay_game *get_replay_game(uint32_t id)
+{
+    if (id >= replay.game_capacity) {
+        const uint32_t capacity = (id + 1) * 2;
+        replay.games = realloc(replay.games, capacity * sizeof(*replay.games));
+        if (!replay.games) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(&replay.games[replay.game_capacity],
+               0,
+               (capacity - replay.game_capacity) * sizeof(*replay.games));
+        replay.game_capacity = capacity;
+    }
+    return &replay.games[id];
+}
+
+static struct host *get_replay_host(struct replay_game *rgame,
+                                    const struct recording_record *record)
+{
+    struct host *host = rgame->hosts[record->slot];
+    if (!host) {
+        struct host_custom_attr *attr = calloc(1, sizeof(*attr));
+        if (!attr) {
+            perror("calloc");
+            exit(1);
+        }
+        host                      = net_null_create_host();
+        attr->handler             = HANDLER_WEBSOCK;
+        attr->game                = rgame->game;
+        rgame->hosts[record->slot] = host;
+        net_set_host_custom_attr(host, attr);
+    }
+    struct host_custom_attr *attr = net_get_host_custom_attr(host);
+    attr->player = make_player_handle(record->slot, record->generation);
+    return host;
+}
+
+/*
+ * Run on the game's actor, "data" is the
+ * record followed by its payload.
+ */
+static void set_charsheet(struct player *player,
+                          const struct recorded_charsheet *char_sheet)
+{
+    player->char_sheet.gender     = char_sheet->gender;
+    player->char_sheet.vigour     = char_sheet->vigour;
+    player->char_sheet.violence   = char_sheet->violence;
+    player->char_sheet.cunning    = char_sheet->cunning;
+    player->char_sheet.background = char_sheet->background;
+    atomic_store(&player->char_sheet.is_valid, char_sheet->is_valid);
+}
+
+static void apply_record(struct game *game,
+                         char *data,
+                         ssize_t data_size,
+                         struct host *remotehost)
+{
+    struct recording_record record;
+    memcpy(&record, data, sizeof(record));
+    const char *payload   = &data[sizeof(record)];
+    struct player *player = get_player_from_handle(
+        game,
+        make_player_handle(record.slot, record.generation));
+
+    switch (record.type) {
+    case RECORD_PLAYER_RESTORE:
+    case RECORD_PLAYER_CREATE: {
+        struct recorded_player recorded;
+        struct player_credentials credentials = {0};
+        memcpy(&recorded, payload, sizeof(recorded));
+        memcpy(credentials.name, recorded.name, MAX_CREDENTIAL_LEN);
+        if (record.type == RECORD_PLAYER_RESTORE) {
+            player = restore_player(game,
+                                    record.slot,
+                                    record.generation,
+                                    &credentials);
+            if (player) {
+                player->coords.x      = recorded.coords[0];
+                player->coords.y      = recorded.coords[1];
+                player->coords.z      = recorded.coords[2];
+                player->current_enc   = recorded.current_enc;
+                player->action_points = recorded.action_points;
+                player->km_walked     = recorded.km_walked;
+            }
+        }
+        else {
+            player = create_player(game, &credentials);
+        }
+        if (!player || player->id != record.slot
+            || player->generation != record.generation
+            || player->coords.x != recorded.coords[0]
+            || player->coords.y != recorded.coords[1]
+            || player->action_points != recorded.action_points
+            || player->km_walked != recorded.km_walked) {
+            atomic_fetch_add(&replay.divergences, 1);
+            fprintf(stderr,
+                    "Diverged at tick %llu of \"%s\", "
+                    "player %d didn't join like they did live\n",
+                    (unsigned long long)record.tick,
+                    game->name,
+                    record.slot);
+            return;
+        }
+        set_charsheet(player, &recorded.char_sheet);
+        break;
+    }
+    case RECORD_GAME_TURN: {
+        struct recorded_turn turn;
+        memcpy(&turn, payload, sizeof(turn));
+        if (turn.current_turn >= 0 && turn.current_turn < MAX_PLAYERS_IN_GAME
+            && (get_live_players(game)
+                & ((player_mask_t)1 << turn.current_turn))) {
+            game->current_turn = &game->players[turn.current_turn];
+            game->state        = turn.state;
+        }
+        break;
+    }
+    case RECORD_PLAYER_LEAVE:
+        if (player) {
+            delete_player(player);
+        }
+        break;
+    case RECORD_CHARSHEET:
+        if (player) {
+            set_charsheet(player, (const struct recorded_charsheet *)payload);
+        }
+        break;
+    case RECORD_HOST_OPEN:
+        if (player) {
+            player->associated_host = remotehost;
+        }
+        break;
+    case RECORD_HOST_CLOSE:
+        if (player && player->associated_host == remotehost) {
+            player->associated_host = NULL;
+        }
+        break;
+    case RECORD_TURN_TIMEOUT:
+        if (player && game->current_turn == player) {
+            turn_timed_out(game);
+        }
+        break;
+    case RECORD_HEAT_NODE: {
+        struct recorded_heat_node node;
+        memcpy(&node, payload, sizeof(node));
+        if (node.index < HEATMAP_OVERLAY_CELLS) {
+            memcpy(get_heatmap_overlay(game)->nodes[node.index].lanes,
+                   node.lanes,
+                   sizeof(node.lanes));
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static void begin_game(const struct recording_record *record,
+                       const char *payload)
+{
+    struct recorded_game recorded;
+    struct game_config config = {0};
+    memcpy(&recorded, payload, sizeof(recorded));
+    memcpy(config.name, recorded.name, MAX_CREDENTIAL_LEN);
+    config.max_player_count = recorded.max_player_count;
+    config.min_player_count = recorded.min_player_count;
+    config.rng_seed         = recorded.rng_state;
+    config.state_epoch      = recorded.state_epoch;
+
+    struct replay_game *rgame = get_replay_game(record->game_id);
+    rgame->game               = create_game(&config);
+    rgame->next_tick          = record->tick + 1;
+    if (!rgame->game) {
+        fprintf(stderr, "Couldn't create \"%s\"\n", config.name);
+        exit(1);
+    }
+    // Nothing's been posted to it yet
+    if (recorded.heat_shift_count) {
+        get_heatmap_overlay(rgame->game)->shift_count =
+            recorded.heat_shift_count;
+    }
+}
+
+static void run_record(const struct recording_record *record,
+                       const char *payload)
+{
+    if (record->type == RECORD_GAME_BEGIN) {
+        begin_game(record, payload);
+        return;
+    }
+    struct replay_game *rgame = get_replay_game(record->game_id);
+    if (!rgame->game) {
+        return;
+    }
+    if (record->tick != rgame->next_tick) {
+        replay.gaps++;
+    }
+    rgame->next_tick = record->tick + 1;
+    if (record->slot < 0 || record->slot >= rgame->game->max_player_count) {
+        if (record->type == RECORD_GAME_TURN
+            || record->type == RECORD_HEAT_NODE) {
+            game_actor_call(rgame->game,
+                            apply_record,
+                            (const char *)record,
+                            sizeof(*record) + record->size,
+                            NULL);
+        }
+        return;
+    }
+    struct host *host = get_replay_host(rgame, record);
+    if (record->type == RECORD_MESSAGE) {
+        replay.messages++;
+        handle_game_message((char *)payload, record->size, host);
+        return;
+    }
+    game_actor_call(rgame->game,
+                    apply_record,
+                    (const char *)record,
+                    sizeof(*record) + record->size,
+                    host);
+}
+
+static void drain_game(struct game *game,
+                       char *data,
+                       ssize_t data_size,
+                       struct host *remotehost)
+{
+}
+
+static void print_digests(void)
+{
+    uint64_t output_hash = FNV_OFFSET_BASIS;
+    uint64_t state_hash  = FNV_OFFSET_BASIS;
+    uint64_t packets     = 0;
+    uint64_t bytes       = 0;
+    for (uint32_t i = 0; i < replay.game_capacity; i++) {
+        const struct replay_game *rgame = &replay.games[i];
+        if (!rgame->game) {
+            continue;
+        }
+        const struct game *game = rgame->game;
+        for (int slot = 0; slot < game->max_player_count; slot++) {
+            struct net_null_stats stats = {0};
+            if (rgame->hosts[slot]) {
+                net_null_get_host_stats(rgame->hosts[slot], &stats);
+            }
+            output_hash = hash_bytes(output_hash, &stats, sizeof(stats));
+            packets += stats.packets;
+            bytes += stats.bytes;
+        }
+        for (player_mask_t slots = get_live_players(game); slots;) {
+            const struct player *player =
+                &game->players[pop_player_slot(&slots)];
+            state_hash = hash_bytes(state_hash, &player->id, sizeof(player->id));
+            state_hash =
+                hash_bytes(state_hash, &player->coords, sizeof(player->coords));
+            state_hash = hash_bytes(state_hash,
+                                    &player->action_points,
+                                    sizeof(player->action_points));
+            state_hash = hash_bytes(state_hash,
+                                    &player->km_walked,
+                                    sizeof(player->km_walked));
+            state_hash = hash_bytes(state_hash,
+                                    &player->current_enc,
+                                    sizeof(player->current_enc));
+        }
+        const player_id_t turn =
+            game->current_turn ? game->current_turn->id : INVALID_PLAYER_ID;
+        state_hash = hash_bytes(state_hash, &turn, sizeof(turn));
+        state_hash = hash_bytes(state_hash, &game->state, sizeof(game->state));
+        if (game->heat_overlay) {
+            state_hash = hash_bytes(state_hash,
+                                    game->heat_overlay,
+                                    sizeof(*game->heat_overlay));
+        }
+    }
+    printf("  sent         %llu packets, %llu bytes\n",
+           (unsigned long long)packets,
+           (unsigned long long)bytes);
+    printf("  output hash  %016llx\n", (unsigned long long)output_hash);
+    printf("  state hash   %016llx\n", (unsigned long long)state_hash);
+}
+
+int main(int argc, char **argv)
+{
+    struct stat file_stat = {0};
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s RECORDING [game_workers]\n", argv[0]);
+        return 1;
+    }
+    const int workers = argc > 2 ? atoi(argv[2]) : 0;
+    const int fd      = open(argv[1], O_RDONLY);
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        perror("Couldn't open the recording");
+        return 1;
+    }
+    const size_t size = file_stat.st_size;
+    // Private and writable, the handlers take "char *"
+    char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    const struct recording_header *header = (const void *)data;
+    if (size < sizeof(*header)
+        || memcmp(header->magic, RECORDING_MAGIC, sizeof(header->magic)) != 0
+        || header->version != RECORDING_VERSION) {
+        fprintf(stderr, "%s isn't a recording we can read\n", argv[1]);
+        return 1;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    net_backend_select(NET_BACKEND_NULL);
+    game_actor_start_workers(workers);
+
+    const uint64_t start = now_ns();
+    size_t offset        = sizeof(*header);
+    while (offset + sizeof(struct recording_record) <= size) {
+        const struct recording_record *record = (const void *)&data[offset];
+        if (offset + sizeof(*record) + record->size > size) {
+            break; // Torn by a crash
+        }
+        run_record(record, &data[offset + sizeof(*record)]);
+        offset += sizeof(*record) + record->size;
+        replay.records++;
+    }
+    for (uint32_t i = 0; i < replay.game_capacity; i++) {
+        if (replay.games[i].game) {
+            game_actor_call(replay.games[i].game, drain_game, NULL, 0, NULL);
+        }
+    }
+    const double elapsed_s = (now_ns() - start) / 1e9;
+
+    printf("Replayed %s\n", argv[1]);
+    printf("  records      %llu, %llu of them messages\n",
+           (unsigned long long)replay.records,
+           (unsigned long long)replay.messages);
+    printf("  took         %.3fs, %.0f messages/s\n",
+           elapsed_s,
+           replay.messages / elapsed_s);
+    printf("  divergences  %lu\n", atomic_load(&replay.divergences));
+    if (replay.gaps) {
+        printf("  gaps         %llu, the recording's missing records\n",
+               (unsigned long long)replay.gaps);
+    }
+    print_digests();
+    return atomic_load(&replay.divergences) ? 2 : 0;
+}
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "auth.h"
+#include "game_wal.h"
 #include "html_server.h"
 
 static int is_player_password_valid(const struct player *restrict player,
@@ -27,20 +28,17 @@ static int is_player_password_valid(const struct player *restrict player,
 static struct player *try_get_player_from_playername(struct game *game,
                                                      const char *playername)
 {
-    int player_index = 0;
     int player_found = -1;
 
-    pthread_mutex_lock(&game->threadlock);
-    for (player_index = 0; player_index < game->player_count; player_index++) {
-        player_found = strncmp(playername,
-                               game->players[player_index].credentials.name,
+    for (player_mask_t slots = get_live_players(game); slots;) {
+        struct player *player = &game->players[pop_player_slot(&slots)];
+        player_found          = strncmp(playername,
+                               player->credentials.name,
                                MAX_CREDENTIAL_LEN);
         if (!player_found) {
-            pthread_mutex_unlock(&game->threadlock);
-            return &game->players[player_index];
+            return player;
         }
     }
-    pthread_mutex_unlock(&game->threadlock);
     return NULL;
 }
 /*
@@ -53,6 +51,8 @@ static struct player *try_get_player_from_playername(struct game *game,
  *
  * returns -1 when the player exists but the
  * password was wrong
+ *
+ * Runs on the game's actor.
  */
 int try_player_login(struct game *restrict game,
                      struct player_credentials *restrict credentials,
@@ -63,37 +63,39 @@ int try_player_login(struct game *restrict game,
         return -1;
     }
     struct player *player = try_get_player_from_playername(game, credentials->name);
-    pthread_mutex_lock(&game->threadlock);
     if (player) {
         if (is_player_password_valid(player, credentials->password)) {
             // Successful login
             generate_session_token(player, game);
+            log_player_login(player);
             build_session_token_header(session_token_header,
-                                       player->session_token);
+                                       atomic_load(&player->session_token));
             send_content("./game.html",
                          HTTP_FLAG_TEXT_HTML,
                          remotehost,
                          session_token_header);
-            pthread_mutex_unlock(&game->threadlock);
             return 0;
         }
         else {
             // Player exists, but the password was wrong
-            pthread_mutex_unlock(&game->threadlock);
             return -1;
         }
     }
     // Player was not found in game redirect them to character creation
     // And create a player
     player = create_player(game, credentials);
+    if (!player) {
+        // Game's full
+        return -1;
+    }
     generate_session_token(player, game);
-    build_session_token_header(session_token_header, player->session_token);
+    log_player_login(player);
+    build_session_token_header(session_token_header,
+                               atomic_load(&player->session_token));
     send_content("./charsheet.html",
                  HTTP_FLAG_TEXT_HTML,
                  remotehost,
                  session_token_header);
-
-    pthread_mutex_unlock(&game->threadlock);
     return 0;
 }
 
@@ -101,7 +103,6 @@ int try_player_login(struct game *restrict game,
  * We pass in the game because the
  * session token needs to be unique
  * on a per game basis.
- * Caller locks the game.
  */
 static void generate_session_token(struct player *restrict player,
                                    struct game *restrict game)
@@ -119,7 +120,7 @@ static void generate_session_token(struct player *restrict player,
             exit(1);
         }
     }
-    player->session_token = nonce;
+    atomic_store(&player->session_token, nonce);
 }
 
 /*
@@ -158,12 +159,11 @@ session_token_t get_token_from_http(char *http, int http_length)
 
 /*
  * Returns 0 on success and -1 on failure
+ * Runs on the game's actor.
  */
 int try_game_login(struct game *restrict game, const char *password)
 {
     assert(game && password);
-    pthread_mutex_lock(&game->threadlock);
     int match = !strncmp(game->password, password, MAX_CREDENTIAL_LEN);
-    pthread_mutex_unlock(&game->threadlock);
     return --match;
 }
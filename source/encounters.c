@@ -0,0 +1,388 @@
+/*
+ * ===========================
+ * encounters.c
+ * ===========================
+ * An alias table has one column per outcome with a
+ * non-zero weight. A draw picks a column uniformly,
+ * and then either the column's own outcome or its
+ * alias, depending on which side of the column's
+ * threshold the rest of the random number falls.
+ * Vose's method fills the columns so that every
+ * outcome comes out in proportion to its weight.
+ *
+ * Everything is integers, so a table built from the
+ * same weights draws the same everywhere, which keeps
+ * replays rolling what the game rolled.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "encounters.h"
+#include "epoch.h"
+#include "error_handling.h"
+#include "game_wal.h"
+#include "heatmap.h"
+
+#define ALIAS_TABLE_MAX ENCOUNTER_COUNT
+
+_Static_assert((int)ENCOUNTER_TYPE_COUNT <= (int)ALIAS_TABLE_MAX,
+               "the category table fits in an alias table");
+_Static_assert(ENCOUNTER_COUNT <= UINT8_MAX,
+               "outcomes are stored in a byte");
+
+struct alias_table {
+    uint32_t count; // Columns, 0 when nothing can be drawn
+    uint32_t thresholds[ALIAS_TABLE_MAX];
+    uint8_t outcomes[ALIAS_TABLE_MAX]; // Below the threshold
+    uint8_t aliases[ALIAS_TABLE_MAX];  // At or above it
+};
+
+struct encounter_region {
+    uint32_t type_weights[ENCOUNTER_TYPE_COUNT];
+    uint32_t weights[ENCOUNTER_TYPE_COUNT][ENCOUNTER_COUNT];
+    struct alias_table types;
+    struct alias_table encounters[ENCOUNTER_TYPE_COUNT];
+};
+
+/*
+ * What every region starts out with.
+ * Categories with nothing in them are never drawn.
+ * Movement rolls once a kilometre, so nothing is
+ * weighted to leave 400 in 16000, 2.5% a kilometre
+ * where the heatmap is at full weight.
+ */
+static const uint32_t default_type_weights[ENCOUNTER_TYPE_COUNT] = {
+    [ENCOUNTER_TYPE_NONE]          = 15600,
+    [ENCOUNTER_TYPE_ANY]           = 60,
+    [ENCOUNTER_TYPE_BANDIT]        = 100,
+    [ENCOUNTER_TYPE_BEASTS]        = 120,
+    [ENCOUNTER_TYPE_MONSTROSITIES] = 40,
+    [ENCOUNTER_TYPE_DRAGON]        = 5,
+    [ENCOUNTER_TYPE_MYSTICAL]      = 30,
+    [ENCOUNTER_TYPE_CULTISTS]      = 45};
+
+static const uint32_t default_weights[ENCOUNTER_TYPE_COUNT][ENCOUNTER_COUNT] = {
+    [ENCOUNTER_TYPE_NONE] = {[ENCOUNTER_NONE] = 1},
+    // Whatever doesn't belong to a category
+    [ENCOUNTER_TYPE_ANY] = {[ENCOUNTER_BEGGAR]         = 3,
+                            [ENCOUNTER_TREASURE_SMALL] = 3,
+                            [ENCOUNTER_TREASURE_LARGE] = 1},
+    [ENCOUNTER_TYPE_BANDIT]        = {[ENCOUNTER_BANDITS] = 1},
+    [ENCOUNTER_TYPE_BEASTS]        = {[ENCOUNTER_WOLVES] = 2,
+                                      [ENCOUNTER_RATS]   = 3},
+    [ENCOUNTER_TYPE_MONSTROSITIES] = {[ENCOUNTER_TROLLS] = 1},
+    [ENCOUNTER_TYPE_DRAGON]        = {[ENCOUNTER_DRAGONS] = 1},
+    [ENCOUNTER_TYPE_MYSTICAL]      = {[ENCOUNTER_RUINS_OLD]         = 4,
+                                      [ENCOUNTER_TREASURE_MAGICAL]  = 1,
+                                      [ENCOUNTER_SPELL_TOME]        = 2},
+    [ENCOUNTER_TYPE_CULTISTS]      = {[ENCOUNTER_CULTISTS_CANNIBAL] = 1,
+                                      [ENCOUNTER_CULTISTS_PEACEFUL] = 1}};
+
+static _Atomic(struct encounter_region *) regions[ENCOUNTER_REGION_COUNT];
+// Writers only, readers never wait on it
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Alias tables
+ * --------------------
+ */
+
+// GCC and Clang both have it, -Wpedantic just wants that said
+__extension__ typedef unsigned __int128 alias_u128;
+
+/*
+ * Vose's method. Every column is worth "total" once
+ * the weights are scaled by the column count, the ones
+ * short of that are topped up from ones that are over.
+ */
+static void build_alias_table(struct alias_table *table,
+                              const uint32_t *weights,
+                              int weight_count)
+{
+    uint64_t scaled[ALIAS_TABLE_MAX];
+    uint8_t small[ALIAS_TABLE_MAX];
+    uint8_t large[ALIAS_TABLE_MAX];
+    int small_count = 0;
+    int large_count = 0;
+    uint64_t total  = 0;
+    uint32_t count  = 0;
+
+    for (int i = 0; i < weight_count; i++) {
+        if (weights[i]) {
+            table->outcomes[count] = (uint8_t)i;
+            scaled[count]          = weights[i];
+            total += weights[i];
+            count++;
+        }
+    }
+    table->count = count;
+    for (uint32_t i = 0; i < count; i++) {
+        scaled[i] *= count;
+        if (scaled[i] < total) {
+            small[small_count++] = (uint8_t)i;
+        }
+        else {
+            large[large_count++] = (uint8_t)i;
+        }
+    }
+    while (small_count && large_count) {
+        const uint8_t column = small[--small_count];
+        const uint8_t donor  = large[large_count - 1];
+        // scaled < total, so this is below 2^32
+        table->thresholds[column] =
+            (uint32_t)(((alias_u128)scaled[column] << 32) / total);
+        table->aliases[column] = table->outcomes[donor];
+        scaled[donor] -= total - scaled[column];
+        if (scaled[donor] < total) {
+            large_count--;
+            small[small_count++] = donor;
+        }
+    }
+    // Full columns, give or take rounding. Their alias is
+    // themselves, for when the threshold's hit exactly.
+    while (large_count) {
+        const uint8_t column      = large[--large_count];
+        table->thresholds[column] = UINT32_MAX;
+        table->aliases[column]    = table->outcomes[column];
+    }
+    while (small_count) {
+        const uint8_t column      = small[--small_count];
+        table->thresholds[column] = UINT32_MAX;
+        table->aliases[column]    = table->outcomes[column];
+    }
+}
+
+// The high half picks the column, the low half the side
+static inline int draw_alias_table(const struct alias_table *table,
+                                   uint64_t random)
+{
+    const uint32_t column =
+        (uint32_t)(((random >> 32) * table->count) >> 32);
+    return (uint32_t)random < table->thresholds[column]
+               ? table->outcomes[column]
+               : table->aliases[column];
+}
+
+/*
+ * Regions
+ * --------------------
+ */
+
+// Categories that can't come up with anything weigh nothing
+static void build_type_table(struct encounter_region *region)
+{
+    uint32_t weights[ENCOUNTER_TYPE_COUNT];
+    for (int type = 0; type < ENCOUNTER_TYPE_COUNT; type++) {
+        weights[type] =
+            region->encounters[type].count ? region->type_weights[type] : 0;
+    }
+    build_alias_table(&region->types, weights, ENCOUNTER_TYPE_COUNT);
+}
+
+static struct encounter_region *alloc_region(void)
+{
+    struct encounter_region *region = malloc(sizeof(*region));
+    if (!region) {
+        print_error(BB_ERR_MALLOC);
+        exit(1);
+    }
+    return region;
+}
+
+static bool reclaim_region(void *region)
+{
+    free(region);
+    return true;
+}
+
+// Caller holds regions_lock
+static void build_default_regions(void)
+{
+    for (int i = 0; i < ENCOUNTER_REGION_COUNT; i++) {
+        struct encounter_region *region = alloc_region();
+        memcpy(region->type_weights,
+               default_type_weights,
+               sizeof(region->type_weights));
+        memcpy(region->weights, default_weights, sizeof(region->weights));
+        for (int type = 0; type < ENCOUNTER_TYPE_COUNT; type++) {
+            build_alias_table(&region->encounters[type],
+                              region->weights[type],
+                              ENCOUNTER_COUNT);
+        }
+        build_type_table(region);
+        atomic_store_explicit(&regions[i], region, memory_order_release);
+    }
+}
+
+// Built the first time anyone asks
+static struct encounter_region *get_region(int index)
+{
+    struct encounter_region *region =
+        atomic_load_explicit(&regions[index], memory_order_acquire);
+    if (__builtin_expect(region != NULL, 1)) {
+        return region;
+    }
+    pthread_mutex_lock(&regions_lock);
+    if (!atomic_load_explicit(&regions[index], memory_order_relaxed)) {
+        build_default_regions();
+    }
+    pthread_mutex_unlock(&regions_lock);
+    return atomic_load_explicit(&regions[index], memory_order_acquire);
+}
+
+static int clamp_region_index(int index, int count)
+{
+    return index < 0 ? 0 : index >= count ? count - 1 : index;
+}
+
+int encounter_region_at(const struct coordinates *coords)
+{
+    const int col = (int)((coords->x + MAP_BOUND_X) / (2 * MAP_BOUND_X)
+                          * ENCOUNTER_REGION_COLS);
+    const int row = (int)((coords->y + MAP_BOUND_Y) / (2 * MAP_BOUND_Y)
+                          * ENCOUNTER_REGION_ROWS);
+    return clamp_region_index(row, ENCOUNTER_REGION_ROWS)
+               * ENCOUNTER_REGION_COLS
+           + clamp_region_index(col, ENCOUNTER_REGION_COLS);
+}
+
+enum encounter_id draw_encounter(struct game *game,
+                                 int region_index,
+                                 enum encounter_type_id *out_type)
+{
+    const struct encounter_region *region = get_region(region_index);
+    enum encounter_type_id type           = ENCOUNTER_TYPE_NONE;
+    enum encounter_id encounter           = ENCOUNTER_NONE;
+
+    if (region->types.count) {
+        type      = draw_alias_table(&region->types, game_random_u64(game));
+        encounter = draw_alias_table(&region->encounters[type],
+                                     game_random_u64(game));
+    }
+    if (out_type) {
+        *out_type = type;
+    }
+    return encounter;
+}
+
+/*
+ * The heatmap is only looked at when something's
+ * drawn, most draws come out as nothing anyway.
+ * The weight maps onto [0, 255) so that
+ * HEATMAP_FULL always keeps it and 0 never does.
+ */
+enum encounter_id draw_encounter_at(struct game *game,
+                                    const struct coordinates *coords,
+                                    enum encounter_type_id *out_type)
+{
+    struct heatmap_weights heat;
+    enum encounter_type_id type = ENCOUNTER_TYPE_NONE;
+    enum encounter_id encounter =
+        draw_encounter(game, encounter_region_at(coords), &type);
+
+    if (type != ENCOUNTER_TYPE_NONE) {
+        get_game_heatmap_weights(game, coords, &heat);
+        const uint64_t roll =
+            ((game_random_u64(game) >> 32) * HEATMAP_FULL) >> 32;
+        if (roll >= heat.lanes[type]) {
+            type      = ENCOUNTER_TYPE_NONE;
+            encounter = ENCOUNTER_NONE;
+        }
+    }
+    if (out_type) {
+        *out_type = type;
+    }
+    return encounter;
+}
+
+void shift_encounter_odds(struct game *game,
+                          const struct coordinates *coords,
+                          double radius,
+                          enum encounter_type_id type,
+                          int delta)
+{
+    struct heatmap_shift shift;
+    make_heatmap_shift(coords, radius, type, delta, &shift);
+    // Logged saturated, so it replays the same
+    if (saturate_heatmap_shift(game, &shift) && shift_heatmap(game, &shift)) {
+        log_heatmap_shift(game, &shift);
+    }
+}
+
+/*
+ * Publishes a copy of the region with the new weight,
+ * rebuilding only the category it's in, and the
+ * category table on top of that.
+ */
+static void update_region(int index,
+                          enum encounter_type_id type,
+                          enum encounter_id encounter,
+                          uint32_t weight,
+                          bool is_type_weight)
+{
+    struct encounter_region *old_region = NULL;
+    struct encounter_region *region     = alloc_region();
+
+    // So there's something to copy
+    get_region(index);
+    pthread_mutex_lock(&regions_lock);
+    old_region = atomic_load_explicit(&regions[index], memory_order_relaxed);
+    memcpy(region, old_region, sizeof(*region));
+    if (is_type_weight) {
+        region->type_weights[type] = weight;
+    }
+    else {
+        region->weights[type][encounter] = weight;
+        build_alias_table(&region->encounters[type],
+                          region->weights[type],
+                          ENCOUNTER_COUNT);
+    }
+    build_type_table(region);
+    atomic_store_explicit(&regions[index], region, memory_order_release);
+    pthread_mutex_unlock(&regions_lock);
+    epoch_retire(old_region, reclaim_region);
+}
+
+void set_encounter_type_weight(int region,
+                               enum encounter_type_id type,
+                               uint32_t weight)
+{
+    update_region(region, type, ENCOUNTER_NONE, weight, true);
+}
+
+void set_encounter_weight(int region,
+                          enum encounter_type_id type,
+                          enum encounter_id encounter,
+                          uint32_t weight)
+{
+    update_region(region, type, encounter, weight, false);
+}
+
+double get_encounter_chance(int region_index,
+                            enum encounter_type_id type,
+                            enum encounter_id encounter)
+{
+    const struct encounter_region *region = get_region(region_index);
+    uint64_t type_total                   = 0;
+    uint64_t encounter_total              = 0;
+
+    if (!region->encounters[type].count) {
+        return 0.0;
+    }
+    for (int i = 0; i < ENCOUNTER_TYPE_COUNT; i++) {
+        if (region->encounters[i].count) {
+            type_total += region->type_weights[i];
+        }
+    }
+    for (int i = 0; i < ENCOUNTER_COUNT; i++) {
+        encounter_total += region->weights[type][i];
+    }
+    if (!type_total) {
+        return 0.0;
+    }
+    return (double)region->type_weights[type] / type_total
+           * region->weights[type][encounter] / encounter_total;
+}
@@ -0,0 +1,86 @@
+/*
+ * ===========================
+ * encounters.h
+ * ===========================
+ * Which encounter, if any, a player runs into.
+ * The map is cut into a grid of regions, and every
+ * region weighs the encounter categories, and the
+ * encounters in each category, on its own.
+ *
+ * A draw is two Walker/Vose alias table lookups,
+ * category first and then the encounter in it, so
+ * it costs the same however many encounters there
+ * are. Changing a weight only rebuilds the tables
+ * of the region and category it's in.
+ *
+ * The tables are shared by every game and read
+ * without a lock, a change publishes a new copy of
+ * the region and retires the old one, see epoch.h.
+ */
+
+#ifndef BB_ENCOUNTERS
+#define BB_ENCOUNTERS
+
+#include <stdint.h>
+
+#include "game_logic.h"
+
+#define ENCOUNTER_REGION_COLS  4
+#define ENCOUNTER_REGION_ROWS  4
+#define ENCOUNTER_REGION_COUNT (ENCOUNTER_REGION_COLS * ENCOUNTER_REGION_ROWS)
+
+// Anything off the map counts as the nearest region
+int encounter_region_at(const struct coordinates *coords);
+
+/*
+ * Rolls with the game's RNG, on its actor.
+ * Returns ENCOUNTER_NONE when nothing happens,
+ * "out_type" can be NULL.
+ * Caller is in epoch_enter(), which game actor
+ * commands always are.
+ */
+enum encounter_id draw_encounter(struct game *game,
+                                 int region,
+                                 enum encounter_type_id *out_type);
+
+/*
+ * Same, but the category's odds are scaled by
+ * the heatmaps at "coords", with the game's shifts,
+ * whatever's left over is nothing happening.
+ * See heatmap.h.
+ */
+enum encounter_id draw_encounter_at(struct game *game,
+                                    const struct coordinates *coords,
+                                    enum encounter_type_id *out_type);
+
+/*
+ * Adds "delta" out of HEATMAP_FULL to the category's
+ * heatmap weight within "radius" of "coords", for
+ * this game only, and logs it. On the game's actor.
+ * Shifts pile up, to at most HEATMAP_SHIFT_MAX
+ * either way, see heatmap.h.
+ */
+void shift_encounter_odds(struct game *game,
+                          const struct coordinates *coords,
+                          double radius,
+                          enum encounter_type_id type,
+                          int delta);
+
+/*
+ * From any thread. A weight of 0 means it's never
+ * drawn, and so is a category with nothing in it.
+ */
+void set_encounter_type_weight(int region,
+                               enum encounter_type_id type,
+                               uint32_t weight);
+void set_encounter_weight     (int region,
+                               enum encounter_type_id type,
+                               enum encounter_id encounter,
+                               uint32_t weight);
+// How likely a draw is to come out as exactly this,
+// from the weights. Caller is in epoch_enter().
+double get_encounter_chance   (int region,
+                               enum encounter_type_id type,
+                               enum encounter_id encounter);
+
+#endif
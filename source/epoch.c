@@ -0,0 +1,170 @@
+/*
+ * ===========================
+ * epoch.c
+ * ===========================
+ * Every thread that reads gets a record, saying
+ * which global epoch it saw when it entered its
+ * read section, or 0 while it's outside of one.
+ *
+ * The global epoch only moves forward when every
+ * reader inside a read section has seen the current
+ * one. Something retired in epoch E is only reachable
+ * by readers in E-1 or E, so once the global epoch
+ * hits E+2 they've all left and it's safe to free.
+ *
+ * Records are never freed, the threads that read
+ * live as long as the server does.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+#include "error_handling.h"
+#include "mem_pool.h"
+
+#define EPOCH_INACTIVE 0
+#define EPOCH_GRACE    2 // Epochs before something retired is freed
+
+struct epoch_record {
+    atomic_uint_fast64_t epoch; // EPOCH_INACTIVE outside read sections
+    int nesting;
+    struct epoch_record *next;
+};
+
+struct epoch_garbage {
+    void *object;
+    epoch_reclaim_fn_t reclaim;
+    uint64_t epoch; // When it was retired
+    struct epoch_garbage *next;
+};
+
+static struct mem_pool garbage_pool =
+    MEM_POOL_INITIALIZER(struct epoch_garbage, 64);
+
+static atomic_uint_fast64_t global_epoch          = 1;
+static _Atomic(struct epoch_record *) records     = NULL;
+static __thread struct epoch_record *thread_record = NULL;
+
+// Retired, waiting for the readers
+static struct {
+    pthread_mutex_t lock;
+    struct epoch_garbage *head;
+    atomic_uint_fast64_t count;
+} limbo = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static struct epoch_record *get_thread_record(void)
+{
+    if (thread_record) {
+        return thread_record;
+    }
+    struct epoch_record *record = calloc(1, sizeof(*record));
+    if (!record) {
+        print_error(BB_ERR_CALLOC);
+        exit(1);
+    }
+    record->next = atomic_load(&records);
+    while (!atomic_compare_exchange_weak(&records, &record->next, record)) {
+    }
+    thread_record = record;
+    return record;
+}
+
+void epoch_enter(void)
+{
+    struct epoch_record *record = get_thread_record();
+    if (record->nesting++ > 0) {
+        return;
+    }
+    // If the global epoch moves on right after we load it,
+    // we just hold it back one epoch longer than needed.
+    atomic_store_explicit(&record->epoch,
+                          atomic_load(&global_epoch),
+                          memory_order_relaxed);
+    // Writers have to see us before we read anything shared
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(void)
+{
+    struct epoch_record *record = thread_record;
+    if (--record->nesting > 0) {
+        return;
+    }
+    atomic_store_explicit(&record->epoch, EPOCH_INACTIVE, memory_order_release);
+}
+
+static void try_advance(void)
+{
+    uint64_t epoch = atomic_load(&global_epoch);
+    atomic_thread_fence(memory_order_seq_cst);
+    for (struct epoch_record *record = atomic_load(&records); record;
+         record                      = record->next) {
+        const uint64_t seen =
+            atomic_load_explicit(&record->epoch, memory_order_acquire);
+        if (seen != EPOCH_INACTIVE && seen != epoch) {
+            return;
+        }
+    }
+    atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+}
+
+static void push_garbage(struct epoch_garbage *garbage)
+{
+    garbage->epoch = atomic_load(&global_epoch);
+    pthread_mutex_lock(&limbo.lock);
+    garbage->next = limbo.head;
+    limbo.head    = garbage;
+    pthread_mutex_unlock(&limbo.lock);
+}
+
+void epoch_retire(void *object, epoch_reclaim_fn_t reclaim)
+{
+    struct epoch_garbage *garbage = mem_pool_alloc(&garbage_pool);
+    garbage->object               = object;
+    garbage->reclaim              = reclaim;
+    atomic_fetch_add(&limbo.count, 1);
+    push_garbage(garbage);
+    epoch_collect();
+}
+
+void epoch_collect(void)
+{
+    struct epoch_garbage *ready = NULL;
+
+    try_advance();
+    const uint64_t epoch = atomic_load(&global_epoch);
+
+    pthread_mutex_lock(&limbo.lock);
+    struct epoch_garbage **link = &limbo.head;
+    while (*link) {
+        struct epoch_garbage *garbage = *link;
+        if (garbage->epoch + EPOCH_GRACE <= epoch) {
+            *link         = garbage->next;
+            garbage->next = ready;
+            ready         = garbage;
+        }
+        else {
+            link = &garbage->next;
+        }
+    }
+    pthread_mutex_unlock(&limbo.lock);
+
+    // Outside the lock, reclaim might retire more
+    while (ready) {
+        struct epoch_garbage *garbage = ready;
+        ready                         = garbage->next;
+        if (!garbage->reclaim(garbage->object)) {
+            push_garbage(garbage);
+            continue;
+        }
+        mem_pool_free(&garbage_pool, garbage);
+        atomic_fetch_sub(&limbo.count, 1);
+    }
+}
+
+uint64_t epoch_pending_count(void)
+{
+    return atomic_load(&limbo.count);
+}
@@ -0,0 +1,45 @@
+/*
+ * ===========================
+ * epoch.h
+ * ===========================
+ * Epoch based reclamation, for shared objects
+ * that readers look up without taking a lock.
+ *
+ * Readers wrap everything they do with such an
+ * object in epoch_enter()/epoch_exit().
+ * Writers unlink the object so nobody new can
+ * find it, then hand it to epoch_retire(), which
+ * calls "reclaim" once every reader that could
+ * still have it has called epoch_exit().
+ *
+ * Read sections nest, and shouldn't block for long,
+ * a stuck reader holds back every reclamation.
+ */
+
+#ifndef BB_EPOCH
+#define BB_EPOCH
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Returns false if the object can't be freed just
+ * yet, it's handed back to us after another epoch.
+ */
+typedef bool (*epoch_reclaim_fn_t)(void *object);
+
+void epoch_enter(void);
+void epoch_exit (void);
+
+void epoch_retire(void *object, epoch_reclaim_fn_t reclaim);
+/*
+ * Reclaims whatever's old enough. epoch_retire()
+ * calls this too, and so does the timer wheel's
+ * thread every few ticks.
+ */
+void epoch_collect(void);
+
+// Objects retired and not reclaimed yet
+uint64_t epoch_pending_count(void);
+
+#endif
@@ -0,0 +1,724 @@
+/*
+ * ===========================
+ * event_loop.c
+ * ===========================
+ * The parts of our network backend that don't care
+ * whether io_uring or epoll is underneath:
+ * TLS, connection lifetime, outbound buffering,
+ * host caches and the listening socket.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "event_loop_internal.h"
+
+// Written by generateCerts.sh
+#define EL_CERT_FILE "server.crt"
+#define EL_KEY_FILE  "server.key"
+
+// A connection's closed within 1 + 1/N idle timeouts
+#define EL_IDLE_SWEEPS_PER_TIMEOUT 4
+
+static SSL_CTX *ssl_ctx = NULL;
+static struct event_loop_config loop_config = {0};
+static struct reactor *reactors            = NULL;
+static int reactor_count                   = 0;
+// Which reactor, if any, the calling thread runs
+static __thread struct reactor *current_reactor = NULL;
+
+static const struct reactor_ops *reactor_backends[EVENT_LOOP_BACKEND_COUNT] = {
+    &epoll_reactor_ops,
+    &uring_reactor_ops,
+};
+
+static inline struct el_conn *conn_from_host(struct host *remotehost)
+{
+    return (struct el_conn *)remotehost;
+}
+
+// Coarse, it's only for idle timeouts
+static uint64_t el_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// On the reactor's own thread
+static void link_conn(struct reactor *reactor, struct el_conn *conn)
+{
+    conn->next_conn = reactor->conns;
+    if (reactor->conns) {
+        reactor->conns->prev_next = &conn->next_conn;
+    }
+    reactor->conns  = conn;
+    conn->prev_next = &reactor->conns;
+}
+
+static void unlink_conn(struct el_conn *conn)
+{
+    if (!conn->prev_next) {
+        return;
+    }
+    *conn->prev_next = conn->next_conn;
+    if (conn->next_conn) {
+        conn->next_conn->prev_next = conn->prev_next;
+    }
+    conn->next_conn = NULL;
+    conn->prev_next = NULL;
+}
+
+static void el_buf_reserve(struct el_buf *buf, size_t extra)
+{
+    if (buf->len + extra <= buf->cap) {
+        return;
+    }
+    size_t new_cap = buf->cap ? buf->cap : 4096;
+    while (new_cap < buf->len + extra) {
+        new_cap *= 2;
+    }
+    char *new_data = realloc(buf->data, new_cap);
+    if (!new_data) {
+        print_error(BB_ERR_MALLOC);
+        exit(1);
+    }
+    buf->data = new_data;
+    buf->cap  = new_cap;
+}
+
+static int init_ssl_ctx(void)
+{
+    ssl_ctx = SSL_CTX_new(TLS_server_method());
+    if (!ssl_ctx) {
+        return -1;
+    }
+    // Idle websockets would otherwise keep their
+    // read and write buffers around forever.
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
+    if (SSL_CTX_use_certificate_chain_file(ssl_ctx, EL_CERT_FILE) != 1
+        || SSL_CTX_use_PrivateKey_file(ssl_ctx, EL_KEY_FILE, SSL_FILETYPE_PEM)
+               != 1) {
+        ERR_print_errors_fp(stderr);
+        fprintf(stderr,
+                "\nCouldn't load %s and %s, run generateCerts.sh\n",
+                EL_CERT_FILE,
+                EL_KEY_FILE);
+        SSL_CTX_free(ssl_ctx);
+        ssl_ctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int create_listen_socket(const char *ip, uint16_t port)
+{
+    const int enable        = 1;
+    struct sockaddr_in addr = {0};
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error creating listening socket");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    // Every reactor binds its own listener to the same port
+    // and the kernel balances new connections between them.
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        perror("Error setting SO_REUSEPORT");
+        goto exit_error;
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+        fprintf(stderr, "\nInvalid listening address %s\n", ip);
+        goto exit_error;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Error binding listening socket");
+        goto exit_error;
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("Error listening");
+        goto exit_error;
+    }
+    return fd;
+exit_error:
+    close(fd);
+    return -1;
+}
+
+/*
+ * Returns the backend the reactor actually uses,
+ * or -1 if it couldn't be set up at all.
+ */
+static int init_reactor(struct reactor *reactor,
+                        int id,
+                        enum event_loop_backend backend,
+                        int listen_fd,
+                        event_loop_handler_t handler)
+{
+    reactor->id        = id;
+    reactor->cpu       = -1;
+    reactor->listen_fd = listen_fd;
+    reactor->handler   = handler;
+    reactor->wake_fd   = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->wake_fd < 0) {
+        perror("Error creating eventfd");
+        return -1;
+    }
+    pthread_mutex_init(&reactor->dirty_lock, NULL);
+    pthread_mutex_init(&reactor->inbox_lock, NULL);
+
+    reactor->ops = reactor_backends[backend];
+    if (reactor->ops->init(reactor) == 0) {
+        return backend;
+    }
+    if (backend == EVENT_LOOP_BACKEND_IO_URING) {
+        fprintf(stderr, "\nio_uring unavailable, falling back to epoll\n");
+        reactor->ops = reactor_backends[EVENT_LOOP_BACKEND_EPOLL];
+        if (reactor->ops->init(reactor) == 0) {
+            return EVENT_LOOP_BACKEND_EPOLL;
+        }
+    }
+    return -1;
+}
+
+static void pin_reactor(struct reactor *reactor)
+{
+    const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(reactor->id % cpu_count, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        fprintf(stderr, "\nCouldn't pin reactor %d\n", reactor->id);
+        return;
+    }
+    reactor->cpu = (int)(reactor->id % cpu_count);
+}
+
+static void *run_reactor(void *arg)
+{
+    struct reactor *reactor = arg;
+    if (loop_config.pin_cpus) {
+        pin_reactor(reactor);
+    }
+    current_reactor = reactor;
+    reactor->ops->run(reactor);
+    return NULL;
+}
+
+int event_loop_run(const struct event_loop_config *config,
+                   const char *ip,
+                   uint16_t port,
+                   event_loop_handler_t handler)
+{
+    enum event_loop_backend backend = config->backend;
+
+    if (init_ssl_ctx() != 0) {
+        return -1;
+    }
+
+    loop_config   = *config;
+    reactor_count = config->reactor_count > 0
+                        ? config->reactor_count
+                        : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    reactors      = calloc(reactor_count, sizeof(*reactors));
+    if (!reactors) {
+        print_error(BB_ERR_CALLOC);
+        exit(1);
+    }
+    for (int i = 0; i < reactor_count; i++) {
+        const int listen_fd = create_listen_socket(ip, port);
+        if (listen_fd < 0) {
+            return -1;
+        }
+        // If io_uring fell back, every reactor after the first
+        // goes straight to epoll.
+        const int used_backend =
+            init_reactor(&reactors[i], i, backend, listen_fd, handler);
+        if (used_backend < 0) {
+            close(listen_fd);
+            return -1;
+        }
+        backend = (enum event_loop_backend)used_backend;
+    }
+    for (int i = 1; i < reactor_count; i++) {
+        if (pthread_create(&reactors[i].thread, NULL, run_reactor, &reactors[i])
+            != 0) {
+            perror("Error starting reactor thread");
+            return -1;
+        }
+    }
+    reactors[0].thread = pthread_self();
+    run_reactor(&reactors[0]);
+    return 0;
+}
+
+int event_loop_reactor_count(void)
+{
+    return reactor_count;
+}
+
+void event_loop_get_stats(int reactor_index, struct event_loop_stats *out)
+{
+    const struct reactor_counters *counters =
+        &reactors[reactor_index].counters;
+    out->cpu         = reactors[reactor_index].cpu;
+    out->connections = atomic_load_explicit(&counters->connections,
+                                            memory_order_relaxed);
+    out->accepted    = atomic_load_explicit(&counters->accepted,
+                                         memory_order_relaxed);
+    out->migrated_in = atomic_load_explicit(&counters->migrated_in,
+                                            memory_order_relaxed);
+    out->handshakes  = atomic_load_explicit(&counters->handshakes,
+                                           memory_order_relaxed);
+    out->handshake_failures =
+        atomic_load_explicit(&counters->handshake_failures,
+                             memory_order_relaxed);
+    out->bytes_in    = atomic_load_explicit(&counters->bytes_in,
+                                         memory_order_relaxed);
+    out->bytes_out   = atomic_load_explicit(&counters->bytes_out,
+                                          memory_order_relaxed);
+    out->packets     = atomic_load_explicit(&counters->packets,
+                                        memory_order_relaxed);
+    out->wakeups     = atomic_load_explicit(&counters->wakeups,
+                                        memory_order_relaxed);
+    out->idle_closed = atomic_load_explicit(&counters->idle_closed,
+                                            memory_order_relaxed);
+}
+
+/*
+ * ------------------------------------------
+ * Connection lifetime
+ * ------------------------------------------
+ */
+struct el_conn *el_conn_create(struct reactor *reactor, int fd)
+{
+    const int enable      = 1;
+    struct el_conn *conn  = calloc(1, sizeof(*conn));
+    if (!conn) {
+        print_error(BB_ERR_CALLOC);
+        exit(1);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    conn->fd      = fd;
+    conn->reactor = reactor;
+    atomic_init(&conn->refs, 1);
+    pthread_mutex_init(&conn->lock, NULL);
+
+    conn->ssl  = SSL_new(ssl_ctx);
+    conn->rbio = BIO_new(BIO_s_mem());
+    conn->wbio = BIO_new(BIO_s_mem());
+    if (!conn->ssl || !conn->rbio || !conn->wbio) {
+        print_error(BB_ERR_MALLOC);
+        exit(1);
+    }
+    SSL_set_bio(conn->ssl, conn->rbio, conn->wbio);
+    SSL_set_accept_state(conn->ssl);
+    conn->last_recv_ms = el_now_ms();
+    link_conn(reactor, conn);
+
+    el_counter_add(&reactor->counters.accepted, 1);
+    el_counter_add(&reactor->counters.connections, 1);
+    return conn;
+}
+
+void el_conn_get(struct el_conn *conn)
+{
+    atomic_fetch_add_explicit(&conn->refs, 1, memory_order_relaxed);
+}
+
+void el_conn_put(struct el_conn *conn)
+{
+    if (atomic_fetch_sub_explicit(&conn->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    // SSL_free() frees both BIOs too
+    SSL_free(conn->ssl);
+    close(conn->fd);
+    free(conn->pending.data);
+    free(conn->sending.data);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn);
+}
+
+/*
+ * Moves whatever OpenSSL wants to send
+ * into the pending buffer.
+ * Caller holds the connection lock.
+ */
+static void drain_wbio(struct el_conn *conn)
+{
+    const size_t out_len = BIO_ctrl_pending(conn->wbio);
+    if (out_len == 0) {
+        return;
+    }
+    el_buf_reserve(&conn->pending, out_len);
+    conn->pending.len += BIO_read(conn->wbio,
+                                  &conn->pending.data[conn->pending.len],
+                                  (int)out_len);
+}
+
+static void wake_reactor(struct reactor *reactor)
+{
+    const uint64_t one = 1;
+    if (write(reactor->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("Error waking reactor");
+    }
+}
+
+/*
+ * Puts the connection on its reactor's dirty list
+ * and wakes the reactor up if we're on another thread.
+ * Caller holds the connection lock.
+ */
+static void mark_dirty(struct el_conn *conn)
+{
+    struct reactor *reactor = conn->reactor;
+    if (conn->dirty || (conn->pending.len == 0 && !conn->migrate_to)) {
+        return;
+    }
+    conn->dirty = true;
+    el_conn_get(conn);
+    pthread_mutex_lock(&reactor->dirty_lock);
+    conn->next_dirty    = reactor->dirty_head;
+    reactor->dirty_head = conn;
+    pthread_mutex_unlock(&reactor->dirty_lock);
+
+    if (current_reactor != reactor) {
+        wake_reactor(reactor);
+    }
+}
+
+struct el_conn *el_reactor_take_dirty(struct reactor *reactor)
+{
+    pthread_mutex_lock(&reactor->dirty_lock);
+    struct el_conn *list = reactor->dirty_head;
+    reactor->dirty_head  = NULL;
+    pthread_mutex_unlock(&reactor->dirty_lock);
+    return list;
+}
+
+/*
+ * Backends call this on every connection they take
+ * off the dirty list, before flushing it, so that
+ * anything sent while flushing marks it dirty again.
+ * A connection that has moved to another reactor in
+ * the meantime is passed along to that one.
+ */
+enum el_dirty_action el_conn_clear_dirty(struct reactor *reactor,
+                                         struct el_conn *conn)
+{
+    enum el_dirty_action action = EL_DIRTY_FLUSH;
+
+    pthread_mutex_lock(&conn->lock);
+    conn->dirty = false;
+    if (conn->reactor != reactor) {
+        mark_dirty(conn);
+        action = EL_DIRTY_MOVED;
+    }
+    else if (conn->migrate_to) {
+        action = EL_DIRTY_MIGRATE;
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return action;
+}
+
+void el_reactor_drain_wake(struct reactor *reactor)
+{
+    uint64_t count = 0;
+    while (read(reactor->wake_fd, &count, sizeof(count)) > 0) {
+        el_counter_add(&reactor->counters.wakeups, 1);
+    }
+}
+
+/*
+ * The connection's old reactor has let go of it,
+ * the reactor's reference moves along with it.
+ */
+void el_conn_handoff(struct el_conn *conn)
+{
+    struct reactor *old_reactor = conn->reactor;
+    struct reactor *new_reactor = NULL;
+
+    pthread_mutex_lock(&conn->lock);
+    new_reactor        = conn->migrate_to;
+    conn->reactor      = new_reactor;
+    conn->migrate_to   = NULL;
+    conn->want_write   = false;
+    conn->cancelling   = false;
+    pthread_mutex_unlock(&conn->lock);
+
+    unlink_conn(conn);
+    atomic_fetch_sub_explicit(&old_reactor->counters.connections,
+                              1,
+                              memory_order_relaxed);
+    pthread_mutex_lock(&new_reactor->inbox_lock);
+    conn->next_inbox        = new_reactor->inbox_head;
+    new_reactor->inbox_head = conn;
+    pthread_mutex_unlock(&new_reactor->inbox_lock);
+    wake_reactor(new_reactor);
+}
+
+void el_reactor_take_inbox(struct reactor *reactor)
+{
+    pthread_mutex_lock(&reactor->inbox_lock);
+    struct el_conn *conn = reactor->inbox_head;
+    reactor->inbox_head  = NULL;
+    pthread_mutex_unlock(&reactor->inbox_lock);
+
+    while (conn) {
+        struct el_conn *next = conn->next_inbox;
+        el_counter_add(&reactor->counters.connections, 1);
+        el_counter_add(&reactor->counters.migrated_in, 1);
+        link_conn(reactor, conn);
+        reactor->ops->attach(reactor, conn);
+        // Whatever was sent while it was moving
+        pthread_mutex_lock(&conn->lock);
+        mark_dirty(conn);
+        pthread_mutex_unlock(&conn->lock);
+        conn = next;
+    }
+}
+
+/*
+ * Feeds ciphertext from the socket into OpenSSL
+ * and calls the packet handler for every chunk of
+ * plaintext that comes out the other end.
+ * The lock is dropped around the handler so
+ * it can send on this same connection.
+ */
+int el_conn_on_recv(struct el_conn *conn, const char *data, size_t len)
+{
+    struct reactor *reactor = conn->reactor;
+    int ret                 = 0;
+
+    el_counter_add(&reactor->counters.bytes_in, len);
+    conn->last_recv_ms = el_now_ms();
+    pthread_mutex_lock(&conn->lock);
+    if (BIO_write(conn->rbio, data, (int)len) != (int)len) {
+        pthread_mutex_unlock(&conn->lock);
+        return -1;
+    }
+    for (;;) {
+        const int read_len =
+            SSL_read(conn->ssl, reactor->read_buf, EL_READ_BUF_SIZE);
+        const int ssl_error = SSL_get_error(conn->ssl, read_len);
+        // Handshake and session tickets
+        drain_wbio(conn);
+        mark_dirty(conn);
+        if (!conn->handshake_done && SSL_is_init_finished(conn->ssl)) {
+            conn->handshake_done = true;
+            el_counter_add(&reactor->counters.handshakes, 1);
+        }
+        if (read_len <= 0) {
+            ret = ssl_error == SSL_ERROR_WANT_READ ? 0 : -1;
+            break;
+        }
+        pthread_mutex_unlock(&conn->lock);
+        el_counter_add(&reactor->counters.packets, 1);
+        reactor->read_buf[read_len] = '\0';
+        reactor->handler(reactor->read_buf,
+                         read_len,
+                         el_conn_to_host(conn));
+        pthread_mutex_lock(&conn->lock);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return ret;
+}
+
+void el_conn_close(struct el_conn *conn)
+{
+    static char empty_packet[1] = {0};
+
+    pthread_mutex_lock(&conn->lock);
+    if (conn->closing) {
+        pthread_mutex_unlock(&conn->lock);
+        return;
+    }
+    conn->closing             = true;
+    const bool handshake_done = conn->handshake_done;
+    pthread_mutex_unlock(&conn->lock);
+    unlink_conn(conn);
+    atomic_fetch_sub_explicit(&conn->reactor->counters.connections,
+                              1,
+                              memory_order_relaxed);
+    if (!handshake_done) {
+        el_counter_add(&conn->reactor->counters.handshake_failures, 1);
+    }
+
+    // Same contract as bb-net-lib, a 0 length packet
+    // means the client went away.
+    conn->reactor->handler(empty_packet, 0, el_conn_to_host(conn));
+    shutdown(conn->fd, SHUT_RDWR);
+}
+
+size_t el_conn_prepare_send(struct el_conn *conn, const char **out_data)
+{
+    size_t len = 0;
+    pthread_mutex_lock(&conn->lock);
+    if (conn->sending_off == conn->sending.len && conn->pending.len > 0) {
+        const struct el_buf drained = conn->sending;
+        conn->sending               = conn->pending;
+        conn->pending               = drained;
+        conn->pending.len           = 0;
+        conn->sending_off           = 0;
+    }
+    *out_data = &conn->sending.data[conn->sending_off];
+    len       = conn->sending.len - conn->sending_off;
+    pthread_mutex_unlock(&conn->lock);
+    return len;
+}
+
+void el_conn_complete_send(struct el_conn *conn, size_t sent)
+{
+    el_counter_add(&conn->reactor->counters.bytes_out, sent);
+    pthread_mutex_lock(&conn->lock);
+    conn->sending_off += sent;
+    if (conn->sending_off == conn->sending.len) {
+        conn->sending.len = 0;
+        conn->sending_off = 0;
+        if (conn->close_when_sent && conn->pending.len == 0
+            && !conn->closing) {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+int el_idle_sweep_interval_ms(void)
+{
+    if (loop_config.idle_timeout <= 0) {
+        return -1;
+    }
+    return loop_config.idle_timeout * 1000 / EL_IDLE_SWEEPS_PER_TIMEOUT;
+}
+
+/*
+ * Keyed on the last bytes we got, so it covers
+ * stalled TLS handshakes and HTTP keep-alives alike.
+ * Websockets in a game get pinged before they're
+ * this quiet, see sweep_idle_hosts(), so anyone
+ * still there answers in time.
+ */
+void el_reactor_sweep_idle(struct reactor *reactor)
+{
+    const int interval_ms = el_idle_sweep_interval_ms();
+    const uint64_t now    = el_now_ms();
+    if (interval_ms < 0 || now < reactor->next_sweep_ms) {
+        return;
+    }
+    const uint64_t timeout_ms = (uint64_t)loop_config.idle_timeout * 1000;
+    reactor->next_sweep_ms    = now + interval_ms;
+
+    for (struct el_conn *conn = reactor->conns; conn; conn = conn->next_conn) {
+        if (now - conn->last_recv_ms < timeout_ms) {
+            continue;
+        }
+        // The backend sees it go like any other disconnect
+        pthread_mutex_lock(&conn->lock);
+        if (!conn->closing) {
+            shutdown(conn->fd, SHUT_RDWR);
+            el_counter_add(&reactor->counters.idle_closed, 1);
+        }
+        pthread_mutex_unlock(&conn->lock);
+    }
+}
+
+/*
+ * ------------------------------------------
+ * Public interface, see net_backend.h
+ * ------------------------------------------
+ */
+ssize_t event_loop_send(const char *data,
+                        ssize_t data_size,
+                        struct host *remotehost)
+{
+    struct el_conn *conn = conn_from_host(remotehost);
+    ssize_t ret          = -1;
+
+    pthread_mutex_lock(&conn->lock);
+    if (!conn->closing && data_size > 0) {
+        // Memory BIOs never block, so this writes everything
+        ret = SSL_write(conn->ssl, data, (int)data_size);
+        drain_wbio(conn);
+        mark_dirty(conn);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return ret;
+}
+
+void event_loop_set_host_affinity(struct host *remotehost, unsigned int key)
+{
+    struct el_conn *conn = conn_from_host(remotehost);
+    if (!loop_config.game_affinity) {
+        return;
+    }
+    struct reactor *target = &reactors[key % (unsigned int)reactor_count];
+
+    pthread_mutex_lock(&conn->lock);
+    if (!conn->closing && !conn->migrate_to && conn->reactor != target) {
+        // The owning reactor notices this when it
+        // goes through its dirty list.
+        conn->migrate_to = target;
+        mark_dirty(conn);
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+/*
+ * Only shuts the socket down, the owning reactor
+ * sees it go and closes it on its own thread like
+ * any other disconnect.
+ * With output still queued, it's shut down once
+ * that's been sent, see el_conn_complete_send().
+ */
+void event_loop_close_host(struct host *remotehost)
+{
+    struct el_conn *conn = conn_from_host(remotehost);
+    pthread_mutex_lock(&conn->lock);
+    if (conn->pending.len > 0 || conn->sending_off < conn->sending.len) {
+        conn->close_when_sent = true;
+    }
+    else if (!conn->closing) {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+bool event_loop_hold_host(struct host *remotehost)
+{
+    el_conn_get(conn_from_host(remotehost));
+    return true;
+}
+
+void event_loop_release_host(struct host *remotehost)
+{
+    el_conn_put(conn_from_host(remotehost));
+}
+
+void *event_loop_get_host_custom_attr(struct host *remotehost)
+{
+    return conn_from_host(remotehost)->custom_attr;
+}
+
+void event_loop_set_host_custom_attr(struct host *remotehost, void *attr)
+{
+    conn_from_host(remotehost)->custom_attr = attr;
+}
@@ -0,0 +1,107 @@
+/*
+ * ===========================
+ * event_loop.h
+ * ===========================
+ * Our own network backend, as an alternative to
+ * bb-net-lib's listen_for_tcp() threading model.
+ * A reactor owns the listening socket and every
+ * connection accepted on it, drives TLS through
+ * OpenSSL memory BIOs and hands the plaintext to the
+ * same packet handler bb-net-lib would call.
+ * The I/O mechanism underneath is io_uring or epoll,
+ * chosen at startup.
+ *
+ * Connections are handed to the packet handler as
+ * a "struct host *" so the handlers never need to know
+ * which backend they're running on, see net_backend.h.
+ * Don't pass these hosts to bb-net-lib functions.
+ */
+
+#ifndef BB_EVENT_LOOP
+#define BB_EVENT_LOOP
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "bbnetlib.h"
+
+enum event_loop_backend {
+    EVENT_LOOP_BACKEND_EPOLL,
+    EVENT_LOOP_BACKEND_IO_URING,
+    EVENT_LOOP_BACKEND_COUNT
+};
+
+typedef void (*event_loop_handler_t)(char *data,
+                                     ssize_t packet_size,
+                                     struct host *remotehost);
+
+/*
+ * Every reactor is a thread with its own SO_REUSEPORT
+ * listener, the kernel spreads new connections across
+ * them and a connection stays on its reactor for life,
+ * unless game affinity moves it (see
+ * event_loop_set_host_affinity()).
+ */
+struct event_loop_config {
+    enum event_loop_backend backend;
+    int reactor_count;  // 0 means one per online CPU
+    bool pin_cpus;      // Pin reactor N to CPU N
+    bool game_affinity; // Honour event_loop_set_host_affinity()
+    int idle_timeout;   // Seconds without input before a
+                        // connection's closed, 0 never
+};
+
+// Per reactor load, for metrics
+struct event_loop_stats {
+    int cpu;              // -1 when not pinned
+    uint64_t connections; // Currently open
+    uint64_t accepted;
+    uint64_t migrated_in;
+    uint64_t handshakes;         // TLS handshakes completed
+    uint64_t handshake_failures; // Connections closed before that
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t packets;     // Packet handler calls
+    uint64_t wakeups;     // Wakeups from other threads
+    uint64_t idle_closed; // Closed for sending us nothing
+};
+
+/*
+ * Sets up TLS, the listening sockets and the reactor
+ * threads, then runs the first reactor in the calling
+ * thread, forever.
+ * io_uring falls back to epoll when the kernel
+ * doesn't support what we need.
+ * Returns -1 if the server couldn't be set up.
+ */
+int event_loop_run(const struct event_loop_config *config,
+                   const char *ip,
+                   uint16_t port,
+                   event_loop_handler_t handler);
+
+int  event_loop_reactor_count(void);
+void event_loop_get_stats(int reactor_index, struct event_loop_stats *out);
+
+/*
+ * Moves the connection onto the reactor "key" maps to,
+ * so every connection with the same key (e.g. a game)
+ * is served by the same thread.
+ * Does nothing unless game_affinity is configured.
+ */
+void event_loop_set_host_affinity(struct host *remotehost, unsigned int key);
+
+// These mirror the bb-net-lib functions of the same name
+// and are safe to call from any thread.
+ssize_t event_loop_send(const char *data,
+                        ssize_t data_size,
+                        struct host *remotehost);
+void   *event_loop_get_host_custom_attr(struct host *remotehost);
+void    event_loop_set_host_custom_attr(struct host *remotehost, void *attr);
+// Whatever's still queued for the host goes out first
+void    event_loop_close_host(struct host *remotehost);
+// A reference on the connection, see net_hold_host()
+bool    event_loop_hold_host(struct host *remotehost);
+void    event_loop_release_host(struct host *remotehost);
+
+#endif
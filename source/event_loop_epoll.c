@@ -0,0 +1,232 @@
+/*
+ * ===========================
+ * event_loop_epoll.c
+ * ===========================
+ * The readiness based reactor, used when
+ * io_uring isn't available.
+ * Level triggered, every connection is watched
+ * for input and only watched for output while
+ * the socket buffer is full.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "event_loop_internal.h"
+
+#define EPOLL_MAX_EVENTS   256
+#define EPOLL_RECV_BUF_LEN 16384
+
+struct epoll_reactor {
+    int epoll_fd;
+    char recv_buf[EPOLL_RECV_BUF_LEN];
+};
+
+// epoll_event.data.ptr for the two fds that aren't connections
+static char listen_marker = 0;
+static char wake_marker   = 0;
+
+static int epoll_reactor_init(struct reactor *reactor)
+{
+    struct epoll_reactor *backend = calloc(1, sizeof(*backend));
+    struct epoll_event event      = {0};
+    if (!backend) {
+        print_error(BB_ERR_CALLOC);
+        exit(1);
+    }
+    backend->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (backend->epoll_fd < 0) {
+        perror("Error creating epoll instance");
+        free(backend);
+        return -1;
+    }
+    event.events   = EPOLLIN;
+    event.data.ptr = &listen_marker;
+    epoll_ctl(backend->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &event);
+    event.data.ptr = &wake_marker;
+    epoll_ctl(backend->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &event);
+
+    reactor->backend = backend;
+    return 0;
+}
+
+static void set_want_write(struct epoll_reactor *backend,
+                           struct el_conn *conn,
+                           bool want_write)
+{
+    struct epoll_event event = {0};
+    if (conn->want_write == want_write) {
+        return;
+    }
+    conn->want_write = want_write;
+    event.events     = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+    event.data.ptr   = conn;
+    epoll_ctl(backend->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+static void close_conn(struct epoll_reactor *backend, struct el_conn *conn)
+{
+    if (conn->closing) {
+        return;
+    }
+    epoll_ctl(backend->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    el_conn_close(conn);
+    // The reactor's reference
+    el_conn_put(conn);
+}
+
+/*
+ * Writes as much of the outbound data as
+ * the socket takes right now.
+ */
+static void flush_conn(struct epoll_reactor *backend, struct el_conn *conn)
+{
+    const char *data = NULL;
+    size_t len       = 0;
+
+    while (!conn->closing && (len = el_conn_prepare_send(conn, &data)) > 0) {
+        const ssize_t sent = send(conn->fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_want_write(backend, conn, true);
+                return;
+            }
+            close_conn(backend, conn);
+            return;
+        }
+        el_conn_complete_send(conn, (size_t)sent);
+    }
+    if (!conn->closing) {
+        set_want_write(backend, conn, false);
+    }
+}
+
+static void epoll_reactor_attach(struct reactor *reactor, struct el_conn *conn)
+{
+    struct epoll_reactor *backend = reactor->backend;
+    struct epoll_event event      = {.events   = EPOLLIN | EPOLLRDHUP,
+                                     .data.ptr = conn};
+    epoll_ctl(backend->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+}
+
+// Nothing is ever in flight with epoll, so hand it off right away
+static void epoll_reactor_detach(struct reactor *reactor, struct el_conn *conn)
+{
+    struct epoll_reactor *backend = reactor->backend;
+    if (conn->closing) {
+        return;
+    }
+    epoll_ctl(backend->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    el_conn_handoff(conn);
+}
+
+static void accept_conns(struct reactor *reactor)
+{
+    for (;;) {
+        const int fd = accept4(reactor->listen_fd,
+                               NULL,
+                               NULL,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Error accepting connection");
+            }
+            return;
+        }
+        epoll_reactor_attach(reactor, el_conn_create(reactor, fd));
+    }
+}
+
+static void read_conn(struct epoll_reactor *backend, struct el_conn *conn)
+{
+    for (;;) {
+        const ssize_t len =
+            recv(conn->fd, backend->recv_buf, EPOLL_RECV_BUF_LEN, 0);
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (len <= 0
+            || el_conn_on_recv(conn, backend->recv_buf, (size_t)len) != 0) {
+            close_conn(backend, conn);
+            return;
+        }
+    }
+}
+
+static void flush_dirty(struct reactor *reactor, struct epoll_reactor *backend)
+{
+    struct el_conn *conn = el_reactor_take_dirty(reactor);
+    while (conn) {
+        struct el_conn *next = conn->next_dirty;
+        switch (el_conn_clear_dirty(reactor, conn)) {
+        case EL_DIRTY_FLUSH:
+            flush_conn(backend, conn);
+            break;
+        case EL_DIRTY_MIGRATE:
+            epoll_reactor_detach(reactor, conn);
+            break;
+        default:
+            break;
+        }
+        el_conn_put(conn);
+        conn = next;
+    }
+}
+
+static void epoll_reactor_run(struct reactor *reactor)
+{
+    struct epoll_reactor *backend = reactor->backend;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    for (;;) {
+        // Wakes up for the idle sweep too
+        const int event_count = epoll_wait(backend->epoll_fd,
+                                           events,
+                                           EPOLL_MAX_EVENTS,
+                                           el_idle_sweep_interval_ms());
+        if (event_count < 0 && errno != EINTR) {
+            perror("Error waiting on epoll");
+            return;
+        }
+        for (int i = 0; i < event_count; i++) {
+            void *source = events[i].data.ptr;
+            if (source == &listen_marker) {
+                accept_conns(reactor);
+                continue;
+            }
+            if (source == &wake_marker) {
+                el_reactor_drain_wake(reactor);
+                continue;
+            }
+            struct el_conn *conn = source;
+            // Keep the connection alive until we're
+            // done with this event.
+            el_conn_get(conn);
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                read_conn(backend, conn);
+            }
+            if (events[i].events & EPOLLOUT) {
+                flush_conn(backend, conn);
+            }
+            el_conn_put(conn);
+        }
+        el_reactor_take_inbox(reactor);
+        // Everything the handlers sent during this round
+        // goes out in one go.
+        flush_dirty(reactor, backend);
+        el_reactor_sweep_idle(reactor);
+    }
+}
+
+const struct reactor_ops epoll_reactor_ops = {
+    .init   = epoll_reactor_init,
+    .run    = epoll_reactor_run,
+    .attach = epoll_reactor_attach,
+    .detach = epoll_reactor_detach,
+};
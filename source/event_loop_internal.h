@@ -0,0 +1,175 @@
+/*
+ * ===========================
+ * event_loop_internal.h
+ * ===========================
+ * Shared between event_loop.c and the
+ * io_uring and epoll reactors.
+ * Nothing outside of the event loop
+ * should include this.
+ */
+
+#ifndef BB_EVENT_LOOP_INTERNAL
+#define BB_EVENT_LOOP_INTERNAL
+
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "event_loop.h"
+
+// Plaintext handed to the packet handler in one go,
+// this is the largest TLS record payload.
+#define EL_READ_BUF_SIZE 16384
+
+struct el_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/*
+ * A single accepted TCP connection.
+ * The reactor that accepted it is the only
+ * thread that ever reads from it or touches the fd,
+ * other threads only append ciphertext to "pending"
+ * under the lock and wake the reactor up.
+ *
+ * The reactor holds a reference for as long as the
+ * connection is open, and every in-flight io_uring
+ * operation holds one too, so the connection is only
+ * freed when nothing can complete on it anymore.
+ */
+struct el_conn {
+    int fd;
+    atomic_int refs;
+    struct reactor *reactor;
+    pthread_mutex_t lock; // Guards everything below
+    SSL *ssl;
+    BIO *rbio;            // Ciphertext in
+    BIO *wbio;            // Ciphertext out
+    struct el_buf pending; // Waiting to be sent
+    struct el_buf sending; // Owned by the send in flight
+    size_t sending_off;
+    bool dirty;           // Is it on the reactor's dirty list?
+    bool send_inflight;
+    bool want_write;      // epoll: waiting on EPOLLOUT
+    bool recv_armed;      // io_uring: multishot recv in flight
+    bool cancelling;      // io_uring: recv cancel submitted
+    bool closing;
+    bool close_when_sent; // See event_loop_close_host()
+    bool handshake_done;
+    struct reactor *migrate_to; // Reactor this is moving to, if any
+    void *custom_attr;
+    struct el_conn *next_dirty;
+    struct el_conn *next_inbox;
+    // Only the owning reactor touches these,
+    // see el_reactor_sweep_idle()
+    uint64_t last_recv_ms;
+    struct el_conn *next_conn;
+    struct el_conn **prev_next; // NULL while no reactor owns it
+};
+
+struct reactor;
+
+enum el_dirty_action {
+    EL_DIRTY_FLUSH,   // Send what's pending
+    EL_DIRTY_MIGRATE, // Detach it, it's moving to another reactor
+    EL_DIRTY_MOVED    // Not ours anymore, nothing to do
+};
+
+/*
+ * What the epoll and io_uring backends implement.
+ * "init" returns -1 when the backend can't run here.
+ * "detach" stops watching a connection that's moving
+ * to another reactor and calls el_conn_handoff() once
+ * nothing is in flight on it anymore, "attach" starts
+ * watching it on the new reactor.
+ */
+struct reactor_ops {
+    int (*init)(struct reactor *reactor);
+    void (*run)(struct reactor *reactor);
+    void (*attach)(struct reactor *reactor, struct el_conn *conn);
+    void (*detach)(struct reactor *reactor, struct el_conn *conn);
+};
+
+struct reactor_counters {
+    atomic_uint_fast64_t connections;
+    atomic_uint_fast64_t accepted;
+    atomic_uint_fast64_t migrated_in;
+    atomic_uint_fast64_t handshakes;
+    atomic_uint_fast64_t handshake_failures;
+    atomic_uint_fast64_t bytes_in;
+    atomic_uint_fast64_t bytes_out;
+    atomic_uint_fast64_t packets;
+    atomic_uint_fast64_t wakeups;
+    atomic_uint_fast64_t idle_closed;
+};
+
+struct reactor {
+    int id;
+    int cpu; // -1 when not pinned
+    pthread_t thread;
+    int listen_fd;
+    int wake_fd; // eventfd, for other threads to wake us up
+    const struct reactor_ops *ops;
+    void *backend; // Backend private state
+    event_loop_handler_t handler;
+    pthread_mutex_t dirty_lock;
+    struct el_conn *dirty_head; // Connections with pending output
+    pthread_mutex_t inbox_lock;
+    struct el_conn *inbox_head; // Connections migrating to us
+    struct el_conn *conns;      // Every connection we own
+    uint64_t next_sweep_ms;
+    struct reactor_counters counters;
+    char read_buf[EL_READ_BUF_SIZE + 1];
+};
+
+extern const struct reactor_ops epoll_reactor_ops;
+extern const struct reactor_ops uring_reactor_ops;
+
+/*
+ * event_loop.c helpers for the backends.
+ */
+struct el_conn *el_conn_create(struct reactor *reactor, int fd);
+void el_conn_get(struct el_conn *conn);
+void el_conn_put(struct el_conn *conn);
+// Returns -1 when the connection should be closed
+int  el_conn_on_recv(struct el_conn *conn, const char *data, size_t len);
+// Runs the disconnect handler, exactly once per connection
+void el_conn_close(struct el_conn *conn);
+// Returns how many bytes from "*out_data" should be sent now
+size_t el_conn_prepare_send(struct el_conn *conn, const char **out_data);
+void el_conn_complete_send(struct el_conn *conn, size_t sent);
+// Detaches the whole dirty list for flushing,
+// each entry holds a reference the backend puts
+// after flushing it.
+struct el_conn *el_reactor_take_dirty(struct reactor *reactor);
+enum el_dirty_action el_conn_clear_dirty(struct reactor *reactor,
+                                         struct el_conn *conn);
+void el_reactor_drain_wake(struct reactor *reactor);
+// Gives a detached connection to the reactor it's migrating to
+void el_conn_handoff(struct el_conn *conn);
+// Attaches connections handed to us, call once per loop iteration
+void el_reactor_take_inbox(struct reactor *reactor);
+/*
+ * Closes connections that sent nothing for the idle
+ * timeout, call once per loop iteration, it only goes
+ * through them every el_idle_sweep_interval_ms().
+ * That's -1 when the timeout's off.
+ */
+void el_reactor_sweep_idle(struct reactor *reactor);
+int  el_idle_sweep_interval_ms(void);
+
+static inline void el_counter_add(atomic_uint_fast64_t *counter,
+                                  uint64_t value)
+{
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static inline struct host *el_conn_to_host(struct el_conn *conn)
+{
+    return (struct host *)conn;
+}
+
+#endif
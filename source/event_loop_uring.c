@@ -0,0 +1,550 @@
+/*
+ * ===========================
+ * event_loop_uring.c
+ * ===========================
+ * The completion based reactor.
+ * Talks to io_uring through the raw syscalls so
+ * we don't drag in liburing as a dependency.
+ *
+ * - One multishot accept on the listening socket
+ * - One multishot recv per connection, reading into
+ *   a ring of buffers registered with the kernel,
+ *   so idle connections don't own any read buffer
+ * - At most one send in flight per connection,
+ *   all sends queued during a loop iteration are
+ *   submitted with a single io_uring_enter()
+ *
+ * Needs Linux 6.0+ for multishot recv, init fails
+ * on anything older and we fall back to epoll.
+ */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "event_loop_internal.h"
+
+#define URING_ENTRIES      1024
+// Provided recv buffers, shared by every connection on the reactor.
+// Must be a power of 2.
+#define URING_BUF_COUNT    256
+#define URING_BUF_SIZE     16384
+#define URING_BUF_GROUP    0
+#define URING_MIN_KERNEL_MAJOR 6
+
+// user_data is a pointer with the operation in its low bits
+enum uring_op {
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_WAKE,
+    URING_OP_CANCEL,
+    URING_OP_SWEEP,
+    URING_OP_COUNT
+};
+#define URING_OP_MASK 0x7ULL
+
+struct uring_reactor {
+    int ring_fd;
+    // Submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_mem;
+    size_t ring_mem_len;
+    // Provided buffers
+    struct io_uring_buf_ring *buf_ring;
+    char *buf_base;
+    uint16_t buf_tail;
+    unsigned to_submit;
+    // Has to outlive the timeout it's for
+    struct __kernel_timespec sweep_interval;
+};
+
+static inline uint64_t make_user_data(void *ptr, enum uring_op op)
+{
+    return (uint64_t)(uintptr_t)ptr | op;
+}
+
+static inline int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int io_uring_enter(int fd,
+                                 unsigned to_submit,
+                                 unsigned min_complete,
+                                 unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter,
+                        fd,
+                        to_submit,
+                        min_complete,
+                        flags,
+                        NULL,
+                        0);
+}
+
+static inline int io_uring_register(int fd,
+                                    unsigned opcode,
+                                    void *arg,
+                                    unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool is_kernel_recent_enough(void)
+{
+    struct utsname name = {0};
+    if (uname(&name) != 0) {
+        return false;
+    }
+    return atoi(name.release) >= URING_MIN_KERNEL_MAJOR;
+}
+
+static void submit(struct uring_reactor *ring, unsigned wait_for)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    for (;;) {
+        const int ret = io_uring_enter(ring->ring_fd,
+                                       ring->to_submit,
+                                       wait_for,
+                                       wait_for ? IORING_ENTER_GETEVENTS : 0);
+        if (ret >= 0) {
+            ring->to_submit -= (unsigned)ret < ring->to_submit
+                                   ? (unsigned)ret
+                                   : ring->to_submit;
+            return;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("Error entering io_uring");
+            return;
+        }
+    }
+}
+
+/*
+ * Returns a zeroed submission entry,
+ * submitting what's queued if the ring is full.
+ */
+static struct io_uring_sqe *get_sqe(struct uring_reactor *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    while (ring->sq_local_tail - head >= ring->sq_entries) {
+        submit(ring, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+    struct io_uring_sqe *sqe =
+        &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void recycle_buffer(struct uring_reactor *ring, uint16_t buf_id)
+{
+    struct io_uring_buf *buf =
+        &ring->buf_ring->bufs[ring->buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)&ring->buf_base[buf_id * URING_BUF_SIZE];
+    buf->len  = URING_BUF_SIZE;
+    buf->bid  = buf_id;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int setup_buffer_ring(struct uring_reactor *ring)
+{
+    const size_t ring_len = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    ring->buf_ring        = mmap(NULL,
+                          ring_len,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS,
+                          -1,
+                          0);
+    if (ring->buf_ring == MAP_FAILED) {
+        return -1;
+    }
+    ring->buf_base = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (!ring->buf_base) {
+        print_error(BB_ERR_MALLOC);
+        exit(1);
+    }
+    struct io_uring_buf_reg reg = {.ring_addr    = (uint64_t)(uintptr_t)
+                                                       ring->buf_ring,
+                                   .ring_entries = URING_BUF_COUNT,
+                                   .bgid         = URING_BUF_GROUP};
+    if (io_uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1)
+        < 0) {
+        return -1;
+    }
+    for (uint16_t i = 0; i < URING_BUF_COUNT; i++) {
+        recycle_buffer(ring, i);
+    }
+    return 0;
+}
+
+static void arm_accept(struct reactor *reactor, struct uring_reactor *ring)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode              = IORING_OP_ACCEPT;
+    sqe->fd                  = reactor->listen_fd;
+    sqe->ioprio              = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags        = SOCK_CLOEXEC;
+    sqe->user_data           = make_user_data(NULL, URING_OP_ACCEPT);
+}
+
+// The eventfd is non-blocking, so poll it rather than read it
+static void arm_wake(struct reactor *reactor, struct uring_reactor *ring)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode              = IORING_OP_POLL_ADD;
+    sqe->fd                  = reactor->wake_fd;
+    sqe->poll32_events       = POLLIN;
+    sqe->len                 = IORING_POLL_ADD_MULTI;
+    sqe->user_data           = make_user_data(NULL, URING_OP_WAKE);
+}
+
+// Wakes us up for el_reactor_sweep_idle()
+static void arm_sweep(struct uring_reactor *ring)
+{
+    const int interval_ms = el_idle_sweep_interval_ms();
+    if (interval_ms < 0) {
+        return;
+    }
+    ring->sweep_interval.tv_sec  = interval_ms / 1000;
+    ring->sweep_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode              = IORING_OP_TIMEOUT;
+    sqe->addr                = (uint64_t)(uintptr_t)&ring->sweep_interval;
+    sqe->len                 = 1;
+    sqe->user_data           = make_user_data(NULL, URING_OP_SWEEP);
+}
+
+// The recv holds a connection reference until its final completion
+static void arm_recv(struct uring_reactor *ring, struct el_conn *conn)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    el_conn_get(conn);
+    conn->recv_armed = true;
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = conn->fd;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = make_user_data(conn, URING_OP_RECV);
+}
+
+static void queue_send(struct uring_reactor *ring, struct el_conn *conn)
+{
+    const char *data = NULL;
+    if (conn->send_inflight || conn->closing || conn->cancelling) {
+        return;
+    }
+    const size_t len = el_conn_prepare_send(conn, &data);
+    if (len == 0) {
+        return;
+    }
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    conn->send_inflight      = true;
+    el_conn_get(conn);
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->fd        = conn->fd;
+    sqe->addr      = (uint64_t)(uintptr_t)data;
+    sqe->len       = (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = make_user_data(conn, URING_OP_SEND);
+}
+
+static void close_conn(struct el_conn *conn)
+{
+    if (conn->closing) {
+        return;
+    }
+    // Shuts the socket down, which ends the multishot recv
+    el_conn_close(conn);
+    // The reactor's reference
+    el_conn_put(conn);
+}
+
+/*
+ * A migrating connection can only move once its
+ * recv has been cancelled and its last send is done.
+ */
+static void try_handoff(struct el_conn *conn)
+{
+    if (conn->cancelling && !conn->closing && !conn->recv_armed
+        && !conn->send_inflight) {
+        el_conn_handoff(conn);
+    }
+}
+
+static void uring_reactor_attach(struct reactor *reactor, struct el_conn *conn)
+{
+    arm_recv(reactor->backend, conn);
+}
+
+static void uring_reactor_detach(struct reactor *reactor, struct el_conn *conn)
+{
+    struct uring_reactor *ring = reactor->backend;
+    if (conn->cancelling || conn->closing) {
+        return;
+    }
+    conn->cancelling = true;
+    if (conn->recv_armed) {
+        struct io_uring_sqe *sqe = get_sqe(ring);
+        sqe->opcode              = IORING_OP_ASYNC_CANCEL;
+        sqe->addr                = make_user_data(conn, URING_OP_RECV);
+        sqe->user_data           = make_user_data(NULL, URING_OP_CANCEL);
+    }
+    try_handoff(conn);
+}
+
+static void on_accept(struct reactor *reactor,
+                      struct uring_reactor *ring,
+                      const struct io_uring_cqe *cqe)
+{
+    if (cqe->res >= 0) {
+        arm_recv(ring, el_conn_create(reactor, cqe->res));
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        arm_accept(reactor, ring);
+    }
+}
+
+static void on_recv(struct uring_reactor *ring,
+                    struct el_conn *conn,
+                    const struct io_uring_cqe *cqe)
+{
+    bool keep_reading = cqe->res > 0 || cqe->res == -ENOBUFS
+                        || (cqe->res == -ECANCELED && conn->cancelling);
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        const uint16_t buf_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !conn->closing
+            && el_conn_on_recv(conn,
+                               &ring->buf_base[buf_id * URING_BUF_SIZE],
+                               (size_t)cqe->res)
+                   != 0) {
+            keep_reading = false;
+        }
+        recycle_buffer(ring, buf_id);
+    }
+    if (!keep_reading) {
+        close_conn(conn);
+    }
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        return;
+    }
+    // The multishot recv has ended
+    conn->recv_armed = false;
+    if (conn->cancelling) {
+        try_handoff(conn);
+    }
+    else if (keep_reading && !conn->closing) {
+        arm_recv(ring, conn);
+    }
+    el_conn_put(conn);
+}
+
+static void on_send(struct uring_reactor *ring,
+                    struct el_conn *conn,
+                    const struct io_uring_cqe *cqe)
+{
+    conn->send_inflight = false;
+    if (cqe->res < 0) {
+        close_conn(conn);
+    }
+    else {
+        el_conn_complete_send(conn, (size_t)cqe->res);
+        queue_send(ring, conn);
+        try_handoff(conn);
+    }
+    el_conn_put(conn);
+}
+
+static void flush_dirty(struct reactor *reactor, struct uring_reactor *ring)
+{
+    struct el_conn *conn = el_reactor_take_dirty(reactor);
+    while (conn) {
+        struct el_conn *next = conn->next_dirty;
+        switch (el_conn_clear_dirty(reactor, conn)) {
+        case EL_DIRTY_FLUSH:
+            queue_send(ring, conn);
+            break;
+        case EL_DIRTY_MIGRATE:
+            uring_reactor_detach(reactor, conn);
+            break;
+        default:
+            break;
+        }
+        el_conn_put(conn);
+        conn = next;
+    }
+}
+
+static void reap_completions(struct reactor *reactor, struct uring_reactor *ring)
+{
+    unsigned head       = *ring->cq_head;
+    const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        const struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+        const enum uring_op op = (enum uring_op)(cqe.user_data & URING_OP_MASK);
+        struct el_conn *conn =
+            (struct el_conn *)(uintptr_t)(cqe.user_data & ~URING_OP_MASK);
+        head++;
+        // Hand the slot back before the handlers run,
+        // they can queue a lot of new work.
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        switch (op) {
+        case URING_OP_ACCEPT:
+            on_accept(reactor, ring, &cqe);
+            break;
+        case URING_OP_RECV:
+            on_recv(ring, conn, &cqe);
+            break;
+        case URING_OP_SEND:
+            on_send(ring, conn, &cqe);
+            break;
+        case URING_OP_WAKE:
+            el_reactor_drain_wake(reactor);
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                arm_wake(reactor, ring);
+            }
+            break;
+        case URING_OP_SWEEP:
+            arm_sweep(ring);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static int uring_reactor_init(struct reactor *reactor)
+{
+    struct io_uring_params params = {0};
+    struct uring_reactor *ring    = NULL;
+
+    if (!is_kernel_recent_enough()) {
+        return -1;
+    }
+    ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        print_error(BB_ERR_CALLOC);
+        exit(1);
+    }
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4;
+    ring->ring_fd = io_uring_setup(URING_ENTRIES, &params);
+    if (ring->ring_fd < 0) {
+        perror("Error setting up io_uring");
+        free(ring);
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+        || !(params.features & IORING_FEAT_NODROP)) {
+        goto exit_error;
+    }
+
+    const size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    const size_t cq_len =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_mem_len = sq_len > cq_len ? sq_len : cq_len;
+    ring->ring_mem     = mmap(NULL,
+                          ring->ring_mem_len,
+                          PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE,
+                          ring->ring_fd,
+                          IORING_OFF_SQ_RING);
+    if (ring->ring_mem == MAP_FAILED) {
+        goto exit_error;
+    }
+    ring->sqes = mmap(NULL,
+                      params.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,
+                      ring->ring_fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto exit_error;
+    }
+
+    char *mem           = ring->ring_mem;
+    ring->sq_head       = (unsigned *)(mem + params.sq_off.head);
+    ring->sq_tail       = (unsigned *)(mem + params.sq_off.tail);
+    ring->sq_mask       = *(unsigned *)(mem + params.sq_off.ring_mask);
+    ring->sq_entries    = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head       = (unsigned *)(mem + params.cq_off.head);
+    ring->cq_tail       = (unsigned *)(mem + params.cq_off.tail);
+    ring->cq_mask       = *(unsigned *)(mem + params.cq_off.ring_mask);
+    ring->cqes          = (struct io_uring_cqe *)(mem + params.cq_off.cqes);
+    // SQ slots map 1:1 onto SQEs
+    unsigned *sq_array = (unsigned *)(mem + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+
+    if (setup_buffer_ring(ring) != 0) {
+        goto exit_error;
+    }
+    reactor->backend = ring;
+    arm_accept(reactor, ring);
+    arm_wake(reactor, ring);
+    arm_sweep(ring);
+    return 0;
+exit_error:
+    if (ring->ring_mem && ring->ring_mem != MAP_FAILED) {
+        munmap(ring->ring_mem, ring->ring_mem_len);
+    }
+    if (ring->sqes && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (ring->buf_ring && ring->buf_ring != MAP_FAILED) {
+        munmap(ring->buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    }
+    close(ring->ring_fd);
+    free(ring->buf_base);
+    free(ring);
+    return -1;
+}
+
+static void uring_reactor_run(struct reactor *reactor)
+{
+    struct uring_reactor *ring = reactor->backend;
+    for (;;) {
+        el_reactor_take_inbox(reactor);
+        flush_dirty(reactor, ring);
+        submit(ring, 1);
+        reap_completions(reactor, ring);
+        el_reactor_sweep_idle(reactor);
+    }
+}
+
+const struct reactor_ops uring_reactor_ops = {
+    .init   = uring_reactor_init,
+    .run    = uring_reactor_run,
+    .attach = uring_reactor_attach,
+    .detach = uring_reactor_detach,
+};
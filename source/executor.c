@@ -0,0 +1,380 @@
+/*
+ * ===========================
+ * executor.c
+ * ===========================
+ * The per-worker deques are Chase-Lev deques,
+ * with the C11 memory orderings from
+ * "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" (Lê et al.). The owner pushes and
+ * takes at the bottom without contention, thieves
+ * CAS the top.
+ *
+ * The deques don't grow, a worker with a full
+ * deque puts new tasks on the injection queue
+ * instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "executor.h"
+#include "mem_pool.h"
+
+#define EXECUTOR_DEQUE_SIZE  1024 // Power of two
+#define EXECUTOR_DEQUE_MASK  (EXECUTOR_DEQUE_SIZE - 1)
+#define EXECUTOR_STEAL_TRIES 4    // Rounds over all victims before sleeping
+
+struct executor_task {
+    executor_fn_t fn;
+    void *arg;
+    struct executor_group *group;
+    struct executor_task *next; // Injection queue only
+};
+
+struct deque {
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic(struct executor_task *) tasks[EXECUTOR_DEQUE_SIZE];
+};
+
+struct worker {
+    int id;
+    pthread_t thread;
+    unsigned int rng; // For picking victims
+    struct deque deque;
+    atomic_uint_fast64_t executed;
+    atomic_uint_fast64_t steals;
+    atomic_uint_fast64_t injected;
+};
+
+static struct mem_pool task_pool = MEM_POOL_INITIALIZER(struct executor_task, 256);
+
+static struct worker *workers   = NULL;
+static int worker_count         = 0;
+static __thread struct worker *current_worker = NULL;
+
+// Tasks from outside the pool
+static struct {
+    pthread_mutex_t lock;
+    struct executor_task *head;
+    struct executor_task *tail;
+    atomic_uint_fast64_t len;
+} injection_queue = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Where workers with nothing to do wait
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond  = PTHREAD_COND_INITIALIZER;
+static atomic_int sleepers       = 0;
+
+/*
+ * Deque operations
+ * --------------------
+ */
+// Owner only, returns -1 when full
+static int deque_push(struct deque *deque, struct executor_task *task)
+{
+    const int64_t bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    const int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= EXECUTOR_DEQUE_SIZE) {
+        return -1;
+    }
+    atomic_store_explicit(&deque->tasks[bottom & EXECUTOR_DEQUE_MASK],
+                          task,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return 0;
+}
+
+// Owner only
+static struct executor_task *deque_take(struct deque *deque)
+{
+    const int64_t bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    struct executor_task *task = NULL;
+
+    if (top > bottom) {
+        // Empty
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    task = atomic_load_explicit(&deque->tasks[bottom & EXECUTOR_DEQUE_MASK],
+                                memory_order_relaxed);
+    if (top == bottom) {
+        // Last one, race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top,
+                                                     &top,
+                                                     top + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+// Any thread, NULL when empty or when we lost a race
+static struct executor_task *deque_steal(struct deque *deque)
+{
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    const int64_t bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+    struct executor_task *task =
+        atomic_load_explicit(&deque->tasks[top & EXECUTOR_DEQUE_MASK],
+                             memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top,
+                                                 &top,
+                                                 top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+static int64_t deque_length(struct deque *deque)
+{
+    const int64_t length = atomic_load(&deque->bottom) - atomic_load(&deque->top);
+    return length > 0 ? length : 0;
+}
+
+/*
+ * Injection queue
+ * --------------------
+ */
+static void inject(struct executor_task *task)
+{
+    task->next = NULL;
+    pthread_mutex_lock(&injection_queue.lock);
+    if (injection_queue.tail) {
+        injection_queue.tail->next = task;
+    }
+    else {
+        injection_queue.head = task;
+    }
+    injection_queue.tail = task;
+    atomic_fetch_add(&injection_queue.len, 1);
+    pthread_mutex_unlock(&injection_queue.lock);
+}
+
+static struct executor_task *take_injected(void)
+{
+    if (atomic_load(&injection_queue.len) == 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&injection_queue.lock);
+    struct executor_task *task = injection_queue.head;
+    if (task) {
+        injection_queue.head = task->next;
+        if (!injection_queue.head) {
+            injection_queue.tail = NULL;
+        }
+        atomic_fetch_sub(&injection_queue.len, 1);
+    }
+    pthread_mutex_unlock(&injection_queue.lock);
+    return task;
+}
+
+/*
+ * Workers
+ * --------------------
+ */
+static void wake_worker(void)
+{
+    // Pairs with the sleepers increment in run_worker()
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&sleepers) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+static bool has_work(void)
+{
+    if (atomic_load(&injection_queue.len) > 0) {
+        return true;
+    }
+    for (int i = 0; i < worker_count; i++) {
+        if (deque_length(&workers[i].deque) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static struct executor_task *steal_task(struct worker *self)
+{
+    for (int round = 0; round < EXECUTOR_STEAL_TRIES; round++) {
+        const int start = rand_r(&self->rng) % worker_count;
+        for (int i = 0; i < worker_count; i++) {
+            struct worker *victim = &workers[(start + i) % worker_count];
+            if (victim == self) {
+                continue;
+            }
+            struct executor_task *task = deque_steal(&victim->deque);
+            if (task) {
+                atomic_fetch_add_explicit(&self->steals,
+                                          1,
+                                          memory_order_relaxed);
+                return task;
+            }
+        }
+    }
+    return NULL;
+}
+
+static struct executor_task *find_task(struct worker *self)
+{
+    struct executor_task *task = deque_take(&self->deque);
+    if (task) {
+        return task;
+    }
+    task = take_injected();
+    if (task) {
+        atomic_fetch_add_explicit(&self->injected, 1, memory_order_relaxed);
+        return task;
+    }
+    return steal_task(self);
+}
+
+static void finish_task(struct executor_task *task)
+{
+    struct executor_group *group = task->group;
+    mem_pool_free(&task_pool, task);
+    if (!group) {
+        return;
+    }
+    // Under the lock, so the waiter can't free
+    // the group before we're done with it.
+    pthread_mutex_lock(&group->lock);
+    if (atomic_fetch_sub(&group->pending, 1) == 1) {
+        pthread_cond_broadcast(&group->cond);
+    }
+    pthread_mutex_unlock(&group->lock);
+}
+
+static void *run_worker(void *arg)
+{
+    struct worker *self = arg;
+    current_worker      = self;
+
+    for (;;) {
+        struct executor_task *task = find_task(self);
+        if (task) {
+            task->fn(task->arg);
+            arena_reset();
+            atomic_fetch_add_explicit(&self->executed, 1, memory_order_relaxed);
+            finish_task(task);
+            continue;
+        }
+        pthread_mutex_lock(&idle_lock);
+        atomic_fetch_add(&sleepers, 1);
+        // Submitters check "sleepers" after queueing,
+        // so either we see their task here or they see us.
+        if (!has_work()) {
+            pthread_cond_wait(&idle_cond, &idle_lock);
+        }
+        atomic_fetch_sub(&sleepers, 1);
+        pthread_mutex_unlock(&idle_lock);
+    }
+    return NULL;
+}
+
+void executor_start(int count)
+{
+    if (count <= 0) {
+        count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    workers = calloc(count, sizeof(*workers));
+    if (!workers) {
+        print_error(BB_ERR_CALLOC);
+        exit(1);
+    }
+    worker_count = count;
+    for (int i = 0; i < count; i++) {
+        workers[i].id  = i;
+        workers[i].rng = (unsigned int)i * 2654435761u + 1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])
+            != 0) {
+            perror("Error starting executor worker");
+            exit(1);
+        }
+        pthread_detach(workers[i].thread);
+    }
+}
+
+int executor_worker_count(void)
+{
+    return worker_count;
+}
+
+void executor_get_stats(int worker_index, struct executor_stats *out)
+{
+    struct worker *worker = &workers[worker_index];
+    out->executed         = atomic_load(&worker->executed);
+    out->steals           = atomic_load(&worker->steals);
+    out->injected         = atomic_load(&worker->injected);
+    out->queue_length     = (uint64_t)deque_length(&worker->deque);
+}
+
+uint64_t executor_injection_queue_length(void)
+{
+    return atomic_load(&injection_queue.len);
+}
+
+void executor_submit(executor_fn_t fn, void *arg, struct executor_group *group)
+{
+    if (!workers) {
+        fn(arg);
+        return;
+    }
+    struct executor_task *task = mem_pool_alloc(&task_pool);
+    task->fn    = fn;
+    task->arg   = arg;
+    task->group = group;
+    task->next  = NULL;
+    if (group) {
+        atomic_fetch_add(&group->pending, 1);
+    }
+
+    if (!current_worker || deque_push(&current_worker->deque, task) != 0) {
+        inject(task);
+    }
+    wake_worker();
+}
+
+void executor_group_init(struct executor_group *group)
+{
+    atomic_store(&group->pending, 0);
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->cond, NULL);
+}
+
+void executor_group_destroy(struct executor_group *group)
+{
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->cond);
+}
+
+void executor_group_wait(struct executor_group *group)
+{
+    pthread_mutex_lock(&group->lock);
+    while (atomic_load(&group->pending) > 0) {
+        pthread_cond_wait(&group->cond, &group->lock);
+    }
+    pthread_mutex_unlock(&group->lock);
+}
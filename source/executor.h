@@ -0,0 +1,67 @@
+/*
+ * ===========================
+ * executor.h
+ * ===========================
+ * Work-stealing thread pool for CPU heavy
+ * request work, so the network threads only
+ * shovel bytes.
+ *
+ * Every worker has its own deque, tasks submitted
+ * from a worker go to the bottom of its own deque,
+ * tasks from anywhere else go to a shared injection
+ * queue. Idle workers steal from the top of the
+ * other workers' deques.
+ *
+ * Tasks that send, do so through the network
+ * backend like any handler would, the backends
+ * are safe to send from any thread.
+ */
+
+#ifndef BB_EXECUTOR
+#define BB_EXECUTOR
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef void (*executor_fn_t)(void *arg);
+
+/*
+ * Counts tasks in flight, so whoever owns
+ * what the tasks use can wait for them, e.g.
+ * a connection that's about to be freed.
+ */
+struct executor_group {
+    atomic_int pending;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct executor_stats {
+    uint64_t executed;
+    uint64_t steals;       // Tasks this worker stole from others
+    uint64_t injected;     // Tasks taken from the injection queue
+    uint64_t queue_length; // Tasks in this worker's deque right now
+};
+
+// 0 starts one worker per online CPU
+void executor_start(int worker_count);
+int  executor_worker_count(void);
+void executor_get_stats(int worker_index, struct executor_stats *out);
+// Tasks waiting in the injection queue right now
+uint64_t executor_injection_queue_length(void);
+
+/*
+ * "group" can be NULL.
+ * Runs the task right away in the calling thread
+ * if the executor wasn't started.
+ */
+void executor_submit(executor_fn_t fn, void *arg, struct executor_group *group);
+
+void executor_group_init   (struct executor_group *group);
+void executor_group_destroy(struct executor_group *group);
+// Blocks until every task submitted with "group" has run
+void executor_group_wait   (struct executor_group *group);
+
+#endif
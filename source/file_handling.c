@@ -20,11 +20,11 @@ struct memory_mapped_file {
 struct mem_mapped_file_buffer {
     struct memory_mapped_file files[MAX_FILE_COUNT];
     int length;
-    bool initialized;
     pthread_mutex_t threadlock;
 };
 
-static struct mem_mapped_file_buffer global_file_table = { 0 };
+static struct mem_mapped_file_buffer global_file_table = {
+    .threadlock = PTHREAD_MUTEX_INITIALIZER};
 
 static size_t list_files_in_directory(const char *directory_name,
                                       size_t directory_name_len,
@@ -37,15 +37,15 @@ static size_t list_files_in_directory(const char *directory_name,
  * at some point.
  * Returns -1 on failure.
  */
-static inline int search_mmap_buffer(const char *dir, char *out_buffer)
+static inline int search_mmap_buffer(const char *dir, char **out_buffer)
 {
-    assert(!out_buffer);
+    assert(!*out_buffer);
     for (int i = 0; i < global_file_table.length; i++) {
         int found_in_cache = string_search(global_file_table.files[i].name,
                                            dir,
                                            MAX_FILENAME_LEN);
         if (!found_in_cache) {
-            out_buffer = global_file_table.files[i].data;
+            *out_buffer = global_file_table.files[i].data;
             return global_file_table.files[i].size;
         }
     }
@@ -62,11 +62,8 @@ static inline int search_mmap_buffer(const char *dir, char *out_buffer)
 size_t get_file_data(const char *dir, char **out_buffer)
 {
     assert(out_buffer && !*out_buffer);
-    if (!global_file_table.initialized) {
-       pthread_mutex_init(&global_file_table.threadlock, NULL); 
-    }
     pthread_mutex_lock(&global_file_table.threadlock);
-    long ret = search_mmap_buffer(dir, *out_buffer);
+    long ret = search_mmap_buffer(dir, out_buffer);
     if (*out_buffer) {
         goto cleanup_threadlock;
     }
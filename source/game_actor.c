@@ -0,0 +1,295 @@
+/*
+ * ===========================
+ * game_actor.c
+ * ===========================
+ * The command queue is Dmitry Vyukov's intrusive
+ * MPSC queue: posting is a single atomic exchange,
+ * and the worker pops without any atomics in the
+ * common case.
+ *
+ * Actors with queued commands sit on a ready queue
+ * that the workers take turns draining. An actor is
+ * only ever on the ready queue once, guarded by
+ * its "scheduled" flag, so only one worker at a time
+ * runs any given game.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "epoch.h"
+#include "game_actor.h"
+#include "game_logic.h"
+#include "mem_pool.h"
+
+// Commands a worker runs for one game before
+// giving the other games a turn
+#define GAME_ACTOR_BATCH 64
+
+// For game_actor_call()
+struct game_call {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+};
+
+struct game_cmd {
+    _Atomic(struct game_cmd *) next;
+    game_cmd_handler_t handler;
+    struct host *remotehost;
+    struct game_call *call; // NULL when nobody's waiting
+    ssize_t data_size;
+    char data[];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct game_actor *head;
+    struct game_actor *tail;
+} ready_queue = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                 .cond = PTHREAD_COND_INITIALIZER};
+
+static struct game_cmd *alloc_cmd(ssize_t data_size)
+{
+    struct game_cmd *cmd = mem_alloc(sizeof(*cmd) + data_size + 1);
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->data[data_size] = '\0';
+    return cmd;
+}
+
+void game_actor_init(struct game_actor *actor, struct game *game)
+{
+    actor->stub = alloc_cmd(0);
+    actor->tail = actor->stub;
+    atomic_store(&actor->head, actor->stub);
+    atomic_store(&actor->scheduled, false);
+    atomic_store(&actor->queued, 0);
+    actor->next_ready = NULL;
+    actor->game       = game;
+}
+
+static void push_cmd(struct game_actor *actor, struct game_cmd *cmd)
+{
+    atomic_store_explicit(&cmd->next, NULL, memory_order_relaxed);
+    struct game_cmd *prev =
+        atomic_exchange_explicit(&actor->head, cmd, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, cmd, memory_order_release);
+}
+
+/*
+ * Returns NULL when the queue is empty, or when
+ * a post is halfway done, in which case the poster
+ * reschedules the actor anyway.
+ */
+static struct game_cmd *pop_cmd(struct game_actor *actor)
+{
+    struct game_cmd *tail = actor->tail;
+    struct game_cmd *next =
+        atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == actor->stub) {
+        if (!next) {
+            return NULL;
+        }
+        actor->tail = next;
+        tail        = next;
+        next        = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next) {
+        actor->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&actor->head, memory_order_acquire)) {
+        return NULL;
+    }
+    // "tail" is the last command, put the stub
+    // behind it so we can pop it.
+    push_cmd(actor, actor->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        actor->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static bool is_queue_empty(struct game_actor *actor)
+{
+    return actor->tail == atomic_load(&actor->head);
+}
+
+static void push_ready(struct game_actor *actor)
+{
+    pthread_mutex_lock(&ready_queue.lock);
+    actor->next_ready = NULL;
+    if (ready_queue.tail) {
+        ready_queue.tail->next_ready = actor;
+    }
+    else {
+        ready_queue.head = actor;
+    }
+    ready_queue.tail = actor;
+    pthread_cond_signal(&ready_queue.cond);
+    pthread_mutex_unlock(&ready_queue.lock);
+}
+
+static struct game_actor *pop_ready(void)
+{
+    pthread_mutex_lock(&ready_queue.lock);
+    while (!ready_queue.head) {
+        pthread_cond_wait(&ready_queue.cond, &ready_queue.lock);
+    }
+    struct game_actor *actor = ready_queue.head;
+    ready_queue.head         = actor->next_ready;
+    if (!ready_queue.head) {
+        ready_queue.tail = NULL;
+    }
+    pthread_mutex_unlock(&ready_queue.lock);
+    return actor;
+}
+
+static void schedule(struct game_actor *actor)
+{
+    if (!atomic_exchange(&actor->scheduled, true)) {
+        push_ready(actor);
+    }
+}
+
+static void finish_cmd(struct game_cmd *cmd)
+{
+    struct game_call *call = cmd->call;
+    mem_free(cmd);
+    if (call) {
+        pthread_mutex_lock(&call->lock);
+        call->done = true;
+        pthread_cond_signal(&call->cond);
+        pthread_mutex_unlock(&call->lock);
+    }
+}
+
+static void run_actor(struct game_actor *actor)
+{
+    for (int i = 0; i < GAME_ACTOR_BATCH; i++) {
+        struct game_cmd *cmd = pop_cmd(actor);
+        if (!cmd) {
+            atomic_store(&actor->scheduled, false);
+            // Something might have been posted after our last
+            // pop, but before we cleared "scheduled".
+            if (!is_queue_empty(actor)) {
+                schedule(actor);
+            }
+            return;
+        }
+        atomic_fetch_sub_explicit(&actor->queued, 1, memory_order_relaxed);
+        cmd->handler(actor->game, cmd->data, cmd->data_size, cmd->remotehost);
+        arena_reset();
+        finish_cmd(cmd);
+    }
+    // Still busy, back of the line
+    push_ready(actor);
+}
+
+static void *run_worker(void *arg)
+{
+    for (;;) {
+        struct game_actor *actor = pop_ready();
+        // So a deleted game isn't freed under us,
+        // see reclaim_game()
+        epoch_enter();
+        run_actor(actor);
+        epoch_exit();
+    }
+    return NULL;
+}
+
+static struct game_cmd *make_cmd(game_cmd_handler_t handler,
+                                 const char *data,
+                                 ssize_t data_size,
+                                 struct host *remotehost)
+{
+    struct game_cmd *cmd = alloc_cmd(data_size);
+    cmd->handler         = handler;
+    cmd->remotehost      = remotehost;
+    cmd->data_size       = data_size;
+    if (data_size > 0) {
+        memcpy(cmd->data, data, data_size);
+    }
+    return cmd;
+}
+
+void game_actor_post(struct game *game,
+                     game_cmd_handler_t handler,
+                     const char *data,
+                     ssize_t data_size,
+                     struct host *remotehost)
+{
+    struct game_actor *actor = &game->actor;
+    atomic_fetch_add_explicit(&actor->queued, 1, memory_order_relaxed);
+    push_cmd(actor, make_cmd(handler, data, data_size, remotehost));
+    schedule(actor);
+}
+
+void game_actor_call(struct game *game,
+                     game_cmd_handler_t handler,
+                     const char *data,
+                     ssize_t data_size,
+                     struct host *remotehost)
+{
+    struct game_actor *actor = &game->actor;
+    struct game_call call    = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                .cond = PTHREAD_COND_INITIALIZER,
+                                .done = false};
+    struct game_cmd *cmd     = make_cmd(handler, data, data_size, remotehost);
+    cmd->call                = &call;
+
+    atomic_fetch_add_explicit(&actor->queued, 1, memory_order_relaxed);
+    push_cmd(actor, cmd);
+    schedule(actor);
+
+    pthread_mutex_lock(&call.lock);
+    while (!call.done) {
+        pthread_cond_wait(&call.cond, &call.lock);
+    }
+    pthread_mutex_unlock(&call.lock);
+    pthread_cond_destroy(&call.cond);
+    pthread_mutex_destroy(&call.lock);
+}
+
+/*
+ * Caller makes sure nothing posts to
+ * the game anymore.
+ */
+void game_actor_destroy(struct game_actor *actor)
+{
+    struct game_cmd *cmd = NULL;
+    while ((cmd = pop_cmd(actor))) {
+        finish_cmd(cmd);
+    }
+    mem_free(actor->stub);
+    actor->stub = NULL;
+}
+
+unsigned int game_actor_queue_length(struct game_actor *actor)
+{
+    return atomic_load_explicit(&actor->queued, memory_order_relaxed);
+}
+
+void game_actor_start_workers(int worker_count)
+{
+    pthread_t thread;
+    if (worker_count <= 0) {
+        worker_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        if (pthread_create(&thread, NULL, run_worker, NULL) != 0) {
+            perror("Error starting game worker");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+}
@@ -0,0 +1,87 @@
+/*
+ * ===========================
+ * game_actor.h
+ * ===========================
+ * Every game is an actor: anything that changes
+ * a game's state is posted to that game's command
+ * queue, and a pool of worker threads runs the
+ * queued commands, one worker per game at a time.
+ *
+ * So the game state never needs a lock, commands
+ * for one game run in the order they were posted,
+ * and different games run in parallel on
+ * different workers.
+ *
+ * Network threads can still read a few
+ * fields directly, those are atomics (see
+ * try_get_player_from_token(), is_charsheet_valid()).
+ */
+
+#ifndef BB_GAME_ACTOR
+#define BB_GAME_ACTOR
+
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "bbnetlib.h"
+
+struct game;
+
+/*
+ * Runs on a game worker with exclusive access
+ * to "game". "data" is the worker's own copy of
+ * whatever was posted, NUL terminated.
+ */
+typedef void (*game_cmd_handler_t)(struct game *game,
+                                   char *data,
+                                   ssize_t data_size,
+                                   struct host *remotehost);
+
+struct game_cmd;
+
+/*
+ * Intrusive MPSC queue, any thread can post,
+ * only the worker running the actor pops.
+ */
+struct game_actor {
+    _Atomic(struct game_cmd *) head; // Producers push here
+    struct game_cmd *tail;           // Worker pops here
+    struct game_cmd *stub;
+    atomic_bool scheduled;           // Queued on, or running on, a worker
+    atomic_uint queued;              // Commands posted that haven't run yet
+    struct game_actor *next_ready;
+    struct game *game;
+};
+
+void game_actor_init   (struct game_actor *actor, struct game *game);
+// Drops any commands that haven't run yet
+void game_actor_destroy(struct game_actor *actor);
+
+/*
+ * Queues "handler" to run on the game's actor
+ * and returns right away.
+ */
+void game_actor_post(struct game *game,
+                     game_cmd_handler_t handler,
+                     const char *data,
+                     ssize_t data_size,
+                     struct host *remotehost);
+/*
+ * Same as game_actor_post(), but waits until "handler"
+ * has run, which means everything posted to the game
+ * before it has run too.
+ * Don't call this from a game worker.
+ */
+void game_actor_call(struct game *game,
+                     game_cmd_handler_t handler,
+                     const char *data,
+                     ssize_t data_size,
+                     struct host *remotehost);
+
+// For metrics, any thread
+unsigned int game_actor_queue_length(struct game_actor *actor);
+
+// 0 starts one worker per online CPU
+void game_actor_start_workers(int worker_count);
+
+#endif
@@ -1,14 +1,20 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "auth.h"
+#include "epoch.h"
+#include "error_handling.h"
 #include "game_logic.h"
 #include "helpers.h"
+#include "net_backend.h"
+#include "recorder.h"
 #include "validators.h"
+#include "websocket_handlers.h"
 
 
 // This is coupled with enum PlayerBackground
@@ -32,99 +38,285 @@ static const char player_gender_strings[GENDER_COUNT][HTMLFORM_FIELD_MAX_LEN] =
 const char test_game_name[MAX_CREDENTIAL_LEN] = "test game";
 
 /*
- * Central global list of games
+ * Central registry of games
+ * ----------------------------
+ * A hash index from name to game, split into shards so
+ * creating and deleting games in different shards doesn't
+ * contend. Writers take their shard's lock, lookups don't
+ * take any, they walk the bucket under epoch_enter() and
+ * deleted games are freed once no lookup can still see them.
+ *
+ * Games are calloc()ed at their own size, players and all,
+ * so there's no cap on how many we host. They're made far
+ * too rarely for a pool to pay, and mem_alloc()'s size
+ * classes would round most of them up to four times that.
  */
-struct game_slot {
-    atomic_int in_use;
-    struct game game;
-    pthread_mutex_t game_mutex;
+#define GAME_REGISTRY_SHARDS  64  // Power of two
+#define GAME_REGISTRY_BUCKETS 256 // Per shard, power of two
+
+struct game_shard {
+    pthread_mutex_t lock; // Writers only
+    _Atomic(struct game *) buckets[GAME_REGISTRY_BUCKETS];
 };
-static struct game_slot game_list[MAX_GAMES] = {0};
-atomic_int game_count                        = 0;
+
+static struct game_shard game_shards[GAME_REGISTRY_SHARDS];
+static pthread_once_t game_shards_once = PTHREAD_ONCE_INIT;
+atomic_int game_count = 0;
+
+// Only writers need the locks, see lock_game_shard()
+static void init_game_shards(void)
+{
+    for (int i = 0; i < GAME_REGISTRY_SHARDS; i++) {
+        pthread_mutex_init(&game_shards[i].lock, NULL);
+    }
+}
+
+static void lock_game_shard(struct game_shard *shard)
+{
+    pthread_once(&game_shards_once, init_game_shards);
+    pthread_mutex_lock(&shard->lock);
+}
+
+static _Atomic(struct game *) *get_game_bucket(const char *name,
+                                              struct game_shard **out_shard)
+{
+    const unsigned int hash =
+        hash_data_simple(name, strnlen(name, MAX_CREDENTIAL_LEN));
+    struct game_shard *shard = &game_shards[hash & (GAME_REGISTRY_SHARDS - 1)];
+    if (out_shard) {
+        *out_shard = shard;
+    }
+    return &shard->buckets[(hash / GAME_REGISTRY_SHARDS)
+                           & (GAME_REGISTRY_BUCKETS - 1)];
+}
+
+static struct game *find_in_bucket(_Atomic(struct game *) *bucket,
+                                   const char *name)
+{
+    struct game *game = atomic_load_explicit(bucket, memory_order_acquire);
+    while (game) {
+        if (strncmp(game->name, name, MAX_CREDENTIAL_LEN) == 0) {
+            return game;
+        }
+        game = atomic_load_explicit(&game->registry_next, memory_order_acquire);
+    }
+    return NULL;
+}
 
 /*
  * Returns a pointer to the corresponding
- * game from the global list, or NULL
+ * game from the registry, or NULL
  * if no name matched
  */
 struct game *get_game_from_name(const char name[static MAX_CREDENTIAL_LEN])
 {
-    int cmp = -1;
-    for (int i = 0; i < MAX_GAMES; i++) {
-        cmp = strncmp(game_list[i].game.name, name, MAX_CREDENTIAL_LEN);
-        if (cmp == 0) {
-            return &game_list[i].game;
+    return find_in_bucket(get_game_bucket(name, NULL), name);
+}
+
+int get_game_count(void)
+{
+    return atomic_load(&game_count);
+}
+
+/*
+ * Caller is in epoch_enter(), or is a forked
+ * child that has the registry to itself.
+ */
+void for_each_game(game_visitor_t visit, void *arg)
+{
+    for (int i = 0; i < GAME_REGISTRY_SHARDS; i++) {
+        for (int j = 0; j < GAME_REGISTRY_BUCKETS; j++) {
+            struct game *game = atomic_load_explicit(&game_shards[i].buckets[j],
+                                                     memory_order_acquire);
+            while (game) {
+                visit(game, arg);
+                game = atomic_load_explicit(&game->registry_next,
+                                            memory_order_acquire);
+            }
         }
     }
-    return NULL;
 }
 
 /*
  * Helpers and Authentication
  * ----------------------------
- *  None of these have mutex locks in them,
- *  the functions that call them are expected
- *  to lock the game state they are modifying.
+ *  Unless stated otherwise, these run
+ *  on the game's actor.
  */
-static void gen_player_start_pos(struct coordinates *out_coords);
+static void gen_player_start_pos(struct game *game,
+                                 struct coordinates *out_coords);
 
-static inline int get_free_game(void)
+static inline size_t get_game_size(int max_player_count)
 {
-    int expected = 0;
-    for (int i = 0; i < MAX_GAMES; i++) {
-        if (atomic_compare_exchange_strong(&game_list[i].in_use,
-                                           &expected,
-                                           1)) {
-            return i;
-        }
-    }
-    return -1;
+    return sizeof(struct game) + max_player_count * sizeof(struct player);
 }
 
+/*
+ * Returns NULL if there's already a game with that
+ * name, or the player counts are out of range.
+ */
 struct game *create_game(struct game_config *config)
 {
-    const int game_index = get_free_game();
-    if (game_index == -1) {
+    if (config->max_player_count < 1
+        || config->max_player_count > MAX_PLAYERS_IN_GAME
+        || config->min_player_count > config->max_player_count) {
         return NULL;
     }
-    struct game *game = &game_list[game_index].game;
+    struct game_shard *shard       = NULL;
+    _Atomic(struct game *) *bucket = get_game_bucket(config->name, &shard);
+    const size_t game_size         = get_game_size(config->max_player_count);
+    struct game *game              = calloc(1, game_size);
+    if (!game) {
+        print_error(BB_ERR_CALLOC);
+        exit(1);
+    }
 
-    pthread_mutex_init(&game->threadlock, NULL);
+    game_actor_init(&game->actor, game);
     strncpy(game->password, config->password, MAX_CREDENTIAL_LEN);
     strncpy(game->name, config->name, MAX_CREDENTIAL_LEN);
     game->max_player_count = config->max_player_count;
     game->min_player_count = config->min_player_count;
     game->state = GAME_STATE_NOT_STARTED;
-    atomic_store(&game->player_count, 0);
+    game->rng_state        = config->rng_seed ? config->rng_seed
+                                              : (uint64_t)get_random_int();
+    game->state_epoch      = config->state_epoch ? config->state_epoch
+                                                 : (uint32_t)get_random_int();
+    game_timer_init(&game->turn_timer, game, turn_timed_out);
+    game_timer_init(&game->idle_timer, game, sweep_idle_hosts);
+    atomic_store(&game->live_players, 0);
+
+    lock_game_shard(shard);
+    if (find_in_bucket(bucket, game->name)) {
+        pthread_mutex_unlock(&shard->lock);
+        game_actor_destroy(&game->actor);
+        free(game);
+        return NULL;
+    }
+    // Before anything can be posted to it
+    record_game_begin(game);
+    atomic_store_explicit(&game->registry_next,
+                          atomic_load_explicit(bucket, memory_order_relaxed),
+                          memory_order_relaxed);
+    // Publishes the game to lookups
+    atomic_store_explicit(bucket, game, memory_order_release);
+    pthread_mutex_unlock(&shard->lock);
     atomic_fetch_add(&game_count, 1);
     return game;
 }
 
+/*
+ * Lookups that found the game before it was unlinked
+ * may still post to it, and so may its hosts until
+ * they've disconnected, so wait until they're all gone
+ * and its actor went idle, then for anyone who saw it
+ * running to leave their read section too.
+ */
+static bool reclaim_game(void *object)
+{
+    struct game *game = object;
+    if (atomic_load(&game->attached_hosts)
+        || atomic_load(&game->actor.scheduled)) {
+        game->reclaim_drained = false;
+        return false;
+    }
+    if (!game->reclaim_drained) {
+        game->reclaim_drained = true;
+        return false;
+    }
+    game_actor_destroy(&game->actor);
+    free(game->heat_overlay);
+    free(game);
+    return true;
+}
+
+// On the game's actor
+static void close_game_hosts(struct game *game,
+                             char *data,
+                             ssize_t data_size,
+                             struct host *unused)
+{
+    for (player_mask_t slots = get_live_players(game); slots;) {
+        struct host *remotehost =
+            game->players[pop_player_slot(&slots)].associated_host;
+        if (remotehost) {
+            net_close_host(remotehost);
+        }
+    }
+}
+
+/*
+ * Not from the game's actor.
+ * Once it's unlinked nobody new can find the game,
+ * then every player's connection is closed, and
+ * it's freed after they've all disconnected.
+ * Hosts that never got past HTTP go once they're
+ * closed for being idle.
+ */
 void delete_game(struct game *game)
 {
-    pthread_mutex_lock(&game->threadlock);
     // TODO:
     // Before we nuke the game,
-    // we need to lock and tell all the clients
-    // that the game is deleted and make
-    // sure they shutdown
-    atomic_store(&game->player_count, 0);
-    memset(game, 0, sizeof(*game));
-    pthread_mutex_unlock(&game->threadlock);
+    // we need to tell all the clients
+    // that the game is deleted.
+    struct game_shard *shard     = NULL;
+    _Atomic(struct game *) *link = get_game_bucket(game->name, &shard);
+
+    lock_game_shard(shard);
+    struct game *entry = atomic_load_explicit(link, memory_order_relaxed);
+    while (entry && entry != game) {
+        link  = &entry->registry_next;
+        entry = atomic_load_explicit(link, memory_order_relaxed);
+    }
+    if (entry) {
+        // Lookups already past us keep walking from our "next"
+        atomic_store_explicit(link,
+                              atomic_load(&game->registry_next),
+                              memory_order_release);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (!entry) {
+        return;
+    }
+    game_actor_post(game, close_game_hosts, NULL, 0, NULL);
+    game_timer_close(&game->turn_timer);
+    game_timer_close(&game->idle_timer);
     atomic_fetch_sub(&game_count, 1);
+    epoch_retire(game, reclaim_game);
 }
 
-static void gen_player_start_pos(struct coordinates *out_coords)
+/*
+ * splitmix64, tiny and good enough for dice,
+ * session tokens still come from get_random_int().
+ */
+uint64_t game_random_u64(struct game *game)
+{
+    uint64_t z = (game->rng_state += 0x9E3779B97F4A7C15ull);
+    z          = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z          = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+double game_random_double(struct game *game, double min, double max)
+{
+    // Top 53 bits, so every value is exact in a double
+    const double normalized =
+        (game_random_u64(game) >> 11) * (1.0 / 9007199254740992.0);
+    return min + normalized * (max - min);
+}
+
+static void gen_player_start_pos(struct game *game,
+                                 struct coordinates *out_coords)
 {
     // TODO: generate an actual start position
-    const enum cardinal_dir edge_to_spawn = (enum cardinal_dir)(get_random_int() % DIR_COUNT);
+    const enum cardinal_dir edge_to_spawn =
+        (enum cardinal_dir)(game_random_u64(game) % DIR_COUNT);
     switch (edge_to_spawn) {
         case DIR_NORTH:
-            out_coords->x = get_random_double(-1.5f, 1.5f);
+            out_coords->x = game_random_double(game, -1.5f, 1.5f);
             out_coords->y = 0.9f;
             break;
         case DIR_SOUTH:
-            out_coords->x = get_random_double(-1.5f, 1.5f);
+            out_coords->x = game_random_double(game, -1.5f, 1.5f);
             out_coords->y = -0.9f;
             break;
         case DIR_WEST:
@@ -133,11 +325,11 @@ static void gen_player_start_pos(struct coordinates *out_coords)
             break;
         case DIR_EAST:
             out_coords->x = 1.5f;
-            out_coords->y = get_random_double(-0.9f, 0.9f);
+            out_coords->y = game_random_double(game, -0.9f, 0.9f);
             break;
         default:
             out_coords->x = -1.5f;
-            out_coords->y = get_random_double(-0.9f, 0.9f);
+            out_coords->y = game_random_double(game, -0.9f, 0.9f);
     }
 
     out_coords->z = 0.0f;
@@ -145,42 +337,199 @@ static void gen_player_start_pos(struct coordinates *out_coords)
 
 /*
  * This function assumes that the player was redirected to
- * character creation and creates a character at the next free
- * index in the game.
- * Caller handles concurrency.
+ * character creation and creates a character in the lowest
+ * free slot in the game.
+ * Returns NULL when the game is full.
  */
 struct player *create_player(struct game *game,
                              const struct player_credentials *credentials)
 {
-    const player_id_t new_player_id = atomic_fetch_add(&game->player_count, 1);
-
-    /* TODO: make this find a free slot instead */
-    struct player *new_player = &game->players[new_player_id];
+    const player_mask_t all_slots    = get_all_player_slots(game);
+    const player_mask_t live_players = get_live_players(game);
+    const player_mask_t free_slots   = ~live_players & all_slots;
+    if (!free_slots) {
+        return NULL;
+    }
+    const player_id_t new_player_id = __builtin_ctzll(free_slots);
+    struct player *new_player       = &game->players[new_player_id];
+    // Odd, the slot is in use
+    const uint16_t generation = new_player->generation + 1;
 
-    new_player->id = new_player_id;
-    pthread_mutex_init(&new_player->threadlock, NULL);
-    new_player->game = game;
+    memset(new_player, 0, sizeof(*new_player));
+    new_player->id            = new_player_id;
+    new_player->generation    = generation;
+    new_player->game          = game;
+    new_player->action_points = GAME_ACTION_POINTS;
     memcpy(&new_player->credentials, credentials, sizeof(*credentials));
-    gen_player_start_pos(&new_player->coords);
+    gen_player_start_pos(game, &new_player->coords);
+    // Only now can network threads see it
+    atomic_fetch_or_explicit(&game->live_players,
+                             (player_mask_t)1 << new_player_id,
+                             memory_order_release);
+    record_player_create(new_player);
     return new_player;
 }
 
+static uint64_t turn_timeout_ms = GAME_TURN_TIMEOUT_DEFAULT * 1000;
+
+/*
+ * Hands "player" the turn, and starts the clock on it.
+ */
+static void start_turn(struct game *game, struct player *player)
+{
+    uint64_t timeout_ms = turn_timeout_ms;
+    game->current_turn  = player;
+    if (!timeout_ms) {
+        return;
+    }
+    if (player->missed_turns >= GAME_AFK_MISSED_TURNS
+        && timeout_ms > GAME_AFK_TURN_MS) {
+        timeout_ms = GAME_AFK_TURN_MS;
+    }
+    game_timer_arm(&game->turn_timer, timeout_ms);
+}
+
+// A new turn, rather than picking the old one back up
+static void give_turn(struct game *game, struct player *player)
+{
+    player->action_points = GAME_ACTION_POINTS;
+    start_turn(game, player);
+}
+
+/*
+ * Gives the turn to the next live player after "slot",
+ * wrapping around, the game stops once nobody's left.
+ */
+static void pass_turn_from(struct game *game, player_id_t slot)
+{
+    // Slots above "slot", 2 << 63 wraps to 0 which works out
+    const player_mask_t higher_slots = ~(((player_mask_t)2 << slot) - 1);
+    const player_mask_t live_players = get_live_players(game);
+    const player_mask_t after        = live_players & higher_slots;
+    if (!live_players) {
+        game->current_turn = NULL;
+        game->state        = GAME_STATE_NOT_STARTED;
+        game_timer_cancel(&game->turn_timer);
+        return;
+    }
+    give_turn(game,
+              &game->players[__builtin_ctzll(after ? after : live_players)]);
+}
+
+void expire_turn(struct game *game)
+{
+    struct player *player = game->current_turn;
+    if (!player) {
+        return;
+    }
+    if (player->missed_turns < UINT8_MAX) {
+        player->missed_turns++;
+    }
+    pass_turn_from(game, player->id);
+}
+
+void set_turn_timeout(int seconds)
+{
+    turn_timeout_ms = (uint64_t)seconds * 1000;
+}
+
+static void resume_turn_deadline(struct game *game, void *arg)
+{
+    if (game->current_turn) {
+        start_turn(game, game->current_turn);
+    }
+}
+
+void resume_turn_deadlines(void)
+{
+    epoch_enter();
+    for_each_game(resume_turn_deadline, NULL);
+    epoch_exit();
+}
+
+void mark_player_active(struct player *player)
+{
+    player->missed_turns = 0;
+}
+
+/*
+ * Puts a saved player back in the slot they had, for
+ * restoring games on startup before we're listening.
+ * NULL if the slot doesn't exist or is taken.
+ */
+struct player *restore_player(struct game *game,
+                              player_id_t slot,
+                              uint16_t generation,
+                              const struct player_credentials *credentials)
+{
+    if (slot < 0 || slot >= game->max_player_count
+        || (get_live_players(game) & ((player_mask_t)1 << slot))) {
+        return NULL;
+    }
+    struct player *player = &game->players[slot];
+    memset(player, 0, sizeof(*player));
+    player->id            = slot;
+    player->generation    = generation | 1; // Keep it odd
+    player->game          = game;
+    player->action_points = GAME_ACTION_POINTS;
+    memcpy(&player->credentials, credentials, sizeof(*credentials));
+    atomic_fetch_or_explicit(&game->live_players,
+                             (player_mask_t)1 << slot,
+                             memory_order_release);
+    return player;
+}
+
 void delete_player(struct player *restrict player)
 {
-    // TODO: if we memset the entire player struct this probably
-    //       messes up the player threadlock
-    pthread_mutex_lock(&player->threadlock);
-    atomic_fetch_sub(&player->game->player_count, 1);
+    struct game *game         = player->game;
+    const player_id_t id      = player->id;
+    // Even, the slot is free and old handles are stale
+    const uint16_t generation = player->generation + 1;
+
+    record_player_leave(player);
+    // Network threads might still be looking at the slot,
+    // make sure its token can't match anymore first.
+    atomic_store(&player->session_token, 0);
+    atomic_fetch_and_explicit(&game->live_players,
+                              ~((player_mask_t)1 << id),
+                              memory_order_release);
+    if (game->current_turn == player) {
+        pass_turn_from(game, id);
+    }
     memset(player, 0, sizeof(*player));
-    pthread_mutex_unlock(&player->threadlock);
+    player->id         = id;
+    player->generation = generation;
+}
+
+player_handle_t get_player_handle(const struct player *player)
+{
+    return make_player_handle(player->id, player->generation);
+}
+
+struct player *get_player_from_handle(struct game *game,
+                                      player_handle_t handle)
+{
+    const unsigned int slot = handle & 0xFFFF;
+    if (!game || slot >= (unsigned int)game->max_player_count
+        || !(get_live_players(game) & ((player_mask_t)1 << slot))) {
+        return NULL;
+    }
+    struct player *player = &game->players[slot];
+    if (player->generation != (uint16_t)(handle >> 16)) {
+        return NULL;
+    }
+    return player;
+}
+
+int get_player_count(const struct game *game)
+{
+    return __builtin_popcountll(get_live_players(game));
 }
 
 void set_player_char_sheet(struct player *player,
                            const struct character_sheet *charsheet)
 {
-    pthread_mutex_lock(&player->threadlock);
     memcpy(&player->char_sheet, charsheet, sizeof(*charsheet));
-    pthread_mutex_unlock(&player->threadlock);
 }
 
 /*
@@ -190,7 +539,6 @@ void set_player_char_sheet(struct player *player,
 int init_charsheet_from_form(struct player *player,
                              const struct html_form *form)
 {
-    pthread_mutex_lock(&player->threadlock);
     struct character_sheet *sheet = &player->char_sheet;
     if (form->field_count < FORM_CHARSHEET_FIELD_COUNT) {
         goto exit_error;
@@ -224,40 +572,37 @@ int init_charsheet_from_form(struct player *player,
         memset(sheet, 0, sizeof(*sheet));
         goto exit_error;
     }
-    sheet->is_valid = true;
-    pthread_mutex_unlock(&player->threadlock);
+    // Network threads check this without going through
+    // the actor, so it's set last.
+    atomic_store(&sheet->is_valid, true);
     return 0;
 exit_error:
-    pthread_mutex_unlock(&player->threadlock);
     return -1;
 }
 
 /*
  * This just checks the "is_valid" flag
- * in a thread safe manner,
+ * in a thread safe manner, from any thread,
  * see "validate_new_charsheet()"
  * for vibe-checking hackers
  */
 bool is_charsheet_valid(const struct player *restrict player)
 {
-    bool result = 0;
-    result = player->char_sheet.is_valid;
-    return result;
+    return atomic_load(&player->char_sheet.is_valid);
 }
 
 void set_game_password(struct game *restrict game,
                        const char password[static MAX_CREDENTIAL_LEN])
 {
-    pthread_mutex_lock(&game->threadlock);
     memset(game->password, 0, MAX_CREDENTIAL_LEN);
     strncpy(game->password, password, MAX_CREDENTIAL_LEN);
-    pthread_mutex_unlock(&game->threadlock);
 }
 
 /*
- * Returns NULL when none is found
- * It's all readonly, so it _should_ be
- * thread safe in this specific case...
+ * Returns NULL when none is found.
+ * Safe from any thread, the tokens are atomics
+ * and a player slot's token is only set after
+ * the rest of the player.
  */
 struct player *try_get_player_from_token(session_token_t token,
                                          struct game *restrict game)
@@ -265,9 +610,10 @@ struct player *try_get_player_from_token(session_token_t token,
     if (token == INVALID_SESSION_TOKEN) {
         return NULL;
     }
-    for (int i = 0; i < game->player_count; i++) {
-        if (token == game->players[i].session_token) {
-            return &game->players[i];
+    for (player_mask_t slots = get_live_players(game); slots;) {
+        struct player *player = &game->players[pop_player_slot(&slots)];
+        if (token == atomic_load(&player->session_token)) {
+            return player;
         }
     }
     return NULL;
@@ -285,14 +631,14 @@ static bool is_player_turn(const struct player *player)
  * Returns 0 on success, -1 if we still
  * can't start the game because there aren't enough
  * players.
- * Caller handles game threadlock.
  */
 void try_start_game(struct game *game)
 {
-    if (atomic_load(&game->player_count) >= game->min_player_count) {
+    const player_mask_t live_players = get_live_players(game);
+    if (live_players && get_player_count(game) >= game->min_player_count) {
         // TODO: handle turn order more
         // gracefully than first come first serve.
-        game->current_turn = &game->players[0];
+        give_turn(game, &game->players[__builtin_ctzll(live_players)]);
         game->state = GAME_STATE_STARTED;
     }
 }
@@ -6,16 +6,38 @@
 #include <unistd.h>
 
 #include "bbnetlib.h"
+#include "game_actor.h"
 #include "helpers.h"
 #include "session_token.h"
+#include "timer_wheel.h"
 
 extern const char test_game_name[];
 
 #define MAX_CREDENTIAL_LEN  32
-#define MAX_PLAYERS_IN_GAME 8
-#define MAX_GAMES           16
-#define MAX_PLAYERS         MAX_PLAYERS_IN_GAME * MAX_GAMES
+// Upper limit for game_config.max_player_count,
+// each game only allocates the slots it asked for.
+#define MAX_PLAYERS_IN_GAME 64
 #define INVALID_PLAYER_ID   -1
+// How many deltas back a reconnecting client can
+// resume from, see game.recent_deltas
+#define GAME_DELTA_RING_SIZE  64
+#define GAME_DELTA_FRAME_MAX  64
+// How long a turn lasts before it's passed on for
+// the player, see set_turn_timeout()
+#define GAME_TURN_TIMEOUT_DEFAULT 60 // Seconds
+// Players who let this many turns in a row time
+// out only get GAME_AFK_TURN_MS, until they move
+#define GAME_AFK_MISSED_TURNS     3
+#define GAME_AFK_TURN_MS          5000
+// What a player has to spend on their turn,
+// a kilometre of travel is one, see movement.h
+#define GAME_ACTION_POINTS        100
+
+// Player slots of a game, bit N is players[N]
+typedef uint64_t player_mask_t;
+
+_Static_assert(MAX_PLAYERS_IN_GAME <= 64,
+               "Player slots are tracked in a 64 bit mask");
 
 typedef uint16_t opcode_t;
 
@@ -106,24 +128,9 @@ enum resource_id {
     RESOURCE_COUNT
 };
 
-/*
- * Encounter Categories, and their possible encounters
- */
-// NOTE: Every encounter category needs at least one specific
-// encounter in it.
-static int encounter_categories[ENCOUNTER_TYPE_COUNT][ENCOUNTER_COUNT] = {
-    // ENCOUNTER_TYPE_BANDIT
-    {ENCOUNTER_BANDITS},
-    // ENCOUNTER_TYPE_BEASTS
-    {ENCOUNTER_WOLVES, ENCOUNTER_RATS},
-    // ENCOUNTER_TYPE_MONSTROSITIES
-    {ENCOUNTER_TROLLS},
-    // ENCOUNTER_TYPE_DRAGON
-    {ENCOUNTER_DRAGONS},
-    // ENCOUNTER_TYPE_MYSTICAL
-    {ENCOUNTER_RUINS_OLD, ENCOUNTER_TREASURE_MAGICAL, ENCOUNTER_SPELL_TOME},
-    // ENOUNTER_TYPE_CULTISTS
-    {ENCOUNTER_CULTISTS_CANNIBAL, ENCOUNTER_CULTISTS_PEACEFUL}};
+// Which encounters are in which category,
+// and how likely they are, is in encounters.c
+
 // This is coupled with playerBackgroundStrings
 enum player_background {
     PLAYER_BACKGROUND_TRADER,
@@ -140,7 +147,7 @@ enum player_background {
 
 typedef unsigned int player_attr_t;
 struct character_sheet {
-    bool is_valid; // Is this Charsheet valid at all?
+    atomic_bool is_valid; // Is this Charsheet valid at all?
     enum gender gender;
     player_attr_t vigour;
     player_attr_t violence;
@@ -154,6 +161,10 @@ struct coordinates {
     double z;
 };
 
+// The map spans [-MAP_BOUND_X, MAP_BOUND_X] and the same for y
+#define MAP_BOUND_X 1.6
+#define MAP_BOUND_Y 1.0
+
 struct player_credentials {
     char name[MAX_CREDENTIAL_LEN];
     char password[MAX_CREDENTIAL_LEN];
@@ -164,6 +175,8 @@ struct game_config {
     char password[MAX_CREDENTIAL_LEN];
     int max_player_count;
     int min_player_count;
+    uint64_t rng_seed;    // 0 picks a random one
+    uint32_t state_epoch; // Same
 };
 
 enum game_state {
@@ -186,22 +199,40 @@ enum charsheet_form_fields {
 };
 /*
  * Networked Data structures.
- * Make sure to lock these properly with
- * respect to concurrent access from
- * multiple clients.
- * They each have their own threadlock mutex
- * set on creation.
- * TODO: Come up with a good system for concurrent access.
+ * These belong to their game's actor, only
+ * modify them from a command posted with
+ * game_actor_post(), see game_actor.h.
+ * The exceptions are the few atomics
+ * network threads read directly.
  */
 typedef int16_t player_id_t;
 
+/*
+ * Refers to a player without keeping a pointer
+ * around, the slot index in the low 16 bits and the
+ * slot's generation in the high 16 bits.
+ * Once the player leaves, the slot's generation
+ * changes and the handle stops resolving, even
+ * when someone else joins in the same slot.
+ */
+typedef uint32_t player_handle_t;
+#define INVALID_PLAYER_HANDLE 0
+
+static inline player_handle_t make_player_handle(player_id_t slot,
+                                                 uint16_t generation)
+{
+    return ((player_handle_t)generation << 16) | (uint16_t)slot;
+}
+
 struct player {
-    player_id_t id;
-    pthread_mutex_t threadlock;
-    struct host *associated_host;
+    player_id_t id; // The slot index
+    // Odd while the slot is in use, so no live
+    // handle is ever INVALID_PLAYER_HANDLE.
+    uint16_t generation;
+    struct host *associated_host; // Websocket connection, if any
     struct game *game;
     struct player_credentials credentials;
-    session_token_t session_token;
+    _Atomic(session_token_t) session_token;
     struct character_sheet char_sheet;
     struct coordinates coords;
     // How many of each ResourceID the player has
@@ -209,16 +240,20 @@ struct player {
     // Which encounter is the player currently
     // encountering, if any.
     enum encounter_id current_enc;
+    int action_points; // Left this turn
+    double km_walked;  // Into the kilometre they're walking
+    uint8_t missed_turns; // Turns in a row that timed out
 };
-/*
- * Lock the threadlock before modifying
- * game data.
- * The struct player has it's own threadlock
- * you should lock before you modify any of their
- * data.
- */
+
+// A delta as it went out, websocket header and all
+struct game_delta {
+    uint32_t seq; // 0 until the slot is used
+    uint8_t frame_size;
+    char frame[GAME_DELTA_FRAME_MAX];
+};
+
 struct game {
-    pthread_mutex_t threadlock;
+    struct game_actor actor;
     char name[MAX_CREDENTIAL_LEN];
     char password[MAX_CREDENTIAL_LEN];
     // Which player is currently
@@ -227,10 +262,42 @@ struct game {
     // and the first turn needs to be assigned.
     struct player *current_turn;
     enum game_state state;
-    int max_player_count;
+    int max_player_count; // How many slots "players" has
     int min_player_count;
-    struct player players[MAX_PLAYERS_IN_GAME];
-    atomic_int player_count;
+    // Bit N is set while players[N] is in use.
+    // Free slots are the clear bits, and network
+    // threads can read it to go over the live players.
+    _Atomic player_mask_t live_players;
+    // Next game in the same registry bucket
+    _Atomic(struct game *) registry_next;
+    // Runs out when the current turn does
+    struct game_timer turn_timer;
+    // Goes over the players' websockets while any
+    // are open, see sweep_idle_hosts()
+    struct game_timer idle_timer;
+    bool idle_sweep_armed;
+    // Connections that can still post to the game,
+    // see set_host_game()
+    atomic_int attached_hosts;
+    // delete_game() saw the actor idle once already
+    bool reclaim_drained;
+    // Every roll in the game comes from here, so
+    // replaying a recording rolls the same.
+    uint64_t rng_state;
+    // How the encounter odds shifted as the game
+    // was played, NULL until they do. See heatmap.h
+    struct heatmap_overlay *heat_overlay;
+    // Version of what the clients have been told,
+    // bumped on the actor for every delta. See wire.h
+    uint32_t state_seq;
+    // Random, so a client can't resume across restarts
+    uint32_t state_epoch;
+    // Delta seq N is in slot N % GAME_DELTA_RING_SIZE
+    struct game_delta recent_deltas[GAME_DELTA_RING_SIZE];
+    // See recorder.h, record_id is 0 when not recorded
+    uint32_t record_id;
+    uint64_t record_tick;
+    struct player players[]; // max_player_count of them
 };
 
 
@@ -238,7 +305,11 @@ void           set_game_password         (struct game *restrict game,
                                           const char password[static MAX_CREDENTIAL_LEN]);
 struct player *try_get_player_from_token (session_token_t token,
                                           struct game *restrict game);
+// Caller stays in epoch_enter() for as long as it uses the game
 struct game   *get_game_from_name        (const char name[static MAX_CREDENTIAL_LEN]);
+int            get_game_count            (void);
+typedef void (*game_visitor_t)(struct game *game, void *arg);
+void           for_each_game             (game_visitor_t visit, void *arg);
 // Character sheet setup stuff
 int            init_charsheet_from_form  (struct player *player,
                                           const struct html_form *form);
@@ -246,13 +317,68 @@ bool           is_charsheet_valid        (const struct player *restrict player);
 // Note: use initCharsheetFromForm.
 void           set_player_char_sheet     (struct player *player,
                                           const struct character_sheet *charsheet);
+// The game's own RNG, on the game's actor
+uint64_t       game_random_u64           (struct game *game);
+double         game_random_double        (struct game *game,
+                                          double min,
+                                          double max);
 /* --------------------------------------------- */
 
+// NULL if the name's taken or the player counts don't make sense
 struct game *create_game      (struct game_config *config);
+// Not from the game's actor, see game_logic.c
+void         delete_game      (struct game *game);
 void         try_start_game   (struct game *game);
 int          get_player_count (const struct game *game);
+// Passes the turn on from whoever's taking too long
+void         expire_turn      (struct game *game);
+// 0 turns the deadlines off, call before any game starts
+void         set_turn_timeout (int seconds);
+/*
+ * Restored games are mid turn with no deadline,
+ * call once they are, before the game workers run.
+ */
+void         resume_turn_deadlines(void);
 
+// NULL when the game is full
 struct player *create_player (struct game *game,
                               const struct player_credentials *credentials);
 void           delete_player (struct player *restrict player);
+// They did something, so they aren't AFK
+void           mark_player_active(struct player *player);
+struct player *restore_player(struct game *game,
+                              player_id_t slot,
+                              uint16_t generation,
+                              const struct player_credentials *credentials);
+
+player_handle_t get_player_handle      (const struct player *player);
+// NULL when the handle is stale
+struct player  *get_player_from_handle (struct game *game,
+                                        player_handle_t handle);
+
+/*
+ * Goes over the live players, e.g.
+ * for (player_mask_t slots = get_live_players(game); slots;) {
+ *     struct player *player = &game->players[pop_player_slot(&slots)];
+ * }
+ */
+static inline player_mask_t get_live_players(const struct game *game)
+{
+    return atomic_load_explicit(&game->live_players, memory_order_acquire);
+}
+
+// Every slot the game has, used or not
+static inline player_mask_t get_all_player_slots(const struct game *game)
+{
+    return game->max_player_count == 64
+               ? ~(player_mask_t)0
+               : ((player_mask_t)1 << game->max_player_count) - 1;
+}
+
+static inline int pop_player_slot(player_mask_t *slots)
+{
+    const int slot = __builtin_ctzll(*slots);
+    *slots &= *slots - 1;
+    return slot;
+}
 #endif
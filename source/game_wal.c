@@ -0,0 +1,323 @@
+/*
+ * ===========================
+ * game_wal.c
+ * ===========================
+ * Records are packed structs, players are found by
+ * game name and slot, and the slot's generation has
+ * to match, so a record for someone who left never
+ * lands on whoever took their slot.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "game_wal.h"
+
+struct wal_player_ref {
+    char game_name[MAX_CREDENTIAL_LEN];
+    int16_t slot;
+    uint16_t generation;
+} __attribute__((packed));
+
+struct wal_login {
+    struct wal_player_ref ref;
+    char name[MAX_CREDENTIAL_LEN];
+    char password[MAX_CREDENTIAL_LEN];
+    int64_t session_token;
+    double coords[3];
+} __attribute__((packed));
+
+struct wal_charsheet {
+    struct wal_player_ref ref;
+    int32_t gender;
+    uint32_t vigour;
+    uint32_t violence;
+    uint32_t cunning;
+    int32_t background;
+} __attribute__((packed));
+
+struct wal_move {
+    struct wal_player_ref ref;
+    double x;
+    double y;
+    int32_t action_points;
+    double km_walked;
+    int32_t current_enc;
+} __attribute__((packed));
+
+struct wal_turn {
+    char game_name[MAX_CREDENTIAL_LEN];
+    int32_t state;
+    int16_t current_turn; // Slot, or INVALID_PLAYER_ID
+} __attribute__((packed));
+
+struct wal_heat_shift {
+    char game_name[MAX_CREDENTIAL_LEN];
+    uint32_t shift_count; // The game's, once this one's in
+    int16_t col_min;
+    int16_t col_max;
+    int16_t row_min;
+    int16_t row_max;
+    int16_t type;
+    int16_t delta;
+} __attribute__((packed));
+
+typedef void (*replay_handler_t)(const char *data);
+
+static void replay_login     (const char *data);
+static void replay_charsheet (const char *data);
+static void replay_move      (const char *data);
+static void replay_turn      (const char *data);
+static void replay_heat_shift(const char *data);
+
+static const size_t record_sizes[GAME_WAL_RECORD_COUNT] = {
+    sizeof(struct wal_login),
+    sizeof(struct wal_charsheet),
+    sizeof(struct wal_move),
+    sizeof(struct wal_turn),
+    sizeof(struct wal_heat_shift),
+};
+
+static const replay_handler_t replay_handlers[GAME_WAL_RECORD_COUNT] = {
+    replay_login,
+    replay_charsheet,
+    replay_move,
+    replay_turn,
+    replay_heat_shift,
+};
+
+static void fill_player_ref(struct wal_player_ref *ref,
+                            const struct player *player)
+{
+    memcpy(ref->game_name, player->game->name, MAX_CREDENTIAL_LEN);
+    ref->slot       = player->id;
+    ref->generation = player->generation;
+}
+
+/*
+ * Logging, on the game's actor
+ * --------------------
+ */
+void log_player_login(const struct player *player)
+{
+    struct wal_login record = {0};
+    if (!wal_enabled()) {
+        return;
+    }
+    fill_player_ref(&record.ref, player);
+    memcpy(record.name, player->credentials.name, MAX_CREDENTIAL_LEN);
+    memcpy(record.password, player->credentials.password, MAX_CREDENTIAL_LEN);
+    record.session_token = atomic_load(&player->session_token);
+    record.coords[0]     = player->coords.x;
+    record.coords[1]     = player->coords.y;
+    record.coords[2]     = player->coords.z;
+    wal_append(GAME_WAL_LOGIN, &record, sizeof(record));
+}
+
+void log_player_charsheet(const struct player *player)
+{
+    struct wal_charsheet record = {0};
+    if (!wal_enabled()) {
+        return;
+    }
+    fill_player_ref(&record.ref, player);
+    record.gender     = player->char_sheet.gender;
+    record.vigour     = player->char_sheet.vigour;
+    record.violence   = player->char_sheet.violence;
+    record.cunning    = player->char_sheet.cunning;
+    record.background = player->char_sheet.background;
+    wal_append(GAME_WAL_CHARSHEET, &record, sizeof(record));
+}
+
+void log_player_move(const struct player *player)
+{
+    struct wal_move record = {0};
+    if (!wal_enabled()) {
+        return;
+    }
+    fill_player_ref(&record.ref, player);
+    record.x             = player->coords.x;
+    record.y             = player->coords.y;
+    record.action_points = player->action_points;
+    record.km_walked     = player->km_walked;
+    record.current_enc   = player->current_enc;
+    wal_append(GAME_WAL_MOVE, &record, sizeof(record));
+}
+
+void log_game_turn(const struct game *game)
+{
+    struct wal_turn record = {0};
+    if (!wal_enabled()) {
+        return;
+    }
+    memcpy(record.game_name, game->name, MAX_CREDENTIAL_LEN);
+    record.state = game->state;
+    record.current_turn =
+        game->current_turn ? game->current_turn->id : INVALID_PLAYER_ID;
+    wal_append(GAME_WAL_TURN, &record, sizeof(record));
+}
+
+void log_heatmap_shift(const struct game *game,
+                       const struct heatmap_shift *shift)
+{
+    struct wal_heat_shift record = {0};
+    if (!wal_enabled()) {
+        return;
+    }
+    memcpy(record.game_name, game->name, MAX_CREDENTIAL_LEN);
+    record.shift_count = game->heat_overlay->shift_count;
+    record.col_min     = shift->col_min;
+    record.col_max     = shift->col_max;
+    record.row_min     = shift->row_min;
+    record.row_max     = shift->row_max;
+    record.type        = shift->type;
+    record.delta       = shift->delta;
+    wal_append(GAME_WAL_HEAT_SHIFT, &record, sizeof(record));
+}
+
+/*
+ * Replay, before we're listening
+ * --------------------
+ */
+static struct player *find_player(const struct wal_player_ref *ref)
+{
+    struct game *game = get_game_from_name(ref->game_name);
+    if (!game) {
+        return NULL;
+    }
+    return get_player_from_handle(game,
+                                  make_player_handle(ref->slot,
+                                                     ref->generation));
+}
+
+static void replay_login(const char *data)
+{
+    struct player_credentials credentials = {0};
+    struct wal_login record;
+    memcpy(&record, data, sizeof(record));
+    struct game *game     = get_game_from_name(record.ref.game_name);
+    struct player *player = find_player(&record.ref);
+    if (!game) {
+        return;
+    }
+
+    if (!player) {
+        memcpy(credentials.name, record.name, MAX_CREDENTIAL_LEN);
+        memcpy(credentials.password, record.password, MAX_CREDENTIAL_LEN);
+        player = restore_player(game,
+                                record.ref.slot,
+                                record.ref.generation,
+                                &credentials);
+        if (!player) {
+            return;
+        }
+        player->coords.x = record.coords[0];
+        player->coords.y = record.coords[1];
+        player->coords.z = record.coords[2];
+    }
+    atomic_store(&player->session_token, record.session_token);
+}
+
+static void replay_charsheet(const char *data)
+{
+    struct wal_charsheet record;
+    memcpy(&record, data, sizeof(record));
+    struct player *player = find_player(&record.ref);
+    if (!player) {
+        return;
+    }
+    player->char_sheet.gender     = record.gender;
+    player->char_sheet.vigour     = record.vigour;
+    player->char_sheet.violence   = record.violence;
+    player->char_sheet.cunning    = record.cunning;
+    player->char_sheet.background = record.background;
+    atomic_store(&player->char_sheet.is_valid, true);
+}
+
+static void replay_move(const char *data)
+{
+    struct wal_move record;
+    memcpy(&record, data, sizeof(record));
+    struct player *player = find_player(&record.ref);
+    if (!player) {
+        return;
+    }
+    player->coords.x      = record.x;
+    player->coords.y      = record.y;
+    player->action_points = record.action_points;
+    player->km_walked     = record.km_walked;
+    player->current_enc   = record.current_enc;
+}
+
+static void replay_turn(const char *data)
+{
+    struct wal_turn record;
+    memcpy(&record, data, sizeof(record));
+    struct game *game = get_game_from_name(record.game_name);
+    if (!game) {
+        return;
+    }
+    const int slot = record.current_turn;
+    if (slot < 0 || slot >= game->max_player_count
+        || !(get_live_players(game) & ((player_mask_t)1 << slot))) {
+        game->current_turn = NULL;
+        game->state        = GAME_STATE_NOT_STARTED;
+        return;
+    }
+    // Turns are only logged when they're handed out
+    game->current_turn                = &game->players[slot];
+    game->current_turn->action_points = GAME_ACTION_POINTS;
+    game->state                       = record.state;
+}
+
+// Only the one right after what the game has
+static void replay_heat_shift(const char *data)
+{
+    struct wal_heat_shift record;
+    memcpy(&record, data, sizeof(record));
+    struct game *game = get_game_from_name(record.game_name);
+    if (!game) {
+        return;
+    }
+    const uint32_t shift_count =
+        game->heat_overlay ? game->heat_overlay->shift_count : 0;
+    if (record.shift_count != shift_count + 1) {
+        return;
+    }
+    const struct heatmap_shift shift = {.col_min = record.col_min,
+                                        .col_max = record.col_max,
+                                        .row_min = record.row_min,
+                                        .row_max = record.row_max,
+                                        .type    = record.type,
+                                        .delta   = record.delta};
+    shift_heatmap(game, &shift);
+}
+
+static void replay_record(uint8_t type,
+                          const char *data,
+                          size_t size,
+                          wal_lsn_t lsn)
+{
+    if (type >= GAME_WAL_RECORD_COUNT || size != record_sizes[type]) {
+        fprintf(stderr, "Skipping bad write-ahead log record %llu\n",
+                (unsigned long long)lsn);
+        return;
+    }
+    replay_handlers[type](data);
+}
+
+void game_wal_start(const char *path, wal_lsn_t after_lsn)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const int replayed = wal_recover(path, after_lsn, replay_record);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (replayed > 0) {
+        printf("Replayed %d write-ahead log records in %.2fms\n",
+               replayed,
+               (end.tv_sec - start.tv_sec) * 1000.0
+                   + (end.tv_nsec - start.tv_nsec) / 1000000.0);
+    }
+    wal_start(path);
+}
@@ -0,0 +1,51 @@
+/*
+ * ===========================
+ * game_wal.h
+ * ===========================
+ * What goes in the write-ahead log, and how it's
+ * applied back onto the games after a crash.
+ *
+ * We log what a command ended up changing, after
+ * it was validated, not the raw request, so replay
+ * doesn't need hosts, RNGs or validation and can
+ * just set state. Every record sets absolute
+ * values, so replaying one that's already in the
+ * snapshot does no harm. Heatmap shifts add up
+ * instead, so they're numbered and one that's
+ * already in is skipped.
+ *
+ * The log_* functions run on the game's actor,
+ * right after the change was made.
+ */
+
+#ifndef BB_GAME_WAL
+#define BB_GAME_WAL
+
+#include "game_logic.h"
+#include "heatmap.h"
+#include "wal.h"
+
+enum game_wal_record {
+    GAME_WAL_LOGIN,      // New player, or a new session token
+    GAME_WAL_CHARSHEET,
+    GAME_WAL_MOVE,
+    GAME_WAL_TURN,       // Game started, or the turn moved
+    GAME_WAL_HEAT_SHIFT, // Encounter odds shifted, see heatmap.h
+    GAME_WAL_RECORD_COUNT
+};
+
+void log_player_login    (const struct player *player);
+void log_player_charsheet(const struct player *player);
+void log_player_move     (const struct player *player);
+void log_game_turn       (const struct game *game);
+void log_heatmap_shift   (const struct game *game,
+                          const struct heatmap_shift *shift);
+
+/*
+ * Call after the snapshot's restored and before
+ * we're listening, replays everything after
+ * "after_lsn" and starts the log.
+ */
+void game_wal_start(const char *path, wal_lsn_t after_lsn);
+
+#endif
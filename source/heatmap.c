@@ -0,0 +1,537 @@
+/*
+ * ===========================
+ * heatmap.c
+ * ===========================
+ * The layers are resampled to HEATMAP_WIDTH by
+ * HEATMAP_HEIGHT when they're loaded, whatever the
+ * size of the image, so a lookup never has to care.
+ *
+ * Blending is done with GCC vector extensions,
+ * which come out as SSE2 on x86 and NEON on ARM,
+ * on 16 bit lanes with 7 bit fractions so that
+ * nothing overflows.
+ *
+ * A shift adds its delta to the overlay's grid of
+ * differences at the rectangle's four corners, and
+ * a cell's shift is the sum of the differences up
+ * and left of it. The Fenwick tree keeps both at
+ * log(rows) * log(cols) nodes, all of a node's
+ * lanes summed at once on lookups.
+ */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "heatmap.h"
+
+#define HEATMAP_TILES_X     (HEATMAP_WIDTH / HEATMAP_TILE)
+#define HEATMAP_TILE_PIXELS (HEATMAP_TILE * HEATMAP_TILE)
+#define HEATMAP_PIXELS      (HEATMAP_WIDTH * HEATMAP_HEIGHT)
+#define BLEND_BITS          7
+#define BLEND_ONE           (1 << BLEND_BITS)
+#define HEATMAP_PATH_MAX    512
+
+_Static_assert(HEATMAP_WIDTH % HEATMAP_TILE == 0
+                   && HEATMAP_HEIGHT % HEATMAP_TILE == 0,
+               "the map is made of whole tiles");
+
+// BMP headers, little endian
+#define BMP_MAGIC           0x4D42 // "BM"
+#define BMP_HEADER_SIZE     54     // File header and BITMAPINFOHEADER
+#define BMP_BI_RGB          0
+#define BMP_BI_BITFIELDS    3
+
+typedef uint8_t heat_u8x16 __attribute__((vector_size(HEATMAP_LANES)));
+typedef int16_t heat_i16x8 __attribute__((vector_size(HEATMAP_LANES)));
+typedef uint16_t heat_u16x8 __attribute__((vector_size(HEATMAP_LANES)));
+
+// Pixel channels in the order BMPs store them
+enum heatmap_channel {
+    HEATMAP_CHANNEL_BLUE,
+    HEATMAP_CHANNEL_GREEN,
+    HEATMAP_CHANNEL_RED,
+    HEATMAP_CHANNEL_ALPHA
+};
+
+struct heatmap_source {
+    const char *file; // NULL when the category has no layer
+    enum heatmap_channel channel;
+};
+
+/*
+ * Where every category's layer comes from.
+ * People, the wilds and the uncanny get an image each.
+ */
+static const struct heatmap_source heatmap_sources[ENCOUNTER_TYPE_COUNT] = {
+    [ENCOUNTER_TYPE_BANDIT]        = {"people.bmp", HEATMAP_CHANNEL_RED},
+    [ENCOUNTER_TYPE_SLAVERS]       = {"people.bmp", HEATMAP_CHANNEL_GREEN},
+    [ENCOUNTER_TYPE_REFUGEES]      = {"people.bmp", HEATMAP_CHANNEL_BLUE},
+    [ENCOUNTER_TYPE_EXILES]        = {"people.bmp", HEATMAP_CHANNEL_ALPHA},
+    [ENCOUNTER_TYPE_BEASTS]        = {"wilds.bmp", HEATMAP_CHANNEL_RED},
+    [ENCOUNTER_TYPE_MONSTROSITIES] = {"wilds.bmp", HEATMAP_CHANNEL_GREEN},
+    [ENCOUNTER_TYPE_DRAGON]        = {"wilds.bmp", HEATMAP_CHANNEL_BLUE},
+    [ENCOUNTER_TYPE_PLAGUE]        = {"wilds.bmp", HEATMAP_CHANNEL_ALPHA},
+    [ENCOUNTER_TYPE_MYSTICAL]      = {"uncanny.bmp", HEATMAP_CHANNEL_RED},
+    [ENCOUNTER_TYPE_CULTISTS]      = {"uncanny.bmp", HEATMAP_CHANNEL_GREEN}};
+
+// Tile after tile, row by row within each
+static struct heatmap_weights pixels[HEATMAP_PIXELS];
+static bool heatmaps_loaded = false;
+
+static inline int get_pixel_index(int x, int y)
+{
+    const int tile = (y / HEATMAP_TILE) * HEATMAP_TILES_X + x / HEATMAP_TILE;
+    return tile * HEATMAP_TILE_PIXELS + (y % HEATMAP_TILE) * HEATMAP_TILE
+           + x % HEATMAP_TILE;
+}
+
+// Every category flat, then the layers go on top
+static void init_pixels(void)
+{
+    if (heatmaps_loaded) {
+        return;
+    }
+    memset(pixels, HEATMAP_FULL, sizeof(pixels));
+    heatmaps_loaded = true;
+}
+
+void set_heatmap_layer(enum encounter_type_id type,
+                       const uint8_t *grey,
+                       int width,
+                       int height)
+{
+    init_pixels();
+    for (int y = 0; y < HEATMAP_HEIGHT; y++) {
+        const uint8_t *row =
+            &grey[(size_t)(y * height / HEATMAP_HEIGHT) * width];
+        for (int x = 0; x < HEATMAP_WIDTH; x++) {
+            pixels[get_pixel_index(x, y)].lanes[type] =
+                HEATMAP_FULL - row[x * width / HEATMAP_WIDTH];
+        }
+    }
+}
+
+/*
+ * Loading
+ * --------------------
+ */
+static uint32_t read_u32(const uint8_t *data)
+{
+    return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static uint16_t read_u16(const uint8_t *data)
+{
+    return (uint16_t)(data[0] | data[1] << 8);
+}
+
+/*
+ * Pulls one channel out of a BMP into "out", top row
+ * first. Returns -1 if it isn't a BMP we can read.
+ */
+static int read_bmp_channel(const uint8_t *data,
+                            size_t size,
+                            enum heatmap_channel channel,
+                            uint8_t **out,
+                            int *out_width,
+                            int *out_height)
+{
+    if (size < BMP_HEADER_SIZE || read_u16(data) != BMP_MAGIC) {
+        return -1;
+    }
+    const uint32_t pixel_offset = read_u32(&data[10]);
+    const int32_t width         = (int32_t)read_u32(&data[18]);
+    const int32_t height        = (int32_t)read_u32(&data[22]);
+    const uint16_t bits         = read_u16(&data[28]);
+    const uint32_t compression  = read_u32(&data[30]);
+    const int bytes_per_pixel   = bits / 8;
+    // Negative heights are stored top row first
+    const int rows              = height < 0 ? -height : height;
+
+    if (width <= 0 || rows == 0 || (bits != 24 && bits != 32)
+        || (compression != BMP_BI_RGB && compression != BMP_BI_BITFIELDS)
+        || (int)channel >= bytes_per_pixel) {
+        return -1;
+    }
+    const size_t stride = ((size_t)width * bits + 31) / 32 * 4;
+    if (pixel_offset > size || stride * rows > size - pixel_offset) {
+        return -1;
+    }
+    uint8_t *grey = malloc((size_t)width * rows);
+    if (!grey) {
+        print_error(BB_ERR_MALLOC);
+        exit(1);
+    }
+    for (int y = 0; y < rows; y++) {
+        const int file_row = height < 0 ? y : rows - 1 - y;
+        const uint8_t *row = &data[pixel_offset + file_row * stride];
+        for (int x = 0; x < width; x++) {
+            grey[(size_t)y * width + x] = row[x * bytes_per_pixel + channel];
+        }
+    }
+    *out        = grey;
+    *out_width  = width;
+    *out_height = rows;
+    return 0;
+}
+
+// Returns 0 when there's no such image
+static int load_heatmap_layer(const char *directory,
+                              enum encounter_type_id type)
+{
+    const struct heatmap_source *source = &heatmap_sources[type];
+    char path[HEATMAP_PATH_MAX];
+    struct stat file_stat;
+    uint8_t *data = NULL;
+    uint8_t *grey = NULL;
+    int width     = 0;
+    int height    = 0;
+    int fd        = -1;
+    int ret       = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", directory, source->file);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        close(fd);
+        goto exit_error;
+    }
+    data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        goto exit_error;
+    }
+    ret = read_bmp_channel(
+        data, file_stat.st_size, source->channel, &grey, &width, &height);
+    munmap(data, file_stat.st_size);
+    if (ret != 0) {
+        goto exit_error;
+    }
+    set_heatmap_layer(type, grey, width, height);
+    free(grey);
+    return 1;
+
+exit_error:
+    fprintf(stderr, "Couldn't read heatmap %s\n", path);
+    return -1;
+}
+
+int load_heatmaps(const char *directory)
+{
+    int layers = 0;
+    init_pixels();
+    for (int type = 0; type < ENCOUNTER_TYPE_COUNT; type++) {
+        if (!heatmap_sources[type].file) {
+            continue;
+        }
+        const int ret = load_heatmap_layer(directory, type);
+        if (ret < 0) {
+            return -1;
+        }
+        layers += ret;
+    }
+    printf("Loaded %d heatmap layers from %s\n", layers, directory);
+    return 0;
+}
+
+/*
+ * Lookups
+ * --------------------
+ */
+static inline heat_u8x16 load_pixel(int x, int y)
+{
+    heat_u8x16 pixel;
+    memcpy(&pixel, &pixels[get_pixel_index(x, y)], sizeof(pixel));
+    return pixel;
+}
+
+/*
+ * Widens half the lanes to 16 bits, keeping to 16
+ * byte vectors, which every target passes around
+ * in a register.
+ */
+#define HEAT_LOW(pixel)                                                      \
+    __builtin_convertvector(                                                 \
+        __builtin_shufflevector(pixel, pixel, 0, 1, 2, 3, 4, 5, 6, 7),       \
+        heat_i16x8)
+#define HEAT_HIGH(pixel)                                                     \
+    __builtin_convertvector(                                                 \
+        __builtin_shufflevector(pixel, pixel, 8, 9, 10, 11, 12, 13, 14, 15), \
+        heat_i16x8)
+// And back, the lanes have to be in [0, 255] already
+#define HEAT_NARROW(low, high)                                               \
+    __builtin_convertvector(                                                 \
+        __builtin_shufflevector(                                             \
+            low, high, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), \
+        heat_u8x16)
+
+// Bilinear, the fractions are out of BLEND_ONE
+static inline heat_i16x8 blend(heat_i16x8 top_left,
+                               heat_i16x8 top_right,
+                               heat_i16x8 bottom_left,
+                               heat_i16x8 bottom_right,
+                               int16_t fx,
+                               int16_t fy)
+{
+    const heat_i16x8 top =
+        top_left + (((top_right - top_left) * fx) >> BLEND_BITS);
+    const heat_i16x8 bottom =
+        bottom_left + (((bottom_right - bottom_left) * fx) >> BLEND_BITS);
+    return top + (((bottom - top) * fy) >> BLEND_BITS);
+}
+
+// Fixed point pixel coordinate, clamped to the map
+static inline int to_pixel(double position, double bound, int pixels_across)
+{
+    // Folds into one multiply, no division
+    const double scaled =
+        (position + bound) * ((pixels_across - 1) * BLEND_ONE / (2 * bound));
+    if (!(scaled > 0)) { // NaN too
+        return 0;
+    }
+    const int max = (pixels_across - 1) * BLEND_ONE;
+    return scaled >= max ? max : (int)scaled;
+}
+
+void get_heatmap_weights(const struct coordinates *coords,
+                         struct heatmap_weights *out)
+{
+    if (!heatmaps_loaded) {
+        memset(out, HEATMAP_FULL, sizeof(*out));
+        return;
+    }
+    // Rows go from north to south
+    const int fixed_x = to_pixel(coords->x, MAP_BOUND_X, HEATMAP_WIDTH);
+    const int fixed_y = to_pixel(-coords->y, MAP_BOUND_Y, HEATMAP_HEIGHT);
+    const int x0      = fixed_x >> BLEND_BITS;
+    const int y0      = fixed_y >> BLEND_BITS;
+    const int x1      = x0 + (x0 < HEATMAP_WIDTH - 1);
+    const int y1      = y0 + (y0 < HEATMAP_HEIGHT - 1);
+    const int16_t fx  = fixed_x & (BLEND_ONE - 1);
+    const int16_t fy  = fixed_y & (BLEND_ONE - 1);
+
+    const heat_u8x16 top_left     = load_pixel(x0, y0);
+    const heat_u8x16 top_right    = load_pixel(x1, y0);
+    const heat_u8x16 bottom_left  = load_pixel(x0, y1);
+    const heat_u8x16 bottom_right = load_pixel(x1, y1);
+    const heat_i16x8 low          = blend(HEAT_LOW(top_left),
+                                 HEAT_LOW(top_right),
+                                 HEAT_LOW(bottom_left),
+                                 HEAT_LOW(bottom_right),
+                                 fx,
+                                 fy);
+    const heat_i16x8 high         = blend(HEAT_HIGH(top_left),
+                                  HEAT_HIGH(top_right),
+                                  HEAT_HIGH(bottom_left),
+                                  HEAT_HIGH(bottom_right),
+                                  fx,
+                                  fy);
+    const heat_u8x16 weights      = HEAT_NARROW(low, high);
+    memcpy(out, &weights, sizeof(*out));
+}
+
+static inline int to_cell(double position, double bound, int pixels_across)
+{
+    return (to_pixel(position, bound, pixels_across) >> BLEND_BITS)
+           / HEATMAP_TILE;
+}
+
+// Clamps to [0, HEATMAP_FULL]
+static inline heat_i16x8 clamp_weights(heat_i16x8 lanes)
+{
+    const heat_i16x8 full = (heat_i16x8){0} + HEATMAP_FULL;
+    const heat_i16x8 over = lanes > full;
+    lanes &= lanes > 0;
+    return (lanes & ~over) | (full & over);
+}
+
+void get_game_heatmap_weights(const struct game *game,
+                              const struct coordinates *coords,
+                              struct heatmap_weights *out)
+{
+    const struct heatmap_overlay *overlay = game->heat_overlay;
+    heat_u16x8 low                        = {0};
+    heat_u16x8 high                       = {0};
+    heat_u16x8 half;
+    heat_u8x16 base;
+
+    get_heatmap_weights(coords, out);
+    if (!overlay) {
+        return;
+    }
+    const int col = to_cell(coords->x, MAP_BOUND_X, HEATMAP_WIDTH);
+    const int row = to_cell(-coords->y, MAP_BOUND_Y, HEATMAP_HEIGHT);
+    for (int r = row + 1; r > 0; r -= r & -r) {
+        for (int c = col + 1; c > 0; c -= c & -c) {
+            const struct heatmap_node *node =
+                &overlay->nodes[(r - 1) * HEATMAP_OVERLAY_COLS + c - 1];
+            memcpy(&half, node->lanes, sizeof(half));
+            low += half;
+            memcpy(&half, &node->lanes[HEATMAP_LANES / 2], sizeof(half));
+            high += half;
+        }
+    }
+    memcpy(&base, out, sizeof(base));
+    const heat_u8x16 weights =
+        HEAT_NARROW(clamp_weights(HEAT_LOW(base) + (heat_i16x8)low),
+                    clamp_weights(HEAT_HIGH(base) + (heat_i16x8)high));
+    memcpy(out, &weights, sizeof(*out));
+}
+
+/*
+ * Shifts
+ * --------------------
+ */
+struct heatmap_overlay *get_heatmap_overlay(struct game *game)
+{
+    if (game->heat_overlay) {
+        return game->heat_overlay;
+    }
+    game->heat_overlay = calloc(1, sizeof(*game->heat_overlay));
+    if (!game->heat_overlay) {
+        print_error(BB_ERR_MALLOC);
+        exit(1);
+    }
+    return game->heat_overlay;
+}
+
+void make_heatmap_shift(const struct coordinates *coords,
+                        double radius,
+                        enum encounter_type_id type,
+                        int delta,
+                        struct heatmap_shift *out)
+{
+    // Rows go from north to south
+    out->col_min = to_cell(coords->x - radius, MAP_BOUND_X, HEATMAP_WIDTH);
+    out->col_max = to_cell(coords->x + radius, MAP_BOUND_X, HEATMAP_WIDTH);
+    out->row_min = to_cell(-coords->y - radius, MAP_BOUND_Y, HEATMAP_HEIGHT);
+    out->row_max = to_cell(-coords->y + radius, MAP_BOUND_Y, HEATMAP_HEIGHT);
+    out->type    = type;
+    out->delta   = delta < -HEATMAP_FULL ? -HEATMAP_FULL
+                 : delta > HEATMAP_FULL  ? HEATMAP_FULL
+                                         : delta;
+}
+
+// Adds "delta" to the difference at (row, col)
+static void add_difference(struct heatmap_overlay *overlay,
+                           int row,
+                           int col,
+                           int lane,
+                           int delta)
+{
+    if (row >= HEATMAP_OVERLAY_ROWS || col >= HEATMAP_OVERLAY_COLS) {
+        return;
+    }
+    for (int r = row + 1; r <= HEATMAP_OVERLAY_ROWS; r += r & -r) {
+        for (int c = col + 1; c <= HEATMAP_OVERLAY_COLS; c += c & -c) {
+            overlay->nodes[(r - 1) * HEATMAP_OVERLAY_COLS + c - 1]
+                .lanes[lane] += (uint16_t)delta;
+        }
+    }
+}
+
+// The cell's own shift in "lane", what a lookup adds up
+static int get_cell_shift(const struct heatmap_overlay *overlay,
+                          int row,
+                          int col,
+                          int lane)
+{
+    uint16_t sum = 0;
+    for (int r = row + 1; r > 0; r -= r & -r) {
+        for (int c = col + 1; c > 0; c -= c & -c) {
+            sum += overlay->nodes[(r - 1) * HEATMAP_OVERLAY_COLS + c - 1]
+                       .lanes[lane];
+        }
+    }
+    return (int16_t)sum;
+}
+
+/*
+ * Copies the part of "shift" that's on the map to
+ * "out". Returns false if none of it is, or its type
+ * isn't a category. Shifts come back from the
+ * write-ahead log too, so they're checked here.
+ */
+static bool clip_shift(const struct heatmap_shift *shift,
+                       struct heatmap_shift *out)
+{
+    *out = *shift;
+    if (out->col_min < 0) {
+        out->col_min = 0;
+    }
+    if (out->row_min < 0) {
+        out->row_min = 0;
+    }
+    if (out->col_max >= HEATMAP_OVERLAY_COLS) {
+        out->col_max = HEATMAP_OVERLAY_COLS - 1;
+    }
+    if (out->row_max >= HEATMAP_OVERLAY_ROWS) {
+        out->row_max = HEATMAP_OVERLAY_ROWS - 1;
+    }
+    return out->type > ENCOUNTER_TYPE_NONE
+           && out->type < ENCOUNTER_TYPE_COUNT
+           && out->col_min <= out->col_max
+           && out->row_min <= out->row_max;
+}
+
+/*
+ * Every cell's already within HEATMAP_SHIFT_MAX, so
+ * the room left in each of them brackets 0, and so
+ * does the tightest of them.
+ */
+bool saturate_heatmap_shift(const struct game *game,
+                            struct heatmap_shift *shift)
+{
+    const struct heatmap_overlay *overlay = game->heat_overlay;
+    struct heatmap_shift clipped;
+    int delta = shift->delta;
+
+    if (!clip_shift(shift, &clipped)) {
+        return false;
+    }
+    for (int row = clipped.row_min; overlay && row <= clipped.row_max;
+         row++) {
+        for (int col = clipped.col_min; col <= clipped.col_max; col++) {
+            const int cell = get_cell_shift(overlay, row, col, clipped.type);
+            if (cell + delta > HEATMAP_SHIFT_MAX) {
+                delta = HEATMAP_SHIFT_MAX - cell;
+            }
+            else if (cell + delta < -HEATMAP_SHIFT_MAX) {
+                delta = -HEATMAP_SHIFT_MAX - cell;
+            }
+        }
+    }
+    shift->delta = delta;
+    return delta != 0;
+}
+
+bool shift_heatmap(struct game *game, const struct heatmap_shift *shift)
+{
+    struct heatmap_shift clipped;
+    if (!clip_shift(shift, &clipped)) {
+        return false;
+    }
+    const int row_min = clipped.row_min;
+    const int row_max = clipped.row_max;
+    const int col_min = clipped.col_min;
+    const int col_max = clipped.col_max;
+    const int type    = clipped.type;
+    const int delta   = clipped.delta;
+
+    struct heatmap_overlay *overlay = get_heatmap_overlay(game);
+    add_difference(overlay, row_min, col_min, type, delta);
+    add_difference(overlay, row_min, col_max + 1, type, -delta);
+    add_difference(overlay, row_max + 1, col_min, type, -delta);
+    add_difference(overlay, row_max + 1, col_max + 1, type, delta);
+    overlay->shift_count++;
+    return true;
+}
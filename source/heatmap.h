@@ -0,0 +1,154 @@
+/*
+ * ===========================
+ * heatmap.h
+ * ===========================
+ * How much of each encounter category's odds are
+ * left at a spot on the map, one greyscale layer
+ * per category. As in the project plan, white is
+ * 0.0 and black is 1.0.
+ *
+ * The layers come from uncompressed 24 or 32 bit
+ * BMPs, with a category per colour channel, so one
+ * image holds up to four of them. Which category is
+ * in which image and channel is in heatmap.c.
+ * Categories without a layer weigh 1.0 everywhere.
+ *
+ * In memory every pixel holds the weights of all
+ * the categories next to each other, as bytes, and
+ * pixels are grouped into square tiles. A lookup is
+ * four 16 byte loads, usually from the same tile,
+ * blended into the full weight vector at once.
+ *
+ * On top of that every game can shift the odds
+ * around a spot as it's played, killing bandits
+ * makes bandits rarer nearby and so on. Shifts go
+ * into an overlay with a cell per tile, a 2D
+ * Fenwick tree over the differences between
+ * neighbouring cells, so shifting a rectangle of
+ * cells and looking up one cell are both a few
+ * dozen node visits however big the rectangle.
+ */
+
+#ifndef BB_HEATMAP
+#define BB_HEATMAP
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "game_logic.h"
+
+#define HEATMAP_WIDTH  256
+#define HEATMAP_HEIGHT 160 // Same aspect as the map
+#define HEATMAP_TILE   4   // Pixels a side
+#define HEATMAP_LANES  16  // Categories, padded to a vector
+#define HEATMAP_FULL   255 // A weight of 1.0
+
+// How far a cell can be shifted either way, see below
+#define HEATMAP_SHIFT_MAX (2 * HEATMAP_FULL)
+
+#define HEATMAP_OVERLAY_COLS  (HEATMAP_WIDTH / HEATMAP_TILE)
+#define HEATMAP_OVERLAY_ROWS  (HEATMAP_HEIGHT / HEATMAP_TILE)
+#define HEATMAP_OVERLAY_CELLS (HEATMAP_OVERLAY_COLS * HEATMAP_OVERLAY_ROWS)
+
+_Static_assert(ENCOUNTER_TYPE_COUNT <= HEATMAP_LANES,
+               "every category has a lane");
+
+// Indexed by encounter_type_id
+struct heatmap_weights {
+    uint8_t lanes[HEATMAP_LANES];
+} __attribute__((aligned(16)));
+
+/*
+ * At startup, before the game workers run.
+ * Missing images leave their categories flat.
+ * Returns -1 if an image is there but unreadable.
+ */
+int  load_heatmaps(const char *directory);
+/*
+ * Replaces a category's layer with "grey", "width"
+ * by "height" bytes, row by row from the top (north),
+ * 0 is a weight of 1.0 like black in the images.
+ * Same rules as load_heatmaps().
+ */
+void set_heatmap_layer(enum encounter_type_id type,
+                       const uint8_t *grey,
+                       int width,
+                       int height);
+
+/*
+ * Fenwick tree nodes, wrapping 16 bit sums so that
+ * a cell comes out right as long as its own shift
+ * fits in an int16_t, whatever the nodes add up to.
+ * saturate_heatmap_shift() keeps every cell within
+ * HEATMAP_SHIFT_MAX, past that the weight's clamped
+ * anyway, and it leaves room to shift back from it.
+ */
+struct heatmap_node {
+    uint16_t lanes[HEATMAP_LANES];
+} __attribute__((aligned(16)));
+
+/*
+ * A game's shifts, owned by its actor.
+ * Allocated on the first shift, a game without one
+ * just has the base odds.
+ */
+struct heatmap_overlay {
+    // Shifts applied so far, so the write-ahead
+    // log can tell which ones are already in
+    uint32_t shift_count;
+    struct heatmap_node nodes[HEATMAP_OVERLAY_CELLS];
+};
+
+// The cells in [col_min, col_max] x [row_min, row_max]
+struct heatmap_shift {
+    int16_t col_min;
+    int16_t col_max;
+    int16_t row_min;
+    int16_t row_max;
+    int16_t type;  // encounter_type_id
+    int16_t delta; // Out of HEATMAP_FULL, added to the weight
+};
+
+// Blends the four pixels around "coords", any thread
+void get_heatmap_weights(const struct coordinates *coords,
+                         struct heatmap_weights *out);
+// Same, with the game's shifts added, on its actor
+void get_game_heatmap_weights(const struct game *game,
+                              const struct coordinates *coords,
+                              struct heatmap_weights *out);
+
+// The cells within "radius" of "coords" either way
+void make_heatmap_shift(const struct coordinates *coords,
+                        double radius,
+                        enum encounter_type_id type,
+                        int delta,
+                        struct heatmap_shift *out);
+/*
+ * Cuts the shift's delta down so no cell it covers
+ * ends up shifted past HEATMAP_SHIFT_MAX either way.
+ * Returns false if there's nothing left to shift.
+ * On the game's actor.
+ */
+bool saturate_heatmap_shift(const struct game *game,
+                            struct heatmap_shift *shift);
+/*
+ * On the game's actor, or before it's running.
+ * Returns false, and changes nothing, if the shift
+ * is all off the map or its type isn't a category.
+ */
+bool shift_heatmap    (struct game *game, const struct heatmap_shift *shift);
+// Allocates the game's overlay if it has none yet
+struct heatmap_overlay *get_heatmap_overlay(struct game *game);
+
+// Shifts that cancelled out leave nodes at 0
+static inline bool is_heatmap_node_set(const struct heatmap_node *node)
+{
+    for (int i = 0; i < HEATMAP_LANES; i++) {
+        if (node->lanes[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
@@ -8,6 +8,9 @@
 
 #include "error_handling.h"
 #include "helpers.h"
+#include "mem_pool.h"
+
+#define STRING_SEARCH_STACK_PATTERN_LEN 64
 
 static void string_search_compute_lps(const char *pattern, int m, int *lps)
 {
@@ -65,10 +68,12 @@ int string_search(const char *text, const char *pattern, int max_length)
 {
     int text_length = strnlen(text, max_length);
     int pat_length  = strnlen(pattern, max_length);
-    int *lps        = malloc(sizeof(*lps) * pat_length);
-    if (!lps) {
-        exit(1);
-    }
+    int lps_buf[STRING_SEARCH_STACK_PATTERN_LEN];
+    // Our patterns are short literals, anything longer
+    // goes in the thread's scratch arena.
+    int *lps = pat_length <= STRING_SEARCH_STACK_PATTERN_LEN
+                   ? lps_buf
+                   : arena_alloc(sizeof(*lps) * pat_length);
 
     string_search_compute_lps(pattern, pat_length, lps);
 
@@ -79,7 +84,6 @@ int string_search(const char *text, const char *pattern, int max_length)
             i++;
         }
         if (j == pat_length) {
-            free(lps);
             return i - j;
         }
         else if (i < text_length && pattern[j] != text[i]) {
@@ -91,7 +95,6 @@ int string_search(const char *text, const char *pattern, int max_length)
             }
         }
     }
-    free(lps);
     return -1;
 }
 
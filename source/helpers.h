@@ -48,6 +48,7 @@ void parse_html_form(const char *in_buffer,
                      ssize_t in_buffer_len);
 void check_data_sizes();
 bool is_empty_string(const char *string);
+unsigned int hash_data_simple(const char *data, size_t data_len);
 
 double clamp(double x, double min, double max);
 
@@ -1,7 +1,13 @@
 #ifndef BB_HOST_CUSTOM_ATTRIBUTES
 #define BB_HOST_CUSTOM_ATTRIBUTES
 
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "executor.h"
 #include "game_logic.h"
+#include "net_backend.h"
 #include "packet_handlers.h"
 
 /*
@@ -13,13 +19,59 @@
 struct host_custom_attr {
     enum handler handler;  // Which handler should be called when receiving a
                            // packet from this host
-    struct player *player; // Which player this host controls
+    player_handle_t player; // Which player this host controls
+    struct game *game;      // Set once we've posted to this game's actor,
+                            // see set_host_game()
+    struct executor_group tasks; // HTTP requests still being handled
+    // One for the connection and one per HTTP request
+    // still being handled, see put_host_attr()
+    atomic_int refs;
+    // When a websocket frame last came in, see host_clock_ms().
+    // Written by the network thread, read by the idle sweep.
+    atomic_uint_fast64_t last_seen_ms;
 };
 
+/*
+ * Only good to about a scheduler tick, which is
+ * plenty for idle timeouts in the seconds, and it's
+ * cheap enough to read on every frame.
+ */
+static inline uint64_t host_clock_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline void mark_host_seen(struct host_custom_attr *attr)
+{
+    atomic_store_explicit(&attr->last_seen_ms,
+                          host_clock_ms(),
+                          memory_order_relaxed);
+}
+
+/*
+ * Keeps the game from being freed under the host,
+ * until game_disconnect_handler() lets go of it.
+ * Caller is in epoch_enter(), where it found "game".
+ */
+static inline void set_host_game(struct host_custom_attr *attr,
+                                 struct game *game)
+{
+    if (!attr->game) {
+        atomic_fetch_add(&game->attached_hosts, 1);
+        attr->game = game;
+    }
+}
+
+/*
+ * NULL once the player left the game, even if
+ * someone else got their slot since.
+ */
 static inline struct player *get_player_from_host(struct host *remotehost)
 {
-    struct host_custom_attr *attr = get_host_custom_attr(remotehost);
-    return attr->player;
+    struct host_custom_attr *attr = net_get_host_custom_attr(remotehost);
+    return get_player_from_handle(attr->game, attr->player);
 }
 
 #endif
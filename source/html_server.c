@@ -10,6 +10,11 @@
 #include "file_handling.h"
 #include "helpers.h"
 #include "html_server.h"
+#include "mem_pool.h"
+#include "net_backend.h"
+
+// Responses up to this size are sent in one go
+#define SEND_CONTENT_COPY_MAX (32 * 1024)
 
 #define FILE_EXTENSION_LEN 16
 
@@ -22,16 +27,17 @@ static const char content_type_strings[HTTP_FLAG_COUNT][STATUS_LENGTH] =
      "image/png\r\n",
      "image/bmp\r\n",
      "text/javascript\r\n",
-     "text/css\r\n"};
+     "text/css\r\n",
+     "text/plain; version=0.0.4\r\n"};
 static const char content_type_mapping[HTTP_FLAG_COUNT][FILE_EXTENSION_LEN] =
-    {"html", "jpg", "png", "bmp", "js", "css"};
+    {"html", "jpg", "png", "bmp", "js", "css", "txt"};
 
 void send_forbidden_packet(struct host *remotehost)
 {
     const char *data = "HTTP/1.1 403 Forbidden\r\n"
                        "Content-Type: text/html\r\n"
                        "Content-Length: 0\r\n\r\n";
-    send_data_tcp(data, strlen(data), remotehost);
+    net_send(data, strlen(data), remotehost);
     return;
 }
 void send_bad_request_packet(struct host *remotehost)
@@ -39,7 +45,7 @@ void send_bad_request_packet(struct host *remotehost)
     const char *data = "HTTP/1.1 400 Bad Request\r\n"
                        "Content-Type: text/html\r\n"
                        "Content-Length: 0\r\n\r\n";
-    send_data_tcp(data, strlen(data), remotehost);
+    net_send(data, strlen(data), remotehost);
     return;
 }
 static const char *get_content_type_string(enum http_content_type type)
@@ -121,6 +127,26 @@ void send_content(char *dir,
                   enum http_content_type type,
                   struct host *remotehost,
                   const char *custom_headers)
+{
+    char *content   = NULL;
+    int content_len = 0;
+
+    content_len = get_file_data(dir, &content);
+    if (content_len < 0) {
+        print_error(BB_ERR_FILE_NOT_FOUND);
+        if (!content) {
+            free(content);
+        }
+        return;
+    }
+    send_buffer(content, content_len, type, remotehost, custom_headers);
+}
+
+void send_buffer(const char *content,
+                 int content_len,
+                 enum http_content_type type,
+                 struct host *remotehost,
+                 const char *custom_headers)
 {
     char header[HEADER_PACKET_LENGTH]            = {0};
     unsigned long header_len                     = 0;
@@ -130,20 +156,10 @@ void send_content(char *dir,
     const char cors_header[HEADER_LENGTH] =
         "Access-Control-Allow-Origin: *\r\n";
 
-    char *content               = NULL;
-    int content_len             = 0;
     char len_str[STATUS_LENGTH] = {0};
     char *packet                = NULL;
     int packet_len              = 0;
 
-    content_len = get_file_data(dir, &content);
-    if (content_len < 0) {
-        print_error(BB_ERR_FILE_NOT_FOUND);
-        if (!content) {
-            free(content);
-        }
-        return;
-    }
     sprintf(len_str, "%d\r\n", content_len);
 
     // Status:
@@ -169,16 +185,18 @@ void send_content(char *dir,
     // ------ Header Over -----------//
 
     packet_len = header_len + content_len;
-    packet = malloc((header_len * sizeof(char)) + (content_len * sizeof(char)));
-    if (!packet) {
-        print_error(BB_ERR_MALLOC);
-        exit(1);
+    // Big files go out without copying them,
+    // the body fills whole segments anyway.
+    if (packet_len > SEND_CONTENT_COPY_MAX) {
+        net_send(header, header_len, remotehost);
+        net_send(content, content_len, remotehost);
+        return;
     }
+    // Scratch memory, net_send() copies it
+    packet = arena_alloc((header_len * sizeof(char)) + (content_len * sizeof(char)));
 
     memcpy(packet, header, header_len);
     memcpy(&packet[header_len], content, content_len);
 
-    send_data_tcp(packet, packet_len, remotehost);
-
-    free(packet);
+    net_send(packet, packet_len, remotehost);
 }
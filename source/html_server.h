@@ -20,6 +20,7 @@ enum http_content_type {
     HTTP_FLAG_IMAGE_BMP,
     HTTP_FLAG_TEXT_JAVASCRIPT,
     HTTP_FLAG_TEXT_CSS,
+    HTTP_FLAG_TEXT_PLAIN,
     HTTP_FLAG_COUNT
 };
 
@@ -27,6 +28,12 @@ void send_content(char *dir,
                   enum http_content_type type,
                   struct host *remotehost,
                   const char *custom_headers);
+// Same as send_content(), for something that isn't a file
+void send_buffer(const char *content,
+                 int content_len,
+                 enum http_content_type type,
+                 struct host *remotehost,
+                 const char *custom_headers);
 void send_forbidden_packet(struct host *remotehost);
 void send_bad_request_packet(struct host *remotehost);
 
@@ -1,42 +1,338 @@
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "bbnetlib.h"
+#include "executor.h"
 #include "game_logic.h"
+#include "game_wal.h"
+#include "heatmap.h"
 #include "helpers.h"
 #include "html_server.h"
+#include "metrics.h"
+#include "net_backend.h"
+#include "recorder.h"
 #include "packet_handlers.h"
+#include "snapshot.h"
+#include "timer_wheel.h"
+#include "trace.h"
+#include "websocket_handlers.h"
 
-struct host *localhost = NULL;
+#define SERVER_IP   "0.0.0.0"
+#define SERVER_PORT 7676
 
-int main(void)
+#define TEST_GAME_MAX_PLAYERS 4
+#define TEST_GAME_MIN_PLAYERS 2
+
+static void print_usage(const char *program_name)
+{
+    fprintf(stderr,
+            "Usage: %s [--net-backend=io_uring|epoll|bbnetlib]\n"
+            "          [--reactors=N] [--pin-cpus] [--game-affinity]\n"
+            "          [--game-workers=N] [--http-workers=N]\n"
+            "          [--max-players=N]\n"
+            "          [--snapshot=FILE] [--snapshot-interval=SECONDS]\n"
+            "          [--snapshot-discard]\n"
+            "          [--wal=FILE] [--record=FILE]\n"
+            "          [--metrics-token=TOKEN] [--trace=FILE]\n"
+            "          [--turn-timeout=SECONDS] [--idle-timeout=SECONDS]\n"
+            "          [--heatmaps=DIR]\n"
+            "\n"
+            "  --reactors=N     Reactor threads for io_uring/epoll,\n"
+            "                   defaults to one per CPU.\n"
+            "  --pin-cpus       Pin each reactor thread to its own CPU.\n"
+            "  --game-affinity  Serve all players of a game from the\n"
+            "                   same reactor.\n"
+            "  --game-workers=N Threads running game logic, defaults\n"
+            "                   to one per CPU.\n"
+            "  --http-workers=N Threads handling HTTP requests, defaults\n"
+            "                   to one per CPU.\n"
+            "  --max-players=N  Players the test game fits, up to %d,\n"
+            "                   defaults to %d.\n"
+            "  --snapshot=FILE  Restore games from FILE on startup, and\n"
+            "                   save them there every so often.\n"
+            "  --snapshot-interval=SECONDS\n"
+            "                   How often, defaults to %d.\n"
+            "  --snapshot-discard\n"
+            "                   Start without the snapshot if it can't\n"
+            "                   be read, it's kept as FILE.corrupt.\n"
+            "                   Otherwise the server won't start.\n"
+            "  --wal=FILE       Log every game change to FILE.<lsn>\n"
+            "                   segments, and replay them on startup.\n"
+            "  --record=FILE    Record every game's messages to FILE,\n"
+            "                   for replaying with relicReplay.\n"
+            "  --metrics-token=TOKEN\n"
+            "                   Serve /metrics to requests with\n"
+            "                   \"Authorization: Bearer TOKEN\".\n"
+            "  --trace=FILE     Trace the hot paths, and write the last\n"
+            "                   few thousand events per thread to FILE\n"
+            "                   as Chrome trace JSON on SIGUSR2.\n"
+            "  --turn-timeout=SECONDS\n"
+            "                   Pass the turn on when a player takes\n"
+            "                   longer, defaults to %d, 0 never does.\n"
+            "  --idle-timeout=SECONDS\n"
+            "                   Close connections that stay quiet this\n"
+            "                   long, websockets even when pinged,\n"
+            "                   defaults to %d, 0 never does.\n"
+            "  --heatmaps=DIR   Weigh encounters by the heatmap images\n"
+            "                   in DIR, keep it out of the website.\n",
+            program_name,
+            MAX_PLAYERS_IN_GAME,
+            TEST_GAME_MAX_PLAYERS,
+            SNAPSHOT_DEFAULT_INTERVAL,
+            GAME_TURN_TIMEOUT_DEFAULT,
+            WEBSOCKET_IDLE_TIMEOUT_DEFAULT);
+}
+
+static int game_worker_count     = 0;
+static int http_worker_count     = 0;
+static int max_player_count      = TEST_GAME_MAX_PLAYERS;
+static const char *snapshot_file = NULL;
+static int snapshot_interval     = SNAPSHOT_DEFAULT_INTERVAL;
+static bool snapshot_discard     = false;
+static const char *wal_file      = NULL;
+static const char *record_file   = NULL;
+static const char *trace_file    = NULL;
+static const char *heatmap_dir   = NULL;
+
+/*
+ * Returns -1 if the program
+ * should exit.
+ */
+static int parse_options(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        {"net-backend",       required_argument, NULL, 'n'},
+        {"reactors",          required_argument, NULL, 'r'},
+        {"pin-cpus",          no_argument,       NULL, 'p'},
+        {"game-affinity",     no_argument,       NULL, 'g'},
+        {"game-workers",      required_argument, NULL, 'w'},
+        {"http-workers",      required_argument, NULL, 'x'},
+        {"max-players",       required_argument, NULL, 'm'},
+        {"snapshot",          required_argument, NULL, 's'},
+        {"snapshot-interval", required_argument, NULL, 'i'},
+        {"snapshot-discard",  no_argument,       NULL, 'c'},
+        {"wal",               required_argument, NULL, 'l'},
+        {"record",            required_argument, NULL, 'o'},
+        {"metrics-token",     required_argument, NULL, 't'},
+        {"trace",             required_argument, NULL, 'e'},
+        {"turn-timeout",      required_argument, NULL, 'u'},
+        {"idle-timeout",      required_argument, NULL, 'd'},
+        {"heatmaps",          required_argument, NULL, 'a'},
+        {"help",              no_argument,       NULL, 'h'},
+        {NULL,                0,                 NULL, 0  }
+    };
+    int option         = 0;
+    int reactor_count  = 0;
+    int turn_timeout   = 0;
+    int idle_timeout   = WEBSOCKET_IDLE_TIMEOUT_DEFAULT;
+    bool pin_cpus      = false;
+    bool game_affinity = false;
+    while ((option = getopt_long(argc,
+                                 argv,
+                                 "n:r:pgw:x:m:s:i:cl:o:t:e:u:d:a:h",
+                                 long_options,
+                                 NULL))
+           != -1) {
+        switch (option) {
+        case 'n': {
+            const enum net_backend_type type = net_backend_from_string(optarg);
+            if (type == NET_BACKEND_COUNT) {
+                fprintf(stderr, "Unknown network backend: %s\n", optarg);
+                return -1;
+            }
+            net_backend_select(type);
+            break;
+        }
+        case 'r':
+            reactor_count = atoi(optarg);
+            if (reactor_count <= 0) {
+                fprintf(stderr, "Invalid reactor count: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'p':
+            pin_cpus = true;
+            break;
+        case 'g':
+            game_affinity = true;
+            break;
+        case 'w':
+            game_worker_count = atoi(optarg);
+            if (game_worker_count <= 0) {
+                fprintf(stderr, "Invalid game worker count: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'x':
+            http_worker_count = atoi(optarg);
+            if (http_worker_count <= 0) {
+                fprintf(stderr, "Invalid HTTP worker count: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'm':
+            max_player_count = atoi(optarg);
+            if (max_player_count < TEST_GAME_MIN_PLAYERS
+                || max_player_count > MAX_PLAYERS_IN_GAME) {
+                fprintf(stderr, "Invalid max player count: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 's':
+            snapshot_file = optarg;
+            break;
+        case 'i':
+            snapshot_interval = atoi(optarg);
+            if (snapshot_interval <= 0) {
+                fprintf(stderr, "Invalid snapshot interval: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'c':
+            snapshot_discard = true;
+            break;
+        case 'l':
+            wal_file = optarg;
+            break;
+        case 'o':
+            record_file = optarg;
+            break;
+        case 't':
+            if (optarg[0] == '\0') {
+                fprintf(stderr, "The metrics token can't be empty\n");
+                return -1;
+            }
+            metrics_set_token(optarg);
+            break;
+        case 'e':
+            trace_file = optarg;
+            break;
+        case 'u':
+            turn_timeout = atoi(optarg);
+            if (turn_timeout < 0) {
+                fprintf(stderr, "Invalid turn timeout: %s\n", optarg);
+                return -1;
+            }
+            set_turn_timeout(turn_timeout);
+            break;
+        case 'd':
+            idle_timeout = atoi(optarg);
+            if (idle_timeout < 0) {
+                fprintf(stderr, "Invalid idle timeout: %s\n", optarg);
+                return -1;
+            }
+            set_idle_timeout(idle_timeout);
+            break;
+        case 'a':
+            heatmap_dir = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+    net_set_reactor_options(reactor_count,
+                            pin_cpus,
+                            game_affinity,
+                            idle_timeout);
+    return 0;
+}
+
+/*
+ * Moves an unreadable snapshot out of the way,
+ * so the next one doesn't overwrite it.
+ * Returns -1 if that didn't work.
+ */
+static int set_snapshot_aside(const char *path)
+{
+    char corrupt_path[PATH_MAX];
+    if (snprintf(corrupt_path, sizeof(corrupt_path), "%s.corrupt", path)
+            >= (int)sizeof(corrupt_path)
+        || rename(path, corrupt_path) != 0) {
+        perror("Couldn't set the snapshot aside");
+        return -1;
+    }
+    fprintf(stderr,
+            "Starting without the snapshot, it's in %s\n",
+            corrupt_path);
+    return 0;
+}
+
+int main(int argc, char **argv)
 {
+    if (parse_options(argc, argv) != 0) {
+        return 1;
+    }
+    // Before any other thread starts
+    if (trace_file && trace_start(trace_file) != 0) {
+        return 1;
+    }
     printf("\nWelcome to the test server!");
     printf("\n-----------------------------------\n");
 #ifdef DEBUG
     printf("RUNNING SLOW DEBUG VERSION\n");
     check_data_sizes();
 #endif
-    enable_tls();
-    localhost = create_host("0.0.0.0", 7676);
 
     create_allowed_file_table();
+    if (heatmap_dir && load_heatmaps(heatmap_dir) != 0) {
+        return 1;
+    }
 
     // TODO: Make a web interface for creating and
     // joining multiple games.
-    struct game_config game_config = {.name             = "test game",
-                                      .password         = "hello",
-                                      .max_player_count = 4,
-                                      .min_player_count = 2};
+    struct game_config game_config = {
+        .name             = "test game",
+        .password         = "hello",
+        .max_player_count = max_player_count,
+        .min_player_count = TEST_GAME_MIN_PLAYERS};
 
+    // Restored games keep their names,
+    // so this is a no-op if the test game was saved.
+    // The next snapshot would overwrite the saved games,
+    // and truncate the log, so don't start over lightly.
+    wal_lsn_t wal_lsn = 0;
+    if (snapshot_file && snapshot_restore(snapshot_file, &wal_lsn) < 0) {
+        if (!snapshot_discard) {
+            fprintf(stderr,
+                    "Couldn't restore the snapshot in %s, left it as it "
+                    "is.\nPass --snapshot-discard to start without it.\n",
+                    snapshot_file);
+            return 1;
+        }
+        if (set_snapshot_aside(snapshot_file) != 0) {
+            return 1;
+        }
+        wal_lsn = 0;
+    }
     create_game(&game_config);
+    if (wal_file) {
+        game_wal_start(wal_file, wal_lsn);
+    }
+    if (record_file && recorder_start(record_file) != 0) {
+        return 1;
+    }
+    resume_turn_deadlines();
+    if (timer_wheel_start() != 0) {
+        return 1;
+    }
+    game_actor_start_workers(game_worker_count);
+    executor_start(http_worker_count);
+    if (snapshot_file) {
+        snapshot_start(snapshot_file, snapshot_interval);
+    }
 
     /* All incoming TCP packets
      * are given to "masterHandler()"
      * in "packet_handlers.c"
      */
-    listen_for_tcp(localhost, master_handler);
+    if (net_listen(SERVER_IP, SERVER_PORT, master_handler) != 0) {
+        return 1;
+    }
     return 0;
 }
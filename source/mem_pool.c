@@ -0,0 +1,237 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error_handling.h"
+#include "mem_pool.h"
+
+#define MEM_ALIGN          16
+#define ARENA_DEFAULT_SIZE (64 * 1024)
+#define MEM_CLASS_COUNT    6
+#define MEM_CLASS_HEAP     MEM_CLASS_COUNT // Header tag for heap fallbacks
+
+// Room in front of mem_alloc() buffers for the size class,
+// kept at MEM_ALIGN so the buffer stays aligned.
+struct mem_header {
+    int size_class;
+    char padding[MEM_ALIGN - sizeof(int)];
+};
+
+// Overflow allocations of an arena,
+// folded into the main block on reset.
+struct arena_chunk {
+    struct arena_chunk *next;
+    char padding[MEM_ALIGN - sizeof(struct arena_chunk *)];
+};
+
+struct arena {
+    char *base;
+    size_t used;
+    size_t cap;
+    struct arena_chunk *overflow;
+    size_t overflow_size;
+};
+
+static const size_t size_classes[MEM_CLASS_COUNT] = {64,
+                                                     256,
+                                                     1024,
+                                                     4096,
+                                                     16384,
+                                                     65536};
+
+#define SIZE_POOL(size, per_slab)                                             \
+    {.lock             = PTHREAD_MUTEX_INITIALIZER,                          \
+     .object_size      = sizeof(struct mem_header) + (size),                  \
+     .objects_per_slab = (per_slab),                                          \
+     .free_list        = NULL}
+
+static struct mem_pool size_pools[MEM_CLASS_COUNT] = {SIZE_POOL(64, 256),
+                                                      SIZE_POOL(256, 128),
+                                                      SIZE_POOL(1024, 64),
+                                                      SIZE_POOL(4096, 16),
+                                                      SIZE_POOL(16384, 8),
+                                                      SIZE_POOL(65536, 2)};
+
+static __thread struct arena thread_arena = {0};
+
+static struct {
+    atomic_uint_fast64_t pool_allocs;
+    atomic_uint_fast64_t pool_frees;
+    atomic_uint_fast64_t slab_mallocs;
+    atomic_uint_fast64_t arena_allocs;
+    atomic_uint_fast64_t arena_resets;
+    atomic_uint_fast64_t chunk_mallocs;
+    atomic_uint_fast64_t heap_fallbacks;
+} stats;
+
+static inline void count(atomic_uint_fast64_t *counter)
+{
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+static inline size_t align_up(size_t size)
+{
+    return (size + MEM_ALIGN - 1) & ~(size_t)(MEM_ALIGN - 1);
+}
+
+static void *malloc_or_exit(size_t size)
+{
+    void *ptr = malloc(size);
+    if (!ptr) {
+        print_error(BB_ERR_MALLOC);
+        exit(1);
+    }
+    return ptr;
+}
+
+/*
+ * Fixed size pools
+ * --------------------
+ */
+static inline size_t slot_size(const struct mem_pool *pool)
+{
+    const size_t size = pool->object_size > sizeof(void *) ? pool->object_size
+                                                           : sizeof(void *);
+    return align_up(size);
+}
+
+// Caller holds the pool lock
+static void grow_pool(struct mem_pool *pool)
+{
+    const size_t size = slot_size(pool);
+    char *slab        = malloc_or_exit(size * pool->objects_per_slab);
+    count(&stats.slab_mallocs);
+    for (size_t i = 0; i < pool->objects_per_slab; i++) {
+        void **slot     = (void **)&slab[i * size];
+        *slot           = pool->free_list;
+        pool->free_list = slot;
+    }
+}
+
+static void *pop_object(struct mem_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->free_list) {
+        grow_pool(pool);
+    }
+    void **slot     = pool->free_list;
+    pool->free_list = *slot;
+    pthread_mutex_unlock(&pool->lock);
+    count(&stats.pool_allocs);
+    return slot;
+}
+
+void *mem_pool_alloc(struct mem_pool *pool)
+{
+    void *object = pop_object(pool);
+    memset(object, 0, pool->object_size);
+    return object;
+}
+
+void mem_pool_free(struct mem_pool *pool, void *object)
+{
+    if (!object) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    *(void **)object = pool->free_list;
+    pool->free_list  = object;
+    pthread_mutex_unlock(&pool->lock);
+    count(&stats.pool_frees);
+}
+
+/*
+ * Size classes
+ * --------------------
+ */
+void *mem_alloc(size_t size)
+{
+    struct mem_header *header = NULL;
+    int size_class            = 0;
+    while (size_class < MEM_CLASS_COUNT && size_classes[size_class] < size) {
+        size_class++;
+    }
+    if (size_class == MEM_CLASS_COUNT) {
+        header = malloc_or_exit(sizeof(*header) + size);
+        count(&stats.heap_fallbacks);
+    }
+    else {
+        header = pop_object(&size_pools[size_class]);
+    }
+    header->size_class = size_class;
+    return header + 1;
+}
+
+void mem_free(void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+    struct mem_header *header = (struct mem_header *)ptr - 1;
+    if (header->size_class == MEM_CLASS_HEAP) {
+        free(header);
+        return;
+    }
+    mem_pool_free(&size_pools[header->size_class], header);
+}
+
+/*
+ * Per-thread arena
+ * --------------------
+ */
+void *arena_alloc(size_t size)
+{
+    struct arena *arena = &thread_arena;
+    size                = align_up(size);
+    count(&stats.arena_allocs);
+
+    if (!arena->base) {
+        arena->cap  = ARENA_DEFAULT_SIZE;
+        arena->base = malloc_or_exit(arena->cap);
+        count(&stats.chunk_mallocs);
+    }
+    if (arena->used + size <= arena->cap) {
+        void *ptr = &arena->base[arena->used];
+        arena->used += size;
+        return ptr;
+    }
+    // Doesn't fit this time, the next reset
+    // grows the arena so it will.
+    struct arena_chunk *chunk = malloc_or_exit(sizeof(*chunk) + size);
+    count(&stats.chunk_mallocs);
+    chunk->next     = arena->overflow;
+    arena->overflow = chunk;
+    arena->overflow_size += size;
+    return chunk + 1;
+}
+
+void arena_reset(void)
+{
+    struct arena *arena = &thread_arena;
+    if (arena->overflow) {
+        while (arena->overflow) {
+            struct arena_chunk *next = arena->overflow->next;
+            free(arena->overflow);
+            arena->overflow = next;
+        }
+        free(arena->base);
+        arena->cap += arena->overflow_size;
+        arena->base = malloc_or_exit(arena->cap);
+        count(&stats.chunk_mallocs);
+        arena->overflow_size = 0;
+    }
+    arena->used = 0;
+    count(&stats.arena_resets);
+}
+
+void mem_get_stats(struct mem_stats *out)
+{
+    out->pool_allocs    = atomic_load(&stats.pool_allocs);
+    out->pool_frees     = atomic_load(&stats.pool_frees);
+    out->slab_mallocs   = atomic_load(&stats.slab_mallocs);
+    out->arena_allocs   = atomic_load(&stats.arena_allocs);
+    out->arena_resets   = atomic_load(&stats.arena_resets);
+    out->chunk_mallocs  = atomic_load(&stats.chunk_mallocs);
+    out->heap_fallbacks = atomic_load(&stats.heap_fallbacks);
+}
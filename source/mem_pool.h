@@ -0,0 +1,72 @@
+/*
+ * ===========================
+ * mem_pool.h
+ * ===========================
+ * Allocators for the request hot path.
+ *
+ * mem_pool: fixed size objects carved out of slabs,
+ * freed objects go on a free list and get reused,
+ * slabs are never given back.
+ * Use it for state that lives as long as a
+ * connection, or that crosses threads.
+ *
+ * mem_alloc(): same thing for variable sized
+ * buffers, rounded up to a handful of size classes.
+ *
+ * arena: per-thread bump allocator for scratch
+ * memory that only lives as long as one dispatch.
+ * Whoever dispatches (reactor, game worker, executor
+ * worker) calls arena_reset() when the handler returns,
+ * so nothing from arena_alloc() outlives that.
+ *
+ * The counters tell us whether we're still going to
+ * malloc in steady state, "slab_mallocs",
+ * "chunk_mallocs" and "heap_fallbacks" should stop
+ * growing once the server is warmed up.
+ */
+
+#ifndef BB_MEM_POOL
+#define BB_MEM_POOL
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct mem_pool {
+    pthread_mutex_t lock;
+    size_t object_size;
+    size_t objects_per_slab;
+    void *free_list;
+};
+
+#define MEM_POOL_INITIALIZER(type, per_slab)                                  \
+    {.lock             = PTHREAD_MUTEX_INITIALIZER,                          \
+     .object_size      = sizeof(type),                                        \
+     .objects_per_slab = (per_slab),                                          \
+     .free_list        = NULL}
+
+struct mem_stats {
+    uint64_t pool_allocs;
+    uint64_t pool_frees;
+    uint64_t slab_mallocs;   // Pools growing
+    uint64_t arena_allocs;
+    uint64_t arena_resets;
+    uint64_t chunk_mallocs;  // Arenas growing
+    uint64_t heap_fallbacks; // mem_alloc() sizes too big for any pool
+};
+
+// These zero the memory
+void *mem_pool_alloc(struct mem_pool *pool);
+void  mem_pool_free (struct mem_pool *pool, void *object);
+
+// Not zeroed
+void *mem_alloc(size_t size);
+void  mem_free (void *ptr);
+
+// Not zeroed, 16 byte aligned
+void *arena_alloc(size_t size);
+void  arena_reset(void);
+
+void mem_get_stats(struct mem_stats *out);
+
+#endif
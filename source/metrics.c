@@ -0,0 +1,533 @@
+/*
+ * ===========================
+ * metrics.c
+ * ===========================
+ * A thread's shard is only ever written by that
+ * thread, so counting is a relaxed load and store,
+ * no locked instructions. Shards are pushed onto a
+ * list the first time a thread counts something
+ * and never freed, so a scrape can walk the list
+ * without locking, and the counts of threads that
+ * are gone stay in the totals.
+ */
+
+#define _GNU_SOURCE // strcasestr()
+#include <openssl/crypto.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "epoch.h"
+#include "error_handling.h"
+#include "event_loop.h"
+#include "executor.h"
+#include "game_logic.h"
+#include "mem_pool.h"
+#include "metrics.h"
+#include "snapshot.h"
+#include "timer_wheel.h"
+#include "wal.h"
+
+#define METRICS_MIN_SHIFT    10 // The first bucket is everything up to 1.024us
+#define METRICS_OCTAVES      24
+// Plus the first bucket, and one for everything over ~17s
+#define METRICS_BUCKET_COUNT (METRICS_OCTAVES * 2 + 2)
+#define METRICS_TOKEN_LEN    128
+
+struct metrics_histogram {
+    atomic_uint_fast64_t buckets[METRICS_BUCKET_COUNT];
+    atomic_uint_fast64_t sum_ns;
+};
+
+struct metrics_shard {
+    atomic_uint_fast64_t counters[METRIC_COUNTER_COUNT];
+    struct metrics_histogram opcodes[METRICS_OPCODE_COUNT];
+    struct metrics_histogram routes[METRIC_ROUTE_COUNT];
+    struct metrics_shard *next;
+} __attribute__((aligned(64)));
+
+static const char *counter_names[METRIC_COUNTER_COUNT] = {
+    "relic_bytes_in_total",
+    "relic_bytes_out_total",
+    "relic_packets_in_total",
+    "relic_websocket_handshakes_total",
+    "relic_game_messages_rejected_total",
+    "relic_websocket_pings_total",
+    "relic_idle_hosts_closed_total"};
+static const char *route_names[METRIC_ROUTE_COUNT] = {"page",
+                                                      "file",
+                                                      "websocket",
+                                                      "login",
+                                                      "charsheet",
+                                                      "metrics",
+                                                      "forbidden"};
+
+static _Atomic(struct metrics_shard *) shards        = NULL;
+static __thread struct metrics_shard *current_shard = NULL;
+
+static char token[METRICS_TOKEN_LEN] = {0};
+static size_t token_len              = 0;
+
+static struct metrics_shard *get_shard(void)
+{
+    struct metrics_shard *shard = current_shard;
+    if (shard) {
+        return shard;
+    }
+    shard = aligned_alloc(64, sizeof(*shard));
+    if (!shard) {
+        print_error(BB_ERR_MALLOC);
+        exit(1);
+    }
+    memset(shard, 0, sizeof(*shard));
+    shard->next = atomic_load(&shards);
+    while (!atomic_compare_exchange_weak(&shards, &shard->next, shard)) {
+    }
+    current_shard = shard;
+    return shard;
+}
+
+// Only the owning thread writes, so no read-modify-write needed
+static inline void shard_add(atomic_uint_fast64_t *counter, uint64_t value)
+{
+    atomic_store_explicit(
+        counter,
+        atomic_load_explicit(counter, memory_order_relaxed) + value,
+        memory_order_relaxed);
+}
+
+static inline uint64_t shard_load(atomic_uint_fast64_t *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/*
+ * The smallest bucket whose upper bound is
+ * at least "ns".
+ */
+static inline int bucket_index(uint64_t ns)
+{
+    if (ns <= (1ull << METRICS_MIN_SHIFT)) {
+        return 0;
+    }
+    const uint64_t below = ns - 1;
+    const int exponent   = 63 - __builtin_clzll(below);
+    const int index      = 1 + (exponent - METRICS_MIN_SHIFT) * 2
+                      + (int)((below >> (exponent - 1)) & 1);
+    return index < METRICS_BUCKET_COUNT - 1 ? index : METRICS_BUCKET_COUNT - 1;
+}
+
+// Not defined for the last bucket, that's "+Inf"
+static uint64_t bucket_upper_ns(int index)
+{
+    if (index == 0) {
+        return 1ull << METRICS_MIN_SHIFT;
+    }
+    const int exponent = METRICS_MIN_SHIFT + (index - 1) / 2;
+    const int half     = (index - 1) % 2 + 1;
+    return (1ull << exponent) + half * (1ull << (exponent - 1));
+}
+
+static void histogram_add(struct metrics_histogram *histogram, uint64_t ns)
+{
+    shard_add(&histogram->buckets[bucket_index(ns)], 1);
+    shard_add(&histogram->sum_ns, ns);
+}
+
+void metrics_count(enum metric_counter counter, uint64_t value)
+{
+    shard_add(&get_shard()->counters[counter], value);
+}
+
+void metrics_time_opcode(unsigned int opcode, uint64_t ns)
+{
+    if (opcode < METRICS_OPCODE_COUNT) {
+        histogram_add(&get_shard()->opcodes[opcode], ns);
+    }
+}
+
+void metrics_time_route(enum metric_route route, uint64_t ns)
+{
+    histogram_add(&get_shard()->routes[route], ns);
+}
+
+/*
+ * Authorization
+ * --------------------
+ */
+void metrics_set_token(const char *new_token)
+{
+    token_len = strnlen(new_token, METRICS_TOKEN_LEN - 1);
+    memcpy(token, new_token, token_len);
+    token[token_len] = '\0';
+}
+
+bool metrics_is_authorized(const char *request)
+{
+    const char header[] = "\nAuthorization: Bearer ";
+    if (token_len == 0) {
+        return false;
+    }
+    const char *given = strcasestr(request, header);
+    if (!given) {
+        return false;
+    }
+    given += sizeof(header) - 1;
+    const size_t given_len = strcspn(given, "\r\n ");
+    // Doesn't leak how much of the token was right
+    return given_len == token_len
+           && CRYPTO_memcmp(given, token, token_len) == 0;
+}
+
+/*
+ * Rendering
+ * --------------------
+ */
+struct metrics_writer {
+    char *buf;
+    size_t size;
+    size_t len;
+};
+
+__attribute__((format(printf, 2, 3)))
+static void emit(struct metrics_writer *writer, const char *format, ...)
+{
+    if (writer->len >= writer->size) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    const int written = vsnprintf(&writer->buf[writer->len],
+                                  writer->size - writer->len,
+                                  format,
+                                  args);
+    va_end(args);
+    if (written > 0) {
+        writer->len += written;
+        if (writer->len > writer->size - 1) {
+            writer->len = writer->size - 1;
+        }
+    }
+}
+
+static void emit_header(struct metrics_writer *writer,
+                        const char *name,
+                        const char *type,
+                        const char *help)
+{
+    emit(writer, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Sums "select(shard)" over every shard
+static void sum_histogram(struct metrics_histogram *(*select)(
+                              struct metrics_shard *shard, int index),
+                          int index,
+                          uint64_t *buckets,
+                          uint64_t *sum_ns)
+{
+    memset(buckets, 0, sizeof(*buckets) * METRICS_BUCKET_COUNT);
+    *sum_ns = 0;
+    for (struct metrics_shard *shard = atomic_load(&shards); shard;
+         shard                       = shard->next) {
+        struct metrics_histogram *histogram = select(shard, index);
+        for (int i = 0; i < METRICS_BUCKET_COUNT; i++) {
+            buckets[i] += shard_load(&histogram->buckets[i]);
+        }
+        *sum_ns += shard_load(&histogram->sum_ns);
+    }
+}
+
+static struct metrics_histogram *select_opcode(struct metrics_shard *shard,
+                                               int index)
+{
+    return &shard->opcodes[index];
+}
+
+static struct metrics_histogram *select_route(struct metrics_shard *shard,
+                                              int index)
+{
+    return &shard->routes[index];
+}
+
+// Histograms that never saw anything are left out
+static void emit_histogram(struct metrics_writer *writer,
+                           const char *name,
+                           const char *label,
+                           const uint64_t *buckets,
+                           uint64_t sum_ns)
+{
+    uint64_t count = 0;
+    for (int i = 0; i < METRICS_BUCKET_COUNT; i++) {
+        count += buckets[i];
+    }
+    if (count == 0) {
+        return;
+    }
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_BUCKET_COUNT - 1; i++) {
+        cumulative += buckets[i];
+        emit(writer,
+             "%s_bucket{%s,le=\"%.9g\"} %llu\n",
+             name,
+             label,
+             bucket_upper_ns(i) / 1e9,
+             (unsigned long long)cumulative);
+    }
+    emit(writer, "%s_bucket{%s,le=\"+Inf\"} %llu\n",
+         name,
+         label,
+         (unsigned long long)count);
+    emit(writer, "%s_sum{%s} %.9f\n", name, label, sum_ns / 1e9);
+    emit(writer,
+         "%s_count{%s} %llu\n",
+         name,
+         label,
+         (unsigned long long)count);
+}
+
+static void emit_counters(struct metrics_writer *writer)
+{
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        uint64_t total = 0;
+        for (struct metrics_shard *shard = atomic_load(&shards); shard;
+             shard                       = shard->next) {
+            total += shard_load(&shard->counters[i]);
+        }
+        emit(writer,
+             "# TYPE %s counter\n%s %llu\n",
+             counter_names[i],
+             counter_names[i],
+             (unsigned long long)total);
+    }
+}
+
+static void emit_latencies(struct metrics_writer *writer)
+{
+    uint64_t buckets[METRICS_BUCKET_COUNT];
+    uint64_t sum_ns = 0;
+    char label[32];
+
+    emit_header(writer,
+                "relic_game_message_seconds",
+                "histogram",
+                "Time the game actor spent on a websocket message");
+    for (int i = 0; i < METRICS_OPCODE_COUNT; i++) {
+        sum_histogram(select_opcode, i, buckets, &sum_ns);
+        snprintf(label, sizeof(label), "opcode=\"%d\"", i);
+        emit_histogram(writer,
+                       "relic_game_message_seconds",
+                       label,
+                       buckets,
+                       sum_ns);
+    }
+    emit_header(writer,
+                "relic_http_request_seconds",
+                "histogram",
+                "Time spent handling an HTTP request, per route");
+    for (int i = 0; i < METRIC_ROUTE_COUNT; i++) {
+        sum_histogram(select_route, i, buckets, &sum_ns);
+        snprintf(label, sizeof(label), "route=\"%s\"", route_names[i]);
+        emit_histogram(writer,
+                       "relic_http_request_seconds",
+                       label,
+                       buckets,
+                       sum_ns);
+    }
+}
+
+struct game_totals {
+    uint64_t players;
+    uint64_t queued;
+};
+
+static void add_game(struct game *game, void *arg)
+{
+    struct game_totals *totals = arg;
+    totals->players += get_player_count(game);
+    totals->queued  += game_actor_queue_length(&game->actor);
+}
+
+static void emit_games(struct metrics_writer *writer)
+{
+    struct game_totals totals = {0};
+    for_each_game(add_game, &totals);
+    emit(writer,
+         "# TYPE relic_games gauge\nrelic_games %d\n",
+         get_game_count());
+    emit(writer,
+         "# TYPE relic_players gauge\nrelic_players %llu\n",
+         (unsigned long long)totals.players);
+    emit_header(writer,
+                "relic_game_queue_depth",
+                "gauge",
+                "Commands waiting on every game actor");
+    emit(writer,
+         "relic_game_queue_depth %llu\n",
+         (unsigned long long)totals.queued);
+
+    struct timer_wheel_stats timers;
+    timer_wheel_get_stats(&timers);
+    emit(writer,
+         "# TYPE relic_timers_pending gauge\n"
+         "relic_timers_pending %llu\n"
+         "# TYPE relic_timers_fired_total counter\n"
+         "relic_timers_fired_total %llu\n"
+         "# TYPE relic_timers_cascaded_total counter\n"
+         "relic_timers_cascaded_total %llu\n",
+         (unsigned long long)timers.pending,
+         (unsigned long long)timers.fired,
+         (unsigned long long)timers.cascaded);
+    emit_header(writer,
+                "relic_epoch_pending",
+                "gauge",
+                "Objects retired and waiting to be freed");
+    emit(writer,
+         "relic_epoch_pending %llu\n",
+         (unsigned long long)epoch_pending_count());
+}
+
+static void emit_executor(struct metrics_writer *writer)
+{
+    struct executor_stats stats;
+    const int workers = executor_worker_count();
+
+    emit_header(writer,
+                "relic_http_queue_depth",
+                "gauge",
+                "HTTP requests waiting, per worker and injected");
+    for (int i = 0; i < workers; i++) {
+        executor_get_stats(i, &stats);
+        emit(writer,
+             "relic_http_queue_depth{worker=\"%d\"} %llu\n",
+             i,
+             (unsigned long long)stats.queue_length);
+    }
+    emit(writer,
+         "relic_http_queue_depth{worker=\"injected\"} %llu\n",
+         (unsigned long long)executor_injection_queue_length());
+    emit(writer, "# TYPE relic_http_tasks_total counter\n");
+    for (int i = 0; i < workers; i++) {
+        executor_get_stats(i, &stats);
+        emit(writer,
+             "relic_http_tasks_total{worker=\"%d\"} %llu\n",
+             i,
+             (unsigned long long)stats.executed);
+    }
+}
+
+static void emit_reactors(struct metrics_writer *writer)
+{
+    struct event_loop_stats stats;
+    const int reactors = event_loop_reactor_count();
+    if (reactors == 0) {
+        return;
+    }
+    const struct {
+        const char *name;
+        const char *type;
+        size_t offset;
+    } fields[] = {
+        {"relic_reactor_connections",          "gauge",
+         offsetof(struct event_loop_stats, connections)},
+        {"relic_reactor_accepted_total",       "counter",
+         offsetof(struct event_loop_stats, accepted)},
+        {"relic_reactor_tls_handshakes_total", "counter",
+         offsetof(struct event_loop_stats, handshakes)},
+        {"relic_reactor_tls_failures_total",   "counter",
+         offsetof(struct event_loop_stats, handshake_failures)},
+        {"relic_reactor_bytes_in_total",       "counter",
+         offsetof(struct event_loop_stats, bytes_in)},
+        {"relic_reactor_bytes_out_total",      "counter",
+         offsetof(struct event_loop_stats, bytes_out)},
+        {"relic_reactor_wakeups_total",        "counter",
+         offsetof(struct event_loop_stats, wakeups)},
+        {"relic_reactor_idle_closed_total",    "counter",
+         offsetof(struct event_loop_stats, idle_closed)}
+    };
+    for (size_t f = 0; f < sizeof(fields) / sizeof(*fields); f++) {
+        emit(writer, "# TYPE %s %s\n", fields[f].name, fields[f].type);
+        for (int i = 0; i < reactors; i++) {
+            event_loop_get_stats(i, &stats);
+            unsigned long long value = 0;
+            memcpy(&value, (char *)&stats + fields[f].offset, sizeof(uint64_t));
+            emit(writer, "%s{reactor=\"%d\"} %llu\n", fields[f].name, i, value);
+        }
+    }
+}
+
+static void emit_persistence(struct metrics_writer *writer)
+{
+    struct mem_stats mem;
+    struct wal_stats wal;
+    struct snapshot_stats snapshot;
+    mem_get_stats(&mem);
+    wal_get_stats(&wal);
+    snapshot_get_stats(&snapshot);
+
+    emit(writer,
+         "# TYPE relic_mem_pool_allocs_total counter\n"
+         "relic_mem_pool_allocs_total %llu\n"
+         "# TYPE relic_mem_arena_allocs_total counter\n"
+         "relic_mem_arena_allocs_total %llu\n"
+         "# TYPE relic_mem_heap_fallbacks_total counter\n"
+         "relic_mem_heap_fallbacks_total %llu\n",
+         (unsigned long long)mem.pool_allocs,
+         (unsigned long long)mem.arena_allocs,
+         (unsigned long long)mem.heap_fallbacks);
+    if (wal_enabled()) {
+        emit(writer,
+             "# TYPE relic_wal_appended_lsn gauge\n"
+             "relic_wal_appended_lsn %llu\n"
+             "# TYPE relic_wal_durable_lsn gauge\n"
+             "relic_wal_durable_lsn %llu\n"
+             "# TYPE relic_wal_last_batch_records gauge\n"
+             "relic_wal_last_batch_records %llu\n"
+             "# TYPE relic_wal_last_batch_bytes gauge\n"
+             "relic_wal_last_batch_bytes %llu\n"
+             "# TYPE relic_wal_max_batch_records gauge\n"
+             "relic_wal_max_batch_records %llu\n"
+             "# TYPE relic_wal_fsyncs_total counter\n"
+             "relic_wal_fsyncs_total %llu\n"
+             "# TYPE relic_wal_last_fsync_seconds gauge\n"
+             "relic_wal_last_fsync_seconds %.6f\n",
+             (unsigned long long)wal.appended_lsn,
+             (unsigned long long)wal.durable_lsn,
+             (unsigned long long)wal.last_batch_records,
+             (unsigned long long)wal.last_batch_bytes,
+             (unsigned long long)wal.max_batch_records,
+             (unsigned long long)wal.fsyncs,
+             wal.last_fsync_us / 1e6);
+    }
+    emit(writer,
+         "# TYPE relic_snapshots_total counter\n"
+         "relic_snapshots_total %llu\n"
+         "# TYPE relic_snapshot_failures_total counter\n"
+         "relic_snapshot_failures_total %llu\n"
+         "# TYPE relic_snapshot_last_fork_seconds gauge\n"
+         "relic_snapshot_last_fork_seconds %.6f\n"
+         "# TYPE relic_snapshot_last_bytes gauge\n"
+         "relic_snapshot_last_bytes %llu\n",
+         (unsigned long long)snapshot.taken,
+         (unsigned long long)snapshot.failed,
+         snapshot.last_fork_us / 1e6,
+         (unsigned long long)snapshot.last_size);
+}
+
+size_t metrics_render(char *buf, size_t buf_size)
+{
+    struct metrics_writer writer = {.buf = buf, .size = buf_size, .len = 0};
+    if (buf_size == 0) {
+        return 0;
+    }
+    buf[0] = '\0';
+    emit_counters(&writer);
+    emit_latencies(&writer);
+    emit_games(&writer);
+    emit_executor(&writer);
+    emit_reactors(&writer);
+    emit_persistence(&writer);
+    return writer.len;
+}
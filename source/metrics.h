@@ -0,0 +1,80 @@
+/*
+ * ===========================
+ * metrics.h
+ * ===========================
+ * Counters and latency histograms that are cheap
+ * enough to leave on in Release builds.
+ * Every thread counts into its own cache line
+ * aligned shard with plain relaxed stores, nothing
+ * is shared until someone scrapes /metrics and the
+ * shards get summed up.
+ *
+ * Histograms are log-linear (HDR style): two buckets
+ * per power of two, from 1us up to ~17s.
+ *
+ * /metrics is only served to requests with
+ * "Authorization: Bearer <token>", where the token
+ * is set with metrics_set_token(). Without a token,
+ * it isn't served at all.
+ */
+
+#ifndef BB_METRICS
+#define BB_METRICS
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Room for every websocket opcode we'll ever have
+#define METRICS_OPCODE_COUNT 16
+
+// This is coupled with counter_names in metrics.c
+enum metric_counter {
+    METRIC_BYTES_IN,            // Plaintext handed to master_handler()
+    METRIC_BYTES_OUT,           // Plaintext given to net_send()
+    METRIC_PACKETS_IN,
+    METRIC_WEBSOCKET_HANDSHAKES,
+    METRIC_GAME_MESSAGES_REJECTED,
+    METRIC_WEBSOCKET_PINGS,     // Sent to quiet clients
+    METRIC_IDLE_HOSTS_CLOSED,
+    METRIC_COUNTER_COUNT
+};
+
+// This is coupled with route_names in metrics.c
+enum metric_route {
+    METRIC_ROUTE_PAGE,      // GET /, login, charsheet or game
+    METRIC_ROUTE_FILE,      // Scripts, styles and images
+    METRIC_ROUTE_WEBSOCKET, // The upgrade
+    METRIC_ROUTE_LOGIN,
+    METRIC_ROUTE_CHARSHEET,
+    METRIC_ROUTE_METRICS,
+    METRIC_ROUTE_FORBIDDEN,
+    METRIC_ROUTE_COUNT
+};
+
+static inline uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Any thread
+void metrics_count      (enum metric_counter counter, uint64_t value);
+void metrics_time_opcode(unsigned int opcode, uint64_t ns);
+void metrics_time_route (enum metric_route route, uint64_t ns);
+
+void metrics_set_token    (const char *token);
+// "request" is a NUL terminated HTTP request
+bool metrics_is_authorized(const char *request);
+
+/*
+ * Writes everything in the Prometheus text format
+ * to "buf", and returns how much it wrote.
+ * Caller is in epoch_enter(), the games are counted too.
+ */
+size_t metrics_render(char *buf, size_t buf_size);
+
+#endif
@@ -0,0 +1,119 @@
+/*
+ * ===========================
+ * movement.c
+ * ===========================
+ * Each segment of the path has its kilometre marks
+ * at the same spacing, so their positions are laid
+ * out a batch at a time with GCC vector extensions,
+ * and then rolled for in order. The rolls come off
+ * the game's RNG one after the other, like every
+ * other roll, so a replay stops at the same mark,
+ * and nothing past the first encounter is rolled.
+ */
+
+#include <math.h>
+
+#include "encounters.h"
+#include "movement.h"
+
+#define MOVE_BATCH 4 // Marks laid out at once
+
+typedef double move_f64x4 __attribute__((vector_size(MOVE_BATCH
+                                                     * sizeof(double))));
+
+static const move_f64x4 batch_steps = {0.0, 1.0, 2.0, 3.0};
+
+/*
+ * Rolls for the first "mark_count" marks along
+ * "from" + t * "delta", the first one "first_km"
+ * in and then every kilometre. Returns which one
+ * had an encounter, or -1.
+ */
+static int roll_segment(struct game *game,
+                        const struct coordinates *from,
+                        const struct coordinates *delta,
+                        double segment_km,
+                        double first_km,
+                        int mark_count,
+                        struct coordinates *out_at,
+                        struct move_result *out)
+{
+    const double per_km = 1.0 / segment_km;
+    for (int mark = 0; mark < mark_count; mark += MOVE_BATCH) {
+        const move_f64x4 t  = (first_km + mark + batch_steps) * per_km;
+        const move_f64x4 xs = from->x + delta->x * t;
+        const move_f64x4 ys = from->y + delta->y * t;
+        const int batch     = mark_count - mark < MOVE_BATCH
+                                  ? mark_count - mark
+                                  : MOVE_BATCH;
+
+        for (int i = 0; i < batch; i++) {
+            const struct coordinates at = {xs[i], ys[i], from->z};
+            out->rolls++;
+            out->encounter = draw_encounter_at(game, &at, &out->type);
+            if (out->encounter != ENCOUNTER_NONE) {
+                *out_at = at;
+                return mark + i;
+            }
+        }
+    }
+    return -1;
+}
+
+void move_player_along(struct player *player,
+                       const struct coordinates *path,
+                       int point_count,
+                       struct move_result *out)
+{
+    struct coordinates at = player->coords;
+    double walked         = player->km_walked;
+
+    out->type      = ENCOUNTER_TYPE_NONE;
+    out->encounter = ENCOUNTER_NONE;
+    out->rolls     = 0;
+    for (int point = 0; point < point_count; point++) {
+        const struct coordinates delta = {path[point].x - at.x,
+                                          path[point].y - at.y,
+                                          0.0};
+        const double segment_km =
+            hypot(delta.x, delta.y) * MOVE_KM_PER_UNIT;
+        const double first_km = 1.0 - walked; // To the next mark
+        if (segment_km == 0.0) {
+            continue;
+        }
+        if (segment_km < first_km) {
+            at.x = path[point].x;
+            at.y = path[point].y;
+            walked += segment_km;
+            continue;
+        }
+        const int mark_count = (int)floor(segment_km - first_km) + 1;
+        const int paid       = mark_count < player->action_points
+                                   ? mark_count
+                                   : player->action_points;
+        const int hit        = roll_segment(
+            player->game, &at, &delta, segment_km, first_km, paid, &at, out);
+        if (hit >= 0) {
+            player->action_points -= hit + 1;
+            walked = 0.0;
+            break;
+        }
+        player->action_points -= paid;
+        if (paid < mark_count) {
+            // At the last mark they paid for, if any
+            if (paid) {
+                const double t = (first_km + paid - 1) / segment_km;
+                at.x += delta.x * t;
+                at.y += delta.y * t;
+                walked = 0.0;
+            }
+            break;
+        }
+        at.x   = path[point].x;
+        at.y   = path[point].y;
+        walked = segment_km - first_km - (mark_count - 1);
+    }
+    player->coords.x  = at.x;
+    player->coords.y  = at.y;
+    player->km_walked = walked;
+}
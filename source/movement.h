@@ -0,0 +1,49 @@
+/*
+ * ===========================
+ * movement.h
+ * ===========================
+ * Walking players across the map.
+ * As in the project plan, travel costs action
+ * points and there's a chance of an encounter at
+ * regular intervals, so every kilometre walked
+ * costs an action point and rolls for an encounter
+ * where it ends. The first encounter stops the
+ * player right there, and out of action points they
+ * stop at the last kilometre they paid for.
+ *
+ * Partial kilometres carry over from move to move,
+ * so splitting a trip up doesn't dodge any rolls.
+ *
+ * With the default weights in encounters.c a roll
+ * comes up with something at most 2.5% of the time,
+ * less where the heatmaps thin it out. That's about
+ * one encounter every 40 km, so a 10 km walk gets
+ * there roughly 3 times out of 4 and a full turn of
+ * GAME_ACTION_POINTS kilometres runs into about 2.5.
+ */
+
+#ifndef BB_MOVEMENT
+#define BB_MOVEMENT
+
+#include "game_logic.h"
+
+#define MOVE_KM_PER_UNIT 100.0 // The map's 320 by 200 km
+
+struct move_result {
+    enum encounter_type_id type;
+    enum encounter_id encounter; // ENCOUNTER_NONE if they got there
+    int rolls;                   // Kilometres walked, and action points spent
+};
+
+/*
+ * Walks "player" from where they are through "path",
+ * "point_count" points already in the map bounds,
+ * and leaves them where they stopped.
+ * On the game's actor, inside epoch_enter().
+ */
+void move_player_along(struct player *player,
+                       const struct coordinates *path,
+                       int point_count,
+                       struct move_result *out);
+
+#endif
@@ -0,0 +1,300 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error_handling.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "net_backend.h"
+
+struct net_backend_ops {
+    int (*listen)(const char *ip,
+                  uint16_t port,
+                  net_packet_handler_t handler);
+    ssize_t (*send)(const char *data, ssize_t data_size, struct host *remotehost);
+    void *(*get_host_custom_attr)(struct host *remotehost);
+    void (*set_host_custom_attr)(struct host *remotehost, void *attr);
+    void (*set_host_affinity)(struct host *remotehost, unsigned int key);
+    void (*close_host)(struct host *remotehost);
+    bool (*hold_host)(struct host *remotehost);
+    void (*release_host)(struct host *remotehost);
+};
+
+static struct event_loop_config event_loop_config = {0};
+
+/*
+ * bb-net-lib, wrapped so the signatures
+ * line up with the table.
+ */
+static int bbnetlib_listen(const char *ip,
+                           uint16_t port,
+                           net_packet_handler_t handler)
+{
+    enable_tls();
+    struct host *localhost = create_host(ip, port);
+    listen_for_tcp(localhost, handler);
+    return 0;
+}
+
+static ssize_t bbnetlib_send(const char *data,
+                             ssize_t data_size,
+                             struct host *remotehost)
+{
+    return send_data_tcp(data, data_size, remotehost);
+}
+
+static void *bbnetlib_get_host_custom_attr(struct host *remotehost)
+{
+    return get_host_custom_attr(remotehost);
+}
+
+static void bbnetlib_set_host_custom_attr(struct host *remotehost, void *attr)
+{
+    set_host_custom_attr(remotehost, attr);
+}
+
+// bb-net-lib decides which thread serves a host itself
+static void bbnetlib_set_host_affinity(struct host *remotehost,
+                                       unsigned int key)
+{
+}
+
+static void bbnetlib_close_host(struct host *remotehost)
+{
+    close_connections(remotehost);
+}
+
+// bb-net-lib frees the host once the disconnect handler returns
+static bool bbnetlib_hold_host(struct host *remotehost)
+{
+    return false;
+}
+
+static void bbnetlib_release_host(struct host *remotehost)
+{
+}
+
+/*
+ * Our own event loop
+ */
+static int epoll_listen(const char *ip,
+                        uint16_t port,
+                        net_packet_handler_t handler)
+{
+    event_loop_config.backend = EVENT_LOOP_BACKEND_EPOLL;
+    return event_loop_run(&event_loop_config, ip, port, handler);
+}
+
+static int uring_listen(const char *ip,
+                        uint16_t port,
+                        net_packet_handler_t handler)
+{
+    event_loop_config.backend = EVENT_LOOP_BACKEND_IO_URING;
+    return event_loop_run(&event_loop_config, ip, port, handler);
+}
+
+/*
+ * Null backend, hosts are just their
+ * custom attribute and what was sent.
+ */
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ull
+#define FNV_PRIME        0x100000001B3ull
+
+struct null_host {
+    atomic_int refs;
+    void *custom_attr;
+    struct net_null_stats stats;
+};
+
+static int null_listen(const char *ip,
+                       uint16_t port,
+                       net_packet_handler_t handler)
+{
+    fprintf(stderr, "The null network backend can't listen\n");
+    return -1;
+}
+
+static ssize_t null_send(const char *data,
+                         ssize_t data_size,
+                         struct host *remotehost)
+{
+    struct net_null_stats *stats = &((struct null_host *)remotehost)->stats;
+    for (ssize_t i = 0; i < data_size; i++) {
+        stats->hash = (stats->hash ^ (uint8_t)data[i]) * FNV_PRIME;
+    }
+    stats->packets++;
+    stats->bytes += data_size;
+    return data_size;
+}
+
+static void *null_get_host_custom_attr(struct host *remotehost)
+{
+    return ((struct null_host *)remotehost)->custom_attr;
+}
+
+static void null_set_host_custom_attr(struct host *remotehost, void *attr)
+{
+    ((struct null_host *)remotehost)->custom_attr = attr;
+}
+
+static void null_set_host_affinity(struct host *remotehost, unsigned int key)
+{
+}
+
+// The replay decides when its hosts go away
+static void null_close_host(struct host *remotehost)
+{
+}
+
+static bool null_hold_host(struct host *remotehost)
+{
+    atomic_fetch_add(&((struct null_host *)remotehost)->refs, 1);
+    return true;
+}
+
+static void null_release_host(struct host *remotehost)
+{
+    if (atomic_fetch_sub(&((struct null_host *)remotehost)->refs, 1) == 1) {
+        free(remotehost);
+    }
+}
+
+struct host *net_null_create_host(void)
+{
+    struct null_host *host = calloc(1, sizeof(*host));
+    if (!host) {
+        print_error(BB_ERR_CALLOC);
+        exit(1);
+    }
+    atomic_init(&host->refs, 1);
+    host->stats.hash = FNV_OFFSET_BASIS;
+    return (struct host *)host;
+}
+
+void net_null_destroy_host(struct host *remotehost)
+{
+    null_release_host(remotehost);
+}
+
+void net_null_get_host_stats(struct host *remotehost,
+                             struct net_null_stats *out)
+{
+    *out = ((struct null_host *)remotehost)->stats;
+}
+
+// This is coupled with enum net_backend_type
+static const char net_backend_names[NET_BACKEND_COUNT][16] = {"bbnetlib",
+                                                              "epoll",
+                                                              "io_uring",
+                                                              "null"};
+
+static const struct net_backend_ops net_backends[NET_BACKEND_COUNT] = {
+    {bbnetlib_listen,
+     bbnetlib_send,
+     bbnetlib_get_host_custom_attr,
+     bbnetlib_set_host_custom_attr,
+     bbnetlib_set_host_affinity,
+     bbnetlib_close_host,
+     bbnetlib_hold_host,
+     bbnetlib_release_host},
+    {epoll_listen,
+     event_loop_send,
+     event_loop_get_host_custom_attr,
+     event_loop_set_host_custom_attr,
+     event_loop_set_host_affinity,
+     event_loop_close_host,
+     event_loop_hold_host,
+     event_loop_release_host},
+    {uring_listen,
+     event_loop_send,
+     event_loop_get_host_custom_attr,
+     event_loop_set_host_custom_attr,
+     event_loop_set_host_affinity,
+     event_loop_close_host,
+     event_loop_hold_host,
+     event_loop_release_host},
+    {null_listen,
+     null_send,
+     null_get_host_custom_attr,
+     null_set_host_custom_attr,
+     null_set_host_affinity,
+     null_close_host,
+     null_hold_host,
+     null_release_host},
+};
+
+static const struct net_backend_ops *backend = &net_backends[NET_BACKEND_DEFAULT];
+
+enum net_backend_type net_backend_from_string(const char *name)
+{
+    int i = 0;
+    while (i < NET_BACKEND_COUNT) {
+        if (strcmp(net_backend_names[i], name) == 0) {
+            break;
+        }
+        i++;
+    }
+    return (enum net_backend_type)i;
+}
+
+/*
+ * Only call this at startup,
+ * before net_listen().
+ */
+void net_backend_select(enum net_backend_type type)
+{
+    backend = &net_backends[type];
+}
+
+void net_set_reactor_options(int reactor_count,
+                             bool pin_cpus,
+                             bool game_affinity,
+                             int idle_timeout)
+{
+    event_loop_config.reactor_count = reactor_count;
+    event_loop_config.pin_cpus      = pin_cpus;
+    event_loop_config.game_affinity = game_affinity;
+    event_loop_config.idle_timeout  = idle_timeout;
+}
+
+int net_listen(const char *ip, uint16_t port, net_packet_handler_t handler)
+{
+    return backend->listen(ip, port, handler);
+}
+
+ssize_t net_send(const char *data, ssize_t data_size, struct host *remotehost)
+{
+    metrics_count(METRIC_BYTES_OUT, data_size);
+    return backend->send(data, data_size, remotehost);
+}
+
+void *net_get_host_custom_attr(struct host *remotehost)
+{
+    return backend->get_host_custom_attr(remotehost);
+}
+
+void net_set_host_custom_attr(struct host *remotehost, void *attr)
+{
+    backend->set_host_custom_attr(remotehost, attr);
+}
+
+void net_set_host_affinity(struct host *remotehost, unsigned int key)
+{
+    backend->set_host_affinity(remotehost, key);
+}
+
+void net_close_host(struct host *remotehost)
+{
+    backend->close_host(remotehost);
+}
+
+bool net_hold_host(struct host *remotehost)
+{
+    return backend->hold_host(remotehost);
+}
+
+void net_release_host(struct host *remotehost)
+{
+    backend->release_host(remotehost);
+}
@@ -0,0 +1,105 @@
+/*
+ * ===========================
+ * net_backend.h
+ * ===========================
+ * Every handler talks to the network through these
+ * instead of calling bb-net-lib directly, so the
+ * server can run on either bb-net-lib or our own
+ * io_uring/epoll event loop (see event_loop.h).
+ * The backend is picked once at startup and
+ * the packet handler contract is the same for all
+ * of them.
+ */
+
+#ifndef BB_NET_BACKEND
+#define BB_NET_BACKEND
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "bbnetlib.h"
+
+// This is coupled with net_backend_names
+enum net_backend_type {
+    NET_BACKEND_BBNETLIB,
+    NET_BACKEND_EPOLL,
+    NET_BACKEND_IO_URING,
+    NET_BACKEND_NULL, // No sockets, see net_null_create_host()
+    NET_BACKEND_COUNT
+};
+
+#define NET_BACKEND_DEFAULT NET_BACKEND_IO_URING
+
+typedef void (*net_packet_handler_t)(char *data,
+                                     ssize_t packet_size,
+                                     struct host *remotehost);
+
+// Returns NET_BACKEND_COUNT if the name is unknown
+enum net_backend_type net_backend_from_string(const char *name);
+void                  net_backend_select(enum net_backend_type type);
+/*
+ * Only used by the io_uring and epoll backends.
+ * reactor_count 0 means one reactor per online CPU,
+ * idle_timeout 0 never closes quiet connections.
+ */
+void                  net_set_reactor_options(int reactor_count,
+                                              bool pin_cpus,
+                                              bool game_affinity,
+                                              int idle_timeout);
+
+/*
+ * Blocks forever handing every incoming packet
+ * to "handler", like listen_for_tcp().
+ * Returns -1 if the server couldn't be set up.
+ */
+int     net_listen              (const char *ip,
+                                 uint16_t port,
+                                 net_packet_handler_t handler);
+ssize_t net_send                (const char *data,
+                                 ssize_t data_size,
+                                 struct host *remotehost);
+void   *net_get_host_custom_attr(struct host *remotehost);
+void    net_set_host_custom_attr(struct host *remotehost, void *attr);
+// Keeps every host with the same key on one thread, when supported
+void    net_set_host_affinity   (struct host *remotehost, unsigned int key);
+/*
+ * Drops the connection from any thread. The host
+ * isn't freed here, the packet handler still gets
+ * its 0 length packet from the network thread, and
+ * the host is gone once that returns.
+ */
+void    net_close_host          (struct host *remotehost);
+/*
+ * Keeps the host's memory around past its disconnect
+ * handler, until net_release_host(). Sends to it are
+ * dropped once it's closed.
+ * Returns false when the backend frees hosts on its
+ * own (bb-net-lib), then whoever uses the host has to
+ * be done with it before the disconnect handler returns.
+ */
+bool    net_hold_host           (struct host *remotehost);
+void    net_release_host        (struct host *remotehost);
+
+/*
+ * The null backend never touches a socket, it's for
+ * driving the handlers headless (see benchmarks/replay.c).
+ * Its hosts come from net_null_create_host(), and
+ * whatever's sent to one is counted and hashed, so two
+ * runs can be checked for sending the exact same bytes.
+ * Sends to one host must not race, which holds when
+ * they all come from the host's game actor.
+ */
+struct net_null_stats {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t hash; // FNV-1a over every byte sent, in order
+};
+
+struct host *net_null_create_host   (void);
+// Freed once nothing holds it anymore, see net_hold_host()
+void         net_null_destroy_host  (struct host *remotehost);
+void         net_null_get_host_stats(struct host *remotehost,
+                                     struct net_null_stats *out);
+
+#endif
@@ -8,12 +8,19 @@
 
 #include "auth.h"
 #include "bbnetlib.h"
+#include "epoch.h"
 #include "error_handling.h"
 #include "file_handling.h"
+#include "game_wal.h"
 #include "helpers.h"
 #include "host_custom_attributes.h"
 #include "html_server.h"
+#include "mem_pool.h"
+#include "metrics.h"
+#include "net_backend.h"
 #include "packet_handlers.h"
+#include "recorder.h"
+#include "trace.h"
 #include "websocket_handlers.h"
 #include "websockets.h"
 
@@ -39,18 +46,32 @@ static void websock_handler(char *data,
                             ssize_t packet_size,
                             struct host *remotehost);
 
-static void login_handler(char *restrict data,
+/*
+ * These run on the game's actor
+ */
+static void login_handler(struct game *game,
+                          char *restrict data,
                           ssize_t packet_size,
                           struct host *remotehost);
-static void charsheet_handler(char *restrict data,
+static void charsheet_handler(struct game *game,
+                              char *restrict data,
                               ssize_t packet_size,
                               struct host *remotehost);
+static void websock_open_handler(struct game *game,
+                                 char *data,
+                                 ssize_t packet_size,
+                                 struct host *remotehost);
+static void game_disconnect_handler(struct game *game,
+                                    char *data,
+                                    ssize_t packet_size,
+                                    struct host *remotehost);
 static void post_handler(char *restrict data,
                          ssize_t packet_size,
                          struct host *remotehost);
-static void http_get_handler(char *restrict get_request,
-                        ssize_t packet_size,
-                        struct host *remotehost);
+static void put_host_attr(struct host *remotehost, bool wait);
+static enum metric_route http_get_handler(char *restrict get_request,
+                                          ssize_t packet_size,
+                                          struct host *remotehost);
 
 /* disconnectHandler needs to be at index 0
  * because we use pointer math to handle
@@ -61,6 +82,16 @@ static void http_get_handler(char *restrict get_request,
 static packet_handler_t handlers[HANDLER_COUNT] = {disconnect_handler,
                                                    http_handler,
                                                    websock_handler};
+static const char *handler_trace_names[HANDLER_COUNT] = {"disconnect_handler",
+                                                         "http_handler",
+                                                         "websock_handler"};
+
+// Big enough for every metric, with a few hundred games
+#define METRICS_PAGE_MAX (128 * 1024)
+
+// Every connection's host_custom_attr
+static struct mem_pool host_attr_pool =
+    MEM_POOL_INITIALIZER(struct host_custom_attr, 256);
 
 /*
  * Called from masterHandler,
@@ -74,18 +105,16 @@ static packet_handler_t handlers[HANDLER_COUNT] = {disconnect_handler,
 static inline enum handler initial_handler_check(struct host *remotehost)
 {
     struct host_custom_attr *custom_attr = NULL;
-    if (!get_host_custom_attr(remotehost)) {
-        custom_attr = calloc(1, sizeof(*custom_attr));
-        if (!custom_attr) {
-            print_error(BB_ERR_CALLOC);
-            exit(1);
-        }
+    if (!net_get_host_custom_attr(remotehost)) {
+        custom_attr          = mem_pool_alloc(&host_attr_pool);
         custom_attr->handler = HANDLER_DEFAULT;
-        set_host_custom_attr(remotehost, (void *)custom_attr);
+        executor_group_init(&custom_attr->tasks);
+        atomic_init(&custom_attr->refs, 1);
+        net_set_host_custom_attr(remotehost, (void *)custom_attr);
     }
     else {
         custom_attr =
-            (struct host_custom_attr *)get_host_custom_attr(remotehost);
+            (struct host_custom_attr *)net_get_host_custom_attr(remotehost);
     }
     return custom_attr->handler;
 }
@@ -99,7 +128,12 @@ void master_handler(char *restrict data,
                     ssize_t packet_size,
                     struct host *remotehost)
 {
+    trace_begin("master_handler");
     const enum handler handler = initial_handler_check(remotehost);
+    if (packet_size > 0) {
+        metrics_count(METRIC_BYTES_IN, packet_size);
+        metrics_count(METRIC_PACKETS_IN, 1);
+    }
 #ifdef DEBUG
     if (packet_size > 0) {
         printf("\nReceived data:");
@@ -115,21 +149,45 @@ void master_handler(char *restrict data,
 
     // Pointer math handles client disconnects
     // and calls disconnectHandler()
-    handlers[handler * (packet_size > 0)](data, packet_size, remotehost);
-
+    const int handler_index = handler * (packet_size > 0);
+    trace_begin(handler_trace_names[handler_index]);
+    handlers[handler_index](data, packet_size, remotehost);
+    trace_end(handler_trace_names[handler_index]);
+    // Scratch memory is only good for one packet
+    arena_reset();
+    trace_end("master_handler");
     return;
 }
 
 /*
- * Handler for HTTP GET requests
+ * Only for whoever has the metrics token,
+ * everyone else gets a 403 like any other
+ * file they're not allowed.
+ */
+static enum metric_route metrics_handler(char *restrict get_request,
+                                         struct host *remotehost)
+{
+    if (!metrics_is_authorized(get_request)) {
+        send_forbidden_packet(remotehost);
+        return METRIC_ROUTE_FORBIDDEN;
+    }
+    char *page           = arena_alloc(METRICS_PAGE_MAX);
+    const size_t written = metrics_render(page, METRICS_PAGE_MAX);
+    send_buffer(page, (int)written, HTTP_FLAG_TEXT_PLAIN, remotehost, NULL);
+    return METRIC_ROUTE_METRICS;
+}
+
+/*
+ * Handler for HTTP GET requests,
+ * returns which route it took
  */
-static void http_get_handler(char *restrict get_request,
-                             ssize_t packet_size,
-                             struct host *remotehost)
+static enum metric_route http_get_handler(char *restrict get_request,
+                                          ssize_t packet_size,
+                                          struct host *remotehost)
 {
     assert(get_request && remotehost);
     const int starting_index = strnlen("GET /", 5);
-    if (packet_size <= starting_index) return;
+    if (packet_size <= starting_index) return METRIC_ROUTE_FORBIDDEN;
 
     char requested_resource[MAX_FILENAME_LEN] = {0};
     const struct char_slice filename = slice_string_to(get_request,
@@ -139,17 +197,26 @@ static void http_get_handler(char *restrict get_request,
     char *file_table_entry = NULL;
 
     struct host_custom_attr *custom_attr =
-        (struct host_custom_attr *)get_host_custom_attr(remotehost);
+        (struct host_custom_attr *)net_get_host_custom_attr(remotehost);
 
     if (filename.len < 0 || filename.len > MAX_FILENAME_LEN) {
-        return;
+        return METRIC_ROUTE_FORBIDDEN;
     }
 
     memcpy(requested_resource, filename.start, filename.len);
 
+    if (string_search(get_request, "GET /metrics ", 14) >= 0) {
+        return metrics_handler(get_request, remotehost);
+    }
+
     struct game     *game   = get_game_from_name(test_game_name);
     session_token_t  token  = get_token_from_http(get_request, packet_size);
-    struct player   *player = try_get_player_from_token(token, game);
+    struct player   *player = NULL;
+
+    // Deleted games can't be found, they get the login page or a 403
+    if (game) {
+        player = try_get_player_from_token(token, game);
+    }
 
     /* Direct the remotehost to the login, character creation
      * or game depending on their session token.
@@ -165,27 +232,39 @@ static void http_get_handler(char *restrict get_request,
                          NULL);
         }
         else if (string_search(get_request, "Sec-WebSocket-Key", packet_size) >= 0) {
-            send_web_socket_response(get_request, packet_size, remotehost);
             struct host_custom_attr *host_attr =
-                (struct host_custom_attr *)get_host_custom_attr(remotehost);
-            host_attr->player    = player;
+                (struct host_custom_attr *)net_get_host_custom_attr(remotehost);
+            host_attr->player    = get_player_handle(player);
+            set_host_game(host_attr, game);
+            mark_host_seen(host_attr);
+            // Before the response goes out, the client's first
+            // websocket message can come in right after it, and
+            // has to reach the game's actor after the open does.
             custom_attr->handler = HANDLER_WEBSOCK;
-            cache_host(remotehost, get_current_host_cache());
-            return;
+            game_actor_post(game, websock_open_handler, NULL, 0, remotehost);
+            send_web_socket_response(get_request, packet_size, remotehost);
+            // Everyone in the same game ends up on the same
+            // reactor, so game broadcasts don't cross cores.
+            net_set_host_affinity(remotehost,
+                                  hash_data_simple(game->name,
+                                                   strnlen(game->name,
+                                                           MAX_CREDENTIAL_LEN)));
+            metrics_count(METRIC_WEBSOCKET_HANDSHAKES, 1);
+            return METRIC_ROUTE_WEBSOCKET;
         }
         else {
             send_content("./game.html", HTTP_FLAG_TEXT_HTML, remotehost, NULL);
         }
-        return;
+        return METRIC_ROUTE_PAGE;
     }
     // Unauthenticated users are allowed the stylesheet, and login script
     else if (string_search(get_request, "GET /styles.css", 16) >= 0) {
         send_content("./styles.css", HTTP_FLAG_TEXT_CSS, remotehost, NULL);
-        return;
+        return METRIC_ROUTE_FILE;
     }
     else if (string_search(get_request, "GET /login.js", 14) >= 0) {
         send_content("./login.js", HTTP_FLAG_TEXT_JAVASCRIPT, remotehost, NULL);
-        return;
+        return METRIC_ROUTE_FILE;
     }
     /*
      * For any other url than a blank one
@@ -195,23 +274,25 @@ static void http_get_handler(char *restrict get_request,
      */
     if (!player) {
         send_forbidden_packet(remotehost);
-        return;
+        return METRIC_ROUTE_FORBIDDEN;
     }
     else if (is_file_allowed(requested_resource, &file_table_entry)) {
         send_content(file_table_entry,
                      get_content_type_enum_from_filename(file_table_entry),
                      remotehost,
                      NULL);
-        return;
+        return METRIC_ROUTE_FILE;
     }
     else if (string_search(get_request, "GET /index.js", 12) >= 0) {
         send_content("./index.js", HTTP_FLAG_TEXT_JAVASCRIPT, remotehost, NULL);
-        return;
+        return METRIC_ROUTE_FILE;
     }
     send_forbidden_packet(remotehost);
+    return METRIC_ROUTE_FORBIDDEN;
 }
 
-static void login_handler(char *restrict data,
+static void log_player_in(struct game *game,
+                          char *restrict data,
                           ssize_t packet_size,
                           struct host *remotehost)
 {
@@ -220,47 +301,45 @@ static void login_handler(char *restrict data,
     struct player_credentials credentials           = {0};
     int credential_index                            = 0;
     const char first_form_field[MAX_CREDENTIAL_LEN] = "playerName=";
-    struct html_form form                           = {0};
+    struct html_form *form                          = arena_alloc(sizeof(*form));
 
     // Where the credentials start, as expected by parse_html_form().
     credential_index =
         string_search(data, first_form_field, packet_size);
 
+    memset(form, 0, sizeof(*form));
     parse_html_form(&data[credential_index],
-                    &form,
+                    form,
                     packet_size - credential_index);
-    if (form.field_count < FORM_CREDENTIAL_FIELD_COUNT) {
+    if (form->field_count < FORM_CREDENTIAL_FIELD_COUNT) {
         send_forbidden_packet(remotehost); // placeholder
         return;
     }
-    if (try_game_login(get_game_from_name(test_game_name),
-                       form.fields[FORM_CREDENTIAL_GAMEPASSWORD]) != 0) {
+    if (try_game_login(game, form->fields[FORM_CREDENTIAL_GAMEPASSWORD]) != 0) {
         send_bad_request_packet(remotehost);
         return;
     };
     strncpy(credentials.name,
-            form.fields[FORM_CREDENTIAL_PLAYERNAME],
+            form->fields[FORM_CREDENTIAL_PLAYERNAME],
             MAX_CREDENTIAL_LEN);
     strncpy(credentials.password,
-            form.fields[FORM_CREDENTIAL_PLAYERPASSWORD],
+            form->fields[FORM_CREDENTIAL_PLAYERPASSWORD],
             MAX_CREDENTIAL_LEN);
-    if (try_player_login(get_game_from_name(test_game_name),
-                         &credentials,
-                         remotehost) < 0) {
+    if (try_player_login(game, &credentials, remotehost) < 0) {
         send_bad_request_packet(remotehost);
         return;
     }
     return;
 }
 
-static void charsheet_handler(char *restrict data,
+static void fill_in_charsheet(struct game *game,
+                              char *restrict data,
                               ssize_t packet_size,
                               struct host *remotehost)
 {
-    session_token_t token = get_token_from_http(data, packet_size);
-    struct player *player =
-        try_get_player_from_token(token, get_game_from_name(test_game_name));
-    struct html_form form = {0};
+    session_token_t token  = get_token_from_http(data, packet_size);
+    struct player *player  = try_get_player_from_token(token, game);
+    struct html_form *form = arena_alloc(sizeof(*form));
 
     const char first_form_field[HTMLFORM_FIELD_MAX_LEN] = "playerBackground=";
 
@@ -275,104 +354,274 @@ static void charsheet_handler(char *restrict data,
         send_forbidden_packet(remotehost); // placeholder
         return;
     }
+    memset(form, 0, sizeof(*form));
     parse_html_form(&data[html_form_index],
-                    &form,
+                    form,
                     packet_size - html_form_index);
-    if (init_charsheet_from_form(player, &form) != 0) {
+    if (init_charsheet_from_form(player, form) != 0) {
         // The client needs to know about malformed data
         send_forbidden_packet(remotehost); // placeholder
         return;
     }
+    log_player_charsheet(player);
+    record_charsheet(player);
     send_content("./game.html", HTTP_FLAG_TEXT_HTML, remotehost, NULL);
 }
 
+static void login_handler(struct game *game,
+                          char *restrict data,
+                          ssize_t packet_size,
+                          struct host *remotehost)
+{
+    const uint64_t start = metrics_now_ns();
+    trace_begin("login");
+    log_player_in(game, data, packet_size, remotehost);
+    trace_end("login");
+    metrics_time_route(METRIC_ROUTE_LOGIN, metrics_now_ns() - start);
+}
+
+static void charsheet_handler(struct game *game,
+                              char *restrict data,
+                              ssize_t packet_size,
+                              struct host *remotehost)
+{
+    const uint64_t start = metrics_now_ns();
+    trace_begin("charsheet");
+    fill_in_charsheet(game, data, packet_size, remotehost);
+    trace_end("charsheet");
+    metrics_time_route(METRIC_ROUTE_CHARSHEET, metrics_now_ns() - start);
+}
+
+/*
+ * Logging in and filling in the charsheet change
+ * the game, so they're handed to the game's actor.
+ */
 static void post_handler(char *restrict data,
                          ssize_t packet_size,
                          struct host *remotehost)
 {
+    struct host_custom_attr *attr = net_get_host_custom_attr(remotehost);
+    struct game *game             = get_game_from_name(test_game_name);
+    game_cmd_handler_t handler    = NULL;
+
+    if (!game) {
+        send_bad_request_packet(remotehost);
+        return;
+    }
     if (string_search(data, "login", 12) >= 0) {
-        login_handler(data, packet_size, remotehost);
+        handler = login_handler;
     }
     else if (string_search(data, "charsheet", 16) >= 0) {
-        charsheet_handler(data, packet_size, remotehost);
+        handler = charsheet_handler;
+    }
+    else {
+        return;
     }
+    set_host_game(attr, game);
+    game_actor_post(game, handler, data, packet_size, remotehost);
 }
 
-static void http_handler(char *restrict data,
-                         ssize_t packet_size,
-                         struct host *remotehost)
+/*
+ * A copy of an HTTP request, handed to the executor.
+ */
+struct http_request {
+    struct host *remotehost;
+    ssize_t packet_size;
+    char data[];
+};
+
+// Runs on the executor
+static void run_http_request(void *arg)
 {
-    if (packet_size < 10) {
-        return;
-    }
+    struct http_request *request = arg;
+    char *data                   = request->data;
+    const ssize_t packet_size    = request->packet_size;
+    struct host *remotehost      = request->remotehost;
+    const uint64_t start         = metrics_now_ns();
+
+    // The handlers look up games
+    trace_begin("http_request");
+    epoch_enter();
     if (string_search(data, "GET /", 8) >= 0) {
-        http_get_handler(data, packet_size, remotehost);
+        const enum metric_route route =
+            http_get_handler(data, packet_size, remotehost);
+        metrics_time_route(route, metrics_now_ns() - start);
     }
     else if (string_search(data, "POST /", 8) >= 0) {
+        // Timed on the game's actor
         post_handler(data, packet_size, remotehost);
     }
     else {
         send_forbidden_packet(remotehost);
+        metrics_time_route(METRIC_ROUTE_FORBIDDEN, metrics_now_ns() - start);
     }
+    epoch_exit();
+    trace_end("http_request");
+    mem_free(request);
+    put_host_attr(remotehost, false);
 }
 
 /*
- * Global caching state.
- * Affected by disconnections.
+ * Routing, handshakes, form parsing and building
+ * responses all happen on the executor, so the
+ * network thread can get back to reading sockets.
+ * Browsers don't pipeline HTTP requests, so
+ * responses can't overtake each other.
  */
-pthread_mutex_t caching_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void http_handler(char *restrict data,
+                         ssize_t packet_size,
+                         struct host *remotehost)
+{
+    if (packet_size < 10) {
+        return;
+    }
+    struct host_custom_attr *attr = net_get_host_custom_attr(remotehost);
+    struct http_request *request  = mem_alloc(sizeof(*request) + packet_size + 1);
 
-// Netlib gives us numbered caches for
-// storing hosts that connect
-int8_t current_host_cache = 0;
-int8_t last_host_cache    = 0;
+    request->remotehost  = remotehost;
+    request->packet_size = packet_size;
+    memcpy(request->data, data, packet_size);
+    request->data[packet_size] = '\0';
+    atomic_fetch_add(&attr->refs, 1);
+    executor_submit(run_http_request, request, &attr->tasks);
+}
 
-static void disconnect_handler(char *data,
-                               ssize_t packet_size,
-                               struct host *remotehost)
+static void websock_open_handler(struct game *game,
+                                 char *data,
+                                 ssize_t packet_size,
+                                 struct host *remotehost)
 {
-    struct host_custom_attr *attr = get_host_custom_attr(remotehost);
-    if (attr->handler == HANDLER_WEBSOCK) {
-        uncache_host(remotehost, get_current_host_cache());
-        // TODO: When someone disconnects,
-        // the game will need to pause and alert everyone
-        // of the disconnect and ask whether to
-        // continue or wait.
+    struct player *player = get_player_from_host(remotehost);
+    if (player) {
+        player->associated_host = remotehost;
+        record_host_open(player);
+        watch_idle_hosts(game);
     }
 }
 
+static void free_host_attr(struct host *remotehost)
+{
+    struct host_custom_attr *attr = net_get_host_custom_attr(remotehost);
+    executor_group_destroy(&attr->tasks);
+    net_set_host_custom_attr(remotehost, NULL);
+    mem_pool_free(&host_attr_pool, attr);
+    net_release_host(remotehost);
+}
+
+static void game_disconnect_handler(struct game *game,
+                                    char *data,
+                                    ssize_t packet_size,
+                                    struct host *remotehost)
+{
+    struct player *player = get_player_from_host(remotehost);
+    if (player && player->associated_host == remotehost) {
+        player->associated_host = NULL;
+        record_host_close(player);
+    }
+    // TODO: When someone disconnects,
+    // the game will need to pause and alert everyone
+    // of the disconnect and ask whether to
+    // continue or wait.
+    free_host_attr(remotehost);
+    atomic_fetch_sub(&game->attached_hosts, 1);
+}
+
 /*
- * When a user disconnects,
- * all OTHER users who are still
- * connected get written to another
- * multicast cache and the former
- * one is cleared.
- * This function returns the up-to-date
- * multicast cache.
+ * Whoever lets go of the host last, the network thread
+ * or an executor worker, hands it to the game's actor,
+ * which gets through everything already posted for the
+ * host before removing it from the game and freeing it.
+ * Only ever "wait" from the network thread.
  */
-int get_current_host_cache(void)
+static void put_host_attr(struct host *remotehost, bool wait)
 {
-    pthread_mutex_lock(&caching_mutex);
-    int ret = (int)current_host_cache;
-    pthread_mutex_unlock(&caching_mutex);
-    return ret;
+    struct host_custom_attr *attr = net_get_host_custom_attr(remotehost);
+    if (atomic_fetch_sub(&attr->refs, 1) != 1) {
+        return;
+    }
+    if (!attr->game) {
+        free_host_attr(remotehost);
+    }
+    else if (wait) {
+        game_actor_call(attr->game, game_disconnect_handler, NULL, 0, remotehost);
+    }
+    else {
+        game_actor_post(attr->game, game_disconnect_handler, NULL, 0, remotehost);
+    }
 }
 
+/*
+ * The host outlives this on backends that let us hold
+ * it, so the network thread doesn't wait on anyone.
+ * bb-net-lib frees it once we return though, so there
+ * we still have to wait for the HTTP requests being
+ * handled and for the game's actor.
+ */
+static void disconnect_handler(char *data,
+                               ssize_t packet_size,
+                               struct host *remotehost)
+{
+    struct host_custom_attr *attr = net_get_host_custom_attr(remotehost);
+    if (net_hold_host(remotehost)) {
+        put_host_attr(remotehost, false);
+        return;
+    }
+    executor_group_wait(&attr->tasks);
+    put_host_attr(remotehost, true);
+}
+
+/*
+ * Control frames are answered right here on the
+ * network thread, only data frames go to the game.
+ */
 static void websock_handler(char *restrict data,
                             ssize_t packet_size,
                             struct host *remotehost)
 {
-    const int min_websocket_packet_len = 8;
-    if (packet_size < min_websocket_packet_len) {
+    if (packet_size < WEBSOCKET_CLIENT_HEADER_MIN) {
         fprintf(stderr, "\nToo short websocket packet received.\n");
         return;
     }
     // After this part we can freely dereference the
-    // first 8 bytes for opcodes and such.
-    char decoded_data[MAX_PACKET_SIZE] = {0};
-    int decoded_data_length            = 0;
+    // header and mask for opcodes and such.
+    char *decoded_data      = arena_alloc(MAX_PACKET_SIZE);
+    int decoded_data_length = 0;
 
+    // Any frame at all means they're still there
+    mark_host_seen(net_get_host_custom_attr(remotehost));
+    memset(decoded_data, 0, MAX_PACKET_SIZE);
+    trace_begin("websocket_decode");
     decoded_data_length =
         decode_websocket_message(decoded_data, data, packet_size);
-    handle_game_message(decoded_data, decoded_data_length, remotehost);
+    trace_end("websocket_decode");
+
+    switch (get_websocket_opcode(data)) {
+    case WEBSOCKET_OPCODE_PING:
+        // A pong carries the ping's payload back
+        send_websocket_control(WEBSOCKET_OPCODE_PONG,
+                               decoded_data,
+                               decoded_data_length,
+                               remotehost);
+        break;
+    case WEBSOCKET_OPCODE_PONG:
+        // Answering our ping, being seen was the point
+        break;
+    case WEBSOCKET_OPCODE_CLOSE:
+        // Echo the status code, and since nothing else
+        // can be said after a close, drop the connection
+        // once the echo is out.
+        send_websocket_control(WEBSOCKET_OPCODE_CLOSE,
+                               decoded_data,
+                               decoded_data_length >= 2 ? 2 : 0,
+                               remotehost);
+        net_close_host(remotehost);
+        break;
+    default:
+        if (decoded_data_length < (int)sizeof(opcode_t)) {
+            fprintf(stderr, "\nToo short websocket packet received.\n");
+            return;
+        }
+        handle_game_message(decoded_data, decoded_data_length, remotehost);
+        break;
+    }
 }
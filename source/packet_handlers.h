@@ -20,6 +20,4 @@ void master_handler(char *restrict data,
 
 void build_file_table(void);
 
-int get_current_host_cache(void);
-
 #endif
@@ -0,0 +1,283 @@
+/*
+ * ===========================
+ * recorder.c
+ * ===========================
+ * Every record is written under "lock", which
+ * also keeps the ones from one game in the order
+ * its actor ran them. A flusher thread pushes the
+ * stdio buffer out now and then, so a crash loses
+ * at most RECORDER_FLUSH_INTERVAL_MS of it.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "epoch.h"
+#include "recorder.h"
+
+#define RECORDER_FLUSH_INTERVAL_MS 100
+#define RECORDER_BUFFER_SIZE       (1 << 20)
+
+static struct {
+    pthread_mutex_t lock;
+    FILE *file;
+    uint64_t start_ns;
+    atomic_bool enabled;
+    atomic_uint next_game_id;
+} recorder = {.lock = PTHREAD_MUTEX_INITIALIZER, .next_game_id = 1};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+int recorder_enabled(void)
+{
+    return atomic_load_explicit(&recorder.enabled, memory_order_relaxed);
+}
+
+/*
+ * Stamps the game's next tick on the record,
+ * so only call it from the game's actor.
+ */
+static void write_record(struct game *game,
+                         enum recording_type type,
+                         const struct player *player,
+                         const void *payload,
+                         uint32_t size)
+{
+    struct recording_record record = {0};
+    record.type       = type;
+    record.game_id    = game->record_id;
+    record.tick       = game->record_tick++;
+    record.slot       = player ? player->id : INVALID_PLAYER_ID;
+    record.generation = player ? player->generation : 0;
+    record.size       = size;
+
+    pthread_mutex_lock(&recorder.lock);
+    record.time_ns = now_ns() - recorder.start_ns;
+    fwrite(&record, sizeof(record), 1, recorder.file);
+    if (size) {
+        fwrite(payload, size, 1, recorder.file);
+    }
+    pthread_mutex_unlock(&recorder.lock);
+}
+
+static void fill_charsheet(struct recorded_charsheet *out,
+                           const struct character_sheet *char_sheet)
+{
+    out->gender     = char_sheet->gender;
+    out->vigour     = char_sheet->vigour;
+    out->violence   = char_sheet->violence;
+    out->cunning    = char_sheet->cunning;
+    out->background = char_sheet->background;
+    out->is_valid   = atomic_load(&char_sheet->is_valid);
+}
+
+static void fill_player(struct recorded_player *out,
+                        const struct player *player)
+{
+    memcpy(out->name, player->credentials.name, MAX_CREDENTIAL_LEN);
+    out->coords[0] = player->coords.x;
+    out->coords[1] = player->coords.y;
+    out->coords[2] = player->coords.z;
+    fill_charsheet(&out->char_sheet, &player->char_sheet);
+    out->current_enc   = player->current_enc;
+    out->action_points = player->action_points;
+    out->km_walked     = player->km_walked;
+}
+
+void record_game_begin(struct game *game)
+{
+    struct recorded_game record = {0};
+    if (!recorder_enabled()) {
+        return;
+    }
+    game->record_id   = atomic_fetch_add(&recorder.next_game_id, 1);
+    game->record_tick = 0;
+    memcpy(record.name, game->name, MAX_CREDENTIAL_LEN);
+    record.max_player_count = game->max_player_count;
+    record.min_player_count = game->min_player_count;
+    record.rng_state        = game->rng_state;
+    record.state_epoch      = game->state_epoch;
+    record.heat_shift_count =
+        game->heat_overlay ? game->heat_overlay->shift_count : 0;
+    write_record(game, RECORD_GAME_BEGIN, NULL, &record, sizeof(record));
+}
+
+/*
+ * Only records games that were recorded from
+ * the start, a game that was created before
+ * recorder_start() and missed the keyframe
+ * can't be replayed anyway.
+ */
+static struct game *get_recorded_game(const struct player *player)
+{
+    if (!recorder_enabled() || !player->game->record_id) {
+        return NULL;
+    }
+    return player->game;
+}
+
+void record_player_create(const struct player *player)
+{
+    struct recorded_player record = {0};
+    struct game *game             = get_recorded_game(player);
+    if (!game) {
+        return;
+    }
+    fill_player(&record, player);
+    write_record(game, RECORD_PLAYER_CREATE, player, &record, sizeof(record));
+}
+
+void record_player_leave(const struct player *player)
+{
+    struct game *game = get_recorded_game(player);
+    if (!game) {
+        return;
+    }
+    write_record(game, RECORD_PLAYER_LEAVE, player, NULL, 0);
+}
+
+void record_charsheet(const struct player *player)
+{
+    struct recorded_charsheet record = {0};
+    struct game *game                = get_recorded_game(player);
+    if (!game) {
+        return;
+    }
+    fill_charsheet(&record, &player->char_sheet);
+    write_record(game, RECORD_CHARSHEET, player, &record, sizeof(record));
+}
+
+void record_host_open(const struct player *player)
+{
+    struct game *game = get_recorded_game(player);
+    if (!game) {
+        return;
+    }
+    write_record(game, RECORD_HOST_OPEN, player, NULL, 0);
+}
+
+void record_host_close(const struct player *player)
+{
+    struct game *game = get_recorded_game(player);
+    if (!game) {
+        return;
+    }
+    write_record(game, RECORD_HOST_CLOSE, player, NULL, 0);
+}
+
+void record_message(const struct player *player,
+                    const char *data,
+                    ssize_t data_size)
+{
+    struct game *game = get_recorded_game(player);
+    if (!game) {
+        return;
+    }
+    write_record(game, RECORD_MESSAGE, player, data, (uint32_t)data_size);
+}
+
+void record_turn_timeout(const struct player *player)
+{
+    struct game *game = get_recorded_game(player);
+    if (!game) {
+        return;
+    }
+    write_record(game, RECORD_TURN_TIMEOUT, player, NULL, 0);
+}
+
+/*
+ * Keyframe, before the game workers run,
+ * so nothing's changing under us.
+ */
+static void record_game_keyframe(struct game *game, void *arg)
+{
+    struct recorded_turn turn = {0};
+    record_game_begin(game);
+    for (player_mask_t slots = get_live_players(game); slots;) {
+        const struct player *player = &game->players[pop_player_slot(&slots)];
+        struct recorded_player record = {0};
+        fill_player(&record, player);
+        write_record(game,
+                     RECORD_PLAYER_RESTORE,
+                     player,
+                     &record,
+                     sizeof(record));
+    }
+    turn.state = game->state;
+    turn.current_turn =
+        game->current_turn ? game->current_turn->id : INVALID_PLAYER_ID;
+    write_record(game, RECORD_GAME_TURN, NULL, &turn, sizeof(turn));
+    if (!game->heat_overlay) {
+        return;
+    }
+    for (int i = 0; i < HEATMAP_OVERLAY_CELLS; i++) {
+        const struct heatmap_node *node = &game->heat_overlay->nodes[i];
+        struct recorded_heat_node record = {0};
+        if (!is_heatmap_node_set(node)) {
+            continue;
+        }
+        record.index = i;
+        memcpy(record.lanes, node->lanes, sizeof(record.lanes));
+        write_record(game, RECORD_HEAT_NODE, NULL, &record, sizeof(record));
+    }
+}
+
+void recorder_flush(void)
+{
+    pthread_mutex_lock(&recorder.lock);
+    if (recorder.file) {
+        fflush(recorder.file);
+    }
+    pthread_mutex_unlock(&recorder.lock);
+}
+
+static void *run_flusher(void *arg)
+{
+    const struct timespec interval = {
+        .tv_sec  = 0,
+        .tv_nsec = RECORDER_FLUSH_INTERVAL_MS * 1000000L};
+    while (1) {
+        nanosleep(&interval, NULL);
+        recorder_flush();
+    }
+    return NULL;
+}
+
+int recorder_start(const char *path)
+{
+    struct recording_header header = {0};
+    pthread_t flusher;
+
+    recorder.file = fopen(path, "wb");
+    if (!recorder.file) {
+        perror("Couldn't open the recording");
+        return -1;
+    }
+    setvbuf(recorder.file, NULL, _IOFBF, RECORDER_BUFFER_SIZE);
+    memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+    header.version    = RECORDING_VERSION;
+    header.created_at = (uint64_t)time(NULL);
+    fwrite(&header, sizeof(header), 1, recorder.file);
+
+    recorder.start_ns = now_ns();
+    atomic_store(&recorder.enabled, true);
+    epoch_enter();
+    for_each_game(record_game_keyframe, NULL);
+    epoch_exit();
+
+    if (pthread_create(&flusher, NULL, run_flusher, NULL) != 0) {
+        perror("Couldn't start the recording flusher");
+        return -1;
+    }
+    pthread_detach(flusher);
+    printf("Recording every game to %s\n", path);
+    return 0;
+}
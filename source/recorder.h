@@ -0,0 +1,137 @@
+/*
+ * ===========================
+ * recorder.h
+ * ===========================
+ * Records what every game was fed, so a desync or a
+ * slowdown seen in production can be replayed
+ * headless and bit for bit (see benchmarks/replay.c).
+ *
+ * Recording starts with a keyframe of every game:
+ * its RNG state, its players, whose turn it is and
+ * how its encounter odds have shifted.
+ * After that we record, on the game's actor, in the
+ * order the actor ran them:
+ * - the decoded websocket messages run_game_message() ran
+ * - players joining, leaving and filling in their charsheet
+ * - websockets opening and closing, since that decides
+ *   who broadcasts reach
+ * - turns timing out, which depends on the wall clock
+ * Every record carries the game's logical clock, which
+ * ticks once per record, so gaps show up on replay.
+ *
+ * Passwords and session tokens are never recorded.
+ *
+ * Records go through one buffered file under a lock,
+ * which is cheap next to the game logic but not free,
+ * so it's only on with --record.
+ */
+
+#ifndef BB_RECORDER
+#define BB_RECORDER
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "game_logic.h"
+#include "heatmap.h"
+
+#define RECORDING_MAGIC   "RELICREC"
+#define RECORDING_VERSION 5
+
+enum recording_type {
+    RECORD_GAME_BEGIN,     // struct recorded_game
+    RECORD_PLAYER_RESTORE, // struct recorded_player, keyframe only
+    RECORD_GAME_TURN,      // struct recorded_turn, keyframe only
+    RECORD_PLAYER_CREATE,  // struct recorded_player
+    RECORD_PLAYER_LEAVE,   // Nothing
+    RECORD_CHARSHEET,      // struct recorded_charsheet
+    RECORD_HOST_OPEN,      // Nothing
+    RECORD_HOST_CLOSE,     // Nothing
+    RECORD_MESSAGE,        // The decoded message, opcode first
+    RECORD_TURN_TIMEOUT,   // Nothing, about whose turn it was
+    RECORD_HEAT_NODE,      // struct recorded_heat_node, keyframe only
+    RECORD_TYPE_COUNT
+};
+
+struct recording_header {
+    char magic[8];
+    uint32_t version;
+    uint64_t created_at; // Unix time
+} __attribute__((packed));
+
+// Followed by "size" bytes of payload
+struct recording_record {
+    uint8_t type;
+    uint32_t game_id;
+    uint64_t tick;    // The game's logical clock
+    uint64_t time_ns; // Since recording started, for reference only
+    int16_t slot;     // Player slot, if it's about one
+    uint16_t generation;
+    uint32_t size;
+} __attribute__((packed));
+
+struct recorded_game {
+    char name[MAX_CREDENTIAL_LEN];
+    int32_t max_player_count;
+    int32_t min_player_count;
+    uint64_t rng_state;
+    uint32_t state_epoch; // It's in what we send, see wire.h
+    uint32_t heat_shift_count;
+} __attribute__((packed));
+
+struct recorded_charsheet {
+    int32_t gender;
+    uint32_t vigour;
+    uint32_t violence;
+    uint32_t cunning;
+    int32_t background;
+    uint8_t is_valid;
+} __attribute__((packed));
+
+struct recorded_player {
+    char name[MAX_CREDENTIAL_LEN];
+    double coords[3];
+    struct recorded_charsheet char_sheet;
+    int32_t current_enc;
+    int32_t action_points;
+    double km_walked; // Partial kilometres carry over, see movement.h
+} __attribute__((packed));
+
+// One of the game's heatmap overlay nodes that isn't 0
+struct recorded_heat_node {
+    uint16_t index;
+    uint16_t lanes[HEATMAP_LANES];
+} __attribute__((packed));
+
+struct recorded_turn {
+    int32_t state;
+    int16_t current_turn; // Slot, or INVALID_PLAYER_ID
+} __attribute__((packed));
+
+/*
+ * Call once every game that's restored has been,
+ * before the game workers start. Returns -1 if
+ * the file couldn't be opened.
+ */
+int  recorder_start  (const char *path);
+int  recorder_enabled(void);
+// Writes out whatever's buffered
+void recorder_flush  (void);
+
+/*
+ * On the game's actor, except record_game_begin(),
+ * which runs before the game can be posted to.
+ * All of them are no-ops unless we're recording.
+ */
+void record_game_begin   (struct game *game);
+void record_player_create(const struct player *player);
+void record_player_leave (const struct player *player);
+void record_charsheet    (const struct player *player);
+void record_host_open    (const struct player *player);
+void record_host_close   (const struct player *player);
+void record_message      (const struct player *player,
+                          const char *data,
+                          ssize_t data_size);
+void record_turn_timeout (const struct player *player);
+
+#endif
@@ -0,0 +1,498 @@
+/*
+ * ===========================
+ * snapshot.c
+ * ===========================
+ * Records are packed and fixed size, with every
+ * field spelled out instead of copying our structs,
+ * so pointers and padding never end up on disk and
+ * struct changes don't silently change the format.
+ * Bump SNAPSHOT_VERSION whenever a record changes.
+ *
+ * The child can't take any lock another thread might
+ * have held when we forked, so it walks the registry
+ * without locks and doesn't allocate.
+ * A game worker might have been in the middle of a
+ * command when we forked, so a game can be saved with
+ * that one command half applied.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "game_logic.h"
+#include "heatmap.h"
+#include "helpers.h"
+#include "snapshot.h"
+#include "wal.h"
+
+#define SNAPSHOT_MAGIC    "RELICSNP"
+#define SNAPSHOT_VERSION  4
+#define SNAPSHOT_PATH_MAX 4096
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t game_count;
+    uint64_t created_at;   // Unix time
+    uint64_t payload_size; // Bytes after the header
+    uint32_t checksum;     // hash_data_simple() of the payload
+    uint64_t wal_lsn;      // Log records up to here are in the snapshot
+} __attribute__((packed));
+
+struct snapshot_game {
+    char name[MAX_CREDENTIAL_LEN];
+    char password[MAX_CREDENTIAL_LEN];
+    int32_t max_player_count;
+    int32_t min_player_count;
+    int32_t state;
+    int16_t current_turn;  // Slot, or INVALID_PLAYER_ID
+    uint16_t player_count; // Player records right after this one
+    uint32_t heat_shift_count;
+    uint16_t heat_node_count; // Heatmap node records after the players
+} __attribute__((packed));
+
+struct snapshot_player {
+    int16_t id;
+    uint16_t generation;
+    char name[MAX_CREDENTIAL_LEN];
+    char password[MAX_CREDENTIAL_LEN];
+    int64_t session_token;
+    uint8_t charsheet_valid;
+    int32_t gender;
+    uint32_t vigour;
+    uint32_t violence;
+    uint32_t cunning;
+    int32_t background;
+    double coords[3];
+    int32_t resources[RESOURCE_COUNT];
+    int32_t current_enc;
+    int32_t action_points;
+    double km_walked;
+} __attribute__((packed));
+
+// One of the game's heatmap overlay nodes that isn't 0
+struct snapshot_heat_node {
+    uint16_t index;
+    uint16_t lanes[HEATMAP_LANES];
+} __attribute__((packed));
+
+// Where the child is at while writing
+struct snapshot_writer {
+    char *data;
+    size_t offset;
+    uint32_t game_count;
+    size_t size;
+};
+
+static struct {
+    atomic_uint_fast64_t taken;
+    atomic_uint_fast64_t failed;
+    atomic_uint_fast64_t last_fork_us;
+    atomic_uint_fast64_t last_write_us;
+    atomic_uint_fast64_t last_size;
+    atomic_uint_fast64_t last_game_count;
+} stats;
+
+static char snapshot_path[SNAPSHOT_PATH_MAX];
+static int snapshot_interval = SNAPSHOT_DEFAULT_INTERVAL;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * Writing, in the child
+ * --------------------
+ */
+static int count_heat_nodes(const struct game *game)
+{
+    int count = 0;
+    if (!game->heat_overlay) {
+        return 0;
+    }
+    for (int i = 0; i < HEATMAP_OVERLAY_CELLS; i++) {
+        count += is_heatmap_node_set(&game->heat_overlay->nodes[i]);
+    }
+    return count;
+}
+
+static void count_game(struct game *game, void *arg)
+{
+    struct snapshot_writer *writer = arg;
+    writer->game_count++;
+    writer->size +=
+        sizeof(struct snapshot_game)
+        + get_player_count(game) * sizeof(struct snapshot_player)
+        + count_heat_nodes(game) * sizeof(struct snapshot_heat_node);
+}
+
+static void write_player(struct snapshot_player *record,
+                         const struct player *player)
+{
+    const struct character_sheet *sheet = &player->char_sheet;
+
+    record->id         = player->id;
+    record->generation = player->generation;
+    memcpy(record->name, player->credentials.name, MAX_CREDENTIAL_LEN);
+    memcpy(record->password, player->credentials.password, MAX_CREDENTIAL_LEN);
+    record->session_token   = atomic_load(&player->session_token);
+    record->charsheet_valid = atomic_load(&sheet->is_valid);
+    record->gender          = sheet->gender;
+    record->vigour          = sheet->vigour;
+    record->violence        = sheet->violence;
+    record->cunning         = sheet->cunning;
+    record->background      = sheet->background;
+    record->coords[0]       = player->coords.x;
+    record->coords[1]       = player->coords.y;
+    record->coords[2]       = player->coords.z;
+    for (int i = 0; i < RESOURCE_COUNT; i++) {
+        record->resources[i] = player->resources[i];
+    }
+    record->current_enc   = player->current_enc;
+    record->action_points = player->action_points;
+    record->km_walked     = player->km_walked;
+}
+
+static void write_game(struct game *game, void *arg)
+{
+    struct snapshot_writer *writer = arg;
+    struct snapshot_game *record =
+        (struct snapshot_game *)&writer->data[writer->offset];
+    player_mask_t live_players = get_live_players(game);
+
+    memcpy(record->name, game->name, MAX_CREDENTIAL_LEN);
+    memcpy(record->password, game->password, MAX_CREDENTIAL_LEN);
+    record->max_player_count = game->max_player_count;
+    record->min_player_count = game->min_player_count;
+    record->state            = game->state;
+    record->current_turn =
+        game->current_turn ? game->current_turn->id : INVALID_PLAYER_ID;
+    record->player_count = __builtin_popcountll(live_players);
+    record->heat_shift_count =
+        game->heat_overlay ? game->heat_overlay->shift_count : 0;
+    record->heat_node_count = count_heat_nodes(game);
+    writer->offset += sizeof(*record);
+
+    while (live_players) {
+        const struct player *player =
+            &game->players[pop_player_slot(&live_players)];
+        write_player((struct snapshot_player *)&writer->data[writer->offset],
+                     player);
+        writer->offset += sizeof(struct snapshot_player);
+    }
+    if (!game->heat_overlay) {
+        return;
+    }
+    for (int i = 0; i < HEATMAP_OVERLAY_CELLS; i++) {
+        const struct heatmap_node *node = &game->heat_overlay->nodes[i];
+        if (!is_heatmap_node_set(node)) {
+            continue;
+        }
+        struct snapshot_heat_node *heat_record =
+            (struct snapshot_heat_node *)&writer->data[writer->offset];
+        heat_record->index = i;
+        memcpy(heat_record->lanes, node->lanes, sizeof(heat_record->lanes));
+        writer->offset += sizeof(*heat_record);
+    }
+}
+
+static int write_snapshot(const char *path, wal_lsn_t wal_lsn)
+{
+    struct snapshot_writer writer = {.size = sizeof(struct snapshot_header)};
+    struct snapshot_header *header = NULL;
+    char tmp_path[SNAPSHOT_PATH_MAX + 8];
+    int fd = -1;
+
+    for_each_game(count_game, &writer);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || ftruncate(fd, writer.size) != 0) {
+        goto exit_error;
+    }
+    writer.data =
+        mmap(NULL, writer.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (writer.data == MAP_FAILED) {
+        goto exit_error;
+    }
+
+    writer.offset = sizeof(*header);
+    for_each_game(write_game, &writer);
+
+    header = (struct snapshot_header *)writer.data;
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version      = SNAPSHOT_VERSION;
+    header->game_count   = writer.game_count;
+    header->created_at   = (uint64_t)time(NULL);
+    header->wal_lsn      = wal_lsn;
+    header->payload_size = writer.size - sizeof(*header);
+    header->checksum     = hash_data_simple(&writer.data[sizeof(*header)],
+                                            header->payload_size);
+
+    if (msync(writer.data, writer.size, MS_SYNC) != 0) {
+        munmap(writer.data, writer.size);
+        goto exit_error;
+    }
+    munmap(writer.data, writer.size);
+    if (fsync(fd) != 0) {
+        goto exit_error;
+    }
+    close(fd);
+    return rename(tmp_path, path);
+
+exit_error:
+    if (fd >= 0) {
+        close(fd);
+    }
+    unlink(tmp_path);
+    return -1;
+}
+
+int snapshot_take(const char *path)
+{
+    const uint64_t start = now_us();
+    // Everything logged up to here has been applied,
+    // so the child is sure to see it.
+    const wal_lsn_t wal_lsn = wal_rotate();
+    const pid_t pid         = fork();
+    if (pid < 0) {
+        perror("Error forking for a snapshot");
+        atomic_fetch_add(&stats.failed, 1);
+        return -1;
+    }
+    if (pid == 0) {
+        // No exit(), the atexit handlers and stdio
+        // buffers belong to the parent.
+        _exit(write_snapshot(path, wal_lsn) == 0 ? 0 : 1);
+    }
+    atomic_store(&stats.last_fork_us, now_us() - start);
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("Error waiting for the snapshot");
+            atomic_fetch_add(&stats.failed, 1);
+            return -1;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Snapshot to %s failed\n", path);
+        atomic_fetch_add(&stats.failed, 1);
+        return -1;
+    }
+    struct stat file_stat;
+    if (stat(path, &file_stat) == 0) {
+        atomic_store(&stats.last_size, (uint64_t)file_stat.st_size);
+    }
+    atomic_store(&stats.last_write_us, now_us() - start);
+    atomic_store(&stats.last_game_count, (uint64_t)get_game_count());
+    atomic_fetch_add(&stats.taken, 1);
+    wal_truncate(wal_lsn);
+    return 0;
+}
+
+static void *run_snapshots(void *arg)
+{
+    for (;;) {
+        sleep(snapshot_interval);
+        snapshot_take(snapshot_path);
+    }
+    return NULL;
+}
+
+void snapshot_start(const char *path, int interval_seconds)
+{
+    pthread_t thread;
+    strncpy(snapshot_path, path, sizeof(snapshot_path) - 1);
+    snapshot_interval = interval_seconds;
+    if (pthread_create(&thread, NULL, run_snapshots, NULL) != 0) {
+        perror("Error starting snapshot thread");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+void snapshot_get_stats(struct snapshot_stats *out)
+{
+    out->taken           = atomic_load(&stats.taken);
+    out->failed          = atomic_load(&stats.failed);
+    out->last_fork_us    = atomic_load(&stats.last_fork_us);
+    out->last_write_us   = atomic_load(&stats.last_write_us);
+    out->last_size       = atomic_load(&stats.last_size);
+    out->last_game_count = atomic_load(&stats.last_game_count);
+}
+
+/*
+ * Restoring
+ * --------------------
+ */
+static void read_player(struct game *game, const struct snapshot_player *record)
+{
+    struct player_credentials credentials = {0};
+    memcpy(credentials.name, record->name, MAX_CREDENTIAL_LEN);
+    memcpy(credentials.password, record->password, MAX_CREDENTIAL_LEN);
+
+    struct player *player =
+        restore_player(game, record->id, record->generation, &credentials);
+    if (!player) {
+        return;
+    }
+    struct character_sheet *sheet = &player->char_sheet;
+    atomic_store(&player->session_token, record->session_token);
+    sheet->gender     = record->gender;
+    sheet->vigour     = record->vigour;
+    sheet->violence   = record->violence;
+    sheet->cunning    = record->cunning;
+    sheet->background = record->background;
+    atomic_store(&sheet->is_valid, record->charsheet_valid != 0);
+    player->coords.x = record->coords[0];
+    player->coords.y = record->coords[1];
+    player->coords.z = record->coords[2];
+    for (int i = 0; i < RESOURCE_COUNT; i++) {
+        player->resources[i] = record->resources[i];
+    }
+    player->current_enc   = record->current_enc;
+    player->action_points = record->action_points;
+    player->km_walked     = record->km_walked;
+}
+
+static void read_heat_nodes(struct game *game,
+                            const struct snapshot_game *record,
+                            const struct snapshot_heat_node *nodes)
+{
+    if (!record->heat_shift_count && !record->heat_node_count) {
+        return;
+    }
+    struct heatmap_overlay *overlay = get_heatmap_overlay(game);
+    overlay->shift_count            = record->heat_shift_count;
+    for (int i = 0; i < record->heat_node_count; i++) {
+        struct snapshot_heat_node node;
+        memcpy(&node, &nodes[i], sizeof(node));
+        if (node.index < HEATMAP_OVERLAY_CELLS) {
+            memcpy(overlay->nodes[node.index].lanes,
+                   node.lanes,
+                   sizeof(node.lanes));
+        }
+    }
+}
+
+/*
+ * Returns how many games we restored,
+ * -1 if the snapshot doesn't check out.
+ */
+static int read_snapshot(const char *data,
+                         size_t size,
+                         int *out_players,
+                         wal_lsn_t *out_wal_lsn)
+{
+    const struct snapshot_header *header = (const struct snapshot_header *)data;
+    size_t offset                        = sizeof(*header);
+    int restored                         = 0;
+
+    if (size < sizeof(*header)
+        || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+        || header->version != SNAPSHOT_VERSION
+        || header->payload_size != size - sizeof(*header)
+        || header->checksum
+               != hash_data_simple(&data[offset], header->payload_size)) {
+        return -1;
+    }
+
+    *out_wal_lsn = header->wal_lsn;
+    for (uint32_t i = 0; i < header->game_count; i++) {
+        if (offset + sizeof(struct snapshot_game) > size) {
+            return -1;
+        }
+        const struct snapshot_game *record =
+            (const struct snapshot_game *)&data[offset];
+        offset += sizeof(*record);
+        if (offset + record->player_count * sizeof(struct snapshot_player)
+                + record->heat_node_count * sizeof(struct snapshot_heat_node)
+            > size) {
+            return -1;
+        }
+
+        struct game_config config = {.max_player_count =
+                                         record->max_player_count,
+                                     .min_player_count =
+                                         record->min_player_count};
+        memcpy(config.name, record->name, MAX_CREDENTIAL_LEN);
+        memcpy(config.password, record->password, MAX_CREDENTIAL_LEN);
+        // NULL for duplicates, their players go too
+        struct game *game = create_game(&config);
+
+        for (int j = 0; j < record->player_count; j++) {
+            if (game) {
+                read_player(game,
+                            (const struct snapshot_player *)&data[offset]);
+                (*out_players)++;
+            }
+            offset += sizeof(struct snapshot_player);
+        }
+        if (game) {
+            read_heat_nodes(game,
+                            record,
+                            (const struct snapshot_heat_node *)&data[offset]);
+        }
+        offset += record->heat_node_count * sizeof(struct snapshot_heat_node);
+        if (!game) {
+            continue;
+        }
+        restored++;
+        if (record->current_turn >= 0
+            && record->current_turn < game->max_player_count
+            && (get_live_players(game)
+                & ((player_mask_t)1 << record->current_turn))) {
+            game->current_turn = &game->players[record->current_turn];
+            game->state        = record->state;
+        }
+    }
+    return restored;
+}
+
+int snapshot_restore(const char *path, wal_lsn_t *out_wal_lsn)
+{
+    struct stat file_stat;
+    const uint64_t start = now_us();
+    int player_count     = 0;
+    int game_count       = 0;
+    const int fd         = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    char *data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    madvise(data, file_stat.st_size, MADV_SEQUENTIAL);
+    game_count =
+        read_snapshot(data, file_stat.st_size, &player_count, out_wal_lsn);
+    munmap(data, file_stat.st_size);
+    if (game_count < 0) {
+        fprintf(stderr, "Snapshot %s is corrupt\n", path);
+        return -1;
+    }
+    printf("Restored %d games and %d players from %s in %.2fms\n",
+           game_count,
+           player_count,
+           path,
+           (now_us() - start) / 1000.0);
+    return game_count;
+}
@@ -0,0 +1,59 @@
+/*
+ * ===========================
+ * snapshot.h
+ * ===========================
+ * Saves every game and player to disk now and then,
+ * and loads them back when the server starts, so a
+ * crash or a deploy doesn't wipe everyone's games.
+ *
+ * Snapshots are taken in a forked child, which gets
+ * a copy-on-write view of the whole process frozen at
+ * the fork, and writes it out while the game workers
+ * carry on. The parent only pays for the fork itself.
+ *
+ * The file is a header followed by a record per game,
+ * each followed by a record per player in it. It's
+ * written to "<path>.tmp" and renamed over "<path>"
+ * once it's on disk, so "<path>" is always complete.
+ *
+ * With the write-ahead log on, the snapshot notes
+ * the last log record it includes, and the log
+ * segments before that are dropped.
+ */
+
+#ifndef BB_SNAPSHOT
+#define BB_SNAPSHOT
+
+#include <stdint.h>
+
+#include "wal.h"
+
+#define SNAPSHOT_DEFAULT_INTERVAL 30 // Seconds
+
+struct snapshot_stats {
+    uint64_t taken;
+    uint64_t failed;
+    uint64_t last_fork_us;  // How long the fork stalled us
+    uint64_t last_write_us; // Fork until the child was done
+    uint64_t last_size;     // Bytes
+    uint64_t last_game_count;
+};
+
+/*
+ * Call before listening, when no game's being
+ * played yet. Returns the amount of games
+ * restored, 0 if there's no snapshot, -1 if
+ * there's a snapshot but we couldn't read it.
+ * "out_wal_lsn" is where the write-ahead log
+ * picks up, it's left alone if there's no snapshot.
+ */
+int snapshot_restore(const char *path, wal_lsn_t *out_wal_lsn);
+
+// Starts a thread snapshotting every "interval_seconds"
+void snapshot_start(const char *path, int interval_seconds);
+// Takes one right away, blocks until it's on disk
+int  snapshot_take (const char *path);
+
+void snapshot_get_stats(struct snapshot_stats *out);
+
+#endif
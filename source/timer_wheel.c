@@ -0,0 +1,303 @@
+/*
+ * ===========================
+ * timer_wheel.c
+ * ===========================
+ * One lock covers the whole wheel, everything done
+ * under it is a handful of pointer writes. Expired
+ * timers are collected under the lock and posted to
+ * their games after it's dropped.
+ *
+ * The ticking thread stays in an epoch read section
+ * while it has expiries in hand, and games close their
+ * timers before they're retired, so a game can't be
+ * freed between its timer expiring and the post.
+ *
+ * It also calls epoch_collect() every so often, or
+ * whatever was retired last would wait for the next
+ * epoch_retire() to be freed.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "epoch.h"
+#include "game_actor.h"
+#include "timer_wheel.h"
+
+#define TIMER_SLOTS         (1 << TIMER_WHEEL_BITS)
+#define TIMER_SLOT_MASK     (TIMER_SLOTS - 1)
+#define TIMER_MAX_TICKS \
+    ((1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+#define TIMER_BATCH         64 // Expiries collected per time we take the lock
+#define TIMER_COLLECT_TICKS 10 // Ticks between epoch_collect()s
+
+// What gets posted to the game's actor
+struct timer_expiry {
+    struct game_timer *timer;
+    unsigned int generation;
+};
+
+struct pending_expiry {
+    struct game *game;
+    struct timer_expiry expiry;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    uint64_t now; // The next tick to run
+    uint64_t start_ns;
+    struct game_timer *slots[TIMER_WHEEL_LEVELS][TIMER_SLOTS];
+    struct timer_wheel_stats stats;
+} wheel = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Wheel lists
+ * --------------------
+ * All of these are under wheel.lock.
+ */
+static void link_timer(struct game_timer *timer)
+{
+    const uint64_t delta = timer->expires - wheel.now;
+    int level            = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1
+           && delta >> (TIMER_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    const int slot =
+        (timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_SLOT_MASK;
+    struct game_timer **head = &wheel.slots[level][slot];
+
+    timer->next = *head;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head        = timer;
+}
+
+static void unlink_timer(struct game_timer *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next  = NULL;
+    timer->pprev = NULL;
+}
+
+/*
+ * Once the level below has gone all the way around,
+ * the slot we're at on this level is due within the
+ * next lap of the level below, so spread it out there.
+ */
+static void cascade(void)
+{
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        const int slot =
+            (wheel.now >> (TIMER_WHEEL_BITS * level)) & TIMER_SLOT_MASK;
+        struct game_timer *timer = wheel.slots[level][slot];
+        wheel.slots[level][slot] = NULL;
+        while (timer) {
+            struct game_timer *next = timer->next;
+            timer->next             = NULL;
+            link_timer(timer);
+            wheel.stats.cascaded++;
+            timer = next;
+        }
+        if (slot != 0) {
+            break;
+        }
+    }
+}
+
+// Returns how many expiries it put in "out"
+static int collect_expired(struct pending_expiry out[static TIMER_BATCH])
+{
+    struct game_timer **head = &wheel.slots[0][wheel.now & TIMER_SLOT_MASK];
+    int count                = 0;
+    while (*head && count < TIMER_BATCH) {
+        struct game_timer *timer = *head;
+        unlink_timer(timer);
+        out[count].game              = timer->game;
+        out[count].expiry.timer      = timer;
+        out[count].expiry.generation = atomic_load_explicit(
+            &timer->generation, memory_order_relaxed);
+        count++;
+    }
+    wheel.stats.pending -= count;
+    wheel.stats.fired += count;
+    return count;
+}
+
+/*
+ * Timers
+ * --------------------
+ */
+void game_timer_init(struct game_timer *timer,
+                     struct game *game,
+                     game_timer_fn_t fire)
+{
+    timer->next    = NULL;
+    timer->pprev   = NULL;
+    timer->expires = 0;
+    timer->closed  = false;
+    timer->game    = game;
+    timer->fire    = fire;
+    atomic_init(&timer->generation, 0);
+}
+
+void game_timer_arm(struct game_timer *timer, uint64_t delay_ms)
+{
+    uint64_t ticks = (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (ticks == 0) {
+        ticks = 1;
+    }
+    else if (ticks > TIMER_MAX_TICKS) {
+        ticks = TIMER_MAX_TICKS;
+    }
+    pthread_mutex_lock(&wheel.lock);
+    if (timer->closed) {
+        pthread_mutex_unlock(&wheel.lock);
+        return;
+    }
+    if (timer->pprev) {
+        unlink_timer(timer);
+        wheel.stats.pending--;
+    }
+    atomic_fetch_add_explicit(&timer->generation, 1, memory_order_relaxed);
+    timer->expires = wheel.now + ticks;
+    link_timer(timer);
+    wheel.stats.pending++;
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+void game_timer_cancel(struct game_timer *timer)
+{
+    pthread_mutex_lock(&wheel.lock);
+    if (timer->pprev) {
+        unlink_timer(timer);
+        wheel.stats.pending--;
+    }
+    atomic_fetch_add_explicit(&timer->generation, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+void game_timer_close(struct game_timer *timer)
+{
+    pthread_mutex_lock(&wheel.lock);
+    timer->closed = true;
+    if (timer->pprev) {
+        unlink_timer(timer);
+        wheel.stats.pending--;
+    }
+    atomic_fetch_add_explicit(&timer->generation, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+/*
+ * On the game's actor. The generation only changes on
+ * this actor, or in game_timer_close() once the game's
+ * on its way out, so if it still matches, nothing has
+ * re-armed or cancelled the timer since it expired.
+ */
+static void run_expiry(struct game *game,
+                       char *data,
+                       ssize_t data_size,
+                       struct host *remotehost)
+{
+    struct timer_expiry expiry;
+    memcpy(&expiry, data, sizeof(expiry));
+    if (atomic_load_explicit(&expiry.timer->generation, memory_order_relaxed)
+        == expiry.generation) {
+        expiry.timer->fire(game);
+    }
+}
+
+/*
+ * Ticking
+ * --------------------
+ */
+static void run_tick(void)
+{
+    struct pending_expiry expired[TIMER_BATCH];
+    int count = 0;
+    do {
+        pthread_mutex_lock(&wheel.lock);
+        if ((wheel.now & TIMER_SLOT_MASK) == 0 && wheel.now) {
+            cascade();
+        }
+        count = collect_expired(expired);
+        // A full batch might have left some behind
+        if (count < TIMER_BATCH) {
+            wheel.now++;
+        }
+        pthread_mutex_unlock(&wheel.lock);
+
+        for (int i = 0; i < count; i++) {
+            game_actor_post(expired[i].game,
+                            run_expiry,
+                            (const char *)&expired[i].expiry,
+                            sizeof(expired[i].expiry),
+                            NULL);
+        }
+    } while (count == TIMER_BATCH);
+}
+
+static void *run_wheel(void *arg)
+{
+    struct timespec next;
+    uint64_t next_collect = 0;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (;;) {
+        next.tv_nsec += TIMER_TICK_MS * 1000000;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        // Catches up if we slept through some ticks
+        const uint64_t due =
+            (now_ns() - wheel.start_ns) / (TIMER_TICK_MS * 1000000ull);
+        epoch_enter();
+        while (wheel.now <= due) {
+            run_tick();
+        }
+        epoch_exit();
+        // Outside the read section, or we'd hold it back ourselves
+        if (due >= next_collect) {
+            epoch_collect();
+            next_collect = due + TIMER_COLLECT_TICKS;
+        }
+    }
+    return NULL;
+}
+
+int timer_wheel_start(void)
+{
+    pthread_t thread;
+    // Anything armed before now counts from here
+    wheel.start_ns = now_ns() - wheel.now * TIMER_TICK_MS * 1000000ull;
+    if (pthread_create(&thread, NULL, run_wheel, NULL) != 0) {
+        perror("Couldn't start the timer wheel");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+void timer_wheel_get_stats(struct timer_wheel_stats *out)
+{
+    pthread_mutex_lock(&wheel.lock);
+    *out = wheel.stats;
+    pthread_mutex_unlock(&wheel.lock);
+}
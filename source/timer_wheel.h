@@ -0,0 +1,75 @@
+/*
+ * ===========================
+ * timer_wheel.h
+ * ===========================
+ * Deadlines for every game, on one hierarchical
+ * timing wheel ticked by one thread, so ten thousand
+ * games don't need ten thousand timer fds.
+ *
+ * The wheel has TIMER_WHEEL_LEVELS levels of 64 slots,
+ * a slot on level N covers 64^N ticks. Timers sit in
+ * the slot they expire in, on the lowest level that
+ * reaches that far, and move down a level whenever
+ * the wheel gets to their slot. Arming and cancelling
+ * is unlinking from one list and linking onto another.
+ *
+ * The timers are embedded in whatever owns them and
+ * belong to their game's actor: arm and cancel them
+ * from there. When one expires, its callback is posted
+ * to the game's actor like any other command, and is
+ * dropped there if the timer was re-armed or cancelled
+ * in the meantime.
+ */
+
+#ifndef BB_TIMER_WHEEL
+#define BB_TIMER_WHEEL
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MS      10
+#define TIMER_WHEEL_BITS   6 // 64 slots a level
+#define TIMER_WHEEL_LEVELS 4 // 64^4 ticks, about 46 hours
+
+struct game;
+
+// Runs on the game's actor
+typedef void (*game_timer_fn_t)(struct game *game);
+
+struct game_timer {
+    struct game_timer *next;
+    struct game_timer **pprev; // NULL while it's not on the wheel
+    uint64_t expires;          // In ticks
+    // Bumped every time the timer is armed or cancelled,
+    // expiries carry the one they were armed with.
+    atomic_uint generation;
+    bool closed;
+    struct game *game;
+    game_timer_fn_t fire;
+};
+
+struct timer_wheel_stats {
+    uint64_t pending; // Armed and not expired yet
+    uint64_t fired;
+    uint64_t cascaded; // Times a timer moved down a level
+};
+
+void game_timer_init  (struct game_timer *timer,
+                       struct game *game,
+                       game_timer_fn_t fire);
+// Re-arming moves the deadline, it still fires once
+void game_timer_arm   (struct game_timer *timer, uint64_t delay_ms);
+void game_timer_cancel(struct game_timer *timer);
+/*
+ * From any thread, before the game is freed.
+ * Once this returns nothing new gets posted for
+ * the timer, and arming it does nothing.
+ */
+void game_timer_close (struct game_timer *timer);
+
+// Until then, timers can be armed but don't expire
+int  timer_wheel_start    (void);
+void timer_wheel_get_stats(struct timer_wheel_stats *out);
+
+#endif
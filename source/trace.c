@@ -0,0 +1,211 @@
+/*
+ * ===========================
+ * trace.c
+ * ===========================
+ * A ring only has one writer, which fills in the
+ * event and then bumps "head". Dumping copies the
+ * ring and checks "head" again afterwards: anything
+ * the writer could have lapped while we were copying
+ * is thrown away instead of locking the writer out.
+ *
+ * Rings are pushed onto a list the first time a
+ * thread traces something and never freed, like
+ * the metrics shards.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "trace.h"
+
+#define TRACE_PATH_MAX 4096
+
+struct trace_record {
+    uint64_t ts_ns;
+    const char *name;
+    enum trace_phase phase;
+};
+
+struct trace_ring {
+    atomic_uint_fast64_t head; // Events ever written
+    long tid;
+    struct trace_ring *next;
+    struct trace_record records[TRACE_RING_SIZE];
+};
+
+bool trace_enabled = false;
+
+static _Atomic(struct trace_ring *) rings        = NULL;
+static __thread struct trace_ring *current_ring = NULL;
+static char dump_path[TRACE_PATH_MAX]           = {0};
+static pthread_mutex_t dump_lock                = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct trace_ring *get_ring(void)
+{
+    struct trace_ring *ring = current_ring;
+    if (ring) {
+        return ring;
+    }
+    ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        print_error(BB_ERR_CALLOC);
+        exit(1);
+    }
+    ring->tid  = syscall(SYS_gettid);
+    ring->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+    }
+    current_ring = ring;
+    return ring;
+}
+
+void trace_event(const char *name, enum trace_phase phase)
+{
+    struct trace_ring *ring = get_ring();
+    const uint64_t head =
+        atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct trace_record *record = &ring->records[head % TRACE_RING_SIZE];
+
+    record->ts_ns = now_ns();
+    record->name  = name;
+    record->phase = phase;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * Dumping
+ * --------------------
+ */
+
+// Returns how many events it wrote
+static uint64_t dump_ring(FILE *file,
+                          struct trace_ring *ring,
+                          struct trace_record *copy,
+                          bool *first)
+{
+    const uint64_t head =
+        atomic_load_explicit(&ring->head, memory_order_acquire);
+    const uint64_t start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for (uint64_t i = start; i < head; i++) {
+        copy[i - start] = ring->records[i % TRACE_RING_SIZE];
+    }
+    atomic_thread_fence(memory_order_acquire);
+    // The writer was at most at "after" while we copied,
+    // so the slot it was filling held event "after - SIZE".
+    const uint64_t after =
+        atomic_load_explicit(&ring->head, memory_order_relaxed);
+    const uint64_t valid_from =
+        after + 1 > TRACE_RING_SIZE ? after + 1 - TRACE_RING_SIZE : 0;
+
+    uint64_t written = 0;
+    for (uint64_t i = start > valid_from ? start : valid_from; i < head; i++) {
+        const struct trace_record *record = &copy[i - start];
+        fprintf(file,
+                "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                "\"pid\":%d,\"tid\":%ld}",
+                *first ? "" : ",",
+                record->name,
+                record->phase == TRACE_PHASE_BEGIN ? 'B' : 'E',
+                record->ts_ns / 1000.0,
+                (int)getpid(),
+                ring->tid);
+        *first = false;
+        written++;
+    }
+    return written;
+}
+
+int trace_dump(const char *path)
+{
+    char tmp_path[TRACE_PATH_MAX + 8];
+    struct trace_record *copy = NULL;
+    FILE *file                = NULL;
+    bool first                = true;
+    uint64_t written          = 0;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    pthread_mutex_lock(&dump_lock);
+    copy = malloc(sizeof(*copy) * TRACE_RING_SIZE);
+    if (!copy) {
+        print_error(BB_ERR_MALLOC);
+        exit(1);
+    }
+    file = fopen(tmp_path, "w");
+    if (!file) {
+        perror("Couldn't write the trace");
+        goto exit_error;
+    }
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (struct trace_ring *ring = atomic_load(&rings); ring;
+         ring                    = ring->next) {
+        written += dump_ring(file, ring, copy, &first);
+    }
+    fprintf(file, "\n]}\n");
+    if (fclose(file) != 0 || rename(tmp_path, path) != 0) {
+        perror("Couldn't write the trace");
+        unlink(tmp_path);
+        goto exit_error;
+    }
+    free(copy);
+    pthread_mutex_unlock(&dump_lock);
+    printf("Dumped %llu trace events to %s\n",
+           (unsigned long long)written,
+           path);
+    return 0;
+
+exit_error:
+    free(copy);
+    pthread_mutex_unlock(&dump_lock);
+    return -1;
+}
+
+// Waits for SIGUSR2, which every other thread has blocked
+static void *run_dumper(void *arg)
+{
+    sigset_t signals;
+    int received = 0;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+    for (;;) {
+        if (sigwait(&signals, &received) == 0) {
+            trace_dump(dump_path);
+        }
+    }
+    return NULL;
+}
+
+int trace_start(const char *path)
+{
+    sigset_t signals;
+    pthread_t dumper;
+
+    snprintf(dump_path, sizeof(dump_path), "%s", path);
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (pthread_create(&dumper, NULL, run_dumper, NULL) != 0) {
+        perror("Couldn't start the trace dumper");
+        return -1;
+    }
+    pthread_detach(dumper);
+    trace_enabled = true;
+    printf("Tracing, kill -USR2 %d dumps it to %s\n", (int)getpid(), path);
+    return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * ===========================
+ * trace.h
+ * ===========================
+ * Begin/end events around the hot paths, so a
+ * latency spike can be looked at as a timeline in
+ * chrome://tracing or ui.perfetto.dev.
+ *
+ * Every thread writes into its own ring buffer and
+ * overwrites the oldest events, nothing is shared
+ * until a dump. With tracing off, trace_begin() and
+ * trace_end() are a single branch on a flag that
+ * never changes after startup.
+ *
+ * Names must be string literals, only the pointer
+ * is kept.
+ */
+
+#ifndef BB_TRACE
+#define BB_TRACE
+
+#include <stdbool.h>
+
+// Events each thread keeps, the newest ones win
+#define TRACE_RING_SIZE (1 << 14)
+
+enum trace_phase {
+    TRACE_PHASE_BEGIN,
+    TRACE_PHASE_END
+};
+
+// Only written by trace_start()
+extern bool trace_enabled;
+
+void trace_event(const char *name, enum trace_phase phase);
+
+static inline void trace_begin(const char *name)
+{
+    if (__builtin_expect(trace_enabled, 0)) {
+        trace_event(name, TRACE_PHASE_BEGIN);
+    }
+}
+
+static inline void trace_end(const char *name)
+{
+    if (__builtin_expect(trace_enabled, 0)) {
+        trace_event(name, TRACE_PHASE_END);
+    }
+}
+
+/*
+ * Turns tracing on, and dumps every thread's events
+ * to "path" as Chrome trace JSON whenever we get
+ * SIGUSR2. Call before any other thread is started,
+ * they all need SIGUSR2 blocked.
+ * Returns -1 if the dumping thread didn't start.
+ */
+int trace_start(const char *path);
+// Any thread, returns -1 if "path" couldn't be written
+int trace_dump (const char *path);
+
+#endif
@@ -27,11 +27,8 @@
 static inline bool validate_player_move_coords(const struct player_move_req *in_data,
                                                struct player_move_req *out_data)
 {
-    const double map_bound_x = 1.6;
-    const double map_bound_y = 1.0;
-
-    out_data->x_coord = clamp(in_data->x_coord, map_bound_x * -1, map_bound_x);
-    out_data->y_coord = clamp(in_data->y_coord, map_bound_y * -1, map_bound_y);
+    out_data->x_coord = clamp(in_data->x_coord, MAP_BOUND_X * -1, MAP_BOUND_X);
+    out_data->y_coord = clamp(in_data->y_coord, MAP_BOUND_Y * -1, MAP_BOUND_Y);
 
     // Currently the client can't pass "invalid" move coords, they're just
     // clamped.
@@ -0,0 +1,520 @@
+/*
+ * ===========================
+ * wal.c
+ * ===========================
+ * Appenders fill "active" under a mutex that's only
+ * ever held for a memcpy. The flusher swaps it with
+ * "spare" and writes "spare" out without the mutex,
+ * so appenders never wait on the disk.
+ * "flush_lock" keeps the flusher and rotations from
+ * writing to the segment at the same time.
+ *
+ * A batch that fails to write is cut back off the
+ * segment and stays in "spare", everything appended
+ * since goes out behind it on the next try.
+ *
+ * Every record has a header with its own checksum,
+ * recovery stops at the first record that doesn't
+ * check out, which is where we crashed mid write.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "helpers.h"
+#include "wal.h"
+
+#define WAL_PATH_MAX       4096
+#define WAL_BUFFER_DEFAULT (64 * 1024)
+
+struct wal_record_header {
+    uint32_t size;     // Payload bytes
+    uint32_t checksum; // hash_data_simple() of the payload
+    wal_lsn_t lsn;
+    uint8_t type;
+} __attribute__((packed));
+
+struct wal_buffer {
+    char *data;
+    size_t used;
+    size_t cap;
+    uint64_t records;
+    wal_lsn_t last_lsn;
+};
+
+static struct {
+    pthread_mutex_t lock; // Only around the active buffer
+    struct wal_buffer active;
+    wal_lsn_t next_lsn;
+} wal = {.lock = PTHREAD_MUTEX_INITIALIZER, .next_lsn = 1};
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct wal_buffer spare    = {0};
+static char wal_path[WAL_PATH_MAX];
+static int segment_fd             = -1;
+static off_t segment_size         = 0;     // Up to the last batch that made it
+static bool retry_spare           = false; // "spare" didn't make it
+static atomic_bool started        = false;
+
+static struct {
+    atomic_uint_fast64_t appended_lsn;
+    atomic_uint_fast64_t durable_lsn;
+    atomic_uint_fast64_t fsyncs;
+    atomic_uint_fast64_t last_batch_records;
+    atomic_uint_fast64_t last_batch_bytes;
+    atomic_uint_fast64_t max_batch_records;
+    atomic_uint_fast64_t last_fsync_us;
+} stats;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void *realloc_or_exit(void *ptr, size_t size)
+{
+    void *new_ptr = realloc(ptr, size);
+    if (!new_ptr) {
+        print_error(BB_ERR_MALLOC);
+        exit(1);
+    }
+    return new_ptr;
+}
+
+/*
+ * Segments
+ * --------------------
+ */
+static void get_segment_path(char *out, size_t out_size, wal_lsn_t first_lsn)
+{
+    snprintf(out, out_size, "%s.%016" PRIx64, wal_path, first_lsn);
+}
+
+/*
+ * Caller holds flush_lock.
+ * A segment that's already there can't hold any
+ * record we still need, it would've been recovered
+ * and we'd be past "first_lsn".
+ */
+static void open_segment(wal_lsn_t first_lsn)
+{
+    char path[WAL_PATH_MAX + 32];
+    if (segment_fd >= 0) {
+        close(segment_fd);
+    }
+    get_segment_path(path, sizeof(path), first_lsn);
+    segment_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (segment_fd < 0) {
+        perror("Error opening write-ahead log segment");
+        exit(1);
+    }
+    segment_size = 0;
+}
+
+/*
+ * Calls "visit" with the first LSN of every
+ * segment file next to "wal_path".
+ */
+static int for_each_segment(void (*visit)(wal_lsn_t first_lsn, void *arg),
+                            void *arg)
+{
+    char dir_buf[WAL_PATH_MAX];
+    char base_buf[WAL_PATH_MAX];
+    // dirname() and basename() write into their argument
+    snprintf(dir_buf, sizeof(dir_buf), "%s", wal_path);
+    snprintf(base_buf, sizeof(base_buf), "%s", wal_path);
+    const char *dir_name  = dirname(dir_buf);
+    const char *base_name = basename(base_buf);
+    const size_t base_len = strlen(base_name);
+
+    DIR *dir = opendir(dir_name);
+    if (!dir) {
+        return -1;
+    }
+    struct dirent *entry = NULL;
+    while ((entry = readdir(dir))) {
+        char *end = NULL;
+        if (strncmp(entry->d_name, base_name, base_len) != 0
+            || entry->d_name[base_len] != '.') {
+            continue;
+        }
+        const wal_lsn_t first_lsn =
+            strtoull(&entry->d_name[base_len + 1], &end, 16);
+        if (end == &entry->d_name[base_len + 1] || *end != '\0') {
+            continue;
+        }
+        visit(first_lsn, arg);
+    }
+    closedir(dir);
+    return 0;
+}
+
+/*
+ * Flushing
+ * --------------------
+ */
+static int write_all(int fd, const char *data, size_t size)
+{
+    while (size > 0) {
+        const ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+static wal_lsn_t get_first_lsn(const struct wal_buffer *batch)
+{
+    return batch->last_lsn - batch->records + 1;
+}
+
+static void append_batch(struct wal_buffer *to, const struct wal_buffer *from)
+{
+    if (from->records == 0) {
+        return;
+    }
+    if (to->used + from->used > to->cap) {
+        while (to->used + from->used > to->cap) {
+            to->cap *= 2;
+        }
+        to->data = realloc_or_exit(to->data, to->cap);
+    }
+    memcpy(&to->data[to->used], from->data, from->used);
+    to->used    += from->used;
+    to->records += from->records;
+    to->last_lsn = from->last_lsn;
+}
+
+/*
+ * Caller holds flush_lock. Hands the appenders
+ * the spare buffer, and returns what they filled.
+ * If the last batch didn't make it, what they
+ * filled is tacked on to that one instead.
+ */
+static struct wal_buffer *take_active(wal_lsn_t *out_last_lsn)
+{
+    pthread_mutex_lock(&wal.lock);
+    if (retry_spare) {
+        append_batch(&spare, &wal.active);
+    }
+    else {
+        const struct wal_buffer full = wal.active;
+        wal.active                   = spare;
+        spare                        = full;
+    }
+    wal.active.used    = 0;
+    wal.active.records = 0;
+    if (out_last_lsn) {
+        *out_last_lsn = wal.next_lsn - 1;
+    }
+    pthread_mutex_unlock(&wal.lock);
+    return &spare;
+}
+
+/*
+ * Caller holds flush_lock.
+ * After a failed fdatasync() the kernel may have
+ * dropped the dirty pages, so syncing again could
+ * pass without the batch ever reaching the disk.
+ * Cutting it back off the segment and writing it
+ * all again is the only way to be sure.
+ */
+static void write_batch(const struct wal_buffer *batch)
+{
+    if (batch->used == 0) {
+        return;
+    }
+    const uint64_t start = now_us();
+    if (write_all(segment_fd, batch->data, batch->used) != 0
+        || fdatasync(segment_fd) != 0) {
+        if (!retry_spare) {
+            perror("Error writing the write-ahead log, retrying");
+        }
+        retry_spare = true;
+        if (ftruncate(segment_fd, segment_size) != 0) {
+            // Recovery stops reading this one where
+            // it's cut off, and goes on to the next.
+            open_segment(get_first_lsn(batch));
+        }
+        return;
+    }
+    if (retry_spare) {
+        fprintf(stderr, "Write-ahead log caught up\n");
+        retry_spare = false;
+    }
+    segment_size += batch->used;
+    atomic_store(&stats.last_fsync_us, now_us() - start);
+    atomic_store(&stats.durable_lsn, batch->last_lsn);
+    atomic_fetch_add(&stats.fsyncs, 1);
+    atomic_store(&stats.last_batch_records, batch->records);
+    atomic_store(&stats.last_batch_bytes, batch->used);
+    if (batch->records > atomic_load(&stats.max_batch_records)) {
+        atomic_store(&stats.max_batch_records, batch->records);
+    }
+}
+
+static void *run_flusher(void *arg)
+{
+    const struct timespec interval = {
+        .tv_sec  = 0,
+        .tv_nsec = WAL_COMMIT_INTERVAL_MS * 1000000L};
+    for (;;) {
+        nanosleep(&interval, NULL);
+        pthread_mutex_lock(&flush_lock);
+        write_batch(take_active(NULL));
+        pthread_mutex_unlock(&flush_lock);
+    }
+    return NULL;
+}
+
+void wal_start(const char *path)
+{
+    pthread_t thread;
+    strncpy(wal_path, path, sizeof(wal_path) - 1);
+
+    wal.active.cap  = WAL_BUFFER_DEFAULT;
+    wal.active.data = realloc_or_exit(NULL, wal.active.cap);
+    spare.cap       = WAL_BUFFER_DEFAULT;
+    spare.data      = realloc_or_exit(NULL, spare.cap);
+    open_segment(wal.next_lsn);
+    atomic_store(&stats.appended_lsn, wal.next_lsn - 1);
+    atomic_store(&stats.durable_lsn, wal.next_lsn - 1);
+    atomic_store(&started, true);
+
+    if (pthread_create(&thread, NULL, run_flusher, NULL) != 0) {
+        perror("Error starting write-ahead log flusher");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+int wal_enabled(void)
+{
+    return atomic_load(&started);
+}
+
+wal_lsn_t wal_append(uint8_t type, const void *data, size_t size)
+{
+    if (!atomic_load(&started)) {
+        return 0;
+    }
+    struct wal_record_header header = {
+        .size     = size,
+        .checksum = hash_data_simple(data, size),
+        .type     = type};
+    const size_t record_size = sizeof(header) + size;
+
+    pthread_mutex_lock(&wal.lock);
+    struct wal_buffer *buffer = &wal.active;
+    if (buffer->used + record_size > buffer->cap) {
+        // Growing beats waiting for the flusher
+        while (buffer->used + record_size > buffer->cap) {
+            buffer->cap *= 2;
+        }
+        buffer->data = realloc_or_exit(buffer->data, buffer->cap);
+    }
+    header.lsn = wal.next_lsn++;
+    memcpy(&buffer->data[buffer->used], &header, sizeof(header));
+    memcpy(&buffer->data[buffer->used + sizeof(header)], data, size);
+    buffer->used += record_size;
+    buffer->records++;
+    buffer->last_lsn = header.lsn;
+    // Under the lock, or it could go backwards
+    atomic_store(&stats.appended_lsn, header.lsn);
+    pthread_mutex_unlock(&wal.lock);
+    return header.lsn;
+}
+
+wal_lsn_t wal_rotate(void)
+{
+    wal_lsn_t last_lsn = 0;
+    if (!atomic_load(&started)) {
+        return 0;
+    }
+    pthread_mutex_lock(&flush_lock);
+    // Everything up to "last_lsn" is in this batch,
+    // anything appended after goes to the new segment.
+    // If it didn't make it, it goes there too.
+    write_batch(take_active(&last_lsn));
+    open_segment(retry_spare ? get_first_lsn(&spare) : last_lsn + 1);
+    pthread_mutex_unlock(&flush_lock);
+    return last_lsn;
+}
+
+/*
+ * Segments are named after their first LSN, so a
+ * segment only holds records up to "lsn" if some
+ * newer segment starts at or before "lsn" + 1.
+ */
+struct truncate_state {
+    wal_lsn_t lsn;
+    wal_lsn_t keep_from; // Newest segment starting at or before lsn + 1
+};
+
+static void find_oldest_kept(wal_lsn_t first_lsn, void *arg)
+{
+    struct truncate_state *state = arg;
+    if (first_lsn <= state->lsn + 1 && first_lsn > state->keep_from) {
+        state->keep_from = first_lsn;
+    }
+}
+
+static void remove_old_segment(wal_lsn_t first_lsn, void *arg)
+{
+    struct truncate_state *state = arg;
+    char path[WAL_PATH_MAX + 32];
+    if (first_lsn < state->keep_from) {
+        get_segment_path(path, sizeof(path), first_lsn);
+        unlink(path);
+    }
+}
+
+void wal_truncate(wal_lsn_t lsn)
+{
+    struct truncate_state state = {.lsn = lsn, .keep_from = 0};
+    if (!atomic_load(&started)) {
+        return;
+    }
+    pthread_mutex_lock(&flush_lock);
+    for_each_segment(find_oldest_kept, &state);
+    for_each_segment(remove_old_segment, &state);
+    pthread_mutex_unlock(&flush_lock);
+}
+
+/*
+ * Recovery
+ * --------------------
+ */
+struct segment_list {
+    wal_lsn_t *first_lsns;
+    int count;
+    int cap;
+};
+
+static void add_segment(wal_lsn_t first_lsn, void *arg)
+{
+    struct segment_list *list = arg;
+    if (list->count == list->cap) {
+        list->cap        = list->cap ? list->cap * 2 : 16;
+        list->first_lsns = realloc_or_exit(list->first_lsns,
+                                           list->cap * sizeof(wal_lsn_t));
+    }
+    list->first_lsns[list->count++] = first_lsn;
+}
+
+static int compare_lsns(const void *a, const void *b)
+{
+    const wal_lsn_t x = *(const wal_lsn_t *)a;
+    const wal_lsn_t y = *(const wal_lsn_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Returns the records replayed, stops at the first
+ * record that's cut off or doesn't match its checksum.
+ */
+static int replay_segment(const char *path,
+                          wal_lsn_t after_lsn,
+                          wal_replay_fn_t replay,
+                          wal_lsn_t *last_lsn)
+{
+    struct stat file_stat;
+    int replayed = 0;
+    size_t offset = 0;
+    const int fd  = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    const size_t size = file_stat.st_size;
+    char *data        = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return 0;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    while (offset + sizeof(struct wal_record_header) <= size) {
+        struct wal_record_header header;
+        memcpy(&header, &data[offset], sizeof(header));
+        const char *payload = &data[offset + sizeof(header)];
+        if (offset + sizeof(header) + header.size > size
+            || header.checksum != hash_data_simple(payload, header.size)) {
+            fprintf(stderr,
+                    "Write-ahead log %s is cut off at LSN %" PRIu64 "\n",
+                    path,
+                    header.lsn);
+            break;
+        }
+        // A retried batch can be in two segments,
+        // "last_lsn" starts out at "after_lsn"
+        if (header.lsn > *last_lsn) {
+            replay(header.type, payload, header.size, header.lsn);
+            replayed++;
+            *last_lsn = header.lsn;
+        }
+        offset += sizeof(header) + header.size;
+    }
+    munmap(data, size);
+    return replayed;
+}
+
+int wal_recover(const char *path, wal_lsn_t after_lsn, wal_replay_fn_t replay)
+{
+    struct segment_list list = {0};
+    wal_lsn_t last_lsn       = after_lsn;
+    int replayed             = 0;
+    char segment_path[WAL_PATH_MAX + 32];
+
+    strncpy(wal_path, path, sizeof(wal_path) - 1);
+    for_each_segment(add_segment, &list);
+    qsort(list.first_lsns, list.count, sizeof(wal_lsn_t), compare_lsns);
+    for (int i = 0; i < list.count; i++) {
+        // Entirely covered by the snapshot
+        if (i + 1 < list.count && list.first_lsns[i + 1] <= after_lsn + 1) {
+            continue;
+        }
+        get_segment_path(segment_path,
+                         sizeof(segment_path),
+                         list.first_lsns[i]);
+        replayed += replay_segment(segment_path, after_lsn, replay, &last_lsn);
+    }
+    free(list.first_lsns);
+    wal.next_lsn = last_lsn + 1;
+    return replayed;
+}
+
+void wal_get_stats(struct wal_stats *out)
+{
+    out->appended_lsn       = atomic_load(&stats.appended_lsn);
+    out->durable_lsn        = atomic_load(&stats.durable_lsn);
+    out->fsyncs             = atomic_load(&stats.fsyncs);
+    out->last_batch_records = atomic_load(&stats.last_batch_records);
+    out->last_batch_bytes   = atomic_load(&stats.last_batch_bytes);
+    out->max_batch_records  = atomic_load(&stats.max_batch_records);
+    out->last_fsync_us      = atomic_load(&stats.last_fsync_us);
+}
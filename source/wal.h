@@ -0,0 +1,71 @@
+/*
+ * ===========================
+ * wal.h
+ * ===========================
+ * Write-ahead log for whatever changes between
+ * snapshots, see game_wal.h for what we log.
+ *
+ * Appending copies the record into a buffer and
+ * returns, it never touches the disk. A flusher
+ * thread writes the buffer out and fdatasync()s it
+ * every WAL_COMMIT_INTERVAL_MS, so one fsync covers
+ * every record appended in that window (group
+ * commit). A crash loses at most that window.
+ *
+ * The log is split into segment files named
+ * "<path>.<first LSN in hex>". Snapshots rotate to a
+ * fresh segment right before they fork, and once
+ * the snapshot is on disk the older segments go.
+ */
+
+#ifndef BB_WAL
+#define BB_WAL
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WAL_COMMIT_INTERVAL_MS 5
+
+// Log sequence number, 0 is "nothing"
+typedef uint64_t wal_lsn_t;
+
+typedef void (*wal_replay_fn_t)(uint8_t type,
+                                const char *data,
+                                size_t size,
+                                wal_lsn_t lsn);
+
+struct wal_stats {
+    wal_lsn_t appended_lsn;      // Last record appended
+    wal_lsn_t durable_lsn;       // Last record that's fsync'd
+    uint64_t fsyncs;
+    uint64_t last_batch_records; // Records in the last fsync
+    uint64_t last_batch_bytes;
+    uint64_t max_batch_records;
+    uint64_t last_fsync_us;
+};
+
+/*
+ * Before wal_start(). Calls "replay" for every
+ * record after "after_lsn", in order, and
+ * continues the LSNs from the last one.
+ * Returns how many records were replayed.
+ */
+int  wal_recover(const char *path, wal_lsn_t after_lsn, wal_replay_fn_t replay);
+void wal_start  (const char *path);
+// Whether wal_start() was called, appending is a no-op otherwise
+int  wal_enabled(void);
+
+// Any thread, returns the record's LSN
+wal_lsn_t wal_append(uint8_t type, const void *data, size_t size);
+
+/*
+ * Flushes and starts a new segment, every record
+ * up to the returned LSN is in the older segments.
+ */
+wal_lsn_t wal_rotate(void);
+// Drops the segments that only hold records up to "lsn"
+void      wal_truncate(wal_lsn_t lsn);
+
+void wal_get_stats(struct wal_stats *out);
+
+#endif
@@ -11,18 +11,32 @@
 
 #include <string.h>
 
+#include "game_wal.h"
 #include "host_custom_attributes.h"
+#include "mem_pool.h"
+#include "metrics.h"
+#include "movement.h"
+#include "net_backend.h"
+#include "recorder.h"
+#include "trace.h"
 #include "websocket_handlers.h"
 #include "websockets.h"
 #include "validators.h"
+#include "wire.h"
 
 #define MAX_RESPONSE_HEADER_SIZE WEBSOCKET_HEADER_SIZE_MAX + sizeof(opcode_t)
-#define MESSAGE_HANDLER_COUNT    3
+#define MESSAGE_HANDLER_COUNT    8
 #define EMPTY_OPCODE             0 // Some opcodes just give the server no data
+#define SERVER_ONLY_OPCODE       -1 // Never a valid length, so never handled
+#define BATCH_OPCODE             -2 // Its sub-messages are checked instead
+#define REPLY_BATCH_MIN          256
 
 /*
  * Primary interpreter for incoming websocket messages
  * carrying valid gameplay opcodes.
+ * Valid messages are posted to the player's game actor,
+ * so the handlers below run there, in order, and can
+ * modify the game freely.
  * Player disconnects are handled in packet_handlers.c,
  * and are not seen by the websocket layer.
  */
@@ -44,25 +58,58 @@ typedef void (*take_resource_handler_t)(enum resource_id resource,
                                         int count);
 
 
+_Static_assert(MESSAGE_HANDLER_COUNT <= METRICS_OPCODE_COUNT,
+               "every opcode gets a histogram in metrics.c");
+
 static int request_sizes[MESSAGE_HANDLER_COUNT] = {
     EMPTY_OPCODE,
     sizeof(struct player_move_req),
     sizeof(struct player_conn_req),
-};
-static int response_sizes[MESSAGE_HANDLER_COUNT] = {
     EMPTY_OPCODE,
-    sizeof(struct player_move_res),
-    sizeof(struct player_conn_res),
+    SERVER_ONLY_OPCODE,
+    sizeof(struct player_resume_req),
+    BATCH_OPCODE,
+    SERVER_ONLY_OPCODE,
 };
+// Responses are laid out in wire.h
 
 enum response_opcodes {
     OPCODE_PING,
     OPCODE_PLAYER_MOVE,
-    OPCODE_PLAYER_CONNECT
+    OPCODE_PLAYER_CONNECT,
+    OPCODE_RESYNC,
+    OPCODE_PLAYER_JOINED, // Server to client only
+    OPCODE_RESUME,
+    OPCODE_BATCH,
+    OPCODE_TURN // Server to client only
 };
 
-static inline int is_game_message_valid_length(opcode_t opcode,
-                                               ssize_t message_size);
+_Static_assert(MAX_RESPONSE_HEADER_SIZE + WIRE_JOINED_RES_MAX
+                       <= GAME_DELTA_FRAME_MAX
+                   && MAX_RESPONSE_HEADER_SIZE + WIRE_MOVE_RES_MAX
+                          <= GAME_DELTA_FRAME_MAX,
+               "every delta fits in game.recent_deltas");
+
+/*
+ * While a batch runs, whatever its handlers send
+ * to the host that sent it is collected here, and
+ * goes out in one net_send() when it's done.
+ */
+struct reply_batch {
+    struct host *remotehost;
+    char *buffer; // From the arena
+    size_t size;
+    size_t capacity;
+};
+static __thread struct reply_batch *current_batch = NULL;
+
+static int is_game_message_valid(opcode_t opcode,
+                                 const char *body,
+                                 ssize_t body_size);
+static void run_game_message(struct game *game,
+                             char *data,
+                             ssize_t data_size,
+                             struct host *remotehost);
 /*
  * These functions handle incoming websocket packets.
  */
@@ -75,11 +122,35 @@ static void move_player_handler(char *data,
 static void player_connect_handler(char *data,
                                    ssize_t data_size,
                                    struct host *remotehost);
+static void resync_handler(char *data,
+                           ssize_t data_size,
+                           struct host *remotehost);
+static void resume_handler(char *data,
+                           ssize_t data_size,
+                           struct host *remotehost);
+static void batch_handler(char *data,
+                          ssize_t data_size,
+                          struct host *remotehost);
 
 static game_message_handler_t game_message_handlers[MESSAGE_HANDLER_COUNT] = {
     ping_handler,
     move_player_handler,
     player_connect_handler,
+    resync_handler,
+    NULL,
+    resume_handler,
+    batch_handler,
+    NULL,
+};
+static const char *game_message_trace_names[MESSAGE_HANDLER_COUNT] = {
+    "ping_handler",
+    "move_player_handler",
+    "player_connect_handler",
+    "resync_handler",
+    NULL,
+    "resume_handler",
+    "batch_handler",
+    NULL,
 };
 
 /*
@@ -95,22 +166,132 @@ static inline int is_game_message_valid_length(opcode_t opcode,
     return message_size == request_sizes[opcode];
 }
 
+/*
+ * A batch is other messages back to back, each an
+ * opcode and exactly its request_sizes worth of data.
+ * Batches can't hold batches.
+ */
+static int is_batch_valid(const char *body, ssize_t body_size)
+{
+    if (!body_size) {
+        return 0;
+    }
+    while (body_size > 0) {
+        opcode_t opcode = 0;
+        if (body_size < (ssize_t)sizeof(opcode)) {
+            return 0;
+        }
+        memcpy(&opcode, body, sizeof(opcode));
+        if (opcode >= MESSAGE_HANDLER_COUNT || opcode == OPCODE_BATCH
+            || request_sizes[opcode] < 0) {
+            return 0;
+        }
+        const ssize_t message_size = sizeof(opcode) + request_sizes[opcode];
+        if (body_size < message_size) {
+            return 0;
+        }
+        body += message_size;
+        body_size -= message_size;
+    }
+    return 1;
+}
+
+static int is_game_message_valid(opcode_t opcode,
+                                 const char *body,
+                                 ssize_t body_size)
+{
+    if (opcode == OPCODE_BATCH) {
+        return is_batch_valid(body, body_size);
+    }
+    return is_game_message_valid_length(opcode, body_size);
+}
+
+/*
+ * What the handlers send with, so the replies
+ * to a batch can be put together.
+ */
+static void send_to_host(const char *data,
+                         ssize_t data_size,
+                         struct host *remotehost)
+{
+    struct reply_batch *batch = current_batch;
+    if (!batch || batch->remotehost != remotehost) {
+        net_send(data, data_size, remotehost);
+        return;
+    }
+    if (batch->size + data_size > batch->capacity) {
+        size_t capacity = batch->capacity ? batch->capacity * 2 : REPLY_BATCH_MIN;
+        while (capacity < batch->size + data_size) {
+            capacity *= 2;
+        }
+        char *buffer = arena_alloc(capacity);
+        memcpy(buffer, batch->buffer, batch->size);
+        batch->buffer   = buffer;
+        batch->capacity = capacity;
+    }
+    memcpy(&batch->buffer[batch->size], data, data_size);
+    batch->size += data_size;
+}
+
+/*
+ * Sends to every player in the game that
+ * has a websocket connection open, other than
+ * "skip", which can be NULL.
+ * Runs on the game's actor, which is also
+ * where hosts are removed from the game on
+ * disconnect, so they're all still alive.
+ */
+static void broadcast_to_game(const char *data,
+                              ssize_t data_size,
+                              struct game *game,
+                              const struct host *skip)
+{
+    trace_begin("broadcast_to_game");
+    for (player_mask_t slots = get_live_players(game); slots;) {
+        struct host *remotehost =
+            game->players[pop_player_slot(&slots)].associated_host;
+        if (remotehost && remotehost != skip) {
+            send_to_host(data, data_size, remotehost);
+        }
+    }
+    trace_end("broadcast_to_game");
+}
+
+/*
+ * Every delta goes through here, so a client that
+ * reconnects can be sent the ones it missed.
+ * "frame" is the whole websocket frame.
+ */
+static void broadcast_delta(const char *frame,
+                            int frame_size,
+                            uint32_t seq,
+                            struct game *game,
+                            const struct host *skip)
+{
+    struct game_delta *delta =
+        &game->recent_deltas[seq % GAME_DELTA_RING_SIZE];
+    delta->seq        = seq;
+    delta->frame_size = frame_size;
+    memcpy(delta->frame, frame, frame_size);
+    broadcast_to_game(frame, frame_size, game, skip);
+}
+
 /*
  * This will run at the start of most
  * websocket handlers to prepare a buffer for writing
  * data to, and takes care of writing the websocket
  * header and opcode data.
  *
- * Response payload should ALWAYS be
- * a single type corresponding to the opcode and what's
- * tracked in gameDataSizes[].
+ * "response_data_size" is the payload after the opcode,
+ * encoded as wire.h lays it out for that opcode.
  *
  * Returns the amount of bytes it wrote to the buffer.
  */
-static int init_handler_response_buffer(char *response_buffer, opcode_t code)
+static int init_sized_response_buffer(char *response_buffer,
+                                      opcode_t code,
+                                      ssize_t response_data_size)
 {
-    int header_size            = 0;
-    ssize_t response_data_size = response_sizes[code];
+    int header_size = 0;
 
     header_size = write_websocket_header(response_buffer,
                                          sizeof(code) + response_data_size);
@@ -135,17 +316,55 @@ void handle_game_message(char *data, ssize_t data_size, struct host *remotehost)
 #ifdef DEBUG
         fprintf(stderr, "\nBad websocket opcode.\n");
 #endif
+        metrics_count(METRIC_GAME_MESSAGES_REJECTED, 1);
         return;
     }
 #ifdef DEBUG
     print_buffer_in_hex(data, data_size);
 #endif
 
-    if (is_game_message_valid_length(opcode, data_size - sizeof(opcode_t))) {
-        game_message_handlers[opcode](&data[sizeof(opcode_t)],
-                                      data_size,
-                                      remotehost);
-    };
+    if (!is_game_message_valid(opcode,
+                               &data[sizeof(opcode_t)],
+                               data_size - sizeof(opcode_t))) {
+        metrics_count(METRIC_GAME_MESSAGES_REJECTED, 1);
+        return;
+    }
+    const struct player *player = get_player_from_host(remotehost);
+    if (!player || !player->game) {
+        return;
+    }
+    game_actor_post(player->game, run_game_message, data, data_size, remotehost);
+}
+
+static void dispatch_game_message(char *data,
+                                  ssize_t data_size,
+                                  struct host *remotehost)
+{
+    opcode_t opcode      = 0;
+    const uint64_t start = metrics_now_ns();
+    memcpy(&opcode, data, sizeof(opcode));
+    trace_begin(game_message_trace_names[opcode]);
+    game_message_handlers[opcode](&data[sizeof(opcode_t)],
+                                  data_size,
+                                  remotehost);
+    trace_end(game_message_trace_names[opcode]);
+    metrics_time_opcode(opcode, metrics_now_ns() - start);
+}
+
+/*
+ * Runs on the game's actor, with a message
+ * handle_game_message() already checked.
+ */
+static void run_game_message(struct game *game,
+                             char *data,
+                             ssize_t data_size,
+                             struct host *remotehost)
+{
+    const struct player *player = get_player_from_host(remotehost);
+    if (player) {
+        record_message(player, data, data_size);
+    }
+    dispatch_game_message(data, data_size, remotehost);
 }
 
 static void ping_handler(char *data, ssize_t data_size, struct host *remotehost)
@@ -155,61 +374,180 @@ static void ping_handler(char *data, ssize_t data_size, struct host *remotehost)
 #endif
     const opcode_t response_opcode                 = OPCODE_PING;
     char response_buffer[MAX_RESPONSE_HEADER_SIZE] = {0};
-    int packet_size =
-        init_handler_response_buffer(response_buffer, response_opcode);
-    send_data_tcp(response_buffer, (ssize_t)packet_size, remotehost);
+    int packet_size = init_sized_response_buffer(response_buffer,
+                                                 response_opcode,
+                                                 EMPTY_OPCODE);
+    send_to_host(response_buffer, (ssize_t)packet_size, remotehost);
 }
 
 static void move_player_handler(char *data,
                                 ssize_t data_size,
                                 struct host *remotehost)
 {
-    struct player_move_res *response_data   = NULL;
+    struct player_move_req coords           = {0};
     const struct player_move_req *move_data = (struct player_move_req *)data;
     const opcode_t response_opcode          = OPCODE_PLAYER_MOVE;
-    int header_size                         = 0;
+    int response_data_size                  = 0;
+    int packet_size                         = 0;
+    struct move_result move                 = {0};
     struct player *host_player              = get_player_from_host(remotehost);
+    if (!host_player) {
+        return;
+    }
 
-    char response_buffer[MAX_RESPONSE_HEADER_SIZE + sizeof(*response_data)] = {
-        0};
-    header_size =
-        init_handler_response_buffer(response_buffer, response_opcode);
-    response_data = (struct player_move_res *)&response_buffer[header_size];
+    char response_buffer[GAME_DELTA_FRAME_MAX] = {0};
 
-    validate_player_move_coords(move_data, &response_data->coords);
-    response_data->player_id = host_player->id;
+    validate_player_move_coords(move_data, &coords);
+    mark_player_active(host_player);
+    // The client only sends where it's headed for now,
+    // a path with one point. Longer ones need a new request.
+    const struct coordinates path[] = {{coords.x_coord, coords.y_coord, 0.0}};
+    move_player_along(host_player, path, 1, &move);
+    host_player->current_enc = move.encounter;
+    // Where everyone sees the player is where they are
+    host_player->coords.x    = wire_dequantize(
+        wire_quantize(host_player->coords.x, MAP_BOUND_X), MAP_BOUND_X);
+    host_player->coords.y    = wire_dequantize(
+        wire_quantize(host_player->coords.y, MAP_BOUND_Y), MAP_BOUND_Y);
+    log_player_move(host_player);
 
-    host_player->coords.x = response_data->coords.x_coord;
-    host_player->coords.y = response_data->coords.y_coord;
+    const uint32_t seq = ++host_player->game->state_seq;
+    response_data_size = wire_varint_len(seq) + wire_varint_len(host_player->id)
+                         + WIRE_COORDS_SIZE + wire_varint_len(move.encounter)
+                         + wire_varint_len(host_player->action_points);
+    packet_size        = init_sized_response_buffer(response_buffer,
+                                             response_opcode,
+                                             response_data_size);
+    packet_size += wire_put_varint(&response_buffer[packet_size], seq);
+    packet_size += wire_put_varint(&response_buffer[packet_size], host_player->id);
+    packet_size += wire_put_coords(&response_buffer[packet_size],
+                                   host_player->coords.x,
+                                   host_player->coords.y);
+    packet_size += wire_put_varint(&response_buffer[packet_size], move.encounter);
+    packet_size += wire_put_varint(&response_buffer[packet_size],
+                                   host_player->action_points);
+    broadcast_delta(response_buffer, packet_size, seq, host_player->game, NULL);
+}
 
-    int packet_size = header_size + sizeof(*response_data);
-    multicast_tcp(response_buffer, packet_size, 0);
+static inline int get_name_len(const struct player *player)
+{
+    return strnlen(player->credentials.name, MAX_CREDENTIAL_LEN);
 }
 
-static void construct_player_connect_response(struct player_conn_res *response_data,
-                                              const struct game *game,
-                                              const struct player *player_connecting)
+// What wire.h sends as current_turn + 1
+static inline uint32_t get_wire_turn(const struct game *game)
 {
-    const ssize_t namelen = sizeof(game->players[0].credentials.name);
-    for (int i = 0; i < MAX_PLAYERS_IN_GAME; i++) {
-        if (!game->players[i].game) {
-            response_data->players[i] = INVALID_PLAYER_ID;
-            continue;
-        }
-        const player_id_t id      = game->players[i].id;
-        response_data->players[i] = id;
-        memcpy(&response_data->player_names[i],
-               game->players[i].credentials.name,
-               namelen);
-        memcpy(&response_data->player_coords[i],
-               &game->players[i].coords,
-               sizeof(game->players[i].coords));
+    return game->state == GAME_STATE_STARTED ? game->current_turn->id + 1 : 0;
+}
+
+static inline uint8_t get_wire_flags(const struct game *game)
+{
+    return game->state == GAME_STATE_STARTED ? WIRE_FLAG_GAME_ONGOING : 0;
+}
+
+static inline int get_player_entry_size(const struct player *player)
+{
+    return wire_varint_len(player->id) + 1 + get_name_len(player)
+           + WIRE_COORDS_SIZE;
+}
+
+// Returns how many bytes it wrote
+static int put_player_entry(char *out, const struct player *player)
+{
+    const int name_len = get_name_len(player);
+    int len            = wire_put_varint(out, player->id);
+    out[len++]         = (char)name_len;
+    memcpy(&out[len], player->credentials.name, name_len);
+    len += name_len;
+    len += wire_put_coords(&out[len], player->coords.x, player->coords.y);
+    return len;
+}
+
+static int get_snapshot_size(const struct game *game,
+                             const struct player *player_connecting,
+                             player_mask_t live_players)
+{
+    int size = 2 + sizeof(game->state_epoch) + wire_varint_len(game->state_seq)
+               + wire_varint_len(get_wire_turn(game))
+               + wire_varint_len(player_connecting->id)
+               + wire_varint_len(__builtin_popcountll(live_players));
+    for (player_mask_t slots = live_players; slots;) {
+        size += get_player_entry_size(&game->players[pop_player_slot(&slots)]);
     }
+    return size;
+}
+
+// Returns how many bytes it wrote
+static int construct_snapshot(char *out,
+                              const struct game *game,
+                              const struct player *player_connecting,
+                              player_mask_t live_players)
+{
+    int len    = 0;
+    out[len++] = WIRE_VERSION;
+    out[len++] = get_wire_flags(game);
+    memcpy(&out[len], &game->state_epoch, sizeof(game->state_epoch));
+    len += sizeof(game->state_epoch);
+    len += wire_put_varint(&out[len], game->state_seq);
+    len += wire_put_varint(&out[len], get_wire_turn(game));
     // On the client side we build an id->name map
-    // from the previous data.
-    // This entry allows the client to know
+    // from the entries, this lets the client know
     // which player in the map they are.
-    response_data->connecting_player_id = player_connecting->id;
+    len += wire_put_varint(&out[len], player_connecting->id);
+    len += wire_put_varint(&out[len], __builtin_popcountll(live_players));
+    for (player_mask_t slots = live_players; slots;) {
+        len += put_player_entry(&out[len],
+                                &game->players[pop_player_slot(&slots)]);
+    }
+    return len;
+}
+
+/*
+ * The whole game, as of the last delta, only to
+ * "remotehost". Everything after it comes as deltas,
+ * on the same connection, so nothing falls in between.
+ */
+static void send_snapshot(struct game *game,
+                          const struct player *player_connecting,
+                          struct host *remotehost)
+{
+    const opcode_t response_opcode   = OPCODE_PLAYER_CONNECT;
+    // Only as many entries as there are players
+    const player_mask_t live_players = get_live_players(game);
+    const int response_data_size =
+        get_snapshot_size(game, player_connecting, live_players);
+    char *response_buffer =
+        arena_alloc(MAX_RESPONSE_HEADER_SIZE + response_data_size);
+    int packet_size = init_sized_response_buffer(response_buffer,
+                                                 response_opcode,
+                                                 response_data_size);
+    packet_size += construct_snapshot(&response_buffer[packet_size],
+                                      game,
+                                      player_connecting,
+                                      live_players);
+    send_to_host(response_buffer, packet_size, remotehost);
+}
+
+// Everyone else just needs to hear about the new player
+static void broadcast_player_joined(struct game *game,
+                                    const struct player *player_joined,
+                                    struct host *remotehost)
+{
+    const opcode_t response_opcode = OPCODE_PLAYER_JOINED;
+    const uint32_t seq             = ++game->state_seq;
+    const uint32_t current_turn    = get_wire_turn(game);
+    const int response_data_size   = wire_varint_len(seq) + 1
+                                   + wire_varint_len(current_turn)
+                                   + get_player_entry_size(player_joined);
+    char response_buffer[GAME_DELTA_FRAME_MAX] = {0};
+    int packet_size = init_sized_response_buffer(response_buffer,
+                                                 response_opcode,
+                                                 response_data_size);
+    packet_size += wire_put_varint(&response_buffer[packet_size], seq);
+    response_buffer[packet_size++] = get_wire_flags(game);
+    packet_size += wire_put_varint(&response_buffer[packet_size], current_turn);
+    packet_size += put_player_entry(&response_buffer[packet_size], player_joined);
+    broadcast_delta(response_buffer, packet_size, seq, game, remotehost);
 }
 
 /*
@@ -226,33 +564,202 @@ static void player_connect_handler(char *data,
     // an ongoing game when someone, or themselves, are
     // in the middle of an encounter or other dialog.
     // This will need to be communicated.
-    const opcode_t response_opcode         = OPCODE_PLAYER_CONNECT;
     const struct player *player_connecting = get_player_from_host(remotehost);
-    struct game *game                      = player_connecting->game;
-    if (!game) {
+    if (!player_connecting) {
         return;
     }
+    struct game *game = player_connecting->game;
 
-    char response_buffer[MAX_RESPONSE_HEADER_SIZE
-                         + sizeof(struct player_conn_res)] = {0};
-    int header_size =
-        init_handler_response_buffer(response_buffer, response_opcode);
-    struct player_conn_res *const response_data =
-        (struct player_conn_res *)&response_buffer[header_size];
-
-    construct_player_connect_response(response_data, game, player_connecting);
     // It's *nobody's* turn?
     // This means the game hasn't started yet.
     if (!game->current_turn) {
         try_start_game(game);
+        if (game->current_turn) {
+            log_game_turn(game);
+        }
+    }
+
+    // The delta first, so the snapshot already has its seq
+    broadcast_player_joined(game, player_connecting, remotehost);
+    send_snapshot(game, player_connecting, remotehost);
+}
+
+/*
+ * The client saw a gap in the seqs,
+ * it gets the whole game again.
+ */
+static void resync_handler(char *data, ssize_t data_size, struct host *remotehost)
+{
+    const struct player *player = get_player_from_host(remotehost);
+    if (!player) {
+        return;
+    }
+    send_snapshot(player->game, player, remotehost);
+}
+
+/*
+ * The client reconnected, and had everything up to
+ * "last_seq". If the deltas after it are still in the
+ * ring, it gets just those, in one send. Otherwise it
+ * starts over from a snapshot.
+ */
+static void resume_handler(char *data, ssize_t data_size, struct host *remotehost)
+{
+    struct player_resume_req resume = {0};
+    const struct player *player     = get_player_from_host(remotehost);
+    if (!player) {
+        return;
+    }
+    struct game *game = player->game;
+    memcpy(&resume, data, sizeof(resume));
+
+    const uint32_t missed = game->state_seq - resume.last_seq;
+    if (resume.state_epoch != game->state_epoch
+        || resume.last_seq > game->state_seq
+        || missed > GAME_DELTA_RING_SIZE) {
+        send_snapshot(game, player, remotehost);
+        return;
+    }
+    if (!missed) {
+        return;
+    }
+    int resume_size = 0;
+    for (uint32_t seq = resume.last_seq + 1; seq <= game->state_seq; seq++) {
+        const struct game_delta *delta =
+            &game->recent_deltas[seq % GAME_DELTA_RING_SIZE];
+        if (delta->seq != seq) {
+            send_snapshot(game, player, remotehost);
+            return;
+        }
+        resume_size += delta->frame_size;
+    }
+    char *resume_buffer = arena_alloc(resume_size);
+    int offset          = 0;
+    for (uint32_t seq = resume.last_seq + 1; seq <= game->state_seq; seq++) {
+        const struct game_delta *delta =
+            &game->recent_deltas[seq % GAME_DELTA_RING_SIZE];
+        memcpy(&resume_buffer[offset], delta->frame, delta->frame_size);
+        offset += delta->frame_size;
     }
-    if (game->state == GAME_STATE_STARTED) {
-        response_data->current_turn = game->current_turn->id;
+    send_to_host(resume_buffer, resume_size, remotehost);
+}
+
+/*
+ * Runs each message in the batch in order, as if they
+ * had come one by one, and sends everything they had
+ * for this host in one go at the end.
+ * Replies stay separate websocket frames, so clients
+ * read them the same as unbatched ones.
+ */
+static void batch_handler(char *data, ssize_t data_size, struct host *remotehost)
+{
+    struct reply_batch batch = {.remotehost = remotehost};
+    const ssize_t body_size  = data_size - sizeof(opcode_t);
+
+    current_batch = &batch;
+    for (ssize_t offset = 0; offset < body_size;) {
+        opcode_t opcode = 0;
+        memcpy(&opcode, &data[offset], sizeof(opcode));
+        const ssize_t message_size = sizeof(opcode) + request_sizes[opcode];
+        dispatch_game_message(&data[offset], message_size, remotehost);
+        offset += message_size;
+    }
+    current_batch = NULL;
+    if (batch.size) {
+        net_send(batch.buffer, batch.size, remotehost);
     }
-    else {
-        response_data->current_turn = INVALID_PLAYER_ID;
+}
+
+static void broadcast_turn(struct game *game)
+{
+    const opcode_t response_opcode = OPCODE_TURN;
+    const uint32_t seq             = ++game->state_seq;
+    const uint32_t current_turn    = get_wire_turn(game);
+    const int response_data_size =
+        wire_varint_len(seq) + wire_varint_len(current_turn);
+    char response_buffer[GAME_DELTA_FRAME_MAX] = {0};
+    int packet_size = init_sized_response_buffer(response_buffer,
+                                                 response_opcode,
+                                                 response_data_size);
+    packet_size += wire_put_varint(&response_buffer[packet_size], seq);
+    packet_size += wire_put_varint(&response_buffer[packet_size], current_turn);
+    broadcast_delta(response_buffer, packet_size, seq, game, NULL);
+}
+
+void turn_timed_out(struct game *game)
+{
+    if (!game->current_turn) {
+        return;
+    }
+    record_turn_timeout(game->current_turn);
+    expire_turn(game);
+    log_game_turn(game);
+    broadcast_turn(game);
+}
+
+/*
+ * Idle connections
+ * --------------------
+ * Browsers answer pings on their own, so a client
+ * that's still there is never quiet for long once
+ * we start pinging it. One that stays quiet anyway
+ * is half-open, and gets closed.
+ */
+#define IDLE_SWEEPS_PER_TIMEOUT 3
+
+static uint64_t idle_timeout_ms = WEBSOCKET_IDLE_TIMEOUT_DEFAULT * 1000;
+
+void set_idle_timeout(int seconds)
+{
+    idle_timeout_ms = (uint64_t)seconds * 1000;
+}
+
+void watch_idle_hosts(struct game *game)
+{
+    if (!idle_timeout_ms || game->idle_sweep_armed) {
+        return;
     }
+    game->idle_sweep_armed = true;
+    game_timer_arm(&game->idle_timer,
+                   idle_timeout_ms / IDLE_SWEEPS_PER_TIMEOUT);
+}
 
-    const ssize_t packet_size = header_size + sizeof(*response_data);
-    multicast_tcp(response_buffer, packet_size, 0);
+/*
+ * A host stays the player's associated_host until
+ * its disconnect reaches this actor, so its attr is
+ * still alive. Closing it sends it down that same
+ * disconnect path, which takes it out of the game
+ * and frees the attr.
+ */
+void sweep_idle_hosts(struct game *game)
+{
+    const uint64_t now     = host_clock_ms();
+    const uint64_t ping_ms = idle_timeout_ms / IDLE_SWEEPS_PER_TIMEOUT;
+    bool watching          = false;
+    game->idle_sweep_armed = false;
+
+    for (player_mask_t slots = get_live_players(game); slots;) {
+        struct host *remotehost =
+            game->players[pop_player_slot(&slots)].associated_host;
+        if (!remotehost) {
+            continue;
+        }
+        struct host_custom_attr *attr = net_get_host_custom_attr(remotehost);
+        const uint64_t last_seen =
+            atomic_load_explicit(&attr->last_seen_ms, memory_order_relaxed);
+        const uint64_t idle_ms = now > last_seen ? now - last_seen : 0;
+        if (idle_ms >= idle_timeout_ms) {
+            net_close_host(remotehost);
+            metrics_count(METRIC_IDLE_HOSTS_CLOSED, 1);
+        }
+        else if (idle_ms >= ping_ms) {
+            send_websocket_control(WEBSOCKET_OPCODE_PING, NULL, 0, remotehost);
+            metrics_count(METRIC_WEBSOCKET_PINGS, 1);
+        }
+        // Closed ones too, in case the disconnect is slow
+        watching = true;
+    }
+    if (watching) {
+        watch_idle_hosts(game);
+    }
 }
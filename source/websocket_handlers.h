@@ -16,6 +16,10 @@
 #include "game_logic.h"
 #include "bbnetlib.h"
 
+// Websockets quiet for this long are closed,
+// see set_idle_timeout()
+#define WEBSOCKET_IDLE_TIMEOUT_DEFAULT 30 // Seconds
+
 /*
  * Data structures coupled with websocket
  * handlers
@@ -33,20 +37,19 @@ struct player_conn_req {
     char placeholder;
 } __attribute__((packed));
 
-// RESPONSES //
-struct player_move_res {
-    player_id_t player_id;
-    struct player_move_req coords;
+struct player_resume_req {
+    uint32_t state_epoch;
+    uint32_t last_seq; // The last delta the client applied
 } __attribute__((packed));
 
-struct player_conn_res {
-    player_id_t players[MAX_PLAYERS_IN_GAME];
-    char player_names[MAX_CREDENTIAL_LEN][MAX_PLAYERS_IN_GAME];
-    struct coordinates player_coords[MAX_PLAYERS_IN_GAME];
-    player_id_t current_turn;         // ID of the player who's turn it is
-    player_id_t connecting_player_id; // ID of the player who connected
-    bool game_ongoing;                // Has the game we've joined started yet?
-} __attribute__((packed));
+/*
+ * OPCODE_BATCH has no struct, it's any of the
+ * requests above back to back, each after its own
+ * opcode, and handled in that order.
+ */
+
+// RESPONSES //
+// These are variable length, see wire.h
 
 /*
  * Primary entry point for interpreting
@@ -56,4 +59,22 @@ void handle_game_message(char *data,
                          ssize_t data_size,
                          struct host *remotehost);
 
+/*
+ * Fires off the game's turn_timer, on its actor.
+ * Passes the turn on and tells everyone.
+ */
+void turn_timed_out(struct game *game);
+
+/*
+ * Websockets that have been quiet for a while are
+ * pinged, and closed once they've been quiet for
+ * the idle timeout. 0 turns that off.
+ * Set it before any game has a websocket open.
+ */
+void set_idle_timeout(int seconds);
+// On the game's actor, when it gets a websocket
+void watch_idle_hosts(struct game *game);
+// Fires off the game's idle_timer, on its actor
+void sweep_idle_hosts(struct game *game);
+
 #endif
@@ -7,6 +7,7 @@
 
 #include "error_handling.h"
 #include "helpers.h"
+#include "net_backend.h"
 #include "websockets.h"
 
 #define WEBSOCK_HEADERS_LEN 512
@@ -63,7 +64,7 @@ int decode_websocket_message(char *out_data, char *in_data, ssize_t data_size)
     char *in_payload  = NULL;
 
     // 1. First byte = FIN and opcodes
-    // Ignore completely!
+    // Ignored here, see get_websocket_opcode()
 
     /* 2. Bytes 2-10 payload length
      * The lengthCode indicates how many bytes we need to tell
@@ -110,13 +111,23 @@ int decode_websocket_message(char *out_data, char *in_data, ssize_t data_size)
  */
 int write_websocket_header(char in_out_data[static WEBSOCKET_HEADER_SIZE_MAX],
                            ssize_t data_size)
+{
+    return write_websocket_frame_header(in_out_data,
+                                        WEBSOCKET_OPCODE_BINARY,
+                                        data_size);
+}
+
+int write_websocket_frame_header(
+    char in_out_data[static WEBSOCKET_HEADER_SIZE_MAX],
+    enum websocket_opcode opcode,
+    ssize_t data_size)
 {
     /* Refer to the websocket spec for how
      * this encoding works
      */
     int header_size = 0;
     // 1. Websocket FIN Header
-    in_out_data[0] = (char)0x82;
+    in_out_data[0] = (char)(0x80 | opcode);
     // 2. Weirdest part of the
     //    websocket spec (writing payload length).
     if (data_size < 126) {
@@ -136,6 +147,23 @@ int write_websocket_header(char in_out_data[static WEBSOCKET_HEADER_SIZE_MAX],
     return header_size;
 }
 
+void send_websocket_control(enum websocket_opcode opcode,
+                            const char *payload,
+                            ssize_t payload_size,
+                            struct host *remotehost)
+{
+    char frame[WEBSOCKET_HEADER_SIZE_MAX + WEBSOCKET_CONTROL_MAX];
+    if (payload_size > WEBSOCKET_CONTROL_MAX) {
+        payload_size = WEBSOCKET_CONTROL_MAX;
+    }
+    const int header_size =
+        write_websocket_frame_header(frame, opcode, payload_size);
+    if (payload_size > 0) {
+        memcpy(&frame[header_size], payload, payload_size);
+    }
+    net_send(frame, header_size + payload_size, remotehost);
+}
+
 static int generate_accept_code(unsigned char *out_code,
                                 char *in_code,
                                 ssize_t code_len)
@@ -181,7 +209,7 @@ void send_web_socket_response(char *http_string,
     strcpy(response, temp_response);
     strncat(response, response_code, WEBSOCK_CODE_LEN);
     strncat(response, fin_response, strlen(fin_response));
-    send_data_tcp(response, strnlen(response, WEBSOCK_HEADERS_LEN), remotehost);
+    net_send(response, strnlen(response, WEBSOCK_HEADERS_LEN), remotehost);
 }
 
 // TODO: move encryption to it's own file?
@@ -2,14 +2,43 @@
 #define BB_WEBSOCKETS
 #include "bbnetlib.h"
 
-#define WEBSOCKET_HEADER_SIZE_MAX 8
+#define WEBSOCKET_HEADER_SIZE_MAX   8
+#define WEBSOCKET_CLIENT_HEADER_MIN 6 // 2 bytes, then the mask
+#define WEBSOCKET_CONTROL_MAX       125 // Longest control frame payload
+
+// The low nibble of a frame's first byte, from RFC 6455
+enum websocket_opcode {
+    WEBSOCKET_OPCODE_CONTINUATION = 0x0,
+    WEBSOCKET_OPCODE_TEXT         = 0x1,
+    WEBSOCKET_OPCODE_BINARY       = 0x2,
+    WEBSOCKET_OPCODE_CLOSE        = 0x8,
+    WEBSOCKET_OPCODE_PING         = 0x9,
+    WEBSOCKET_OPCODE_PONG         = 0xA
+};
 
 void send_web_socket_response(char *http_string,
                               ssize_t packet_size,
                               struct host *remotehost);
 
 int decode_websocket_message(char *out_data, char *in_data, ssize_t data_size);
+static inline enum websocket_opcode get_websocket_opcode(const char *in_data)
+{
+    return (enum websocket_opcode)(in_data[0] & 0x0F);
+}
 // returns size of entire websocket packet including header
 int write_websocket_header(char in_out_data[static WEBSOCKET_HEADER_SIZE_MAX],
                            ssize_t data_size);
+int write_websocket_frame_header(
+    char in_out_data[static WEBSOCKET_HEADER_SIZE_MAX],
+    enum websocket_opcode opcode,
+    ssize_t data_size);
+/*
+ * Ping, pong and close frames, these never go
+ * through the game. Payloads longer than
+ * WEBSOCKET_CONTROL_MAX are cut short.
+ */
+void send_websocket_control(enum websocket_opcode opcode,
+                            const char *payload,
+                            ssize_t payload_size,
+                            struct host *remotehost);
 #endif
@@ -0,0 +1,139 @@
+/*
+ * ===========================
+ * wire.h
+ * ===========================
+ * How game state goes out over the websocket.
+ * Coupled with the decoders in
+ * test-clients/website/src/networking.js,
+ * change them together and bump WIRE_VERSION.
+ *
+ * Everything is little endian and follows the
+ * 2 byte opcode. Varints are LEB128, 7 bits a byte,
+ * low bits first. Coordinates are quantized to 16 bit
+ * fixed point over the map bounds, see wire_quantize().
+ *
+ * Every game has a state_seq. Anything that changes
+ * what the clients see goes out as a delta tagged with
+ * the next seq, in order, to everyone in the game.
+ * Only a client joining, or asking for a resync, gets
+ * the full snapshot, tagged with the seq it's current
+ * up to. A client that sees a seq that isn't its last
+ * one + 1 missed something, and sends OPCODE_RESYNC.
+ *
+ * The last GAME_DELTA_RING_SIZE deltas are kept as they
+ * went out. A client that reconnects sends OPCODE_RESUME
+ * with the epoch and seq it got up to, and is sent the
+ * deltas it missed, or a snapshot when they're gone or
+ * the epoch changed, ie the server restarted.
+ *
+ * OPCODE_PLAYER_MOVE, a delta:
+ *   varint seq
+ *   varint player_id
+ *   int16  x, int16 y
+ *   varint encounter        Where they stopped, 0 if none
+ *   varint action_points    Left this turn
+ *
+ * OPCODE_PLAYER_JOINED, a delta:
+ *   varint seq
+ *   uint8  flags            WIRE_FLAG_*
+ *   varint current_turn + 1 0 when it's nobody's turn
+ *   and the player, as in a snapshot entry
+ *
+ * OPCODE_TURN, a delta, when a turn times out:
+ *   varint seq
+ *   varint current_turn + 1
+ *
+ * OPCODE_PLAYER_CONNECT, the snapshot:
+ *   uint8  version          WIRE_VERSION
+ *   uint8  flags
+ *   uint32 epoch            Only changes across restarts
+ *   varint seq
+ *   varint current_turn + 1
+ *   varint connecting_player_id
+ *   varint player_count
+ *   and per live player, an entry:
+ *   varint player_id
+ *   uint8  name_len, then the name, no NUL
+ *   int16  x, int16 y
+ */
+
+#ifndef BB_WIRE
+#define BB_WIRE
+
+#include <stdint.h>
+#include <string.h>
+
+#include "game_logic.h"
+
+#define WIRE_VERSION     5
+#define WIRE_VARINT_MAX  5 // For 32 bits
+#define WIRE_COORDS_SIZE (2 * sizeof(int16_t))
+#define WIRE_COORD_STEPS 32767
+
+#define WIRE_MOVE_RES_MAX (4 * WIRE_VARINT_MAX + WIRE_COORDS_SIZE)
+#define WIRE_ENTRY_MAX                                                        \
+    (WIRE_VARINT_MAX + 1 + MAX_CREDENTIAL_LEN + WIRE_COORDS_SIZE)
+#define WIRE_JOINED_RES_MAX (2 * WIRE_VARINT_MAX + 1 + WIRE_ENTRY_MAX)
+
+enum wire_flags {
+    WIRE_FLAG_GAME_ONGOING = 1 << 0
+};
+
+static inline int wire_varint_len(uint32_t value)
+{
+    int len = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        len++;
+    }
+    return len;
+}
+
+// Returns how many bytes it wrote
+static inline int wire_put_varint(char *out, uint32_t value)
+{
+    int len = 0;
+    while (value >= 0x80) {
+        out[len++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (char)value;
+    return len;
+}
+
+/*
+ * Maps [-bound, bound] onto [-WIRE_COORD_STEPS,
+ * WIRE_COORD_STEPS], anything outside is clamped.
+ * The server keeps the dequantized value, so its
+ * state is exactly what the clients see.
+ */
+static inline int16_t wire_quantize(double value, double bound)
+{
+    const double steps = value / bound * WIRE_COORD_STEPS;
+    if (steps != steps) { // NaN
+        return 0;
+    }
+    if (steps >= WIRE_COORD_STEPS) {
+        return WIRE_COORD_STEPS;
+    }
+    if (steps <= -WIRE_COORD_STEPS) {
+        return -WIRE_COORD_STEPS;
+    }
+    return (int16_t)(steps + (steps >= 0 ? 0.5 : -0.5));
+}
+
+static inline double wire_dequantize(int16_t steps, double bound)
+{
+    return (double)steps * bound / WIRE_COORD_STEPS;
+}
+
+// Always writes WIRE_COORDS_SIZE bytes
+static inline int wire_put_coords(char *out, double x, double y)
+{
+    const int16_t quantized[2] = {wire_quantize(x, MAP_BOUND_X),
+                                  wire_quantize(y, MAP_BOUND_Y)};
+    memcpy(out, quantized, sizeof(quantized));
+    return sizeof(quantized);
+}
+
+#endif
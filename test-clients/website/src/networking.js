@@ -4,22 +4,86 @@ const _scriptUrl     = new URL(window.location.href);
 const _websocketUrl  = 'wss://' + _scriptUrl.hostname + ':' + _scriptUrl.port;
 const _opcodeSize    = 2;
 let   _connected     = false; // Have we done an initial connection?
+let   _stateEpoch    = 0;
+let   _stateSeq      = null;  // Seq of the last delta we applied
+let   _resyncPending = false;
+let   _reconnectWait = 250;   // ms, doubles up to _reconnectMax
+const _reconnectMax  = 8000;
+let   _outbox        = [];    // Sent together at the end of this task
 let   _socket;
 
+// No heartbeat, the server pings quiet sockets
+// and the browser answers those by itself.
 window.onload = function() {
+    openSocket();
+}
+
+// Reconnects whenever the socket drops, and picks
+// up from the last delta we saw if we had one.
+function openSocket() {
     _socket            = new WebSocket(_websocketUrl);
     _socket.binaryType = "arraybuffer";
     _socket.onmessage  = e => handleIncoming(e.data);
     _socket.onopen = () => {
         console.log('WebSocket connection established');
-        setInterval(sendHeartbeat, 3000);
-        sendPlayerConnect();
+        _reconnectWait = 250;
+        if (_stateSeq === null) {
+            sendPlayerConnect();
+        }
+        else if (_resyncPending) {
+            sendResync();
+        }
+        else {
+            sendResume();
+        }
+    }
+    _socket.onclose = () => {
+        console.log('WebSocket closed, reconnecting in', _reconnectWait, 'ms');
+        setTimeout(openSocket, _reconnectWait);
+        _reconnectWait = Math.min(_reconnectWait * 2, _reconnectMax);
     }
-
 
     _socket.onerror = e => console.log('WebSocket error:', e);
 }
 
+function isSocketOpen() {
+    return _socket && _socket.readyState === WebSocket.OPEN;
+}
+
+/**
+ * Everything queued in the same task goes out in one
+ * frame, wrapped in an OPCODE_BATCH envelope when
+ * there's more than one message.
+ * @param {ArrayBuffer} ab An opcode and its request
+ */
+function queueMessage(ab) {
+    _outbox.push(ab);
+    if (_outbox.length === 1) {
+        queueMicrotask(flushOutbox);
+    }
+}
+
+function flushOutbox() {
+    const messages = _outbox;
+    _outbox = [];
+    if (!isSocketOpen()) {
+        return;
+    }
+    if (messages.length === 1) {
+        _socket.send(messages[0]);
+        return;
+    }
+    const size  = messages.reduce((total, ab) => total + ab.byteLength, _opcodeSize);
+    const batch = new Uint8Array(size);
+    new DataView(batch.buffer).setInt16(0, 6, true);
+    let offset = _opcodeSize;
+    for (const ab of messages) {
+        batch.set(new Uint8Array(ab), offset);
+        offset += ab.byteLength;
+    }
+    _socket.send(batch.buffer);
+}
+
 export function getSocket() {
     return _socket;
 }
@@ -43,26 +107,147 @@ function handleIncoming(msg) {
         case 2:
             handlePlayerConnectResponse(dataView);
             break;
+        case 4:
+            handlePlayerJoinedResponse(dataView);
+            break;
+        case 7:
+            handleTurnResponse(dataView);
+            break;
         default:
             console.log('Unknown opcode: ', opcode);
             break;
     }
 }
 
+// The layouts are in source/wire.h on the server
+const _wireVersion     = 5;
+const _wireCoordSteps  = 32767;
+const _mapBoundX       = 1.6;
+const _mapBoundY       = 1.0;
+const _flagGameOngoing = 1;
+
+/**
+ * Reads what source/wire.h writes, from "offset" on.
+ * @param {DataView} dataView
+ * @param {number} offset
+ */
+function wireReader(dataView, offset) {
+    return {
+        varint() {
+            let value = 0;
+            let shift = 0;
+            let byte;
+            do {
+                byte   = dataView.getUint8(offset++);
+                value += (byte & 0x7F) * 2 ** shift;
+                shift += 7;
+            } while (byte & 0x80);
+            return value;
+        },
+        uint8() {
+            return dataView.getUint8(offset++);
+        },
+        uint32() {
+            const value = dataView.getUint32(offset, true);
+            offset += 4;
+            return value;
+        },
+        coords() {
+            const x = dataView.getInt16(offset, true) * _mapBoundX / _wireCoordSteps;
+            const y = dataView.getInt16(offset + 2, true) * _mapBoundY / _wireCoordSteps;
+            offset += 4;
+            return {x, y};
+        },
+        string(len) {
+            const bytes = new Uint8Array(dataView.buffer, dataView.byteOffset + offset, len);
+            offset += len;
+            return new TextDecoder().decode(bytes);
+        }
+    };
+}
+
+/**
+ * Deltas come in seq order, anything at or before the
+ * snapshot is already in it. Anything past the next
+ * one means we missed something, so we ask for the
+ * whole game again and drop deltas until it's here.
+ * @param {number} seq
+ * @returns {boolean} Whether to apply the delta
+ */
+function acceptDelta(seq) {
+    if (_stateSeq === null || _resyncPending || seq <= _stateSeq) {
+        return false;
+    }
+    if (seq !== _stateSeq + 1) {
+        console.warn('Missed deltas', _stateSeq + 1, 'to', seq - 1, ', resyncing');
+        sendResync();
+        return false;
+    }
+    _stateSeq = seq;
+    return true;
+}
+
+function sendResync() {
+    const ab       = new ArrayBuffer(2);
+    const dataView = new DataView(ab);
+
+    // opcode
+    dataView.setInt16(0, 3, true);
+
+    _resyncPending = true;
+    queueMessage(ab);
+}
+
+// varint id, uint8 name length, the name, int16 x, int16 y
+function readPlayerEntry(reader) {
+    const playerId   = reader.varint();
+    const playerName = reader.string(reader.uint8());
+    const coords     = reader.coords();
+
+    // Add player to the map, if their ID is not already in the map
+    GameLogic.addPlayerToGame(playerId, coords.x, coords.y, 1, 2, 3, "playerTest.png", playerName);
+    // They might have been, with stale coordinates
+    GameLogic.movePlayer(GameLogic.getPlayer(playerId), coords.x, coords.y);
+    return playerId;
+}
+
+// uint32 epoch, uint32 last seq
+function sendResume() {
+    const ab       = new ArrayBuffer(10);
+    const dataView = new DataView(ab);
+
+    // opcode
+    dataView.setInt16 (0, 5, true);
+    dataView.setUint32(2, _stateEpoch, true);
+    dataView.setUint32(6, _stateSeq, true);
+
+    queueMessage(ab);
+}
+
+// varint seq, varint player id, int16 x, int16 y,
+// varint encounter, varint action points left
 function handleMovePlayerResponse(dataView) {
-    const playerId = dataView.getInt16(_opcodeSize, true);
-    const xCoord   = dataView.getFloat64(4, true);
-    const yCoord   = dataView.getFloat64(12, true);
+    const reader   = wireReader(dataView, _opcodeSize);
+    if (!acceptDelta(reader.varint())) {
+        return;
+    }
+    const playerId     = reader.varint();
+    const coords       = reader.coords();
+    // Where they stopped, 0 if they got there
+    const encounter    = reader.varint();
+    const actionPoints = reader.varint();
 
     const movePlayerResponse = {
         playerNetID: playerId,
         coords: {
-            xCoord: xCoord,
-            yCoord: yCoord
-        }
+            xCoord: coords.x,
+            yCoord: coords.y
+        },
+        encounter,
+        actionPoints
     };
     const player = GameLogic.getPlayer(playerId);
-    GameLogic.movePlayer(player, xCoord, yCoord);
+    GameLogic.movePlayer(player, coords.x, coords.y);
 
     console.log('Received movePlayerResponse: ', movePlayerResponse);
 }
@@ -76,73 +261,75 @@ function sendPlayerConnect() {
     // Placeholder data, does nothing
     dataView.setInt8    (2, 0, true);
 
-    _socket.send(ab);
+    queueMessage(ab);
 }
 
-// The C struct
-// -----------------------------------
-// #define MAX_PLAYERS_IN_GAME 8
-// #define MAX_CREDENTIAL_LEN  32
-//
-// typedef uint16_t player_id_t;
-//
-// struct player_connect_res {
-//    player_id_t        players       [MAX_PLAYERS_IN_GAME];
-//    char               player_names  [MAX_CREDENTIAL_LEN][MAX_PLAYERS_IN_GAME];
-//    struct coordinates player_coords [MAX_PLAYERS_IN_GAME];
-//    player_id_t        current_turn; // NetID of the player who's turn it is
-//    player_id_t        player_index; // Index in the "players" array of the connecting player
-//    bool               game_ongoing; // Has the game we've joined started yet?
-//}__attribute__((packed));
+// varint seq, uint8 flags, varint current turn + 1,
+// then the player who joined, as a snapshot entry.
+function handlePlayerJoinedResponse(dataView) {
+    const reader = wireReader(dataView, _opcodeSize);
+    if (!acceptDelta(reader.varint())) {
+        return;
+    }
+    reader.uint8(); // flags
+    const currentTurn = reader.varint() - 1;
+    const playerId    = readPlayerEntry(reader);
+
+    GameLogic.setCurrentTurn(currentTurn);
+    console.log('Player joined:', playerId);
+}
+
+// varint seq, varint current turn + 1,
+// someone took too long and the turn moved on.
+function handleTurnResponse(dataView) {
+    const reader = wireReader(dataView, _opcodeSize);
+    if (!acceptDelta(reader.varint())) {
+        return;
+    }
+    const currentTurn = reader.varint() - 1;
+
+    GameLogic.setCurrentTurn(currentTurn);
+    console.log('Turn passed to:', currentTurn);
+}
+
+// The snapshot, we get it when we connect or resync.
+// uint8  version, uint8 flags, uint32 epoch, varint seq,
+// varint current turn + 1 (0 means nobody's turn),
+// varint connecting player id, varint player count,
+// then per player: varint id, uint8 name length,
+// the name, int16 x, int16 y.
 function handlePlayerConnectResponse(dataView) {
-    const maxPlayers         = 8;
-    const playerIdSize       = 2;
-    const doubleSize         = 8;
-    const opcodeSize         = 2;
-    const maxCredentialLen   = 32;
-    const playerIdOffset     = opcodeSize;
-    const nameOffset         = playerIdOffset + (playerIdSize * maxPlayers);
-    const coordOffset        = nameOffset + (maxCredentialLen * maxPlayers);
-
-    let playerList = [];
-
-    for (let i = 0; i < maxPlayers; i++) {
-        // Extract player_id
-        const playerId = dataView.getInt16(playerIdOffset + (i * playerIdSize), true);
-        playerList.push(playerId);
-
-        // Extract player name
-        const playerNameBytes = new Uint8Array(dataView.buffer,
-                                               nameOffset + (maxCredentialLen * i),
-                                               maxCredentialLen);
-        const playerName      = new TextDecoder().decode(playerNameBytes).trim();
-
-        // Extract player coordinates
-        const coordStartIndex = coordOffset + (i * 3 * doubleSize);
-        const x = dataView.getFloat64(coordStartIndex, true);
-        const y = dataView.getFloat64(coordStartIndex + doubleSize, true);
-
-        // Add player to the map, if their ID is not already in the map
-        GameLogic.addPlayerToGame(playerId, x, y, 1, 2, 3, "playerTest.png", playerName);
-    }
-
-    // Extract current turn player_id
-    const currentTurnOffset = coordOffset + (3 * doubleSize * maxPlayers);
-    const currentTurn = dataView.getInt16(currentTurnOffset, true);
+    const reader  = wireReader(dataView, _opcodeSize);
+    const version = reader.uint8();
+    if (version !== _wireVersion) {
+        console.error('Server speaks wire version', version,
+                      'but we speak', _wireVersion, ', reload the page');
+        return;
+    }
+    const flags             = reader.uint8();
+    const epoch             = reader.uint32();
+    const seq               = reader.varint();
+    const currentTurn       = reader.varint() - 1;
+    const extractedPlayerId = reader.varint();
+    const playerCount       = reader.varint();
+    let playerList          = [];
+
+    for (let i = 0; i < playerCount; i++) {
+        playerList.push(readPlayerEntry(reader));
+    }
+
     GameLogic.setCurrentTurn(currentTurn);
+    _stateEpoch    = epoch;
+    _stateSeq      = seq;
+    _resyncPending = false;
 
-    // Extract player index
-    const myPlayerIdOffset = currentTurnOffset + playerIdSize;
     if (!_connected) {
         _connected = true;
-        const extractedPlayerId = dataView.getInt16(myPlayerIdOffset, true);
         GameLogic.setMyPlayerId(extractedPlayerId);
         console.log('Player ID extracted from packet:', extractedPlayerId);
     }
 
-    const gameOngoingOffset = myPlayerIdOffset + playerIdSize;
-    // Extract game ongoing status
-    const gameOngoing = Boolean(dataView.getInt8(gameOngoingOffset));
+    const gameOngoing = Boolean(flags & _flagGameOngoing);
 
     console.log('My Player Id:', GameLogic.getMyPlayerId());
     console.log('Player Ids:', playerList);
@@ -150,24 +337,19 @@ function handlePlayerConnectResponse(dataView) {
     console.log('Is Game Ongoing:', gameOngoing);
 }
 
-function sendHeartbeat() {
-    console.log('Sending heartbeat...');
-    const ab = new ArrayBuffer(2);
-    ab[0] = 0b0;
-    ab[1] = 0b0;
-    _socket.send(ab);
-}
-
 export function sendMovePacket(coordX, coordY) {
     const ab       = new ArrayBuffer(18);
     const dataView = new DataView(ab);
     const opcode   = 1; // opcode for moving a player
+    if (!isSocketOpen()) {
+        return;
+    }
 
     dataView.setInt16   (0, opcode, true);
     dataView.setFloat64 (2, coordX, true);
     dataView.setFloat64 (10, coordY, true);
 
-    _socket.send(ab);
+    queueMessage(ab);
 }
 
 export function sendArgs() {